@@ -9,6 +9,7 @@
 //
 /////////////////////////////////////////////////////////////
 
+#include <sys/uio.h>   // struct iovec, for netreadv and netwritev
 
 
 
@@ -20,7 +21,11 @@
 
 
 //
-// Hard-coded port number for net file server
+// Default port number for net file server.  The server's
+// "-p" option and a "host:port" name in netserverinit
+// override it ("[addr]:port" for an IPv6 address).  Data transfer ports are the next
+// MAX_FILE_TRANSFER_SOCKETS ports after it, and are sent
+// to the client as offsets from it.
 //
 #define NET_SERVER_PORT_NUM  54321  
 
@@ -28,14 +33,28 @@
 //
 // Max size of the file descriptor table.  
 //
-#define FD_TABLE_SIZE   128  
+#define FD_TABLE_SIZE   4096  
+
+
+//
+// Max number of entries in one netopen_batch, netstat_batch
+// or netclose_batch call
+//
+#define NET_BATCH_MAX   4096
 
 
 //
 // Size of each message between the
 // server and the client.
 //
-#define MSG_SIZE  256 
+#define MSG_SIZE  256
+
+
+//
+// Max size of the statistics report returned by netstats.
+// The report follows a MSG_SIZE header message.
+//
+#define STATS_TEXT_SIZE  16384
 
 
 //
@@ -57,6 +76,85 @@
 
 
 
+//
+// Reads and writes of at most this many bytes are carried
+// inline: the data follows a MSG_SIZE header on the command
+// connection itself, so no data ports or transfer threads
+// are used and the call takes a single round trip.
+//
+#define INLINE_DATA_SIZE  65536
+
+
+//
+// A data port netread of a sparse file sends only the parts
+// of it that hold data.  The data follows a MSG_SIZE map of
+// at most NET_SPARSE_EXTENTS extents, and the client fills
+// in the holes between them.
+//
+#define NET_SPARSE_EXTENTS 8
+
+
+//
+// Max number of ranges in one netreadranges call
+//
+#define NET_RANGES_MAX    1024
+
+
+//
+// Number of client threads that run asynchronous requests.
+// This is how many of them can be on the wire at once; the
+// rest wait in the library's queue.
+//
+#define NET_ASYNC_WORKERS 64
+
+
+//
+// Default window of netread_stream: chunks of this many
+// bytes, this many of them in flight.  A stream holds at
+// most chunk size * depth bytes at a time.
+//
+#define NET_STREAM_CHUNK_SIZE  1048576
+#define NET_STREAM_DEPTH       4
+#define NET_STREAM_DEPTH_MAX   64
+
+
+//
+// Access hints for netadvise.  The client sends the hint
+// with every later transfer of the netfd, so it applies to
+// that client's transfers only.
+//
+#define NET_ADVICE_NORMAL      0    // no hint
+#define NET_ADVICE_SEQUENTIAL  1    // read front to back, read ahead further
+#define NET_ADVICE_RANDOM      2    // no read ahead
+#define NET_ADVICE_ONCE        3    // drop the data from the page cache once moved
+#define NET_ADVICE_WILLNEED    4    // start reading the file into the cache now
+#define NET_ADVICE_MASK        0xff
+
+//
+// Or'ed into any of the above: netreads of at least
+// NET_DIRECT_MIN_SIZE bytes bypass the page cache with
+// O_DIRECT, and netwrites are flushed and dropped from it
+//
+#define NET_ADVICE_DIRECT      0x100
+#define NET_DIRECT_MIN_SIZE    (1024 * 1024)
+
+
+//
+// When the server makes a file's writes durable, set with
+// netdurability.  netfsync works in any mode.
+//
+#define NET_DURABLE_NONE       0    // when the system gets to it
+#define NET_DURABLE_CLOSE      1    // before netclose returns
+#define NET_DURABLE_WRITE      2    // before each netwrite returns
+
+
+//
+// Most files one transaction can write
+//
+#define NET_TX_MAX_FILES       16
+
+
+
 //
 // Constant definitions
 //
@@ -69,7 +167,11 @@
 
 
 //
-// Network file connection mode
+// Network file connection mode.  A file opened for writing
+// in TRANSACTION_MODE is written as a new version, which
+// replaces the file when it is closed.  Readers in the other
+// modes may open it meanwhile and keep the version they
+// opened until they close.
 //
 typedef enum {
     UNRESTRICTED_MODE = 1,
@@ -89,11 +191,87 @@ typedef enum {
     NET_READ  = 3,
     NET_WRITE = 4,
     NET_CLOSE = 5,
+    NET_STATS = 6,
+    NET_READ_INLINE  = 7,
+    NET_WRITE_INLINE = 8,
+    NET_GET   = 9,
+    NET_PUT   = 10,
+    NET_OPEN_BATCH  = 11,
+    NET_STAT_BATCH  = 12,
+    NET_CLOSE_BATCH = 13,
+    NET_READ_RANGES = 14,
+    NET_ADVISE      = 15,
+    NET_DURABILITY  = 16,
+    NET_FSYNC       = 17,
+    NET_TX_BEGIN    = 18,
+    NET_TX_COMMIT   = 19,
+    NET_TX_ABORT    = 20,
+    NET_COPY        = 21,
     INVALID   = 99
 } NET_FUNCTION_TYPE;
 
 
 
+//
+// Per-file result of netstat_batch
+//
+typedef struct {
+    int  result;     // SUCCESS or FAILURE
+    int  error;      // errno of a failed entry
+    long size;       // file size in bytes
+    int  mode;       // st_mode, file type and permissions
+    long mtime;      // last modification, seconds since the epoch
+} NET_STAT_TYPE;
+
+
+
+//
+// One range of a netreadranges call.  "nBytes" is set to the
+// number of bytes read into the range's buffer, which is
+// less than "length" for a range running past end of file.
+//
+typedef struct {
+    long offset;     // from the start of the file
+    int  length;     // bytes wanted
+    int  nBytes;     // bytes read
+} NET_RANGE_TYPE;
+
+
+
+//
+// A finished asynchronous request, as returned by
+// netasync_poll.  "result" and "error" are what the blocking
+// call returned and its errno.
+//
+typedef struct {
+    long requestId;  // handle returned when the request was made
+    int  op;         // NET_OPEN, NET_READ or NET_WRITE
+    long result;     // new netfd, or bytes moved, or FAILURE
+    int  error;      // errno of a failed request
+    void *userData;  // as passed with the request
+} NET_COMPLETION_TYPE;
+
+
+
+//
+// Called by netread_stream with each chunk of the file in
+// order.  "offset" is where the chunk starts in the file.
+// The chunk is only valid until the callback returns.  A
+// non-zero return stops the stream.
+//
+typedef int (*NET_STREAM_CALLBACK)(const void *chunk, size_t nbyte, long offset, void *userData);
+
+
+
+
+
+//
+// A client context: which server to talk to, in which file
+// connection mode.  Its contents are private to the library.
+//
+typedef struct netctx netctx_t;
+
+
 
 
 /////////////////////////////////////////////////////////////
@@ -107,6 +285,167 @@ extern int netopen(const char *pathname, int flags);
 extern ssize_t netread(int fildes, void *buf, size_t nbyte); 
 extern ssize_t netwrite(int fildes, const void *buf, size_t nbyte); 
 extern int netclose(int fd);
+extern ssize_t netstats(char *buf, size_t nbyte);
+
+//
+// Scatter/gather forms of netread and netwrite.  The iovecs
+// are filled, or sent, in order as one transfer.
+//
+extern ssize_t netreadv(int fildes, const struct iovec *iov, int iovcnt);
+extern ssize_t netwritev(int fildes, const struct iovec *iov, int iovcnt);
+
+//
+// Read up to NET_RANGES_MAX ranges of a file in one request,
+// range "i" into "bufs[i]".  Returns the total bytes read.
+//
+extern ssize_t netreadranges(int fildes, NET_RANGE_TYPE *ranges, int count, void **bufs);
+
+//
+// Asynchronous calls.  Each returns a request handle at once,
+// or FAILURE if the request could not be queued.  The buffer
+// must stay valid until the request completes.  Completions
+// are collected with netasync_poll, which waits up to
+// "timeoutMs" (-1 = forever, 0 = not at all) and returns how
+// many it stored.  netasync_fd is readable while completions
+// are waiting, for use in the caller's own event loop.
+//
+extern long netopen_async(const char *pathname, int flags, void *userData);
+extern long netread_async(int fildes, void *buf, size_t nbyte, void *userData);
+extern long netwrite_async(int fildes, const void *buf, size_t nbyte, void *userData);
+extern int  netasync_fd(void);
+extern int  netasync_poll(NET_COMPLETION_TYPE *completions, int max, int timeoutMs);
+
+//
+// Stream a whole file, of any size, through "callback" in
+// order, NET_STREAM_DEPTH chunks of NET_STREAM_CHUNK_SIZE
+// bytes at a time.  Returns the number of bytes delivered.
+//
+extern ssize_t netread_stream(int fildes, NET_STREAM_CALLBACK callback, void *userData);
+
+//
+// netwrite and netread with the data in a local file rather
+// than a buffer: "nbyte" bytes of "localfd" starting at
+// "offset".  Large transfers move between the file and the
+// data ports with sendfile and splice, without being copied
+// into the process.  "localfd" must be a regular file, open
+// for reading or writing respectively.
+//
+extern ssize_t netwrite_from_fd(int fildes, int localfd, off_t offset, size_t nbyte);
+extern ssize_t netread_to_fd(int fildes, int localfd, off_t offset, size_t nbyte);
+
+//
+// Give the server an access hint (NET_ADVICE_*) for the
+// file behind "fildes", so bulk transfers can keep from
+// pushing other files out of its page cache
+//
+extern int netadvise(int fildes, int advice);
+
+//
+// Set when writes to the file behind "fildes" reach the
+// server's disk (NET_DURABLE_*), or wait for everything
+// written to it so far to get there.  Syncs that come in
+// together are done together.
+//
+extern int netdurability(int fildes, int mode);
+extern int netfsync(int fildes);
+
+//
+// Transactions.  Between nettx_begin and nettx_commit, each
+// netwrite is staged on the server rather than replacing
+// its file, and reads still see the files as they were.
+// nettx_commit puts every staged file in place, on disk,
+// together: a netopen sees all of them or none.  nettx_abort
+// drops them.  A transaction can write up to
+// NET_TX_MAX_FILES files.  A commit that fails before
+// putting any file in place is aborted; one that fails on a
+// rename keeps the transaction open, with the files not yet
+// in place, to try nettx_commit again or nettx_abort.  A
+// server that stops part way through a commit finishes it
+// when it starts again.  The server aborts a transaction
+// left without a netwrite for five minutes.
+//
+extern int nettx_begin(void);
+extern int nettx_commit(void);
+extern int nettx_abort(void);
+
+//
+// Whole-file operations.  netget reads up to "nbyte" bytes of
+// a file and netput replaces a file's contents, each in one
+// request that opens, transfers and closes the file under
+// the current connection mode.
+//
+extern ssize_t netget(const char *pathname, void *buf, size_t nbyte);
+extern ssize_t netput(const char *pathname, const void *buf, size_t nbyte);
+
+//
+// Replace the contents of "dst" with up to "nbyte" bytes of
+// "src" from "offset", copied on the server.  Where the
+// server's file system can, the copy shares the blocks
+// rather than duplicating them.  Both files are opened under
+// the current connection mode.  Returns the number of bytes
+// copied, which is short at the end of "src".
+//
+extern ssize_t netcopy(const char *src, const char *dst, off_t offset, size_t nbyte);
+
+//
+// Batched calls.  Each carries up to NET_BATCH_MAX entries in
+// one request and returns the number of entries that
+// succeeded, or FAILURE if the request itself failed.  Entry
+// results are returned per entry: "fds" gets each new netfd
+// (FAILURE for a failed entry) and "errnos", if not NULL,
+// each entry's errno.
+//
+extern int netopen_batch(const char **pathnames, const int *flags, int count, int *fds, int *errnos);
+extern int netstat_batch(const char **pathnames, int count, NET_STAT_TYPE *stats);
+extern int netclose_batch(const int *fds, int count, int *errnos);
+
+//
+// Context calls.  Each netctx_ call does what the call of the
+// same name above does, on the server of the given context
+// rather than the one set by netserverinit.  A process can
+// hold contexts for several servers, and any number of
+// threads can share one context.  A netfd can only be used
+// with the context that opened it.  The asynchronous calls
+// use the netserverinit server.
+//
+extern netctx_t *netctx_create(const char *hostname, int filemode);
+extern void netctx_destroy(netctx_t *ctx);
+
+extern int netctx_open(netctx_t *ctx, const char *pathname, int flags);
+extern ssize_t netctx_read(netctx_t *ctx, int fildes, void *buf, size_t nbyte);
+extern ssize_t netctx_write(netctx_t *ctx, int fildes, const void *buf, size_t nbyte);
+extern int netctx_close(netctx_t *ctx, int fd);
+extern ssize_t netctx_stats(netctx_t *ctx, char *buf, size_t nbyte);
+extern ssize_t netctx_readv(netctx_t *ctx, int fildes, const struct iovec *iov, int iovcnt);
+extern ssize_t netctx_writev(netctx_t *ctx, int fildes, const struct iovec *iov, int iovcnt);
+extern ssize_t netctx_readranges(netctx_t *ctx, int fildes, NET_RANGE_TYPE *ranges, int count, void **bufs);
+extern ssize_t netctx_get(netctx_t *ctx, const char *pathname, void *buf, size_t nbyte);
+extern ssize_t netctx_put(netctx_t *ctx, const char *pathname, const void *buf, size_t nbyte);
+extern ssize_t netctx_copy(netctx_t *ctx, const char *src, const char *dst, off_t offset, size_t nbyte);
+extern int netctx_open_batch(netctx_t *ctx, const char **pathnames, const int *flags, int count,
+                             int *fds, int *errnos);
+extern int netctx_stat_batch(netctx_t *ctx, const char **pathnames, int count, NET_STAT_TYPE *stats);
+extern int netctx_close_batch(netctx_t *ctx, const int *fds, int count, int *errnos);
+extern ssize_t netctx_read_stream(netctx_t *ctx, int fildes, int chunkSize, int depth,
+                                  NET_STREAM_CALLBACK callback, void *userData);
+extern ssize_t netctx_write_from_fd(netctx_t *ctx, int fildes, int localfd, off_t offset, size_t nbyte);
+extern ssize_t netctx_read_to_fd(netctx_t *ctx, int fildes, int localfd, off_t offset, size_t nbyte);
+extern int netctx_advise(netctx_t *ctx, int fildes, int advice);
+extern int netctx_durability(netctx_t *ctx, int fildes, int mode);
+extern int netctx_fsync(netctx_t *ctx, int fildes);
+extern int netctx_tx_begin(netctx_t *ctx);
+extern int netctx_tx_commit(netctx_t *ctx);
+extern int netctx_tx_abort(netctx_t *ctx);
+
+//
+// Request tracing.  nettrace_last returns the trace ID of
+// the calling thread's most recent net function call.
+// nettrace_export writes this process' spans of that trace
+// (or of all traces if traceId is 0) to "path" as Chrome
+// trace-event JSON.
+//
+extern unsigned long long nettrace_last();
+extern int nettrace_export(const char *path, unsigned long long traceId);
 
 
 
@@ -0,0 +1,612 @@
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// netbench drives a net file server with many client
+// threads and reports throughput and latency percentiles.
+//
+// Each thread runs a number of sessions.  A session picks a
+// file (uniformly or by Zipf popularity), opens it, performs
+// a number of reads and writes according to the read/write
+// mix, and closes it.  Every open, read, write and close is
+// timed individually.
+//
+// Because the connection mode is set by netserverinit for
+// the whole process, all threads share one access mode.  In
+// exclusive and transaction mode, opens that conflict with
+// another thread are counted as errors and the session is
+// skipped, which makes the cost of contention visible.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef enum {
+    BENCH_OPEN  = 0,
+    BENCH_READ  = 1,
+    BENCH_WRITE = 2,
+    BENCH_CLOSE = 3,
+    BENCH_OP_COUNT = 4
+} BENCH_OP_TYPE;
+
+
+typedef struct {
+    uint64_t *ns;         // latency of each successful op
+    long count;
+    long errors;
+    long long bytes;
+} BENCH_RESULT_TYPE;
+
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    uint64_t rng;
+    char *buf;
+    BENCH_RESULT_TYPE result[ BENCH_OP_COUNT ];
+} BENCH_THREAD_TYPE;
+
+
+typedef struct {
+    char *hostname;
+    int threads;
+    int sessions;         // per thread
+    int opsPerSession;
+    int readPct;
+    int files;
+    int sizes[16];
+    int sizeCount;
+    double zipf;
+    int mode;
+    char *dir;
+    char *format;
+    unsigned int seed;
+} BENCH_CONFIG_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void usage( const char *prog );
+int  parseSizes( char *list );
+uint64_t nowNs();
+uint64_t nextRandom( uint64_t *state );
+double   nextUniform( uint64_t *state );
+int  pickFile( uint64_t *state );
+int  fileSize( const int file );
+void filePath( const int file, char *path, const size_t len );
+int  prepareFiles();
+void recordOp( BENCH_THREAD_TYPE *t, const BENCH_OP_TYPE op, const uint64_t start,
+               const long long rc );
+void *benchThread( void *arg );
+int  compareNs( const void *a, const void *b );
+uint64_t percentile( const uint64_t *sorted, const long n, const double q );
+void report( const double wallSec );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+BENCH_CONFIG_TYPE gConfig;
+BENCH_THREAD_TYPE *gThreads = NULL;
+double *gZipfCdf = NULL;
+
+const char *gOpNames[ BENCH_OP_COUNT ] = { "open", "read", "write", "close" };
+const char *gModeNames[] = { "", "unrestricted", "exclusive", "transaction" };
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+void usage( const char *prog )
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "    -h host       server host name (localhost)\n"
+        "    -t threads    client threads (4)\n"
+        "    -s sessions   sessions per thread (100)\n"
+        "    -n ops        reads/writes per session (10)\n"
+        "    -r percent    percentage of reads, the rest are writes (90)\n"
+        "    -f files      number of files (16)\n"
+        "    -b sizes      comma separated file sizes in bytes (4096)\n"
+        "    -z s          Zipf exponent for file popularity, 0 = uniform (0)\n"
+        "    -m mode       unrestricted | exclusive | transaction (unrestricted)\n"
+        "    -d dir        directory for the files, as seen by the server (/tmp)\n"
+        "    -o format     text | csv | json (text)\n"
+        "    -S seed       random seed (1)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+int parseSizes( char *list )
+{
+    char *token = NULL;
+    char *savePtr = NULL;
+
+    gConfig.sizeCount = 0;
+    for (token = strtok_r(list, ",", &savePtr); token != NULL; token = strtok_r(NULL, ",", &savePtr)) {
+        if ( gConfig.sizeCount >= 16 ) return FAILURE;
+        gConfig.sizes[ gConfig.sizeCount ] = atoi(token);
+        if ( gConfig.sizes[ gConfig.sizeCount ] <= 0 ) return FAILURE;
+        gConfig.sizeCount++;
+    }
+
+    return (gConfig.sizeCount > 0) ? SUCCESS : FAILURE;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+//
+// Per-thread xorshift64* generator, so threads never share
+// random state and runs with the same seed pick the same
+// sequence of files and ops.
+//
+uint64_t nextRandom( uint64_t *state )
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+double nextUniform( uint64_t *state )
+{
+    return (double)(nextRandom(state) >> 11) / (double)(1ULL << 53);
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// File "i" has popularity proportional to 1 / (i+1)^s.
+// The cumulative distribution is built once in main and
+// searched with a binary search.
+//
+/////////////////////////////////////////////////////////////
+
+int pickFile( uint64_t *state )
+{
+    double u = nextUniform(state);
+    int lo = 0;
+    int hi = gConfig.files - 1;
+
+    while ( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        if ( gZipfCdf[mid] < u ) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+
+//
+// File sizes are assigned to files round robin
+//
+int fileSize( const int file )
+{
+    return gConfig.sizes[ file % gConfig.sizeCount ];
+}
+
+
+void filePath( const int file, char *path, const size_t len )
+{
+    snprintf(path, len, "%s/netbench.%d", gConfig.dir, file);
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Create every file at its full size before the timed run,
+// so reads see real data from the first op.
+//
+/////////////////////////////////////////////////////////////
+
+int prepareFiles()
+{
+    char path[256] = "";
+    char *buf = NULL;
+    int maxSize = 0;
+    int i = 0;
+    int fd = -1;
+
+    for (i=0; i < gConfig.sizeCount; i++) {
+        if ( gConfig.sizes[i] > maxSize ) maxSize = gConfig.sizes[i];
+    }
+
+    buf = malloc(maxSize);
+    if ( buf == NULL ) return FAILURE;
+    memset(buf, 'b', maxSize);
+
+    for (i=0; i < gConfig.files; i++) {
+        filePath(i, path, sizeof(path));
+
+        fd = netopen(path, O_RDWR);
+        if ( fd == FAILURE ) {
+            fprintf(stderr, "netbench: cannot open \"%s\", errno= %d (%s)\n",
+                    path, errno, strerror(errno));
+            free(buf);
+            return FAILURE;
+        }
+
+        if ( netwrite(fd, buf, fileSize(i)) != fileSize(i) ) {
+            fprintf(stderr, "netbench: cannot write \"%s\", errno= %d (%s)\n",
+                    path, errno, strerror(errno));
+        }
+        netclose(fd);
+    }
+
+    free(buf);
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void recordOp( BENCH_THREAD_TYPE *t, const BENCH_OP_TYPE op, const uint64_t start,
+               const long long rc )
+{
+    BENCH_RESULT_TYPE *r = &t->result[op];
+
+    if ( rc == FAILURE ) {
+        r->errors++;
+        return;
+    }
+
+    r->ns[ r->count++ ] = nowNs() - start;
+    if ((op == BENCH_READ) || (op == BENCH_WRITE)) r->bytes += rc;
+}
+
+
+void *benchThread( void *arg )
+{
+    BENCH_THREAD_TYPE *t = (BENCH_THREAD_TYPE *)arg;
+    char path[256] = "";
+    int session = 0;
+    int i = 0;
+
+    //
+    // Only open for writing when the mix has writes, so a pure
+    // read run can share files in exclusive mode.
+    //
+    int flags = (gConfig.readPct >= 100) ? O_RDONLY : O_RDWR;
+
+    for (session = 0; session < gConfig.sessions; session++) {
+        int file = pickFile(&t->rng);
+        int size = fileSize(file);
+        uint64_t start = nowNs();
+        int fd = -1;
+
+        filePath(file, path, sizeof(path));
+        fd = netopen(path, flags);
+        recordOp(t, BENCH_OPEN, start, fd);
+        if ( fd == FAILURE ) continue;
+
+        for (i=0; i < gConfig.opsPerSession; i++) {
+            long long rc = 0;
+
+            if ( (int)(nextUniform(&t->rng) * 100.0) < gConfig.readPct ) {
+                start = nowNs();
+                rc = netread(fd, t->buf, size);
+                recordOp(t, BENCH_READ, start, rc);
+            }
+            else {
+                start = nowNs();
+                rc = netwrite(fd, t->buf, size);
+                recordOp(t, BENCH_WRITE, start, rc);
+            }
+        }
+
+        start = nowNs();
+        recordOp(t, BENCH_CLOSE, start, netclose(fd));
+    }
+
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int compareNs( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+uint64_t percentile( const uint64_t *sorted, const long n, const double q )
+{
+    long i = 0;
+
+    if ( n == 0 ) return 0;
+
+    i = (long)ceil(q * (double)n) - 1;
+    if ( i < 0 ) i = 0;
+    if ( i >= n ) i = n - 1;
+
+    return sorted[i];
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Merge the per-thread results and print one row per op
+// type plus an "all" row, as a text table, CSV or JSON.
+// CSV rows repeat the configuration so runs from different
+// builds can be appended to one file and compared.
+//
+/////////////////////////////////////////////////////////////
+
+void report( const double wallSec )
+{
+    int op = 0;
+    int i = 0;
+    int bCsv  = (strcmp(gConfig.format, "csv") == 0);
+    int bJson = (strcmp(gConfig.format, "json") == 0);
+    long totalOps = 0;
+    long long totalBytes = 0;
+
+
+    for (op = 0; op < BENCH_OP_COUNT; op++) {
+        for (i=0; i < gConfig.threads; i++) {
+            totalOps   += gThreads[i].result[op].count;
+            totalBytes += gThreads[i].result[op].bytes;
+        }
+    }
+
+    if ( bCsv ) {
+        printf("op,threads,sessions,ops_per_session,read_pct,files,zipf,mode,"
+               "count,errors,bytes,ops_per_s,mb_per_s,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    }
+    else if ( bJson ) {
+        printf("{\"config\":{\"host\":\"%s\",\"threads\":%d,\"sessions\":%d,"
+               "\"ops_per_session\":%d,\"read_pct\":%d,\"files\":%d,\"zipf\":%.3f,\"mode\":\"%s\"},\n",
+               gConfig.hostname, gConfig.threads, gConfig.sessions, gConfig.opsPerSession,
+               gConfig.readPct, gConfig.files, gConfig.zipf, gModeNames[gConfig.mode]);
+        printf(" \"wall_s\":%.3f,\"ops_per_s\":%.1f,\"mb_per_s\":%.3f,\n \"ops\":[",
+               wallSec, totalOps / wallSec, totalBytes / wallSec / 1e6);
+    }
+    else {
+        printf("netbench: %d threads x %d sessions x %d ops, %d%% reads, %d files, zipf %.2f, %s mode\n",
+               gConfig.threads, gConfig.sessions, gConfig.opsPerSession, gConfig.readPct,
+               gConfig.files, gConfig.zipf, gModeNames[gConfig.mode]);
+        printf("wall %.3f s, %.1f ops/s, %.3f MB/s\n\n", wallSec, totalOps / wallSec,
+               totalBytes / wallSec / 1e6);
+        printf("%-6s %9s %7s %12s %10s %10s %10s %10s %10s\n", "op", "count", "errors",
+               "bytes", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    }
+
+
+    //
+    // Row BENCH_OP_COUNT is the "all" row
+    //
+    for (op = 0; op <= BENCH_OP_COUNT; op++) {
+        int first = (op == BENCH_OP_COUNT) ? 0 : op;
+        int last  = (op == BENCH_OP_COUNT) ? BENCH_OP_COUNT - 1 : op;
+        const char *name = (op == BENCH_OP_COUNT) ? "all" : gOpNames[op];
+        long count = 0;
+        long errors = 0;
+        long long bytes = 0;
+        double sum = 0.0;
+        uint64_t *ns = NULL;
+        int k = 0;
+
+        for (k = first; k <= last; k++) {
+            for (i=0; i < gConfig.threads; i++) count += gThreads[i].result[k].count;
+        }
+
+        ns = malloc(sizeof(uint64_t) * (count + 1));
+        count = 0;
+        for (k = first; k <= last; k++) {
+            for (i=0; i < gConfig.threads; i++) {
+                BENCH_RESULT_TYPE *r = &gThreads[i].result[k];
+                memcpy(ns + count, r->ns, sizeof(uint64_t) * r->count);
+                count  += r->count;
+                errors += r->errors;
+                bytes  += r->bytes;
+            }
+        }
+        qsort(ns, count, sizeof(uint64_t), compareNs);
+        for (i=0; i < count; i++) sum += ns[i];
+
+        double mean = (count > 0) ? sum / count / 1e3 : 0.0;
+        double p50  = percentile(ns, count, 0.50) / 1e3;
+        double p99  = percentile(ns, count, 0.99) / 1e3;
+        double p999 = percentile(ns, count, 0.999) / 1e3;
+        double max  = (count > 0) ? ns[count - 1] / 1e3 : 0.0;
+
+        if ( bCsv ) {
+            printf("%s,%d,%d,%d,%d,%d,%.3f,%s,%ld,%ld,%lld,%.1f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                   name, gConfig.threads, gConfig.sessions, gConfig.opsPerSession,
+                   gConfig.readPct, gConfig.files, gConfig.zipf, gModeNames[gConfig.mode],
+                   count, errors, bytes, count / wallSec, bytes / wallSec / 1e6,
+                   mean, p50, p99, p999, max);
+        }
+        else if ( bJson ) {
+            printf("%s\n  {\"op\":\"%s\",\"count\":%ld,\"errors\":%ld,\"bytes\":%lld,"
+                   "\"ops_per_s\":%.1f,\"mb_per_s\":%.3f,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+                   "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+                   (op == 0) ? "" : ",", name, count, errors, bytes,
+                   count / wallSec, bytes / wallSec / 1e6, mean, p50, p99, p999, max);
+        }
+        else {
+            printf("%-6s %9ld %7ld %12lld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                   name, count, errors, bytes, mean, p50, p99, p999, max);
+        }
+
+        free(ns);
+    }
+
+    if ( bJson ) printf("\n ]}\n");
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    char sizeList[128] = "4096";
+    int opt = 0;
+    int i = 0;
+    int op = 0;
+
+
+    bzero(&gConfig, sizeof(gConfig));
+    gConfig.hostname      = "localhost";
+    gConfig.threads       = 4;
+    gConfig.sessions      = 100;
+    gConfig.opsPerSession = 10;
+    gConfig.readPct       = 90;
+    gConfig.files         = 16;
+    gConfig.zipf          = 0.0;
+    gConfig.mode          = UNRESTRICTED_MODE;
+    gConfig.dir           = "/tmp";
+    gConfig.format        = "text";
+    gConfig.seed          = 1;
+
+    while ((opt = getopt(argc, argv, "h:t:s:n:r:f:b:z:m:d:o:S:")) != -1) {
+        switch (opt) {
+            case 'h': gConfig.hostname      = optarg; break;
+            case 't': gConfig.threads       = atoi(optarg); break;
+            case 's': gConfig.sessions      = atoi(optarg); break;
+            case 'n': gConfig.opsPerSession = atoi(optarg); break;
+            case 'r': gConfig.readPct       = atoi(optarg); break;
+            case 'f': gConfig.files         = atoi(optarg); break;
+            case 'z': gConfig.zipf          = atof(optarg); break;
+            case 'd': gConfig.dir           = optarg; break;
+            case 'o': gConfig.format        = optarg; break;
+            case 'S': gConfig.seed          = (unsigned int)atoi(optarg); break;
+            case 'b':
+                strncpy(sizeList, optarg, sizeof(sizeList) - 1);
+                break;
+            case 'm':
+                if      ( strcmp(optarg, "unrestricted") == 0 ) gConfig.mode = UNRESTRICTED_MODE;
+                else if ( strcmp(optarg, "exclusive")    == 0 ) gConfig.mode = EXCLUSIVE_MODE;
+                else if ( strcmp(optarg, "transaction")  == 0 ) gConfig.mode = TRANSACTION_MODE;
+                else usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if ((gConfig.threads <= 0) || (gConfig.sessions <= 0) || (gConfig.opsPerSession < 0) ||
+        (gConfig.files <= 0) || (gConfig.readPct < 0) || (gConfig.readPct > 100) ||
+        (gConfig.zipf < 0.0) || (parseSizes(sizeList) != SUCCESS) ||
+        ((strcmp(gConfig.format, "text") != 0) && (strcmp(gConfig.format, "csv") != 0) &&
+         (strcmp(gConfig.format, "json") != 0)))
+    {
+        usage(argv[0]);
+    }
+
+
+    //
+    // Build the cumulative popularity distribution
+    //
+    gZipfCdf = malloc(sizeof(double) * gConfig.files);
+    double total = 0.0;
+    for (i=0; i < gConfig.files; i++) {
+        total += 1.0 / pow((double)(i + 1), gConfig.zipf);
+        gZipfCdf[i] = total;
+    }
+    for (i=0; i < gConfig.files; i++) gZipfCdf[i] /= total;
+
+
+    //
+    // Files are created in unrestricted mode, then the server
+    // is re-initialized in the mode under test.
+    //
+    if ( netserverinit(gConfig.hostname, UNRESTRICTED_MODE) != SUCCESS ) {
+        fprintf(stderr, "netbench: netserverinit \"%s\" failed, errno= %d, h_errno= %d\n",
+                gConfig.hostname, errno, h_errno);
+        exit(EXIT_FAILURE);
+    }
+    if ( prepareFiles() != SUCCESS ) exit(EXIT_FAILURE);
+    if ( netserverinit(gConfig.hostname, gConfig.mode) != SUCCESS ) exit(EXIT_FAILURE);
+
+
+    //
+    // Allocate everything up front so the timed run does no
+    // bookkeeping allocations.
+    //
+    int maxSize = 0;
+    for (i=0; i < gConfig.sizeCount; i++) {
+        if ( gConfig.sizes[i] > maxSize ) maxSize = gConfig.sizes[i];
+    }
+
+    gThreads = calloc(gConfig.threads, sizeof(BENCH_THREAD_TYPE));
+    for (i=0; i < gConfig.threads; i++) {
+        long maxOps = (long)gConfig.sessions * (gConfig.opsPerSession > 0 ? gConfig.opsPerSession : 1);
+
+        gThreads[i].id  = i;
+        gThreads[i].rng = ((uint64_t)gConfig.seed << 32) ^ (0x9E3779B97F4A7C15ULL * (i + 1));
+        gThreads[i].buf = malloc(maxSize);
+        memset(gThreads[i].buf, 'a' + (i % 26), maxSize);
+
+        for (op = 0; op < BENCH_OP_COUNT; op++) {
+            long n = ((op == BENCH_READ) || (op == BENCH_WRITE)) ? maxOps : gConfig.sessions;
+            gThreads[i].result[op].ns = malloc(sizeof(uint64_t) * (n + 1));
+        }
+    }
+
+
+    uint64_t start = nowNs();
+    for (i=0; i < gConfig.threads; i++) {
+        pthread_create(&gThreads[i].tid, NULL, &benchThread, &gThreads[i]);
+    }
+    for (i=0; i < gConfig.threads; i++) {
+        pthread_join(gThreads[i].tid, NULL);
+    }
+    double wallSec = (nowNs() - start) / 1e9;
+
+    report( wallSec );
+
+    exit(EXIT_SUCCESS);
+}
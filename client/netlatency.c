@@ -0,0 +1,307 @@
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// netlatency measures the latency of a single netwrite and
+// netread for every power of two size from 1 byte up to
+// the maximum size (64 KB by default).  One client thread
+// does one op at a time, so the numbers are the round trip
+// cost of each call with no queueing.
+//
+// Sizes up to INLINE_DATA_SIZE use the inline path.  Going
+// past it with "-m" shows the cost of the data port path
+// for comparison.
+//
+// For whole files, netget and netput are timed against the
+// netopen, netread/netwrite, netclose sequence they replace.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef enum {
+    LAT_WRITE  = 0,
+    LAT_READ   = 1,
+    LAT_PUT    = 2,
+    LAT_OWC    = 3,   // netopen, netwrite, netclose
+    LAT_GET    = 4,
+    LAT_ORC    = 5,   // netopen, netread, netclose
+    LAT_OP_COUNT = 6
+} LAT_OP_TYPE;
+
+
+typedef struct {
+    char *hostname;
+    char *path;
+    int iterations;
+    int warmup;
+    int maxSize;
+    char *format;
+} LAT_CONFIG_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void usage( const char *prog );
+uint64_t nowNs();
+int  compareNs( const void *a, const void *b );
+uint64_t percentile( const uint64_t *sorted, const long n, const double q );
+ssize_t doOp( const LAT_OP_TYPE op, const int fd, char *buf, const int size );
+int  timeOps( const LAT_OP_TYPE op, const int fd, char *buf, const int size, uint64_t *ns );
+void report( const LAT_OP_TYPE op, const int size, uint64_t *ns, const int n );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+LAT_CONFIG_TYPE gConfig;
+
+const char *gOpNames[ LAT_OP_COUNT ] = { "write", "read", "put", "o-w-c", "get", "o-r-c" };
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+void usage( const char *prog )
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "    -h host       server host name, or host:port (localhost)\n"
+        "    -f path       file on the server to use (/tmp/netlatency.dat)\n"
+        "    -n count      timed ops per size and direction (1000)\n"
+        "    -w count      untimed warm up ops per size (10)\n"
+        "    -m bytes      largest size, a power of two (65536)\n"
+        "    -o format     text or csv (text)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+int compareNs( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+uint64_t percentile( const uint64_t *sorted, const long n, const double q )
+{
+    long i = 0;
+
+    if ( n <= 0 ) return 0;
+    i = (long)(q * (double)n);
+    if ( i >= n ) i = n - 1;
+    return sorted[i];
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// The open-transfer-close sequences open the file read-only
+// or write-only, so they never share (and close) the
+// benchmark's own read-write netfd.
+//
+/////////////////////////////////////////////////////////////
+
+ssize_t doOp( const LAT_OP_TYPE op, const int fd, char *buf, const int size )
+{
+    ssize_t rc = 0;
+    int opFd = -1;
+
+    switch (op) {
+        case LAT_WRITE: return netwrite(fd, buf, size);
+        case LAT_READ:  return netread(fd, buf, size);
+        case LAT_PUT:   return netput(gConfig.path, buf, size);
+        case LAT_GET:   return netget(gConfig.path, buf, size);
+
+        case LAT_OWC:
+        case LAT_ORC:
+            opFd = netopen(gConfig.path, (op == LAT_OWC) ? O_WRONLY : O_RDONLY);
+            if ( opFd == FAILURE ) return FAILURE;
+            rc = (op == LAT_OWC) ? netwrite(opFd, buf, size) : netread(opFd, buf, size);
+            if ( netclose(opFd) == FAILURE ) return FAILURE;
+            return rc;
+
+        default:
+            return FAILURE;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Run the warm up ops and then "iterations" timed ops of one
+// kind and size.  Returns the number of timed ops that
+// succeeded; their latencies are in "ns".
+//
+/////////////////////////////////////////////////////////////
+
+int timeOps( const LAT_OP_TYPE op, const int fd, char *buf, const int size, uint64_t *ns )
+{
+    int n = 0;
+    int i = 0;
+    ssize_t rc = 0;
+
+    for (i=0; i < gConfig.warmup + gConfig.iterations; i++) {
+        uint64_t start = nowNs();
+
+        rc = doOp(op, fd, buf, size);
+        if ( rc < 0 ) {
+            fprintf(stderr, "netlatency: %s of %d bytes returns %ld, errno= %d (%s)\n",
+                    gOpNames[op], size, (long)rc, errno, strerror(errno));
+            continue;
+        }
+
+        if ( i >= gConfig.warmup ) ns[ n++ ] = nowNs() - start;
+    }
+
+    return n;
+}
+
+
+void report( const LAT_OP_TYPE op, const int size, uint64_t *ns, const int n )
+{
+    double sum = 0.0;
+    int i = 0;
+
+    qsort(ns, n, sizeof(uint64_t), compareNs);
+    for (i=0; i < n; i++) sum += (double)ns[i];
+
+    if ( strcmp(gConfig.format, "csv") == 0 ) {
+        printf("%s,%d,%d,%.1f,%.1f,%.1f,%.1f\n", gOpNames[op], size, n,
+               (n > 0) ? sum / n / 1000.0 : 0.0,
+               percentile(ns, n, 0.50) / 1000.0, percentile(ns, n, 0.99) / 1000.0,
+               percentile(ns, n, 1.0) / 1000.0);
+    }
+    else {
+        printf("%-6s %8d %6d %10.1f %10.1f %10.1f %10.1f  %s\n", gOpNames[op], size, n,
+               (n > 0) ? sum / n / 1000.0 : 0.0,
+               percentile(ns, n, 0.50) / 1000.0, percentile(ns, n, 0.99) / 1000.0,
+               percentile(ns, n, 1.0) / 1000.0,
+               ((op == LAT_PUT) || (op == LAT_GET)) ? "whole" :
+               (size <= INLINE_DATA_SIZE) ? "inline" : "ports");
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    char *buf = NULL;
+    uint64_t *ns = NULL;
+    int opt = 0;
+    int size = 0;
+    int fd = -1;
+
+
+    gConfig.hostname   = "localhost";
+    gConfig.path       = "/tmp/netlatency.dat";
+    gConfig.iterations = 1000;
+    gConfig.warmup     = 10;
+    gConfig.maxSize    = 65536;
+    gConfig.format     = "text";
+
+    while ((opt = getopt(argc, argv, "h:f:n:w:m:o:")) != -1) {
+        switch (opt) {
+            case 'h': gConfig.hostname   = optarg; break;
+            case 'f': gConfig.path       = optarg; break;
+            case 'n': gConfig.iterations = atoi(optarg); break;
+            case 'w': gConfig.warmup     = atoi(optarg); break;
+            case 'm': gConfig.maxSize    = atoi(optarg); break;
+            case 'o': gConfig.format     = optarg; break;
+            default:  usage(argv[0]);
+        }
+    }
+
+    if ((gConfig.iterations <= 0) || (gConfig.warmup < 0) || (gConfig.maxSize <= 0) ||
+        ((strcmp(gConfig.format, "text") != 0) && (strcmp(gConfig.format, "csv") != 0)))
+    {
+        usage(argv[0]);
+    }
+
+
+    if ( netserverinit(gConfig.hostname, UNRESTRICTED_MODE) == FAILURE ) {
+        fprintf(stderr, "netlatency: netserverinit(\"%s\") failed, errno= %d, h_errno= %d\n",
+                gConfig.hostname, errno, h_errno);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = netopen(gConfig.path, O_RDWR);
+    if ( fd == FAILURE ) {
+        fprintf(stderr, "netlatency: cannot open \"%s\", errno= %d (%s)\n",
+                gConfig.path, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    buf = malloc( gConfig.maxSize );
+    ns  = malloc( sizeof(uint64_t) * gConfig.iterations );
+    if ((buf == NULL) || (ns == NULL)) {
+        fprintf(stderr, "netlatency: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'l', gConfig.maxSize);
+
+
+    if ( strcmp(gConfig.format, "csv") == 0 ) {
+        printf("op,bytes,count,mean_us,p50_us,p99_us,max_us\n");
+    }
+    else {
+        printf("%-6s %8s %6s %10s %10s %10s %10s  %s\n",
+               "op", "bytes", "count", "mean_us", "p50_us", "p99_us", "max_us", "path");
+    }
+
+    //
+    // Each size is written first, so the reads that follow
+    // find a file of exactly that size.
+    //
+    for (size = 1; size <= gConfig.maxSize; size = size * 2) {
+        LAT_OP_TYPE op;
+
+        for (op = LAT_WRITE; op < LAT_OP_COUNT; op++) {
+            report(op, size, ns, timeOps(op, fd, buf, size, ns));
+        }
+    }
+
+    netclose(fd);
+    free(ns);
+    free(buf);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,638 @@
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// netproxy sits between libnetfiles and netfileserver and
+// makes a loopback connection look like a WAN link.
+//
+// It listens on a control port and the
+// MAX_FILE_TRANSFER_SOCKETS data ports after it, and
+// forwards each connection to the same offset on the
+// server.  Because the server sends data ports as offsets
+// from its control port, clients just use the proxy as
+// their server:
+//
+//     netfileserver
+//     netproxy -l 44321 -s localhost:54321 -d 25 -b 100000
+//     netbench -h localhost:44321
+//
+// Each direction of a connection is a pipe with a reader
+// and a writer thread.  The reader stamps every chunk it
+// reads with a release time and the writer holds the
+// chunk until then.  The release time models:
+//
+//     bandwidth   the link sends one chunk at a time at
+//                 the given rate
+//     delay       one-way propagation delay
+//     jitter      extra delay, uniform in [0, jitter]
+//     reorder     with the given probability, a chunk is
+//                 held for an extra stall.  TCP delivers
+//                 in order, so a reordered or retransmitted
+//                 segment shows up as a stall of everything
+//                 behind it.  That is what is emulated.
+//
+// Release times never go backwards, so bytes are never
+// reordered on the stream.  A new connection also costs
+// one round trip before its first bytes arrive, like a TCP
+// handshake over the emulated link.
+//
+// All random choices come from a generator seeded by the
+// "-S" seed, the port offset, the connection's sequence
+// number on that port and the direction.  The same seed
+// and the same workload give the same delays.
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// Largest chunk read from a socket in one go
+//
+#define PROXY_CHUNK_SIZE    16384
+
+
+//
+// Bytes a pipe may hold before its reader stops reading.
+// This is the emulated link's buffer.
+//
+#define PROXY_QUEUE_LIMIT   (16 * 1024 * 1024)
+
+
+typedef struct PROXY_CHUNK {
+    struct PROXY_CHUNK *next;
+    uint64_t release;           // monotonic ns
+    int len;
+    char data[];
+} PROXY_CHUNK_TYPE;
+
+
+struct PROXY_CONN;
+
+typedef struct {
+    int src;
+    int dst;
+    const char *name;           // "up" or "down", for -v
+    uint64_t rng;
+    uint64_t linkFree;          // when the link finishes the previous chunk
+    uint64_t lastRelease;       // release times never go backwards
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    PROXY_CHUNK_TYPE *head;
+    PROXY_CHUNK_TYPE *tail;
+    long queued;                // bytes in the queue
+    int eof;                    // reader is done
+
+    struct PROXY_CONN *conn;
+} PROXY_PIPE_TYPE;
+
+
+typedef struct PROXY_CONN {
+    int client;
+    int server;
+    int offset;                 // port offset, 0 = control port
+    long seq;                   // connection number on this port
+    _Atomic int refs;           // writers still running
+    PROXY_PIPE_TYPE up;         // client to server
+    PROXY_PIPE_TYPE down;       // server to client
+} PROXY_CONN_TYPE;
+
+
+typedef struct {
+    int sockfd;
+    int offset;
+    long seq;
+} PROXY_LISTENER_TYPE;
+
+
+typedef struct {
+    int listenPort;
+    char serverHost[256];
+    int serverPort;
+    uint64_t delayNs;
+    uint64_t jitterNs;
+    uint64_t reorderNs;
+    double reorderProb;
+    double bitsPerSec;          // 0 = unlimited
+    uint64_t seed;
+    int verbose;
+} PROXY_CONFIG_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void usage( const char *prog );
+uint64_t nowNs();
+void     sleepUntil( const uint64_t when );
+uint64_t nextRandom( uint64_t *state );
+double   nextUniform( uint64_t *state );
+int  listenOn( const int port );
+int  connectServer( const int port );
+int  writeFully( const int sockfd, const char *buf, const int nBytes );
+void initPipe( PROXY_PIPE_TYPE *pipe, PROXY_CONN_TYPE *conn, const int src, const int dst,
+               const char *name, const int direction );
+void *listenerThread( void *arg );
+void *pipeReader( void *arg );
+void *pipeWriter( void *arg );
+void releaseConn( PROXY_CONN_TYPE *conn );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+PROXY_CONFIG_TYPE gConfig;
+struct sockaddr_storage gServerAddr;
+socklen_t gServerAddrLen = 0;
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+void usage( const char *prog )
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "    -l port        control port to listen on (44321)\n"
+        "    -s host:port   net file server (localhost:%d)\n"
+        "    -d ms          one-way delay, half the round trip time (0)\n"
+        "    -j ms          jitter, added uniformly in [0, ms] (0)\n"
+        "    -b kbit        bandwidth per direction per connection, 0 = unlimited (0)\n"
+        "    -r percent     chance a chunk is held back as if reordered (0)\n"
+        "    -R ms          extra stall of a held back chunk (2 x delay)\n"
+        "    -S seed        random seed (1)\n"
+        "    -v             log each connection\n", prog, NET_SERVER_PORT_NUM);
+    exit(EXIT_FAILURE);
+}
+
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+void sleepUntil( const uint64_t when )
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t)(when / 1000000000ULL);
+    ts.tv_nsec = (long)(when % 1000000000ULL);
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR ) ;
+}
+
+
+//
+// splitmix64, so nearby seeds still give unrelated streams
+//
+uint64_t nextRandom( uint64_t *state )
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+double nextUniform( uint64_t *state )
+{
+    return (double)(nextRandom(state) >> 11) / (double)(1ULL << 53);
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int listenOn( const int port )
+{
+    int sockfd  = -1;
+    int sockOpt = 1;
+    struct sockaddr_in addr;
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return FAILURE;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
+
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if ((bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+        (listen(sockfd, SOMAXCONN) < 0))
+    {
+        fprintf(stderr,"netproxy: port %d not available, errno= %d (%s)\n",
+                port, errno, strerror(errno));
+        close(sockfd);
+        return FAILURE;
+    }
+
+    return sockfd;
+}
+
+
+int connectServer( const int port )
+{
+    int sockfd = -1;
+    int sockOpt = 1;
+    struct sockaddr_storage addr = gServerAddr;
+
+    if ( addr.ss_family == AF_INET6 ) {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+    }
+
+    sockfd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0) return FAILURE;
+
+    if (connect(sockfd, (struct sockaddr *)&addr, gServerAddrLen) < 0) {
+        close(sockfd);
+        return FAILURE;
+    }
+
+    // The proxy adds the delay itself.  Don't let Nagle add more.
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &sockOpt, sizeof(sockOpt));
+    return sockfd;
+}
+
+
+int writeFully( const int sockfd, const char *buf, const int nBytes )
+{
+    int nSent = 0;
+    int rc = 0;
+
+    while ( nSent < nBytes ) {
+        rc = write(sockfd, buf + nSent, nBytes - nSent);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        nSent = nSent + rc;
+    }
+
+    return nSent;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void initPipe( PROXY_PIPE_TYPE *pipe, PROXY_CONN_TYPE *conn, const int src, const int dst,
+               const char *name, const int direction )
+{
+    bzero(pipe, sizeof(PROXY_PIPE_TYPE));
+    pipe->src  = src;
+    pipe->dst  = dst;
+    pipe->name = name;
+    pipe->conn = conn;
+    pipe->rng  = gConfig.seed ^ ((uint64_t)conn->offset << 56) ^
+                 ((uint64_t)conn->seq << 8) ^ (uint64_t)direction;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// One thread per listening port.  Connections are accepted
+// one at a time, so their sequence numbers (and with them
+// the random streams) follow the order the client makes
+// them in.
+//
+/////////////////////////////////////////////////////////////
+
+void *listenerThread( void *arg )
+{
+    PROXY_LISTENER_TYPE *listener = (PROXY_LISTENER_TYPE *)arg;
+    pthread_t tid;
+    int client = -1;
+    int server = -1;
+    int sockOpt = 1;
+
+    while ( TRUE ) {
+        client = accept(listener->sockfd, NULL, NULL);
+        if ( client < 0 ) {
+            if ( errno == EINTR ) continue;
+            fprintf(stderr,"netproxy: accept() failed, errno= %d\n", errno);
+            break;
+        }
+        uint64_t acceptTime = nowNs();
+
+        server = connectServer( gConfig.serverPort + listener->offset );
+        if ( server < 0 ) {
+            fprintf(stderr,"netproxy: cannot connect to server port %d, errno= %d (%s)\n",
+                    gConfig.serverPort + listener->offset, errno, strerror(errno));
+            close(client);
+            continue;
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &sockOpt, sizeof(sockOpt));
+
+        PROXY_CONN_TYPE *conn = calloc(1, sizeof(PROXY_CONN_TYPE));
+        conn->client = client;
+        conn->server = server;
+        conn->offset = listener->offset;
+        conn->seq    = listener->seq++;
+        atomic_init(&conn->refs, 2);
+        initPipe(&conn->up,   conn, client, server, "up",   0);
+        initPipe(&conn->down, conn, server, client, "down", 1);
+
+        //
+        // Handshake: the client's first bytes cannot reach the
+        // server before one round trip has passed.
+        //
+        conn->up.lastRelease = acceptTime + 2 * gConfig.delayNs;
+
+        if ( gConfig.verbose ) {
+            printf("netproxy: port +%d connection %ld\n", conn->offset, conn->seq);
+        }
+
+        pthread_create(&tid, NULL, &pipeReader, &conn->up);   pthread_detach(tid);
+        pthread_create(&tid, NULL, &pipeWriter, &conn->up);   pthread_detach(tid);
+        pthread_create(&tid, NULL, &pipeReader, &conn->down); pthread_detach(tid);
+        pthread_create(&tid, NULL, &pipeWriter, &conn->down); pthread_detach(tid);
+    }
+
+    close(listener->sockfd);
+    free(listener);
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void *pipeReader( void *arg )
+{
+    PROXY_PIPE_TYPE *pipe = (PROXY_PIPE_TYPE *)arg;
+    PROXY_CHUNK_TYPE *chunk = NULL;
+    int rc = 0;
+
+    while ( TRUE ) {
+        chunk = malloc(sizeof(PROXY_CHUNK_TYPE) + PROXY_CHUNK_SIZE);
+        if ( chunk == NULL ) break;
+
+        rc = read(pipe->src, chunk->data, PROXY_CHUNK_SIZE);
+        if ( rc < 0 && errno == EINTR ) {
+            free(chunk);
+            continue;
+        }
+        if ( rc <= 0 ) {
+            free(chunk);
+            break;
+        }
+
+        //
+        // Work out when this chunk comes out of the far end of
+        // the emulated link.
+        //
+        uint64_t now = nowNs();
+        uint64_t start = (pipe->linkFree > now) ? pipe->linkFree : now;
+        uint64_t release = 0;
+
+        if ( gConfig.bitsPerSec > 0 ) {
+            pipe->linkFree = start + (uint64_t)((double)rc * 8.0 * 1e9 / gConfig.bitsPerSec);
+        } else {
+            pipe->linkFree = start;
+        }
+
+        release = pipe->linkFree + gConfig.delayNs;
+        if ( gConfig.jitterNs > 0 ) {
+            release += (uint64_t)(nextUniform(&pipe->rng) * (double)gConfig.jitterNs);
+        }
+        if ((gConfig.reorderProb > 0.0) && (nextUniform(&pipe->rng) < gConfig.reorderProb)) {
+            release += gConfig.reorderNs;
+        }
+        if ( release < pipe->lastRelease ) release = pipe->lastRelease;
+        pipe->lastRelease = release;
+
+        chunk->next = NULL;
+        chunk->release = release;
+        chunk->len = rc;
+
+        pthread_mutex_lock(&pipe->lock);
+        while ( pipe->queued > PROXY_QUEUE_LIMIT ) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        if ( pipe->tail != NULL ) pipe->tail->next = chunk;
+        else pipe->head = chunk;
+        pipe->tail = chunk;
+        pipe->queued += rc;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->eof = TRUE;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void *pipeWriter( void *arg )
+{
+    PROXY_PIPE_TYPE *pipe = (PROXY_PIPE_TYPE *)arg;
+    PROXY_CHUNK_TYPE *chunk = NULL;
+    int bFailed = FALSE;
+
+    while ( TRUE ) {
+        pthread_mutex_lock(&pipe->lock);
+        while ((pipe->head == NULL) && (pipe->eof == FALSE)) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        chunk = pipe->head;
+        if ( chunk == NULL ) {
+            // Reader is done and everything has been delivered
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pipe->head = chunk->next;
+        if ( pipe->head == NULL ) pipe->tail = NULL;
+        pipe->queued -= chunk->len;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+
+        if ( bFailed == FALSE ) {
+            sleepUntil( chunk->release );
+            if ( writeFully(pipe->dst, chunk->data, chunk->len) < 0 ) {
+                //
+                // The far side is gone.  Stop this direction's
+                // reader and drop whatever is still queued.  The
+                // other direction keeps delivering what it has,
+                // as the far side sent that before going away.
+                //
+                bFailed = TRUE;
+                shutdown(pipe->src, SHUT_RD);
+            }
+        }
+        free(chunk);
+    }
+
+    //
+    // Pass the end of stream on, after the last chunk
+    //
+    if ( bFailed == FALSE ) shutdown(pipe->dst, SHUT_WR);
+
+    releaseConn( pipe->conn );
+    return NULL;
+}
+
+
+//
+// The last writer to finish closes the connection.  Both
+// readers have ended by then, because a writer only
+// finishes after its reader saw end of stream.
+//
+void releaseConn( PROXY_CONN_TYPE *conn )
+{
+    if ( atomic_fetch_sub(&conn->refs, 1) != 1 ) return;
+
+    if ( gConfig.verbose ) {
+        printf("netproxy: port +%d connection %ld closed\n", conn->offset, conn->seq);
+    }
+
+    close(conn->client);
+    close(conn->server);
+    pthread_mutex_destroy(&conn->up.lock);
+    pthread_cond_destroy(&conn->up.cond);
+    pthread_mutex_destroy(&conn->down.lock);
+    pthread_cond_destroy(&conn->down.cond);
+    free(conn);
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    char server[256] = "localhost";
+    double reorderMs = -1.0;
+    int opt = 0;
+    int i = 0;
+    pthread_t tid;
+
+
+    bzero(&gConfig, sizeof(gConfig));
+    gConfig.listenPort = 44321;
+    gConfig.serverPort = NET_SERVER_PORT_NUM;
+    gConfig.seed = 1;
+
+    while ((opt = getopt(argc, argv, "l:s:d:j:b:r:R:S:v")) != -1) {
+        switch (opt) {
+            case 'l': gConfig.listenPort  = atoi(optarg); break;
+            case 'd': gConfig.delayNs     = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'j': gConfig.jitterNs    = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'b': gConfig.bitsPerSec  = atof(optarg) * 1000.0; break;
+            case 'r': gConfig.reorderProb = atof(optarg) / 100.0; break;
+            case 'R': reorderMs           = atof(optarg); break;
+            case 'S': gConfig.seed        = strtoull(optarg, NULL, 10); break;
+            case 'v': gConfig.verbose     = TRUE; break;
+            case 's':
+                strncpy(server, optarg, sizeof(server) - 1);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    char *colon = strrchr(server, ':');
+    if ( colon != NULL ) {
+        *colon = '\0';
+        gConfig.serverPort = atoi(colon + 1);
+    }
+    strcpy(gConfig.serverHost, server);
+
+    if ((gConfig.listenPort <= 0) || (gConfig.listenPort + MAX_FILE_TRANSFER_SOCKETS > 65535) ||
+        (gConfig.serverPort <= 0) || (gConfig.serverPort + MAX_FILE_TRANSFER_SOCKETS > 65535) ||
+        (gConfig.reorderProb < 0.0) || (gConfig.reorderProb > 1.0) || (gConfig.bitsPerSec < 0.0))
+    {
+        usage(argv[0]);
+    }
+    gConfig.reorderNs = (reorderMs >= 0.0) ? (uint64_t)(reorderMs * 1e6) : 2 * gConfig.delayNs;
+
+
+    //
+    // Resolve the server once.  Every connection goes to the
+    // same address, only the port changes.
+    //
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo(gConfig.serverHost, NULL, &hints, &result) != 0 || result == NULL ) {
+        fprintf(stderr, "netproxy: cannot resolve \"%s\"\n", gConfig.serverHost);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&gServerAddr, result->ai_addr, result->ai_addrlen);
+    gServerAddrLen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    signal(SIGPIPE, SIG_IGN);   // write errors are handled where they happen
+
+
+    //
+    // Listen on the control port and every data port offset
+    //
+    for (i = 0; i <= MAX_FILE_TRANSFER_SOCKETS; i++) {
+        PROXY_LISTENER_TYPE *listener = calloc(1, sizeof(PROXY_LISTENER_TYPE));
+
+        listener->offset = i;
+        listener->sockfd = listenOn( gConfig.listenPort + i );
+        if ( listener->sockfd < 0 ) exit(EXIT_FAILURE);
+
+        pthread_create(&tid, NULL, &listenerThread, listener);
+        pthread_detach(tid);
+    }
+
+    printf("netproxy: %d-%d -> %s:%d-%d, delay %.1f ms, jitter %.1f ms, "
+           "bandwidth %.0f kbit/s, reorder %.1f%% (+%.1f ms), seed %llu\n",
+           gConfig.listenPort, gConfig.listenPort + MAX_FILE_TRANSFER_SOCKETS,
+           gConfig.serverHost, gConfig.serverPort, gConfig.serverPort + MAX_FILE_TRANSFER_SOCKETS,
+           gConfig.delayNs / 1e6, gConfig.jitterNs / 1e6, gConfig.bitsPerSec / 1000.0,
+           gConfig.reorderProb * 100.0, gConfig.reorderNs / 1e6, (unsigned long long)gConfig.seed);
+    fflush(stdout);
+
+    pause();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,329 @@
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <sys/types.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// netregress runs one regression case against a server the
+// "regress" script has started with the options the case
+// needs.  Each case prints a "test" line that says PASSED or
+// FAILED and exits non-zero on a failure.  A case that hangs
+// is failed by an alarm after REGRESS_TIMEOUT seconds.
+//
+/////////////////////////////////////////////////////////////
+
+
+#define REGRESS_TIMEOUT   30
+
+
+typedef struct {
+    const char *name;
+    const char *description;
+    int (*run)();
+} REGRESS_CASE_TYPE;
+
+
+typedef struct {
+    char *hostname;
+    char *path;
+} REGRESS_CONFIG_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void usage( const char *prog );
+void timedOut( int sig );
+int  caseRanges();
+int  caseJournalWrite();
+int  caseJournalCheck();
+int  caseTxRecover();
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+REGRESS_CONFIG_TYPE gConfig;
+
+REGRESS_CASE_TYPE gCases[] = {
+    { "ranges",  "netreadranges of 1 MB, then an inline netread (run with -m 1)", caseRanges },
+    { "journal-write", "a journaled netwrite, then a larger durable one (run with -j)", caseJournalWrite },
+    { "journal-check", "the larger netwrite is there after a crash and replay", caseJournalCheck },
+    { "tx-recover",    "a commit left part way is finished on startup (run with -t)", caseTxRecover },
+    { NULL, NULL, NULL }
+};
+
+const char *gCaseName = "";
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+void usage( const char *prog )
+{
+    int i = 0;
+
+    fprintf(stderr,
+        "Usage: %s [options] case\n"
+        "    -h host       server host name, or host:port (localhost)\n"
+        "    -f path       file on the server to use (/tmp/netregress.dat)\n"
+        "Cases:\n", prog);
+    for (i=0; gCases[i].name != NULL; i++) {
+        fprintf(stderr, "    %-12s  %s\n", gCases[i].name, gCases[i].description);
+    }
+    exit(EXIT_FAILURE);
+}
+
+
+void timedOut( int sig )
+{
+    char msg[128] = "";
+    int n = 0;
+
+    (void)sig;
+    n = snprintf(msg, sizeof(msg), "test %s: FAILED: no answer in %d seconds\n",
+                 gCaseName, REGRESS_TIMEOUT);
+    if ( write(STDOUT_FILENO, msg, n) < 0 ) _exit(EXIT_FAILURE);
+    _exit(EXIT_FAILURE);
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// A netreadranges holding a range list and a data buffer
+// at once used to wait forever for a budget only the data
+// fits in, and every later request waited behind it.  Both
+// calls have to come back.
+//
+/////////////////////////////////////////////////////////////
+
+int caseRanges()
+{
+    NET_RANGE_TYPE range;
+    void *bufs[1];
+    char *data = NULL;
+    char small[100];
+    int size = 2 * 1024 * 1024;
+    int fd = -1;
+    ssize_t rc = 0;
+
+    data = malloc( size );
+    if ( data == NULL ) return FAILURE;
+    memset(data, 'r', size);
+
+    fd = netopen(gConfig.path, O_RDWR);
+    if ( fd == FAILURE ) {
+        printf("test ranges: FAILED: netopen, errno= %d (%s)\n", errno, strerror(errno));
+        return FAILURE;
+    }
+
+    // Through the data ports, whose buffers fit a small budget
+    if ( netwrite(fd, data, size) != size ) {
+        printf("test ranges: FAILED: netwrite of %d bytes, errno= %d (%s)\n", size, errno, strerror(errno));
+        return FAILURE;
+    }
+
+    range.offset = 4096;
+    range.length = 1024 * 1024;
+    bufs[0] = data;
+    rc = netreadranges(fd, &range, 1, bufs);
+    if ((rc != range.length) || (range.nBytes != range.length)) {
+        printf("test ranges: FAILED: netreadranges returns %ld, errno= %d (%s)\n",
+               (long)rc, errno, strerror(errno));
+        return FAILURE;
+    }
+
+    rc = netread(fd, small, sizeof(small));
+    if ( rc != (ssize_t)sizeof(small) ) {
+        printf("test ranges: FAILED: netread after netreadranges returns %ld, errno= %d (%s)\n",
+               (long)rc, errno, strerror(errno));
+        return FAILURE;
+    }
+
+    netclose(fd);
+    free(data);
+    printf("test ranges: PASSED: netreadranges of %d bytes and netread of %d bytes\n",
+           range.length, (int)sizeof(small));
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// A small netwrite goes to the journal.  A larger one with
+// NET_DURABLE_WRITE goes straight to the file, and is on disk
+// when it returns, so the journal's record of the small one
+// must not be replayed over it: the "regress" script kills
+// the server right after this case and journal-check looks
+// at what the restarted server has.
+//
+/////////////////////////////////////////////////////////////
+
+#define JOURNAL_SMALL_SIZE   100
+#define JOURNAL_LARGE_SIZE   200000
+
+int caseJournalWrite()
+{
+    char *data = NULL;
+    int fd = -1;
+
+    data = malloc( JOURNAL_LARGE_SIZE );
+    if ( data == NULL ) return FAILURE;
+    memset(data, 'j', JOURNAL_LARGE_SIZE);
+
+    fd = netopen(gConfig.path, O_RDWR);
+    if ( fd == FAILURE ) {
+        printf("test journal-write: FAILED: netopen, errno= %d (%s)\n", errno, strerror(errno));
+        return FAILURE;
+    }
+
+    if ( netwrite(fd, data, JOURNAL_SMALL_SIZE) != JOURNAL_SMALL_SIZE ) {
+        printf("test journal-write: FAILED: netwrite of %d bytes, errno= %d (%s)\n",
+               JOURNAL_SMALL_SIZE, errno, strerror(errno));
+        return FAILURE;
+    }
+    if ( netdurability(fd, NET_DURABLE_WRITE) == FAILURE ) {
+        printf("test journal-write: FAILED: netdurability, errno= %d (%s)\n", errno, strerror(errno));
+        return FAILURE;
+    }
+    if ( netwrite(fd, data, JOURNAL_LARGE_SIZE) != JOURNAL_LARGE_SIZE ) {
+        printf("test journal-write: FAILED: netwrite of %d bytes, errno= %d (%s)\n",
+               JOURNAL_LARGE_SIZE, errno, strerror(errno));
+        return FAILURE;
+    }
+
+    // Left open: the server is killed next
+    free(data);
+    printf("test journal-write: PASSED: netwrites of %d and %d bytes\n",
+           JOURNAL_SMALL_SIZE, JOURNAL_LARGE_SIZE);
+    return SUCCESS;
+}
+
+
+int caseJournalCheck()
+{
+    char *data = NULL;
+    int fd = -1;
+    ssize_t rc = 0;
+
+    data = malloc( 2 * JOURNAL_LARGE_SIZE );
+    if ( data == NULL ) return FAILURE;
+
+    fd = netopen(gConfig.path, O_RDONLY);
+    if ( fd == FAILURE ) {
+        printf("test journal-check: FAILED: netopen, errno= %d (%s)\n", errno, strerror(errno));
+        return FAILURE;
+    }
+
+    rc = netread(fd, data, 2 * JOURNAL_LARGE_SIZE);
+    if ( rc != JOURNAL_LARGE_SIZE ) {
+        printf("test journal-check: FAILED: netread returns %ld, not %d, errno= %d (%s)\n",
+               (long)rc, JOURNAL_LARGE_SIZE, errno, strerror(errno));
+        return FAILURE;
+    }
+
+    netclose(fd);
+    free(data);
+    printf("test journal-check: PASSED: the file has the %d bytes after a replay\n", JOURNAL_LARGE_SIZE);
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// The "regress" script leaves a staged file with TX_DATA in
+// it and a commit record to rename it over the file, as a
+// server that stopped part way through a commit would, and
+// starts a server.  The file has to have the staged data.
+//
+/////////////////////////////////////////////////////////////
+
+#define TX_DATA   "committed before the crash"
+
+int caseTxRecover()
+{
+    char data[64] = "";
+    int fd = -1;
+    ssize_t rc = 0;
+
+    fd = netopen(gConfig.path, O_RDONLY);
+    if ( fd == FAILURE ) {
+        printf("test tx-recover: FAILED: netopen, errno= %d (%s)\n", errno, strerror(errno));
+        return FAILURE;
+    }
+
+    rc = netread(fd, data, sizeof(data) - 1);
+    if ((rc != (ssize_t)strlen(TX_DATA)) || (strcmp(data, TX_DATA) != 0)) {
+        printf("test tx-recover: FAILED: netread returns %ld, \"%s\"\n", (long)rc, data);
+        return FAILURE;
+    }
+
+    netclose(fd);
+    printf("test tx-recover: PASSED: the staged file is in place\n");
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    int i = 0;
+
+
+    gConfig.hostname = "localhost";
+    gConfig.path     = "/tmp/netregress.dat";
+
+    while ((opt = getopt(argc, argv, "h:f:")) != -1) {
+        switch (opt) {
+            case 'h': gConfig.hostname = optarg; break;
+            case 'f': gConfig.path     = optarg; break;
+            default:  usage(argv[0]);
+        }
+    }
+    if ( optind != argc - 1 ) usage(argv[0]);
+
+    for (i=0; gCases[i].name != NULL; i++) {
+        if ( strcmp(gCases[i].name, argv[optind]) == 0 ) break;
+    }
+    if ( gCases[i].name == NULL ) usage(argv[0]);
+    gCaseName = gCases[i].name;
+
+
+    if ( netserverinit(gConfig.hostname, UNRESTRICTED_MODE) == FAILURE ) {
+        printf("test %s: FAILED: netserverinit(\"%s\"), errno= %d, h_errno= %d\n",
+               gCaseName, gConfig.hostname, errno, h_errno);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGALRM, timedOut);
+    alarm(REGRESS_TIMEOUT);
+
+    if ( gCases[i].run() == FAILURE ) exit(EXIT_FAILURE);
+    return 0;
+}
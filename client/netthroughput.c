@@ -0,0 +1,543 @@
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// netthroughput checks and times large netreads.  For every
+// size from 1 MB up to the maximum size (16 MB by default),
+// doubling each time, it stores a file of known contents on
+// the server with netput and then reads it back with netread
+// over the data ports.  Every read is compared byte for byte
+// with what was stored, and the first mismatch, if any, is
+// reported.
+//
+// The read buffer is filled with a different pattern before
+// each read, so bytes the library failed to receive cannot
+// pass for data left over from the last one.
+//
+// Each size is then read again with netread_stream, which
+// hands the file over in chunks rather than into one buffer
+// of the whole size, and the chunks are checked the same way.
+//
+// Last, the file is copied into a local file with
+// netread_to_fd and a different local file is written back
+// with netwrite_from_fd, and each copy is checked.
+//
+// With -a, the file is given a netadvise hint before any
+// of this, so the same runs can be timed with the server's
+// page cache hints or O_DIRECT reads.
+//
+// The exit status is non-zero if any read came back short
+// or wrong, so it can be used as a test.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct {
+    char *hostname;
+    char *path;
+    int iterations;
+    int minSize;
+    int maxSize;
+    char *format;
+    int advice;              // NET_ADVICE_*, or -1 for none
+} TPUT_CONFIG_TYPE;
+
+
+//
+// What the stream callback checks its chunks against
+//
+typedef struct {
+    const char *want;
+    long size;
+    long nextOffset;
+    long bad;                // first bad offset, or -1
+} STREAM_CHECK_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void usage( const char *prog );
+uint64_t nowNs();
+void fillPattern( char *buf, const int size, const int seed );
+long firstMismatch( const char *want, const char *got, const int size );
+int  runSize( const int fd, char *want, char *got, const int size );
+int  checkChunk( const void *chunk, size_t nbyte, long offset, void *userData );
+int  runStream( const int fd, const char *want, const int size );
+int  runFd( const int fd, const int wfd, char *want, char *got, const int size );
+int  localFile();
+void report( const char *op, const int size, const int nGood, const int nBad,
+             const uint64_t total, const uint64_t best );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+TPUT_CONFIG_TYPE gConfig;
+int gLocalIn  = -1;          // local file netwrite_from_fd sends
+int gLocalOut = -1;          // local file netread_to_fd fills
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+void usage( const char *prog )
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "    -h host       server host name, or host:port (localhost)\n"
+        "    -f path       file on the server to use (/tmp/netthroughput.dat)\n"
+        "    -n count      timed reads per size (5)\n"
+        "    -s bytes      smallest size (1048576)\n"
+        "    -m bytes      largest size (16777216)\n"
+        "    -o format     text or csv (text)\n"
+        "    -a advice     netadvise the file first: normal, sequential, random,\n"
+        "                  once or willneed, with \"+direct\" for O_DIRECT reads\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
+//
+// The NET_ADVICE_* value for a -a argument, or -1
+//
+int adviceByName( const char *name )
+{
+    const char *names[] = { "normal", "sequential", "random", "once", "willneed" };
+    const char *plus = strchr(name, '+');
+    size_t len = (plus != NULL) ? (size_t)(plus - name) : strlen(name);
+    int advice = -1;
+    int i = 0;
+
+    for (i=0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if ((strlen(names[i]) == len) && (strncmp(name, names[i], len) == 0)) advice = i;
+    }
+    if ((advice >= 0) && (plus != NULL)) {
+        advice = (strcmp(plus, "+direct") == 0) ? (advice | NET_ADVICE_DIRECT) : -1;
+    }
+    return advice;
+}
+
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// A pattern that differs at every offset within a 251 byte
+// cycle and between seeds, so a part landing at the wrong
+// offset shows up as well as a missing one
+//
+/////////////////////////////////////////////////////////////
+
+void fillPattern( char *buf, const int size, const int seed )
+{
+    int i = 0;
+
+    for (i=0; i < size; i++) {
+        buf[i] = (char)((i % 251) + (i / 251) + seed);
+    }
+}
+
+
+long firstMismatch( const char *want, const char *got, const int size )
+{
+    long i = 0;
+
+    // The stream check runs inside the timed part, so only
+    // look for the offset once there is a difference
+    if ( memcmp(want, got, size) == 0 ) return -1;
+
+    for (i=0; i < size; i++) {
+        if ( want[i] != got[i] ) return i;
+    }
+    return -1;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Store "size" bytes, read them back "iterations" times and
+// report.  Returns the number of reads that were short or
+// wrong.
+//
+/////////////////////////////////////////////////////////////
+
+int runSize( const int fd, char *want, char *got, const int size )
+{
+    uint64_t total = 0;
+    uint64_t best = 0;
+    ssize_t rc = 0;
+    long bad = 0;
+    int nBad = 0;
+    int i = 0;
+
+    fillPattern( want, size, size );
+    rc = netput( gConfig.path, want, size );
+    if ( rc != size ) {
+        fprintf(stderr, "netthroughput: netput of %d bytes returns %ld, errno= %d (%s)\n",
+                size, (long)rc, errno, strerror(errno));
+        return gConfig.iterations;
+    }
+
+    for (i=0; i < gConfig.iterations; i++) {
+        fillPattern( got, size, size + 1 );
+
+        uint64_t start = nowNs();
+        rc = netread( fd, got, size );
+        uint64_t ns = nowNs() - start;
+
+        if ( rc != size ) {
+            fprintf(stderr, "netthroughput: netread of %d bytes returns %ld, errno= %d (%s)\n",
+                    size, (long)rc, errno, strerror(errno));
+            nBad++;
+            continue;
+        }
+
+        bad = firstMismatch( want, got, size );
+        if ( bad >= 0 ) {
+            fprintf(stderr, "netthroughput: netread of %d bytes differs at offset %ld\n", size, bad);
+            nBad++;
+            continue;
+        }
+
+        total = total + ns;
+        if ((best == 0) || (ns < best)) best = ns;
+    }
+
+    report( "read", size, gConfig.iterations - nBad, nBad, total, best );
+    return nBad + runStream( fd, want, size );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Copy the file to a local file and a local file back to
+// the server "iterations" times each.  Returns the number
+// of copies that were short or wrong.  On return the server
+// holds different data from "want".
+//
+/////////////////////////////////////////////////////////////
+
+int runFd( const int fd, const int wfd, char *want, char *got, const int size )
+{
+    uint64_t total = 0;
+    uint64_t best = 0;
+    ssize_t rc = 0;
+    long bad = 0;
+    int nBad = 0;
+    int i = 0;
+
+    for (i=0; i < gConfig.iterations; i++) {
+        if ( ftruncate(gLocalOut, 0) != 0 ) perror("netthroughput: ftruncate");
+
+        uint64_t start = nowNs();
+        rc = netread_to_fd( fd, gLocalOut, 0, size );
+        uint64_t ns = nowNs() - start;
+
+        fillPattern( got, size, size + 1 );
+        if ((rc != size) || (pread(gLocalOut, got, size, 0) != size)) {
+            fprintf(stderr, "netthroughput: netread_to_fd of %d bytes returns %ld, errno= %d (%s)\n",
+                    size, (long)rc, errno, strerror(errno));
+            nBad++;
+            continue;
+        }
+        bad = firstMismatch( want, got, size );
+        if ( bad >= 0 ) {
+            fprintf(stderr, "netthroughput: netread_to_fd of %d bytes differs at offset %ld\n", size, bad);
+            nBad++;
+            continue;
+        }
+
+        total = total + ns;
+        if ((best == 0) || (ns < best)) best = ns;
+    }
+    report( "tofd", size, gConfig.iterations - nBad, nBad, total, best );
+
+    //
+    // Send different data than the server holds, so the check
+    // shows it was really written
+    //
+    int nBadWrites = 0;
+    total = 0;
+    best = 0;
+    fillPattern( want, size, size + 2 );
+    if ((ftruncate(gLocalIn, 0) != 0) || (pwrite(gLocalIn, want, size, 0) != size)) {
+        perror("netthroughput: cannot write the local file");
+        return nBad + gConfig.iterations;
+    }
+
+    for (i=0; i < gConfig.iterations; i++) {
+        uint64_t start = nowNs();
+        rc = netwrite_from_fd( wfd, gLocalIn, 0, size );
+        uint64_t ns = nowNs() - start;
+
+        fillPattern( got, size, size + 1 );
+        if ((rc != size) || (netread(fd, got, size) != size)) {
+            fprintf(stderr, "netthroughput: netwrite_from_fd of %d bytes returns %ld, errno= %d (%s)\n",
+                    size, (long)rc, errno, strerror(errno));
+            nBadWrites++;
+            continue;
+        }
+        bad = firstMismatch( want, got, size );
+        if ( bad >= 0 ) {
+            fprintf(stderr, "netthroughput: netwrite_from_fd of %d bytes differs at offset %ld\n", size, bad);
+            nBadWrites++;
+            continue;
+        }
+
+        total = total + ns;
+        if ((best == 0) || (ns < best)) best = ns;
+    }
+    report( "fromfd", size, gConfig.iterations - nBadWrites, nBadWrites, total, best );
+
+    return nBad + nBadWrites;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// An empty, unnamed scratch file in /tmp
+//
+/////////////////////////////////////////////////////////////
+
+int localFile()
+{
+    char name[] = "/tmp/netthroughputXXXXXX";
+    int fd = mkstemp(name);
+
+    if ( fd < 0 ) return FAILURE;
+    unlink(name);
+    return fd;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Chunks must arrive in order, each continuing where the
+// last one ended
+//
+/////////////////////////////////////////////////////////////
+
+int checkChunk( const void *chunk, size_t nbyte, long offset, void *userData )
+{
+    STREAM_CHECK_TYPE *check = (STREAM_CHECK_TYPE *)userData;
+    long bad = -1;
+
+    if ((offset != check->nextOffset) || (offset + (long)nbyte > check->size)) {
+        bad = offset;
+    }
+    else {
+        bad = firstMismatch( check->want + offset, chunk, (int)nbyte );
+        if ( bad >= 0 ) bad = bad + offset;
+    }
+
+    if ((bad >= 0) && (check->bad < 0)) check->bad = bad;
+    check->nextOffset = offset + (long)nbyte;
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Stream the file "iterations" times.  Returns the number
+// of streams that were short or wrong.
+//
+/////////////////////////////////////////////////////////////
+
+int runStream( const int fd, const char *want, const int size )
+{
+    STREAM_CHECK_TYPE check;
+    uint64_t total = 0;
+    uint64_t best = 0;
+    ssize_t rc = 0;
+    int nBad = 0;
+    int i = 0;
+
+    for (i=0; i < gConfig.iterations; i++) {
+        check.want = want;
+        check.size = size;
+        check.nextOffset = 0;
+        check.bad = -1;
+
+        uint64_t start = nowNs();
+        rc = netread_stream( fd, checkChunk, &check );
+        uint64_t ns = nowNs() - start;
+
+        if ( rc != size ) {
+            fprintf(stderr, "netthroughput: netread_stream of %d bytes returns %ld, errno= %d (%s)\n",
+                    size, (long)rc, errno, strerror(errno));
+            nBad++;
+            continue;
+        }
+        if ( check.bad >= 0 ) {
+            fprintf(stderr, "netthroughput: netread_stream of %d bytes differs at offset %ld\n",
+                    size, check.bad);
+            nBad++;
+            continue;
+        }
+
+        total = total + ns;
+        if ((best == 0) || (ns < best)) best = ns;
+    }
+
+    report( "stream", size, gConfig.iterations - nBad, nBad, total, best );
+    return nBad;
+}
+
+
+void report( const char *op, const int size, const int nGood, const int nBad,
+             const uint64_t total, const uint64_t best )
+{
+    double meanMs = (nGood > 0) ? (double)total / nGood / 1e6 : 0.0;
+    double bestMs = (double)best / 1e6;
+    double mbps   = (meanMs > 0.0) ? ((double)size / 1e6) / (meanMs / 1e3) : 0.0;
+
+    if ( strcmp(gConfig.format, "csv") == 0 ) {
+        printf("%s,%d,%d,%d,%.2f,%.2f,%.1f\n", op, size, nGood, nBad, meanMs, bestMs, mbps);
+    }
+    else {
+        printf("%-6s %10d %6d %6d %10.2f %10.2f %10.1f\n", op, size, nGood, nBad, meanMs, bestMs, mbps);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    char *want = NULL;
+    char *got = NULL;
+    int opt = 0;
+    int size = 0;
+    int fd = -1;
+    int wfd = -1;
+    int nBad = 0;
+
+
+    gConfig.hostname   = "localhost";
+    gConfig.path       = "/tmp/netthroughput.dat";
+    gConfig.iterations = 5;
+    gConfig.minSize    = 1048576;
+    gConfig.maxSize    = 16777216;
+    gConfig.format     = "text";
+    gConfig.advice     = -1;
+
+    while ((opt = getopt(argc, argv, "h:f:n:s:m:o:a:")) != -1) {
+        switch (opt) {
+            case 'h': gConfig.hostname   = optarg; break;
+            case 'f': gConfig.path       = optarg; break;
+            case 'n': gConfig.iterations = atoi(optarg); break;
+            case 's': gConfig.minSize    = atoi(optarg); break;
+            case 'm': gConfig.maxSize    = atoi(optarg); break;
+            case 'o': gConfig.format     = optarg; break;
+            case 'a': gConfig.advice     = adviceByName(optarg);
+                      if ( gConfig.advice < 0 ) usage(argv[0]);
+                      break;
+            default:  usage(argv[0]);
+        }
+    }
+
+    if ((gConfig.iterations <= 0) || (gConfig.minSize <= 0) ||
+        (gConfig.maxSize < gConfig.minSize) ||
+        ((strcmp(gConfig.format, "text") != 0) && (strcmp(gConfig.format, "csv") != 0)))
+    {
+        usage(argv[0]);
+    }
+
+
+    if ( netserverinit(gConfig.hostname, UNRESTRICTED_MODE) == FAILURE ) {
+        fprintf(stderr, "netthroughput: netserverinit(\"%s\") failed, errno= %d, h_errno= %d\n",
+                gConfig.hostname, errno, h_errno);
+        exit(EXIT_FAILURE);
+    }
+
+    //
+    // netput creates the file, so store something before the
+    // netopen that the reads will use
+    //
+    want = malloc( gConfig.maxSize );
+    got  = malloc( gConfig.maxSize );
+    if ((want == NULL) || (got == NULL)) {
+        fprintf(stderr, "netthroughput: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    fillPattern( want, 1, 0 );
+    netput( gConfig.path, want, 1 );
+
+    fd = netopen(gConfig.path, O_RDONLY);
+    wfd = netopen(gConfig.path, O_WRONLY);
+    if ((fd == FAILURE) || (wfd == FAILURE)) {
+        fprintf(stderr, "netthroughput: cannot open \"%s\", errno= %d (%s)\n",
+                gConfig.path, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((gConfig.advice >= 0) && (netadvise(fd, gConfig.advice) == FAILURE)) {
+        fprintf(stderr, "netthroughput: netadvise(%d) failed, errno= %d (%s)\n",
+                gConfig.advice, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    gLocalIn  = localFile();
+    gLocalOut = localFile();
+    if ((gLocalIn < 0) || (gLocalOut < 0)) {
+        perror("netthroughput: cannot create a local file in /tmp");
+        exit(EXIT_FAILURE);
+    }
+
+
+    if ( strcmp(gConfig.format, "csv") == 0 ) {
+        printf("op,bytes,good,bad,mean_ms,best_ms,mean_MBps\n");
+    }
+    else {
+        printf("%-6s %10s %6s %6s %10s %10s %10s\n", "op", "bytes", "good", "bad",
+               "mean_ms", "best_ms", "mean_MB/s");
+    }
+
+    for (size = gConfig.minSize; size <= gConfig.maxSize; size = size * 2) {
+        nBad = nBad + runSize( fd, want, got, size );
+        nBad = nBad + runFd( fd, wfd, want, got, size );
+        if ( size > gConfig.maxSize / 2 ) break;  // no overflow past maxSize
+    }
+
+    netclose(wfd);
+    netclose(fd);
+    close(gLocalIn);
+    close(gLocalOut);
+    free(got);
+    free(want);
+    exit( (nBad == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
@@ -43,14 +43,20 @@ void emptyFDtable( char *hostname )
 {
     int i = 0;
     int fd = 0;
+    int fds[ NET_BATCH_MAX ];
 
     // 
-    // Clean up FD table before begin testing.
+    // Clean up FD table before begin testing.  The table is
+    // too big to close one fd per request, so close them in
+    // batches.
     //
     netserverinit( hostname, UNRESTRICTED_MODE );
     for (i=0; i < FD_TABLE_SIZE ; i++) {
         fd = (-10 * (i+1));
-        netclose(fd);
+        fds[ i % NET_BATCH_MAX ] = fd;
+        if ((i % NET_BATCH_MAX == NET_BATCH_MAX - 1) || (i == FD_TABLE_SIZE - 1)) {
+            netclose_batch(fds, (i % NET_BATCH_MAX) + 1, NULL);
+        }
         //printf("emptyFDtable(): netclose(%d)\n", fd);
     };
 }
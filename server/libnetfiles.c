@@ -8,11 +8,41 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
 
 #include "libnetfiles.h"
+#include "nettrace.h"
+
+
+//
+// A data port transfer gives up when none of its parts has
+// made progress for this long
+//
+#define XFER_IDLE_TIMEOUT_MS  30000
+
+
+//
+// The server's addresses are looked up once and kept for
+// this long.  A lookup that fails after that keeps the old
+// addresses for another period rather than failing calls.
+//
+#define SERVER_ADDR_TTL_SEC   300
+
+
+//
+// Max number of addresses (A and AAAA records) kept for
+// the server
+//
+#define SERVER_ADDR_MAX       8
 
 
 /////////////////////////////////////////////////////////////
@@ -35,11 +65,66 @@
 
 typedef struct {
     char hostname[64];
+    int port;                // control port, data ports follow it
     FILE_CONNECTION_MODE fcMode;
+    long txId;               // open transaction netwrites are staged in, 0= none
 } NET_SERVER;
 
 
 
+//
+// The resolved addresses of a server, IPv4 and IPv6, in the
+// order getaddrinfo returned them.  Connections try the
+// address that last worked first, then the others in order.
+//
+typedef struct {
+    char hostname[64];       // name the addresses belong to
+    int nAddrs;
+    struct sockaddr_storage addrs[ SERVER_ADDR_MAX ];
+    socklen_t addrLens[ SERVER_ADDR_MAX ];
+    int iPreferred;          // last address a connect worked on
+    time_t expires;
+} SERVER_ADDR_TYPE;
+
+
+
+//
+// A client context: the server it talks to, that server's
+// addresses and the netadvise hint of each netfd.  "lock"
+// guards them all, and calls take a copy of the server under
+// it, so any number of threads can share a context.  The
+// legacy calls use gDefaultCtx, which netserverinit sets up.
+//
+// A netfd may be shared with other clients, so the server
+// doesn't keep its hint; it goes with each netread and
+// netwrite instead.
+//
+struct netctx {
+    NET_SERVER server;
+    SERVER_ADDR_TYPE addrs;
+    int bResolving;                // a caller is looking "addrs" up again, unlocked
+    int advice[ FD_TABLE_SIZE ];   // NET_ADVICE_* by netfd slot, see adviceSlot
+    pthread_mutex_t lock;
+};
+
+
+
+//
+// Where a data port part is in its exchange with the server
+//
+typedef enum {
+    PART_CONNECTING  = 0,
+    PART_SEND_CMD    = 1,
+    PART_WAIT_ACK    = 2,   // netwrite: server ready for the data
+    PART_SEND_DATA   = 3,   // netwrite
+    PART_WAIT_RESULT = 4,   // netwrite: server's final response
+    PART_RECV_DATA   = 5,   // netread
+    PART_SEND_RESULT = 6,   // netread: tell the server what arrived
+    PART_DONE        = 7,
+    PART_RECV_MAP    = 8    // netread: where the data is in a sparse file
+} PART_STATE_TYPE;
+
+
 typedef struct {
     int port;
     int netfd;
@@ -47,6 +132,25 @@ typedef struct {
     char *buf;
     int iStartPos;
     int iLength;
+    NET_FUNCTION_TYPE netFunc;    // NET_READ or NET_WRITE
+    int advice;                   // netread: the netadvise hint for "netfd"
+    int sockfd;                   // non-blocking data port socket
+    PART_STATE_TYPE state;
+    char msg[MSG_SIZE];           // message being sent or received
+    int msgLen;
+    int msgDone;
+    int nDone;                    // data bytes moved so far
+    int bFailed;
+    uint64_t startTime;
+    const char *hostname;         // for messages
+    int localfd;                  // move the data to or from this file instead of "buf", or -1
+    off_t localOff;               // where "buf" would start in "localfd"
+    int pipefd[2];                // netread into "localfd": socket -> pipe -> file
+    int nCovered;                 // netread: bytes of the part the file has
+    int nExtents;                 // netread: the extents of data within them
+    int iExtent;                  //   the one being received
+    int extOff[ NET_SPARSE_EXTENTS ];
+    int extLen[ NET_SPARSE_EXTENTS ];
 } FILE_PART_TYPE;
 
 
@@ -57,16 +161,59 @@ typedef struct {
 //
 /////////////////////////////////////////////////////////////
 
-int     getSockfd( const char * hostname, const int port );
-
-int     isNetServerInitialized( NET_FUNCTION_TYPE iFunc );
-
-int     xferStrategy(NET_FUNCTION_TYPE netFunc, const int netfd, 
+int     getSockfd( netctx_t *ctx, const char * hostname, const int port );
+int     resolveServer( netctx_t *ctx, const char *hostname, const int bRefresh, SERVER_ADDR_TYPE *copy );
+void    preferServerAddr( netctx_t *ctx, const char *hostname, const int iAddr );
+void    setAddrPort( struct sockaddr_storage *addr, const int port );
+int     splitHostPort( const char *hostname, char *host, const int hostSize, int *port );
+
+int     isNetServerInitialized( netctx_t *ctx, NET_FUNCTION_TYPE iFunc, NET_SERVER *server );
+int     ctxInit( netctx_t *ctx, const char *hostname, int filemode );
+
+int     readFully( const int sockfd, char *buf, const int nBytes );
+int     writeFully( const int sockfd, const char *buf, const int nBytes );
+int     readvFully( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes );
+int     writevFully( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes );
+int     transferv( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes,
+                   const int bWrite );
+int     iovecBytes( const struct iovec *iov, const int iovcnt );
+
+ssize_t netreadInline( const int sockfd, const int netfd, const int advice, const struct iovec *iov,
+                       const int iovcnt, const int nBytesWant );
+ssize_t netwriteInline( const int sockfd, const int netfd, const long txId, const int advice,
+                        const struct iovec *iov, const int iovcnt, const int nBytes );
+
+int     wholeFileSockfd( netctx_t *ctx, NET_SERVER *server, const char *pathname );
+
+int     batchRequest( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc, const char *body, const int nBody,
+                      const int count, char **pReply );
+int     batchPathnames( const char **pathnames, const int count, const int extra );
+
+ssize_t netwriteFrom( netctx_t *ctx, int netfd, const void *buf, const int localfd,
+                     const off_t localOff, size_t nbyte );
+ssize_t netreadTo( netctx_t *ctx, int netfd, void *buf, const int localfd,
+                   const off_t localOff, size_t nbyte );
+int     preadFully( const int fd, char *buf, const int nBytes, const off_t offset );
+int     pwriteFully( const int fd, const char *buf, const int nBytes, const off_t offset );
+
+int     xferStrategy(netctx_t *ctx, const NET_SERVER *server,
+                     NET_FUNCTION_TYPE netFunc, const int netfd, 
                      char *buf,   int nBytes, 
+                     const int localfd, const off_t localOff,
                      const int portCount, int *ports);
 
-void    *sendData( void *filePart);  // thread for netwrite
-void    *getData(  void *filePart);  // thread for netread
+int     partConnect( FILE_PART_TYPE *part, const struct sockaddr_storage *serverAddr,
+                     const socklen_t serverAddrLen, const int epfd );
+uint32_t partStep( FILE_PART_TYPE *part );
+int      partSplice( FILE_PART_TYPE *part, const int nWant );
+int      partMap( FILE_PART_TYPE *part );
+int      partHole( FILE_PART_TYPE *part, const int from, const int to );
+int      fdCommand( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc, const int netfd, const long arg,
+                    long *value );
+int      txEnd( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc );
+int      adviceSlot( const int netfd );
+int      getAdvice( netctx_t *ctx, const int netfd );
+void     setAdvice( netctx_t *ctx, const int netfd, const int advice );
 
 
 
@@ -77,79 +224,445 @@ void    *getData(  void *filePart);  // thread for netread
 //
 /////////////////////////////////////////////////////////////
 
-NET_SERVER gNetServer;
+//
+// The context of the legacy calls, set by netserverinit
+//
+netctx_t gDefaultCtx = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 
 
 /////////////////////////////////////////////////////////////
 
 
-int getSockfd( const char * hostname, const int port )
+int getSockfd( netctx_t *ctx, const char * hostname, const int port )
 {
-    int sockfd = 0;
+    SERVER_ADDR_TYPE server;
+    int sockfd = -1;
+    int rc = 0;
+    int i = 0;
 
-    struct sockaddr_in serv_addr;
-    struct hostent *server = NULL;
 
+    if ( resolveServer( ctx, hostname, FALSE, &server ) == FAILURE ) {
+        return -1;
+    }
 
     //
-    // Create a new socket 
+    // Try the address that worked last time first, then the
+    // rest in order, so a host with both IPv6 and IPv4
+    // addresses is reached on whichever the server listens on
     //
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        fprintf(stderr,"libnetfiles: socket() failed, errno= %d\n", errno);
-	return -1;
+    uint64_t spanStart = traceNow();
+    for (i=0; i < server.nAddrs; i++) {
+        int iAddr = (server.iPreferred + i) % server.nAddrs;
+        struct sockaddr_storage addr = server.addrs[iAddr];
+
+        setAddrPort( &addr, (port < 0) ? NET_SERVER_PORT_NUM : port );
+
+        sockfd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            fprintf(stderr,"libnetfiles: socket() failed, errno= %d\n", errno);
+            continue;
+        }
+
+        rc = connect(sockfd, (struct sockaddr *)&addr, server.addrLens[iAddr]);
+        if ( rc == 0 ) {
+            if ( iAddr != server.iPreferred ) preferServerAddr( ctx, hostname, iAddr );
+            break;
+        }
+        close(sockfd);
+        sockfd = -1;
     }
-  
-    //
-    // Find the address of the given server by name
-    //
-    server = gethostbyname(hostname);
-    if (server == NULL) {
-        errno = 0;
-        h_errno = HOST_NOT_FOUND;
-        //fprintf(stderr,"libnetfiles: host not found, h_errno= %d\n", h_errno);
+    traceSpan( "connect", spanStart, traceNow() );
+
+    if (sockfd < 0) 
+    {
+        fprintf(stderr,"libnetfiles: cannot connect to %s, errno= %d\n", 
+                hostname, errno);
 	return -1;
     }
 
+    //printf("client getSockfd: sockfd %d connected to port %d\n", sockfd);
+    return sockfd;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Get the addresses of the given server into "copy" (if not
+// NULL).  They are looked up with getaddrinfo when the
+// server changes, when SERVER_ADDR_TTL_SEC has passed, or
+// when "bRefresh" is TRUE, and otherwise come from the
+// addresses kept in the context.
+//
+// The lookup is done with the context unlocked, so a slow
+// resolver holds up only the caller doing it.  While one
+// caller refreshes expired addresses, the others go on
+// using them.
+//
+/////////////////////////////////////////////////////////////
+
+int resolveServer( netctx_t *ctx, const char *hostname, const int bRefresh, SERVER_ADDR_TYPE *copy )
+{
+    SERVER_ADDR_TYPE fresh;
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    struct addrinfo *ai = NULL;
+    time_t now = time(NULL);
+    int bSameHost = FALSE;
+    int bLookup = FALSE;
+    int rc = SUCCESS;
+
+
+    pthread_mutex_lock( &ctx->lock );
+
+    bSameHost = ((ctx->addrs.nAddrs > 0) &&
+                 (strcmp(ctx->addrs.hostname, hostname) == 0));
+    bLookup = ((bRefresh == TRUE) || (bSameHost != TRUE) || (now >= ctx->addrs.expires));
+    if ((bLookup == TRUE) && (bRefresh != TRUE) && (bSameHost == TRUE) && (ctx->bResolving == TRUE)) {
+        bLookup = FALSE;   // someone else is refreshing them
+    }
+
+    if ( bLookup == TRUE ) {
+        ctx->bResolving = TRUE;
+        pthread_mutex_unlock( &ctx->lock );
+
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+
+        uint64_t spanStart = traceNow();
+        rc = getaddrinfo(hostname, NULL, &hints, &result);
+        traceSpan( "resolve", spanStart, traceNow() );
+
+        bzero(&fresh, sizeof(fresh));
+        if ((rc == 0) && (result != NULL)) {
+            strncpy(fresh.hostname, hostname, sizeof(fresh.hostname) - 1);
+            for (ai = result; (ai != NULL) && (fresh.nAddrs < SERVER_ADDR_MAX); ai = ai->ai_next) {
+                if ( ai->ai_addrlen > sizeof(struct sockaddr_storage) ) continue;
+                memcpy(&fresh.addrs[ fresh.nAddrs ], ai->ai_addr, ai->ai_addrlen);
+                fresh.addrLens[ fresh.nAddrs ] = ai->ai_addrlen;
+                fresh.nAddrs++;
+            }
+            fresh.expires = now + SERVER_ADDR_TTL_SEC;
+        }
+        if ( result != NULL ) freeaddrinfo(result);
+
+        pthread_mutex_lock( &ctx->lock );
+        ctx->bResolving = FALSE;
+        bSameHost = ((ctx->addrs.nAddrs > 0) &&
+                     (strcmp(ctx->addrs.hostname, hostname) == 0));
+        if ( fresh.nAddrs > 0 ) {
+            ctx->addrs = fresh;
+            rc = SUCCESS;
+        }
+        else if ((bRefresh != TRUE) && (bSameHost == TRUE)) {
+            // Resolver trouble: keep going on the addresses we have
+            ctx->addrs.expires = now + SERVER_ADDR_TTL_SEC;
+            rc = SUCCESS;
+        }
+        else {
+            rc = FAILURE;
+        }
+    }
+
+    if ((rc == SUCCESS) && (ctx->addrs.nAddrs == 0)) rc = FAILURE;
+    if ((rc == SUCCESS) && (copy != NULL)) *copy = ctx->addrs;
+
+    pthread_mutex_unlock( &ctx->lock );
+
     //
-    // Initialize the server address structure.  This 
-    // structure is used to do the actual connect.
+    // getaddrinfo may leave h_errno set from a lookup that
+    // found nothing (no AAAA record, say) even when it
+    // succeeds, so set it here either way
     //
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
+    errno = 0;
+    h_errno = (rc == SUCCESS) ? 0 : HOST_NOT_FOUND;
+    return rc;
+}
 
-    bcopy((char *)server->h_addr_list[0], 
-         (char *)&serv_addr.sin_addr.s_addr,
-         server->h_length);
 
-    if (port < 0 ) {
-       serv_addr.sin_port = htons(NET_SERVER_PORT_NUM);
-    } 
+/////////////////////////////////////////////////////////////
+//
+// Remember which of the server's addresses a connect worked
+// on, so the next connection goes straight to it
+//
+/////////////////////////////////////////////////////////////
+
+void preferServerAddr( netctx_t *ctx, const char *hostname, const int iAddr )
+{
+    pthread_mutex_lock( &ctx->lock );
+    if ((strcmp(ctx->addrs.hostname, hostname) == 0) && (iAddr < ctx->addrs.nAddrs)) {
+        ctx->addrs.iPreferred = iAddr;
+    }
+    pthread_mutex_unlock( &ctx->lock );
+}
+
+
+void setAddrPort( struct sockaddr_storage *addr, const int port )
+{
+    if ( addr->ss_family == AF_INET6 ) {
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Split a netserverinit name into host and port.  The forms
+// are "host", "host:port", an IPv6 address on its own, and
+// "[IPv6 address]:port".  The port is left alone if there
+// is none.
+//
+/////////////////////////////////////////////////////////////
+
+int splitHostPort( const char *hostname, char *host, const int hostSize, int *port )
+{
+    const char *start = hostname;
+    const char *end = NULL;
+    const char *colon = NULL;
+
+    if ( hostname[0] == '[' ) {
+        start = hostname + 1;
+        end = strchr(start, ']');
+        if ((end == NULL) || ((end[1] != '\0') && (end[1] != ':'))) return FAILURE;
+        if ( end[1] == ':' ) colon = end + 1;
+    }
     else {
-       serv_addr.sin_port = htons(port);
+        colon = strchr(hostname, ':');
+        if ((colon != NULL) && (strchr(colon + 1, ':') != NULL)) {
+            colon = NULL;   // more than one ':' is a bare IPv6 address
+        }
+        end = (colon != NULL) ? colon : hostname + strlen(hostname);
     }
 
+    if ((end == start) || (end - start >= hostSize)) return FAILURE;
+    memcpy(host, start, end - start);
+    host[end - start] = '\0';
 
-    if (connect(sockfd,(struct sockaddr *)&serv_addr,sizeof(serv_addr)) < 0) 
-    {
-        fprintf(stderr,"libnetfiles: cannot connect to %s, h_errno= %d\n", 
-                hostname, h_errno);
-	return -1;
+    if ( colon != NULL ) {
+        *port = atoi(colon + 1);
+        if ((*port <= 0) || (*port + MAX_FILE_TRANSFER_SOCKETS > 65535)) return FAILURE;
     }
+    return SUCCESS;
+}
 
-    //printf("client getSockfd: sockfd %d connected to port %d\n", sockfd);
-    return sockfd;
+
+/////////////////////////////////////////////////////////////
+//
+// Read exactly "nBytes" from the socket.  Returns the number
+// of bytes read, which is less than "nBytes" only if the
+// server closed the connection, or FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+int readFully( const int sockfd, char *buf, const int nBytes )
+{
+    int nRead = 0;
+    int rc = 0;
+
+    while ( nRead < nBytes ) {
+        rc = read(sockfd, buf + nRead, nBytes - nRead);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        if ( rc == 0 ) break;  // connection closed
+        nRead = nRead + rc;
+    }
+    return nRead;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write all "nBytes" to the socket, retrying short writes.
+// Returns the number of bytes written or FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+int writeFully( const int sockfd, const char *buf, const int nBytes )
+{
+    int nWritten = 0;
+    int rc = 0;
+
+    while ( nWritten < nBytes ) {
+        rc = write(sockfd, buf + nWritten, nBytes - nWritten);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        nWritten = nWritten + rc;
+    }
+    return nWritten;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Positioned forms of readFully and writeFully for a local
+// file.  preadFully reads less than "nBytes" only at end of
+// file.
+//
+/////////////////////////////////////////////////////////////
+
+int preadFully( const int fd, char *buf, const int nBytes, const off_t offset )
+{
+    int nRead = 0;
+    int rc = 0;
+
+    while ( nRead < nBytes ) {
+        rc = pread(fd, buf + nRead, nBytes - nRead, offset + nRead);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        if ( rc == 0 ) break;  // end of file
+        nRead = nRead + rc;
+    }
+    return nRead;
+}
+
+
+int pwriteFully( const int fd, const char *buf, const int nBytes, const off_t offset )
+{
+    int nWritten = 0;
+    int rc = 0;
+
+    while ( nWritten < nBytes ) {
+        rc = pwrite(fd, buf + nWritten, nBytes - nWritten, offset + nWritten);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        nWritten = nWritten + rc;
+    }
+    return nWritten;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Vectored forms of readFully and writeFully.  Exactly
+// "nBytes" are moved to or from the "iov" buffers in order;
+// buffers past the first "nBytes" are left alone.  The
+// caller's iovec array is not changed.
+//
+/////////////////////////////////////////////////////////////
+
+int readvFully( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes )
+{
+    return transferv( sockfd, iov, iovcnt, nBytes, FALSE );
+}
+
+
+int writevFully( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes )
+{
+    return transferv( sockfd, iov, iovcnt, nBytes, TRUE );
+}
+
+
+int transferv( const int sockfd, const struct iovec *iov, const int iovcnt, const int nBytes,
+               const int bWrite )
+{
+    struct iovec *vec = NULL;
+    int nVec = 0;
+    int first = 0;
+    int nDone = 0;
+    int left = nBytes;
+    int rc = 0;
+    int i = 0;
+
+    if ( nBytes <= 0 ) return 0;
+
+    vec = malloc( sizeof(struct iovec) * iovcnt );
+    if ( vec == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    // Work on a copy trimmed to "nBytes"
+    for (i=0; (i < iovcnt) && (left > 0); i++) {
+        if ( iov[i].iov_len == 0 ) continue;
+        vec[nVec] = iov[i];
+        if ( vec[nVec].iov_len > (size_t)left ) vec[nVec].iov_len = left;
+        left = left - vec[nVec].iov_len;
+        nVec++;
+    }
+
+    while ((nDone < nBytes) && (first < nVec)) {
+        int n = ((nVec - first) < IOV_MAX) ? (nVec - first) : IOV_MAX;
+
+        rc = bWrite ? writev(sockfd, vec + first, n) : readv(sockfd, vec + first, n);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            free( vec );
+            return FAILURE;
+        }
+        if ( rc == 0 ) break;  // connection closed
+        nDone = nDone + rc;
+
+        // Step past what was moved
+        while ((rc > 0) && (first < nVec)) {
+            if ( (size_t)rc >= vec[first].iov_len ) {
+                rc = rc - vec[first].iov_len;
+                first++;
+            }
+            else {
+                vec[first].iov_base = (char *)vec[first].iov_base + rc;
+                vec[first].iov_len  = vec[first].iov_len - rc;
+                rc = 0;
+            }
+        }
+    }
+
+    free( vec );
+    return nDone;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Total size of an iovec array, or FAILURE if the array is
+// not valid for netreadv or netwritev
+//
+/////////////////////////////////////////////////////////////
+
+int iovecBytes( const struct iovec *iov, const int iovcnt )
+{
+    long nBytes = 0;
+    int i = 0;
+
+    if ((iov == NULL) || (iovcnt <= 0) || (iovcnt > IOV_MAX)) return FAILURE;
+
+    for (i=0; i < iovcnt; i++) {
+        if ((iov[i].iov_base == NULL) && (iov[i].iov_len > 0)) return FAILURE;
+        nBytes = nBytes + iov[i].iov_len;
+        if ( nBytes > INT_MAX ) return FAILURE;
+    }
+    return (int)nBytes;
 }
 
 
 /////////////////////////////////////////////////////////////
 
 
-int isNetServerInitialized( NET_FUNCTION_TYPE iFunc )
+int isNetServerInitialized( netctx_t *ctx, NET_FUNCTION_TYPE iFunc, NET_SERVER *server )
 {
-    if ( (strcmp(gNetServer.hostname, "") == 0) ||
-         (gNetServer.fcMode <= 0 ) )
+    if ( ctx == NULL ) return FALSE;
+
+    //
+    // Work from a copy, so a netserverinit in another thread
+    // can't change the server part way through a call
+    //
+    pthread_mutex_lock( &ctx->lock );
+    *server = ctx->server;
+    pthread_mutex_unlock( &ctx->lock );
+
+    if ( (strcmp(server->hostname, "") == 0) ||
+         (server->fcMode <= 0 ) )
     {
         switch (iFunc) {
             case NET_OPEN:
@@ -197,7 +710,7 @@ int isNetServerInitialized( NET_FUNCTION_TYPE iFunc )
            ECOMM  = 70, Communication error on send
 
 ******************************************************/
-int netserverinit(char *hostname, int filemode)
+int ctxInit( netctx_t *ctx, const char *hostname, int filemode )
 {
     int rc = 0;
     int sockfd = -1;
@@ -209,13 +722,21 @@ int netserverinit(char *hostname, int filemode)
     errno = 0;
     h_errno = 0;
 
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
 
     //
     // Remove current net file server name 
     // and file connection mode setting.
     //
-    strcpy(gNetServer.hostname, "");
-    gNetServer.fcMode = INVALID_FILE_MODE;
+    pthread_mutex_lock( &ctx->lock );
+    strcpy(ctx->server.hostname, "");
+    ctx->server.fcMode = INVALID_FILE_MODE;
+    pthread_mutex_unlock( &ctx->lock );
 
     //
     // Verify the given file connection mode is valid
@@ -248,10 +769,35 @@ int netserverinit(char *hostname, int filemode)
     };
 
 
+    //
+    // The hostname may be followed by ":port" to reach a
+    // server (or a proxy in front of it) on a port other
+    // than NET_SERVER_PORT_NUM.  An IPv6 address with a port
+    // is written in brackets, "[::1]:54321".
+    //
+    char host[64] = "";
+    int  port = NET_SERVER_PORT_NUM;
+
+    if ( splitHostPort( hostname, host, sizeof(host), &port ) == FAILURE ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+
+    //
+    // Look the server up afresh for this session.  Every
+    // connection after this, control and data, uses the
+    // addresses found here until they expire.
+    //
+    if ( resolveServer( ctx, host, TRUE, NULL ) == FAILURE ) {
+        return FAILURE;
+    }
+
+
     //
     // Get a socket to talk to my net file server
     //
-    sockfd = getSockfd( hostname, NET_SERVER_PORT_NUM );
+    sockfd = getSockfd( ctx, host, port );
     if ( sockfd < 0 ) {
         errno = 0;
         h_errno = HOST_NOT_FOUND;
@@ -273,6 +819,7 @@ int netserverinit(char *hostname, int filemode)
 
 
     //printf("netserverinit: send to server - \"%s\"\n", msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
@@ -298,6 +845,7 @@ int netserverinit(char *hostname, int filemode)
     }
 
     close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netserverinit", spanStart, traceNow() );
 
     //
     // Received a response back from the server
@@ -312,11 +860,14 @@ int netserverinit(char *hostname, int filemode)
         // Save the hostname of the net server.  All subsequent
         // network function calls will go this this net server.
         //
-        strcpy(gNetServer.hostname, hostname);
-        gNetServer.fcMode = (FILE_CONNECTION_MODE)filemode;
+        pthread_mutex_lock( &ctx->lock );
+        strcpy(ctx->server.hostname, host);
+        ctx->server.port = port;
+        ctx->server.fcMode = (FILE_CONNECTION_MODE)filemode;
+        pthread_mutex_unlock( &ctx->lock );
 
         //printf("netserverinit: netServerName= %s, connection mode= %d\n", 
-        //         gNetServer.hostname, gNetServer.fcMode);
+        //         host, filemode);
         //printf("netserverinit: server responded with SUCCESS\n");
     }
 
@@ -324,6 +875,59 @@ int netserverinit(char *hostname, int filemode)
 }
 
 
+int netserverinit(char *hostname, int filemode)
+{
+    return ctxInit( &gDefaultCtx, hostname, filemode );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Make a context talking to "hostname" in the given file
+// connection mode.  Returns NULL, with errno and h_errno set
+// as for netserverinit, if the server can't be reached.
+//
+/////////////////////////////////////////////////////////////
+
+netctx_t *netctx_create(const char *hostname, int filemode)
+{
+    netctx_t *ctx = NULL;
+    int saveErrno = 0;
+    int saveHerrno = 0;
+
+    ctx = calloc( 1, sizeof(netctx_t) );
+    if ( ctx == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return NULL;
+    }
+    pthread_mutex_init( &ctx->lock, NULL );
+
+    if ( ctxInit( ctx, hostname, filemode ) != SUCCESS ) {
+        saveErrno = errno;
+        saveHerrno = h_errno;
+        netctx_destroy( ctx );
+        errno = saveErrno;
+        h_errno = saveHerrno;
+        return NULL;
+    }
+    return ctx;
+}
+
+
+//
+// Files still open on the server through the context stay
+// open; close them first.  The default context can't be
+// destroyed.
+//
+void netctx_destroy(netctx_t *ctx)
+{
+    if ((ctx == NULL) || (ctx == &gDefaultCtx)) return;
+
+    pthread_mutex_destroy( &ctx->lock );
+    free( ctx );
+}
+
+
 /////////////////////////////////////////////////////////////
 
 
@@ -348,8 +952,9 @@ int netserverinit(char *hostname, int filemode)
 
 ******************************************************/
 
-int netopen(const char *pathname, int flags)
+int netctx_open(netctx_t *ctx, const char *pathname, int flags)
 {
+    NET_SERVER server;
     int netFd  = -1;
     int sockfd = -1;
     int rc     = 0;
@@ -362,6 +967,12 @@ int netopen(const char *pathname, int flags)
     errno = 0;
     h_errno = 0;
 
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
     // Check the given pathname
     if (pathname == NULL) {
         //fprintf(stderr,"netopen: pathname is NULL\n");
@@ -392,7 +1003,7 @@ int netopen(const char *pathname, int flags)
     } 
        
 
-    if ( isNetServerInitialized( NET_OPEN ) != TRUE ) {
+    if ( isNetServerInitialized( ctx, NET_OPEN, &server ) != TRUE ) {
         errno = EPERM;  // 1 = Operation not permitted
         return FAILURE;
     }
@@ -401,7 +1012,7 @@ int netopen(const char *pathname, int flags)
     //
     // Get a socket to talk to my net file server
     //
-    sockfd = getSockfd( gNetServer.hostname, NET_SERVER_PORT_NUM );
+    sockfd = getSockfd( ctx, server.hostname, server.port );
     if ( sockfd < 0 ) {
         // this error should not happen
         errno = 0;
@@ -418,9 +1029,10 @@ int netopen(const char *pathname, int flags)
     //     netCmd,connectionMode,fileOpenFlags,pathname
     //
     bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%s", NET_OPEN, gNetServer.fcMode, flags, pathname);
+    sprintf(msg, "%d,%d,%d,%s", NET_OPEN, server.fcMode, flags, pathname);
     //printf("netopen: send to server - \"%s\"\n", msg);
 
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
@@ -443,6 +1055,7 @@ int netopen(const char *pathname, int flags)
     }
 
     close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netopen", spanStart, traceNow() );
 
     //
     // Received a response back from the server
@@ -479,8 +1092,9 @@ int netopen(const char *pathname, int flags)
 
 ******************************************************/
 
-int netclose(int netFd)
+int netctx_close(netctx_t *ctx, int netFd)
 {
+    NET_SERVER server;
     int fd = -1;
     int sockfd = -1;
     int rc     = 0;
@@ -493,8 +1107,14 @@ int netclose(int netFd)
     errno = 0;
     h_errno = 0;
 
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
 
-    if ( isNetServerInitialized( NET_CLOSE ) != TRUE ) {
+    if ( isNetServerInitialized( ctx, NET_CLOSE, &server ) != TRUE ) {
         errno = EPERM;  // 1 = Operation not permitted
         return FAILURE;
     }
@@ -503,7 +1123,7 @@ int netclose(int netFd)
     //
     // Get a socket to talk to my net file server
     //
-    sockfd = getSockfd( gNetServer.hostname, NET_SERVER_PORT_NUM );
+    sockfd = getSockfd( ctx, server.hostname, server.port );
     if ( sockfd < 0 ) {
         // this error should not happen
         errno = 0;
@@ -524,6 +1144,7 @@ int netclose(int netFd)
 
 
     //printf("netclose: send to server - \"%s\"\n", msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
@@ -546,6 +1167,7 @@ int netclose(int netFd)
     }
 
     close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netclose", spanStart, traceNow() );
 
     //
     // Received a response back from the server
@@ -562,6 +1184,8 @@ int netclose(int netFd)
         return FAILURE;
     }
 
+    // A later netfd in the same slot starts with no hint
+    setAdvice( ctx, netFd, NET_ADVICE_NORMAL );
     return SUCCESS;
 }
 
@@ -582,13 +1206,31 @@ int netclose(int netFd)
            EPERM      =  1, Operation not permitted
 	   EBADF      =  9, Bad file number
 	   EACCES     = 14, Permission denied
+	   EBUSY      = 16, the transaction is being committed
 	   EINVAL     = 22, Invalid argument
+	   EMFILE     = 24, the transaction has NET_TX_MAX_FILES files
 	   ECONNRESET = 104, connection reset by peer
 
 ******************************************************/
 
-ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
+ssize_t netctx_write(netctx_t *ctx, int netfd, const void *buf, size_t nbyte)
 {
+    return netwriteFrom( ctx, netfd, buf, -1, 0, nbyte );
+}
+
+/////////////////////////////////////////////////////////////
+//
+// netwrite of "nbyte" bytes taken either from "buf" or, if
+// "localfd" is not -1, from "localfd" at "localOff".  Data
+// port parts send straight from the file with sendfile, so
+// it never passes through this process' memory.
+//
+/////////////////////////////////////////////////////////////
+
+ssize_t netwriteFrom( netctx_t *ctx, int netfd, const void *buf, const int localfd,
+                     const off_t localOff, size_t nbyte )
+{
+    NET_SERVER server;
     int fd     = -1;
     int sockfd = -1;
     int rc     =  0;
@@ -601,17 +1243,23 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     errno = 0;
     h_errno = 0;
 
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
 
     //
     // Check input parameters
     //
-    if ((buf == NULL) || (nbyte < 0)) {
+    if (((buf == NULL) && (localfd < 0)) || (nbyte < 0)) {
 	errno = EINVAL;  // 22 = Invalid argument
 	return FAILURE;
     }
 
 
-    if ( isNetServerInitialized( NET_CLOSE ) != TRUE ) {
+    if ( isNetServerInitialized( ctx, NET_CLOSE, &server ) != TRUE ) {
         errno = EPERM;  // 1 = Operation not permitted
         return FAILURE;
     }
@@ -620,7 +1268,7 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     //
     // Get a socket to talk to my net file server
     //
-    sockfd = getSockfd( gNetServer.hostname, NET_SERVER_PORT_NUM );
+    sockfd = getSockfd( ctx, server.hostname, server.port );
     if ( sockfd < 0 ) {
         // this error should not happen
         errno = 0;
@@ -631,15 +1279,45 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     //printf("client netwrite: sockfd= %d\n", sockfd);
 
 
+    //
+    // Small writes travel with the command itself.  From a
+    // local file, the few bytes are read into a buffer first.
+    //
+    if ( nbyte <= INLINE_DATA_SIZE ) {
+        char *data = (char *)buf;
+        ssize_t iBytesWritten = FAILURE;
+
+        if ( localfd >= 0 ) {
+            data = malloc( nbyte + 1 );
+            if ((data != NULL) && (preadFully(localfd, data, (int)nbyte, localOff) != (int)nbyte)) {
+                free(data);
+                data = NULL;
+                if ( errno == 0 ) errno = EIO;  // 5 = I/O error, file shorter than nbyte
+            }
+            else if ( data == NULL ) errno = ENOMEM;  // 12 = Out of memory
+        }
+        if ( data != NULL ) {
+            struct iovec iov = { data, nbyte };
+            iBytesWritten = netwriteInline(sockfd, netfd, server.txId, getAdvice(ctx, netfd),
+                                           &iov, 1, (int)nbyte);
+        }
+        if ( localfd >= 0 ) free(data);
+        close(sockfd);  // Don't need this socket anymore
+        traceSpan( "netwrite", spanStart, traceNow() );
+        return iBytesWritten;
+    }
+
+
     // 
     // Compose my net command to send to the server.  The format is:
     //
-    //     netCmd,netFd,nbytes,0
+    //     netCmd,netFd,nbytes,txId,advice
     //
     bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,0", NET_WRITE, netfd, (int)nbyte);
+    sprintf(msg, "%d,%d,%d,%ld,%d", NET_WRITE, netfd, (int)nbyte, server.txId, getAdvice(ctx, netfd));
 
     //printf("client netwrite: send to server - \"%s\"\n", msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
@@ -657,7 +1335,7 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     //
     //    result,errno,h_errno,netFd,
     //    portCount,
-    //    portNum, portNum, portNum,....
+    //    portOffset, portOffset, portOffset,....
     //    
     //
     bzero(msg, MSG_SIZE);
@@ -676,6 +1354,8 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     //
     // Save the given list of ports into an array
     //
+    traceSpan( "negotiate", spanStart, traceNow() );
+
     int portCount = 0;
     sscanf(msg, "%d,%d,%d,%d,%d,", &rc, &errno, &h_errno, &fd, &portCount);
     //printf("client netwrite: received portCount= %d\n", portCount);
@@ -685,7 +1365,8 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
         
         int i = 0;  // Token counter
         char* token;
-        for (token = strtok(msg, ","); token != NULL; token = strtok(NULL, ","))
+        char* savePtr = NULL;  // strtok_r: netread/netwrite may run in many threads
+        for (token = strtok_r(msg, ",", &savePtr); token != NULL; token = strtok_r(NULL, ",", &savePtr))
         {
             if ( i > 4 ) {
                 ports[i-5] = atoi(token);
@@ -699,7 +1380,8 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
         // use to transmit my "nbyte" of data.  Now I need to decide
         // how many bytes to go over each port.
         //
-        rc = xferStrategy(NET_WRITE, netfd, (char *)buf, nbyte, portCount, ports);
+        rc = xferStrategy(ctx, &server, NET_WRITE, netfd, (char *)buf, nbyte,
+                          localfd, localOff, portCount, ports);
     }
 
 
@@ -712,6 +1394,7 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
     }
 
     close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netwrite", spanStart, traceNow() );
 
     //
     // Received a response back from the server
@@ -733,8 +1416,23 @@ ssize_t netwrite(int netfd, const void *buf, size_t nbyte)
 /////////////////////////////////////////////////////////////
 
 
-ssize_t netread(int netfd, void *buf, size_t nbyte)
+ssize_t netctx_read(netctx_t *ctx, int netfd, void *buf, size_t nbyte)
+{
+    return netreadTo( ctx, netfd, buf, -1, 0, nbyte );
+}
+
+/////////////////////////////////////////////////////////////
+//
+// netread of up to "nbyte" bytes into either "buf" or, if
+// "localfd" is not -1, into "localfd" at "localOff".  Data
+// port parts splice straight from the socket into the file.
+//
+/////////////////////////////////////////////////////////////
+
+ssize_t netreadTo( netctx_t *ctx, int netfd, void *buf, const int localfd,
+                   const off_t localOff, size_t nbyte )
 {
+    NET_SERVER server;
     int fd     = -1;
     int sockfd = -1;
     int rc     = 0;
@@ -747,18 +1445,23 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     errno = 0;
     h_errno = 0;
 
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
 
     //
     // Check input parameters
     //
-    if ((buf == NULL) || (nbyte < 0)) {
+    if (((buf == NULL) && (localfd < 0)) || (nbyte < 0)) {
 	errno = EINVAL;  // 22 = Invalid argument
 	return FAILURE;
     }
-    bzero(buf,nbyte);
 
 
-    if ( isNetServerInitialized( NET_CLOSE ) != TRUE ) {
+    if ( isNetServerInitialized( ctx, NET_CLOSE, &server ) != TRUE ) {
         errno = EPERM;  // 1 = Operation not permitted
         return FAILURE;
     }
@@ -767,7 +1470,7 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     //
     // Get a socket to talk to my net file server
     //
-    sockfd = getSockfd( gNetServer.hostname, NET_SERVER_PORT_NUM );
+    sockfd = getSockfd( ctx, server.hostname, server.port );
     if ( sockfd < 0 ) {
         // this error should not happen
         errno = 0;
@@ -778,6 +1481,30 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     //printf("client netread: sockfd= %d\n", sockfd);
 
 
+    //
+    // Small reads come back with the response itself.  Into
+    // a local file, the few bytes go through a buffer.
+    //
+    if ( nbyte <= INLINE_DATA_SIZE ) {
+        char *data = (localfd >= 0) ? malloc( nbyte + 1 ) : buf;
+        ssize_t nTotalBytes = FAILURE;
+
+        if ( data == NULL ) errno = ENOMEM;  // 12 = Out of memory
+        else {
+            struct iovec iov = { data, nbyte };
+            nTotalBytes = netreadInline(sockfd, netfd, getAdvice(ctx, netfd), &iov, 1, (int)nbyte);
+        }
+        if ((localfd >= 0) && (nTotalBytes > 0) &&
+            (pwriteFully(localfd, data, (int)nTotalBytes, localOff) != (int)nTotalBytes)) {
+            nTotalBytes = FAILURE;
+        }
+        if ( localfd >= 0 ) free(data);
+        close(sockfd);  // Don't need this socket anymore
+        traceSpan( "netread", spanStart, traceNow() );
+        return nTotalBytes;
+    }
+
+
     // 
     // Compose my net command to send to the server.  The format is:
     //
@@ -788,6 +1515,7 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     sprintf(msg, "%d,%d,%d,0", NET_READ, netfd, nBytesWant);
 
     //printf("client netread: send to server - \"%s\"\n", msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
@@ -805,7 +1533,7 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     //
     //    result,errno,h_errno,netFd,
     //    nFleSize, portCount,
-    //    portNum, portNum, portNum,....
+    //    portOffset, portOffset, portOffset,....
     //    
     //
     bzero(msg, MSG_SIZE);
@@ -824,6 +1552,8 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     //
     // Save the given list of ports into an array
     //
+    traceSpan( "negotiate", spanStart, traceNow() );
+
     int fileSize = 0;
     int portCount = 0;
     sscanf(msg, "%d,%d,%d,%d,%d,%d,", &rc, &errno, &h_errno, &fd, &fileSize, &portCount);
@@ -834,7 +1564,8 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
         
         int i = 0;  // Token counter
         char* token;
-        for (token = strtok(msg, ","); token != NULL; token = strtok(NULL, ","))
+        char* savePtr = NULL;  // strtok_r: netread/netwrite may run in many threads
+        for (token = strtok_r(msg, ",", &savePtr); token != NULL; token = strtok_r(NULL, ",", &savePtr))
         {
             if ( i > 5 ) {
                 ports[i-6] = atoi(token);
@@ -854,7 +1585,8 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
         //
         if (nBytesWant > fileSize ) nBytesWant = fileSize;
  
-        rc = xferStrategy(NET_READ, netfd, (char *)buf, nBytesWant, portCount, ports);
+        rc = xferStrategy(ctx, &server, NET_READ, netfd, (char *)buf, nBytesWant,
+                          localfd, localOff, portCount, ports);
     }
 
 
@@ -871,6 +1603,7 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     }
 
     close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netread", spanStart, traceNow() );
 
 
     //
@@ -890,28 +1623,208 @@ ssize_t netread(int netfd, void *buf, size_t nbyte)
     return nTotalBytes;
 }
 
+/////////////////////////////////////////////////////////////
+//
+// Inline netread.  The command goes out on the connected
+// "sockfd" and the response is a MSG_SIZE header followed
+// by the file data, so the whole read is one round trip.
+// The data is scattered over the "iov" buffers in order.
+//
+/////////////////////////////////////////////////////////////
+
+ssize_t netreadInline( const int sockfd, const int netfd, const int advice, const struct iovec *iov,
+                       const int iovcnt, const int nBytesWant )
+{
+    int rc = 0;
+    char msg[MSG_SIZE] = "";
+
+
+    //
+    // Compose my net command to send to the server.  The format is:
+    //
+    //     netCmd,netFd,nBytesWant,advice
+    //
+    bzero(msg, MSG_SIZE);
+    sprintf(msg, "%d,%d,%d,%d", NET_READ_INLINE, netfd, nBytesWant, advice);
+
+    traceTagMessage(msg, MSG_SIZE);
+    rc = write(sockfd, msg, strlen(msg));
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netread: failed to write cmd to server.  rc= %d\n", rc);
+        return FAILURE;
+    }
+
+
+    //
+    // The response header format is:
+    //
+    //    result,errno,h_errno,nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = readFully(sockfd, msg, MSG_SIZE);
+    if ( rc != MSG_SIZE ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+    msg[MSG_SIZE-1] = '\0';
+
+    int nBytes = 0;
+    sscanf(msg, "%d,%d,%d,%d", &rc, &errno, &h_errno, &nBytes);
+    if ( rc == FAILURE ) {
+        fprintf(stderr, "client netread: server returns FAILURE, errno= %d (%s), h_errno=%d\n",
+                  errno, strerror(errno), h_errno);
+        return FAILURE;
+    }
+
+    if ((nBytes < 0) || (nBytes > nBytesWant)) {
+        errno = EPROTO;  // 71 = Protocol error
+        return FAILURE;
+    }
+
+
+    //
+    // The data goes straight into the caller's buffers
+    //
+    rc = readvFully(sockfd, iov, iovcnt, nBytes);
+    if ( rc != nBytes ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    return nBytes;
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Inline netwrite.  The command is a MSG_SIZE header with
+// the data right behind it, sent in a single write so both
+// leave together.  The server answers with the usual final
+// response message.
+//
+/////////////////////////////////////////////////////////////
+
+ssize_t netwriteInline( const int sockfd, const int netfd, const long txId, const int advice,
+                        const struct iovec *iov, const int iovcnt, const int nBytes )
+{
+    int rc = 0;
+    char msg[MSG_SIZE] = "";
+    struct iovec *frame = NULL;
+
+
+    frame = malloc( sizeof(struct iovec) * (iovcnt + 1) );
+    if ( frame == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    //
+    // Compose my net command to send to the server.  The format is:
+    //
+    //     netCmd,netFd,nbytes,txId,advice
+    //
+    // The header and the caller's buffers are gathered into
+    // one frame, with no copy of the data.
+    //
+    bzero(msg, MSG_SIZE);
+    sprintf(msg, "%d,%d,%d,%ld,%d", NET_WRITE_INLINE, netfd, nBytes, txId, advice);
+    traceTagMessage(msg, MSG_SIZE);
+    frame[0].iov_base = msg;
+    frame[0].iov_len  = MSG_SIZE;
+    memcpy(frame + 1, iov, sizeof(struct iovec) * iovcnt);
+
+    rc = writevFully(sockfd, frame, iovcnt + 1, MSG_SIZE + nBytes);
+    free( frame );
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netwrite: failed to write cmd to server.  rc= %d\n", rc);
+        return FAILURE;
+    }
+
+
+    //
+    // Read the final response from the server.  The format is:
+    //
+    //    resultCode, errno, h_errno, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(sockfd, msg, MSG_SIZE -1);
+    if ( rc <= 0 ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    long iBytesWritten = 0;
+    sscanf(msg, "%d,%d,%d,%ld", &rc, &errno, &h_errno, &iBytesWritten);
+    if ( rc == FAILURE ) {
+        fprintf(stderr, "client netwrite: server returns FAILURE, errno= %d (%s), h_errno=%d\n",
+                  errno, strerror(errno), h_errno);
+        return FAILURE;
+    }
+
+    return iBytesWritten;
+}
+
 /////////////////////////////////////////////////////////////
 
 
-int xferStrategy(NET_FUNCTION_TYPE netFunc, const int netfd, 
+int xferStrategy(netctx_t *ctx, const NET_SERVER *server,
+                 NET_FUNCTION_TYPE netFunc, const int netfd, 
                  char *buf, int nBytes, 
+                 const int localfd, const off_t localOff,
                  const int portCount, int *ports)
 {
     int seqNum;  // file sequence number
     int iStartPos = 0;
     int iRemainingBytes = nBytes;
+    int nActive = 0;
+    int bFailed = FALSE;
+    int epfd = -1;
+    int i = 0;
+
+    SERVER_ADDR_TYPE addrs;
+    struct epoll_event events[ MAX_FILE_TRANSFER_SOCKETS ];
+    FILE_PART_TYPE parts[ MAX_FILE_TRANSFER_SOCKETS ];
+    uint64_t spanStart = traceNow();
+
 
-    pthread_t tids[portCount];
+    if ((portCount <= 0) || (portCount > MAX_FILE_TRANSFER_SOCKETS)) return FAILURE;
 
-    FILE_PART_TYPE part;
+    //
+    // All parts go to the address the control connection
+    // last reached the server on
+    //
+    if ( resolveServer( ctx, server->hostname, FALSE, &addrs ) == FAILURE ) {
+        return FAILURE;
+    }
 
-    part.netfd = netfd;
-    part.buf = buf;
+    epfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( epfd < 0 ) {
+        fprintf(stderr, "libnetfiles: epoll_create1() failed, errno= %d\n", errno);
+        return FAILURE;
+    }
 
+    bzero(parts, sizeof(parts));
     for ( seqNum = 1; seqNum <= portCount; seqNum++ ) {
-        part.port = ports[seqNum-1];
+        FILE_PART_TYPE *part = &parts[seqNum-1];
 
-        part.seqNum = seqNum;
+        //
+        // The server hands out data ports as offsets from
+        // its control port
+        //
+        part->port = server->port + ports[seqNum-1];
+        part->hostname = server->hostname;
+        part->netfd = netfd;
+        part->seqNum = seqNum;
+        part->buf = buf;
+        part->netFunc = netFunc;
+        part->advice = getAdvice( ctx, netfd );
+        part->sockfd = -1;
+        part->startTime = traceNow();
+        part->localfd = localfd;
+        part->localOff = localOff;
+        part->pipefd[0] = -1;
+        part->pipefd[1] = -1;
 
         if ( seqNum == portCount ) {
             //
@@ -919,294 +1832,2312 @@ int xferStrategy(NET_FUNCTION_TYPE netFunc, const int netfd,
             // in a file sequence.  Send all remaining 
             // bytes in this one port.
             //
-            part.iStartPos = iStartPos;
-            part.iLength = iRemainingBytes;
+            part->iStartPos = iStartPos;
+            part->iLength = iRemainingBytes;
 
         } else {
-            part.iStartPos = iStartPos;
+            part->iStartPos = iStartPos;
             if ( iRemainingBytes >= DATA_CHUNK_SIZE ) {
-                part.iLength = DATA_CHUNK_SIZE;
+                part->iLength = DATA_CHUNK_SIZE;
                 iRemainingBytes = iRemainingBytes - DATA_CHUNK_SIZE;
             } 
             iStartPos = iStartPos + DATA_CHUNK_SIZE;
         }
 
         //printf("client xferStrategy: netFunc= %d, part: port= %d, netfd= %d, seqNum= %d, iStartPos= %d, iLength= %d\n",
-        //     netFunc, part.port, part.netfd, part.seqNum, part.iStartPos, part.iLength);
+        //     netFunc, part->port, part->netfd, part->seqNum, part->iStartPos, part->iLength);
 
         //
-        // Spawn a thread to send or receive one part of the data
+        // Data for a local file goes socket -> pipe -> file
+        // with splice, never through a buffer here
         //
-        FILE_PART_TYPE *partArg = malloc(sizeof(FILE_PART_TYPE));
-        partArg->port = part.port;
-        partArg->netfd = part.netfd;
-        partArg->seqNum = part.seqNum;
-        partArg->buf = part.buf;
-        partArg->iStartPos = part.iStartPos;
-        partArg->iLength = part.iLength;
-
-        if ( netFunc == NET_WRITE ) {
-            pthread_create(&tids[seqNum-1], NULL, &sendData, partArg );
+        if ((localfd >= 0) && (netFunc == NET_READ) &&
+            (pipe2(part->pipefd, O_NONBLOCK | O_CLOEXEC) < 0)) {
+            fprintf(stderr, "libnetfiles: pipe2() failed, errno= %d\n", errno);
+            part->pipefd[0] = -1;
+            part->pipefd[1] = -1;
+            bFailed = TRUE;
+            continue;
         }
-        else {
-            pthread_create(&tids[seqNum-1], NULL, &getData, partArg );
+
+        if ( partConnect( part, &addrs.addrs[ addrs.iPreferred ],
+                          addrs.addrLens[ addrs.iPreferred ], epfd ) == FAILURE ) {
+            bFailed = TRUE;
+            continue;
         }
+        nActive++;
     }
 
 
-    // wait for all spawned threads to finish
-    int i;
-    for (i=0; i < portCount; i++) {
-        //printf("client xferStrategy: waiting for thread %d to finish\n", (int)tids[i]);
-        
-        pthread_join(tids[i], NULL);
+    //
+    // Drive every part from this thread until all are done.
+    // A part is stepped whenever its socket is ready and
+    // re-armed for whatever it waits on next.
+    //
+    while ( nActive > 0 ) {
+        int n = epoll_wait(epfd, events, MAX_FILE_TRANSFER_SOCKETS, XFER_IDLE_TIMEOUT_MS);
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            fprintf(stderr, "libnetfiles: epoll_wait() failed, errno= %d\n", errno);
+            break;
+        }
+        if ( n == 0 ) {
+            fprintf(stderr, "libnetfiles: data transfer idle for %d ms, giving up\n",
+                    XFER_IDLE_TIMEOUT_MS);
+            break;
+        }
+
+        for (i=0; i < n; i++) {
+            FILE_PART_TYPE *part = (FILE_PART_TYPE *)events[i].data.ptr;
+            struct epoll_event ev;
 
-        //printf("client xferStrategy: thread %d finished\n", (int)tids[i]);
+            ev.events = partStep( part );
+            ev.data.ptr = part;
+            if ( ev.events != 0 ) {
+                epoll_ctl(epfd, EPOLL_CTL_MOD, part->sockfd, &ev);
+                continue;
+            }
+
+            // This part is done
+            epoll_ctl(epfd, EPOLL_CTL_DEL, part->sockfd, NULL);
+            close(part->sockfd);
+            part->sockfd = -1;
+            if ( part->bFailed ) bFailed = TRUE;
+            traceSpan( (netFunc == NET_WRITE) ? "sendData" : "getData", part->startTime, traceNow() );
+            nActive--;
+        }
     }
 
+    // Anything still open timed out or lost its poll
+    for (i=0; i < portCount; i++) {
+        if ( parts[i].sockfd >= 0 ) {
+            close(parts[i].sockfd);
+            bFailed = TRUE;
+        }
+        if ( parts[i].pipefd[0] >= 0 ) close(parts[i].pipefd[0]);
+        if ( parts[i].pipefd[1] >= 0 ) close(parts[i].pipefd[1]);
+    }
+    close(epfd);
 
     //printf("client xferStrategy: buf= %s \n", buf);
 
-    return 0;
+    traceSpan( "xferStrategy", spanStart, traceNow() );
+    return bFailed ? FAILURE : 0;
 }
 
+/////////////////////////////////////////////////////////////
+//
+// Start a non-blocking connect for one part and register it
+// with the transfer's epoll set.  The part becomes writable
+// when the connect completes.
+//
 /////////////////////////////////////////////////////////////
 
-void *sendData( void *filePart )
+int partConnect( FILE_PART_TYPE *part, const struct sockaddr_storage *serverAddr,
+                 const socklen_t serverAddrLen, const int epfd )
 {
-    int rc = FAILURE;
-    FILE_PART_TYPE part;
-
-
-    pthread_detach( pthread_self() );
-
-    part.port      = ((FILE_PART_TYPE *)filePart)->port;
-    part.netfd     = ((FILE_PART_TYPE *)filePart)->netfd;
-    part.seqNum    = ((FILE_PART_TYPE *)filePart)->seqNum;
-    part.buf       = ((FILE_PART_TYPE *)filePart)->buf;
-    part.iStartPos = ((FILE_PART_TYPE *)filePart)->iStartPos;
-    part.iLength   = ((FILE_PART_TYPE *)filePart)->iLength;
+    struct sockaddr_storage addr = *serverAddr;
+    struct epoll_event ev;
 
-    free(filePart);
-
-    //printf("client netwrite: sendData thread %ld: Part: port= %d, netfd= %d, seqNum= %d, iStartPos= %d, iLength= %d\n",
-    //         pthread_self(), part.port, part.netfd, part.seqNum, part.iStartPos, part.iLength);
-
-
-    // 
-    // Create a new socket with the given port number to talk to the server
-    //
-    int sockfd = -1;
-    sockfd = getSockfd( gNetServer.hostname, part.port);
-    if ( sockfd < 0 ) {
-        // this error should not happen
-        errno = 0;
-        h_errno = HOST_NOT_FOUND;
-        fprintf(stderr, "client netwrite: sendData thread %d: host not found, %s\n", 
-                     (int)pthread_self(), gNetServer.hostname);
-        rc = FAILURE;
-        pthread_exit( &rc );
+    part->sockfd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( part->sockfd < 0 ) {
+        fprintf(stderr,"libnetfiles: socket() failed, errno= %d\n", errno);
+        return FAILURE;
     }
-    //printf("client netwrite: sendData thread %d: sockfd= %d, port= %d\n", 
-    //          (int)pthread_self(), sockfd, part.port);
-
 
+    setAddrPort( &addr, part->port );
+    part->state = PART_CONNECTING;
+    if ((connect(part->sockfd, (struct sockaddr *)&addr, serverAddrLen) < 0) &&
+        (errno != EINPROGRESS)) {
+        fprintf(stderr,"libnetfiles: cannot connect to %s port %d, errno= %d\n",
+                part->hostname, part->port, errno);
+        close(part->sockfd);
+        part->sockfd = -1;
+        return FAILURE;
+    }
 
-    // 
-    // Compose my net command to send to the server.  The format is:
-    //
-    //     netCmd,netFd,SeqNum,nbytes
-    //
-    char msg[MSG_SIZE] = "";
-    bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%d", NET_WRITE, part.netfd, part.seqNum, part.iLength);
-
-    //printf("client netwrite: sendData thread %d: send to server - \"%s\"\n",(int)pthread_self(),msg);
-    rc = write(sockfd, msg, strlen(msg));
-    if ( rc < 0 ) {
-        // Failed to write command to server
-        fprintf(stderr, "client netwrite: sendData failed to write msg to server.  rc= %d\n", rc);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+    ev.events = EPOLLOUT;
+    ev.data.ptr = part;
+    if ( epoll_ctl(epfd, EPOLL_CTL_ADD, part->sockfd, &ev) < 0 ) {
+        close(part->sockfd);
+        part->sockfd = -1;
+        return FAILURE;
     }
+    return SUCCESS;
+}
 
+/////////////////////////////////////////////////////////////
+//
+// Move one part along as far as it goes without blocking.
+// Returns the epoll events the part waits on next, or 0 when
+// it is done ("bFailed" says how it ended).
+//
+// A netwrite part sends its command, waits for the server to
+// accept it, sends its data and reads the server's final
+// response.  A netread part sends its command, reads its
+// data straight into the caller's buffer until it has all
+// of it or the server ends the stream, then tells the server
+// how many bytes arrived.
+//
+/////////////////////////////////////////////////////////////
 
-    //
-    // Read the response message from server.  The format is:
-    //     resultCode, errno, h_errno, seqNum, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    rc = read(sockfd, msg, MSG_SIZE -1);
-    if ( rc < 0 ) {
-        fprintf(stderr,"client netwrite: sendData thread %d: fails to read from socket\n", 
-                    (int)pthread_self());
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
-    }
-    //printf("client netwrite: sendData thread %d: received from server - \"%s\"\n",(int)pthread_self(),msg);
+uint32_t partStep( FILE_PART_TYPE *part )
+{
+    int rc = 0;
+    int extStart = 0;
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+
+    while ( TRUE ) {
+        switch (part->state) {
+            case PART_CONNECTING:
+                if ((getsockopt(part->sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0) || (err != 0)) {
+                    fprintf(stderr,"libnetfiles: cannot connect to %s port %d, errno= %d\n",
+                            part->hostname, part->port, err);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+
+                // 
+                // Compose my net command to send to the server.  The format is:
+                //
+                //     netwrite: netCmd,netFd,SeqNum,nbytes
+                //     netread:  netCmd,netFd,SeqNum,iStartPos,nbytes,bSparse,advice
+                //
+                bzero(part->msg, MSG_SIZE);
+                if ( part->netFunc == NET_WRITE ) {
+                    sprintf(part->msg, "%d,%d,%d,%d", NET_WRITE, part->netfd, part->seqNum, part->iLength);
+                }
+                else {
+                    sprintf(part->msg, "%d,%d,%d,%d,%d,%d,%d", NET_READ, part->netfd, part->seqNum,
+                            part->iStartPos, part->iLength, TRUE, part->advice);
+                }
+                traceTagMessage(part->msg, MSG_SIZE);
+                part->msgLen = strlen(part->msg);
+                part->msgDone = 0;
+                part->state = PART_SEND_CMD;
+                break;
 
+            case PART_SEND_CMD:
+            case PART_SEND_RESULT:
+                rc = send(part->sockfd, part->msg + part->msgDone, part->msgLen - part->msgDone, MSG_NOSIGNAL);
+                if ( rc < 0 ) {
+                    if ( errno == EINTR ) break;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return EPOLLOUT;
+                    fprintf(stderr, "libnetfiles: part %d failed to write msg to server, errno= %d\n",
+                            part->seqNum, errno);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+                part->msgDone = part->msgDone + rc;
+                if ( part->msgDone < part->msgLen ) break;
+
+                if ( part->state == PART_SEND_RESULT ) {
+                    part->state = PART_DONE;
+                }
+                else if ( part->netFunc == NET_WRITE ) {
+                    part->state = PART_WAIT_ACK;
+                }
+                else {
+                    bzero(part->msg, MSG_SIZE);
+                    part->msgDone = 0;
+                    part->state = PART_RECV_MAP;
+                }
+                break;
 
+            case PART_RECV_MAP:
+                //
+                // A MSG_SIZE map of the part comes ahead of its
+                // data.  The format is:
+                //
+                //     nCovered,nExtents,offset,length,offset,length,...
+                //
+                rc = recv(part->sockfd, part->msg + part->msgDone, MSG_SIZE - part->msgDone, 0);
+                if ( rc < 0 ) {
+                    if ( errno == EINTR ) break;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return EPOLLIN;
+                }
+                if ( rc <= 0 ) {
+                    fprintf(stderr,"libnetfiles: part %d fails to read its map from socket\n", part->seqNum);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+                part->msgDone = part->msgDone + rc;
+                if ( part->msgDone < MSG_SIZE ) break;
+
+                part->msg[MSG_SIZE - 1] = '\0';
+                if ( partMap( part ) == FAILURE ) {
+                    fprintf(stderr,"libnetfiles: part %d got a bad map \"%s\"\n", part->seqNum, part->msg);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+                part->nDone = 0;
+                part->iExtent = 0;
+                part->state = PART_RECV_DATA;
+                break;
 
-    // 
-    // Send nBytes of data to the server
-    //
+            case PART_WAIT_ACK:
+            case PART_WAIT_RESULT:
+                //
+                // Read a response message from server.  The format is:
+                //     resultCode, errno, h_errno, seqNum, nBytes
+                //
+                bzero(part->msg, MSG_SIZE);
+                rc = recv(part->sockfd, part->msg, MSG_SIZE -1, 0);
+                if ( rc < 0 ) {
+                    if ( errno == EINTR ) break;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return EPOLLIN;
+                }
+                if ( rc <= 0 ) {
+                    fprintf(stderr,"libnetfiles: part %d fails to read from socket\n", part->seqNum);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+
+                if ( part->state == PART_WAIT_RESULT ) {
+                    sscanf(part->msg, "%d", &rc);
+                    part->bFailed = (rc == FAILURE);
+                    part->state = PART_DONE;
+                }
+                else {
+                    part->nDone = 0;
+                    part->state = PART_SEND_DATA;
+                }
+                break;
 
-    rc = write(sockfd, &(part.buf[part.iStartPos]), part.iLength);
-    if ( rc < 0 ) {
-        // Failed to write data to server
-        fprintf(stderr, "client netwrite: sendData failed to write data to server.  rc= %d\n", rc);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
-    }
-    //printf("client netwrite: sendData thread %d: send %d bytes of data to server\n",
-    //          (int)pthread_self(),rc);
+            case PART_SEND_DATA:
+                if ( part->localfd >= 0 ) {
+                    off_t off = part->localOff + part->iStartPos + part->nDone;
+                    rc = sendfile(part->sockfd, part->localfd, &off, part->iLength - part->nDone);
+                    if ( rc == 0 ) {
+                        // The local file ends before this part does
+                        fprintf(stderr, "libnetfiles: part %d hit end of the local file\n", part->seqNum);
+                        part->bFailed = TRUE;
+                        part->state = PART_DONE;
+                        break;
+                    }
+                }
+                else {
+                    rc = send(part->sockfd, part->buf + part->iStartPos + part->nDone,
+                              part->iLength - part->nDone, MSG_NOSIGNAL);
+                }
+                if ( rc < 0 ) {
+                    if ( errno == EINTR ) break;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return EPOLLOUT;
+                    fprintf(stderr, "libnetfiles: part %d failed to write data to server, errno= %d\n",
+                            part->seqNum, errno);
+                    part->bFailed = TRUE;
+                    part->state = PART_DONE;
+                    break;
+                }
+                part->nDone = part->nDone + rc;
+                if ( part->nDone >= part->iLength ) part->state = PART_WAIT_RESULT;
+                break;
 
+            case PART_RECV_DATA:
+                //
+                // Take the extents in order, filling in the hole
+                // ahead of each one.  What is left after the last
+                // one is a hole too.
+                //
+                rc = 0;
+                while ((part->iExtent < part->nExtents) &&
+                       (part->nDone >= part->extOff[part->iExtent] + part->extLen[part->iExtent])) {
+                    part->iExtent++;
+                }
+                extStart = (part->iExtent < part->nExtents) ? part->extOff[part->iExtent] : part->nCovered;
+                if ( part->nDone < extStart ) {
+                    if ( partHole( part, part->nDone, extStart ) == FAILURE ) {
+                        fprintf(stderr,"libnetfiles: part %d fails to fill a hole, errno= %d\n",
+                                part->seqNum, errno);
+                        part->bFailed = TRUE;
+                        part->state = PART_DONE;
+                        break;
+                    }
+                    part->nDone = extStart;
+                }
+
+                if ( part->iExtent < part->nExtents ) {
+                    int nWant = part->extOff[part->iExtent] + part->extLen[part->iExtent] - part->nDone;
+
+                    if ( part->localfd >= 0 ) {
+                        rc = partSplice( part, nWant );
+                    }
+                    else {
+                        rc = recv(part->sockfd, part->buf + part->iStartPos + part->nDone, nWant, 0);
+                    }
+                    if ( rc < 0 ) {
+                        if ( errno == EINTR ) break;
+                        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return EPOLLIN;
+                        fprintf(stderr,"libnetfiles: part %d fails to read from socket, errno= %d\n",
+                                part->seqNum, errno);
+                        part->bFailed = TRUE;
+                        part->state = PART_DONE;
+                        break;
+                    }
+                    part->nDone = part->nDone + rc;
+                    if ( rc > 0 ) break;
+                }
+
+                // 
+                // All data is in, or the server ended the stream.
+                // Send a response msg back to the server.  The
+                // format is:
+                //
+                //     resultCode, errno, h_errno, nBytes
+                //
+                bzero(part->msg, MSG_SIZE);
+                sprintf(part->msg, "%d,%d,%d,%d", SUCCESS, 0, 0, part->nDone);
+                traceTagMessage(part->msg, MSG_SIZE);
+                part->msgLen = strlen(part->msg);
+                part->msgDone = 0;
+                part->state = PART_SEND_RESULT;
+                break;
 
-    //
-    // Read the response message from server.  The format is:
-    //     resultCode, errno, h_errno, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    rc = read(sockfd, msg, MSG_SIZE -1);
-    if ( rc < 0 ) {
-        fprintf(stderr,"client netwrite: sendData thread %d: fails to read from socket\n", 
-                    (int)pthread_self());
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+            case PART_DONE:
+            default:
+                return 0;
+        }
     }
+}
 
-    //printf("client netwrite: sendData thread %d: received from server - \"%s\"\n",(int)pthread_self(),msg);
-
-    int nBytes = 0;
-    sscanf(msg, "%d,%d,%d,%d", &rc, &errno, &h_errno, &nBytes);
-    //printf("client netwrite: endData thread %d: server wrote %d bytes\n",(int)pthread_self(),nBytes);
+/////////////////////////////////////////////////////////////
+//
+// Read a netread part's map out of its message.  Returns
+// FAILURE unless the extents are in order and inside the
+// part.
+//
+/////////////////////////////////////////////////////////////
 
-    if ( sockfd != 0 ) close(sockfd);
-    pthread_exit( &nBytes );
+int partMap( FILE_PART_TYPE *part )
+{
+    char *token = NULL;
+    char *savePtr = NULL;
+    int end = 0;
+    int i = 0;
 
+    part->nCovered = -1;
+    part->nExtents = -1;
+    sscanf(part->msg, "%d,%d", &part->nCovered, &part->nExtents);
+    if ((part->nCovered < 0) || (part->nCovered > part->iLength) ||
+        (part->nExtents < 0) || (part->nExtents > NET_SPARSE_EXTENTS)) return FAILURE;
+
+    token = strtok_r(part->msg, ",", &savePtr);
+    token = strtok_r(NULL, ",", &savePtr);
+    for (i=0; i < part->nExtents; i++) {
+        token = strtok_r(NULL, ",", &savePtr);
+        if ( token == NULL ) return FAILURE;
+        part->extOff[i] = atoi(token);
+        token = strtok_r(NULL, ",", &savePtr);
+        if ( token == NULL ) return FAILURE;
+        part->extLen[i] = atoi(token);
+
+        if ((part->extOff[i] < end) || (part->extLen[i] <= 0) ||
+            (part->extLen[i] > part->nCovered - part->extOff[i])) return FAILURE;
+        end = part->extOff[i] + part->extLen[i];
+    }
+    return SUCCESS;
 }
 
+/////////////////////////////////////////////////////////////
+//
+// Fill in a hole from "from" to "to" in a netread part.  In
+// a buffer the hole is zeroed.  In a local file it is made
+// a hole too, by punching it out of what the file held and
+// growing the file over it if it ends there; a file system
+// that can't punch holes gets zeros written instead.
+//
 /////////////////////////////////////////////////////////////
 
-
-void *getData( void *filePart )
+int partHole( FILE_PART_TYPE *part, const int from, const int to )
 {
-    int rc = FAILURE;
-    FILE_PART_TYPE part;
+    static const char zeros[ 65536 ];
+    off_t off = part->localOff + part->iStartPos + from;
+    off_t end = part->localOff + part->iStartPos + to;
+    struct stat st;
+    int n = 0;
+
+    if ( part->localfd < 0 ) {
+        bzero(part->buf + part->iStartPos + from, to - from);
+        return SUCCESS;
+    }
 
+    if ( fstat(part->localfd, &st) < 0 ) return FAILURE;
+    if ( off < st.st_size ) {
+        if ( fallocate(part->localfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, end - off) < 0 ) {
+            while ( off < end ) {
+                n = ((end - off) < (off_t)sizeof(zeros)) ? (int)(end - off) : (int)sizeof(zeros);
+                if ( pwriteFully(part->localfd, zeros, n, off) != n ) return FAILURE;
+                off = off + n;
+            }
+        }
+    }
+    if ( end > st.st_size ) {
+        if ( ftruncate(part->localfd, end) < 0 ) return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Move what has arrived for a netread part from its socket
+// into its local file, through the part's pipe.  Returns
+// like recv: the bytes moved, 0 when the server ended the
+// stream, or FAILURE with errno EAGAIN if nothing is
+// waiting.
+//
+/////////////////////////////////////////////////////////////
+
+int partSplice( FILE_PART_TYPE *part, const int nWant )
+{
+    off_t off = part->localOff + part->iStartPos + part->nDone;
+    ssize_t nIn = 0;
+    ssize_t nOut = 0;
+    ssize_t rc = 0;
+
+    nIn = splice(part->sockfd, NULL, part->pipefd[1], NULL, nWant,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if ( nIn <= 0 ) return (int)nIn;
+
+    // The pipe is emptied every time, so it never fills up
+    while ( nOut < nIn ) {
+        rc = splice(part->pipefd[0], NULL, part->localfd, &off, nIn - nOut, SPLICE_F_MOVE);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            if ( errno == EAGAIN ) errno = EIO;  // not the socket's EAGAIN
+            return FAILURE;
+        }
+        nOut = nOut + rc;
+    }
+    return (int)nIn;
+}
 
-    pthread_detach( pthread_self() );
+/////////////////////////////////////////////////////////////
 
-    part.port      = ((FILE_PART_TYPE *)filePart)->port;
-    part.netfd     = ((FILE_PART_TYPE *)filePart)->netfd;
-    part.seqNum    = ((FILE_PART_TYPE *)filePart)->seqNum;
-    part.buf       = ((FILE_PART_TYPE *)filePart)->buf;
-    part.iStartPos = ((FILE_PART_TYPE *)filePart)->iStartPos;
-    part.iLength   = ((FILE_PART_TYPE *)filePart)->iLength;
 
-    free(filePart);
+/*******************************************************
 
-    //printf("client netread: getData thread %ld: Part: port= %d, netfd= %d, seqNum= %d, iStartPos= %d, iLength= %d\n",
-    //         pthread_self(), part.port, part.netfd, part.seqNum, part.iStartPos, part.iLength);
+  netstats needs to handle these error codes
 
+       Implemented:
+           EPERM  =  1, Operation not permitted
+           EINVAL = 22, Invalid argument
+           ECOMM  = 70, Communication error on send
 
-    // 
-    // Create a new socket with the given port number to talk to the server
-    //
+******************************************************/
+
+ssize_t netctx_stats(netctx_t *ctx, char *buf, size_t nbyte)
+{
+    NET_SERVER server;
     int sockfd = -1;
-    sockfd = getSockfd( gNetServer.hostname, part.port);
+    int rc     = 0;
+    char msg[MSG_SIZE] = "";
+
+
+    //
+    // Clear errno and h_errno
+    //
+    errno = 0;
+    h_errno = 0;
+
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((buf == NULL) || (nbyte == 0)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+    buf[0] = '\0';
+
+
+    if ( isNetServerInitialized( ctx, NET_STATS, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+
+    //
+    // Get a socket to talk to my net file server
+    //
+    sockfd = getSockfd( ctx, server.hostname, server.port );
     if ( sockfd < 0 ) {
-        // this error should not happen
         errno = 0;
         h_errno = HOST_NOT_FOUND;
-        fprintf(stderr, "client netread: getData thread %d: host not found, %s\n", 
-                     (int)pthread_self(), gNetServer.hostname);
-        rc = FAILURE;
-        pthread_exit( &rc );
+        return FAILURE;
     }
-    //printf("client netread: getData thread %d: sockfd= %d, port= %d\n", 
-    //          (int)pthread_self(), sockfd, part.port);
-
 
 
-    // 
+    //
     // Compose my net command to send to the server.  The format is:
     //
-    //     netread, netFd, SeqNum, iStartPos, nbytes
+    //     netCmd,0,0,0
     //
-    char msg[MSG_SIZE] = "";
     bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%d,%d", NET_READ, part.netfd, part.seqNum, part.iStartPos, part.iLength);
+    sprintf(msg, "%d,0,0,0", NET_STATS);
 
-    //printf("client netread: getData thread %d: send to server - \"%s\"\n",(int)pthread_self(),msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
-        // Failed to write command to server
-        fprintf(stderr, "client netread: getData failed to write msg to server.  rc= %d\n", rc);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+        h_errno = ECOMM;  // 70 = Communication error on send
+        close(sockfd);
+        return FAILURE;
     }
 
 
     //
-    // Read the response message from server.  This should
-    // be "part.iLength" bytes of data
+    // The response is a MSG_SIZE header message followed by
+    // the report text.  The header format is:
+    //
+    //    result,errno,h_errno,nBytes
     //
     bzero(msg, MSG_SIZE);
-    rc = read(sockfd, msg, MSG_SIZE -1);
+    rc = readFully(sockfd, msg, MSG_SIZE);
+    if ( rc != MSG_SIZE ) {
+        h_errno = ECOMM;  // 70 = Communication error on send
+        close(sockfd);
+        return FAILURE;
+    }
+    msg[MSG_SIZE-1] = '\0';
+
+    int nBytes = 0;
+    sscanf(msg, "%d,%d,%d,%d", &rc, &errno, &h_errno, &nBytes);
+    if ( rc == FAILURE ) {
+        close(sockfd);
+        return FAILURE;
+    }
+
+
+    //
+    // Keep as much of the report as fits in the caller's
+    // buffer, leaving room for the terminating NUL.
+    //
+    int nKeep = nBytes;
+    if ( nKeep > (int)nbyte - 1 ) nKeep = (int)nbyte - 1;
+
+    rc = readFully(sockfd, buf, nKeep);
+    close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netstats", spanStart, traceNow() );
+
     if ( rc < 0 ) {
-        fprintf(stderr,"client netread: getData thread %d: fails to read from socket\n", 
-                    (int)pthread_self());
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+        h_errno = ECOMM;
+        return FAILURE;
+    }
+    buf[rc] = '\0';
+
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Common checks for netget and netput.  Returns a socket
+// connected to the net file server, or FAILURE, and sets
+// "server" to the server it is connected to.
+//
+/////////////////////////////////////////////////////////////
+
+int wholeFileSockfd( netctx_t *ctx, NET_SERVER *server, const char *pathname )
+{
+    int sockfd = -1;
+
+    // Check the given pathname
+    if ((pathname == NULL) || (strcmp(pathname,"") == 0)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    // The pathname must fit in the command message
+    if ( strlen(pathname) > MSG_SIZE - 64 ) {
+        errno = ENAMETOOLONG;  // 36 = File name too long
+        return FAILURE;
+    }
+
+    if ( isNetServerInitialized( ctx, NET_OPEN, server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+    //
+    // Get a socket to talk to my net file server
+    //
+    sockfd = getSockfd( ctx, server->hostname, server->port );
+    if ( sockfd < 0 ) {
+        errno = 0;
+        h_errno = HOST_NOT_FOUND;
+        return FAILURE;
     }
-    int iBytesRecv = rc;
-    //printf("client netread: getData thread %d: received %d bytes of data from server\n",(int)pthread_self(),rc);
 
+    return sockfd;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netget needs to handle these error codes
 
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           ENOENT       =  2, No such file or directory
+           EACCES       = 13, Permission denied
+           EISDIR       = 21, Is a directory
+           EINVAL       = 22, Invalid argument
+           ENFILE       = 23, File table overflow
+           ENAMETOOLONG = 36, File name too long
+           ECONNRESET   = 104, Connection reset by peer
+
+******************************************************/
+
+ssize_t netctx_get(netctx_t *ctx, const char *pathname, void *buf, size_t nbyte)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    char msg[MSG_SIZE] = "";
+
+
+    //
+    // Clear errno and h_errno
     //
-    // Return data read from server.  The caller of this "libnetfiles" library
-    // gave me a char pointer, "buf", to return data I read from the server.  
-    // Here, I will write out the data one byte at a time to "buf".
+    errno = 0;
+    h_errno = 0;
+
     //
+    // Every call starts a new trace
     //
-    //printf("client netread: getData thread %d: seqNum= %d\n",(int)pthread_self(), part.seqNum);
-    int k = part.iStartPos;
-    int i = 0;
-    for (i=0; i < iBytesRecv; i++) {
-         part.buf[k] = msg[i];
-         //printf("client netread: getData thread %d: buf[%d]=%c\n",(int)pthread_self(), k, part.buf[k]);
-         k++;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ( buf == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
     }
 
+    sockfd = wholeFileSockfd( ctx, &server, pathname );
+    if ( sockfd < 0 ) return FAILURE;
 
-    // 
-    // Send a response msg back to the server.  The format is:
+
+    //
+    // Compose my net command to send to the server.  The format is:
     //
-    //     resultCode, errno, h_errno, nBytes
+    //     netCmd,connectionMode,nBytesWant,pathname
     //
     bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, iBytesRecv);
+    sprintf(msg, "%d,%d,%d,%s", NET_GET, server.fcMode, (int)nbyte, pathname);
 
-    //printf("client netread: getData thread %d: send to server - \"%s\"\n",(int)pthread_self(),msg);
+    traceTagMessage(msg, MSG_SIZE);
     rc = write(sockfd, msg, strlen(msg));
     if ( rc < 0 ) {
         // Failed to write command to server
-        fprintf(stderr, "client netread: getData failed to write msg to server.  rc= %d\n", rc);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+        fprintf(stderr, "netget: failed to write cmd to server.  rc= %d\n", rc);
+        close(sockfd);
+        return FAILURE;
+    }
+
+
+    //
+    // The response is a MSG_SIZE header message followed by
+    // the file data.  The header format is:
+    //
+    //    result,errno,h_errno,nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = readFully(sockfd, msg, MSG_SIZE);
+    if ( rc != MSG_SIZE ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        close(sockfd);
+        return FAILURE;
+    }
+    msg[MSG_SIZE-1] = '\0';
+
+    int nBytes = 0;
+    sscanf(msg, "%d,%d,%d,%d", &rc, &errno, &h_errno, &nBytes);
+    if ( rc == FAILURE ) {
+        close(sockfd);
+        return FAILURE;
+    }
+
+    if ((nBytes < 0) || (nBytes > (int)nbyte)) {
+        errno = EPROTO;  // 71 = Protocol error
+        close(sockfd);
+        return FAILURE;
+    }
+
+    rc = readFully(sockfd, (char *)buf, nBytes);
+    close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netget", spanStart, traceNow() );
+
+    if ( rc != nBytes ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    return nBytes;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netput needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           ENOMEM       = 12, Out of memory, or larger than
+                              the server's memory budget
+           EACCES       = 13, Permission denied
+           EISDIR       = 21, Is a directory
+           EINVAL       = 22, Invalid argument
+           ENFILE       = 23, File table overflow
+           ENAMETOOLONG = 36, File name too long
+           ECONNRESET   = 104, Connection reset by peer
+
+******************************************************/
+
+ssize_t netctx_put(netctx_t *ctx, const char *pathname, const void *buf, size_t nbyte)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    char msg[MSG_SIZE] = "";
+    char *frame = NULL;
+
+
+    //
+    // Clear errno and h_errno
+    //
+    errno = 0;
+    h_errno = 0;
+
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ( buf == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    frame = malloc( MSG_SIZE + nbyte );
+    if ( frame == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    sockfd = wholeFileSockfd( ctx, &server, pathname );
+    if ( sockfd < 0 ) {
+        free( frame );
+        return FAILURE;
+    }
+
+
+    //
+    // Compose my net command to send to the server.  It is a
+    // MSG_SIZE header followed by the data.  The format is:
+    //
+    //     netCmd,connectionMode,nbytes,pathname
+    //
+    bzero(frame, MSG_SIZE);
+    sprintf(frame, "%d,%d,%d,%s", NET_PUT, server.fcMode, (int)nbyte, pathname);
+    traceTagMessage(frame, MSG_SIZE);
+    memcpy(frame + MSG_SIZE, buf, nbyte);
+
+    rc = writeFully(sockfd, frame, MSG_SIZE + nbyte);
+    free( frame );
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netput: failed to write cmd to server.  rc= %d\n", rc);
+        close(sockfd);
+        return FAILURE;
     }
 
 
-    if ( sockfd != 0 ) close(sockfd);
-    pthread_exit( &iBytesRecv );
+    //
+    // Read the final response from the server.  The format is:
+    //
+    //    resultCode, errno, h_errno, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(sockfd, msg, MSG_SIZE -1);
+    close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netput", spanStart, traceNow() );
+
+    if ( rc <= 0 ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    long iBytesWritten = 0;
+    sscanf(msg, "%d,%d,%d,%ld", &rc, &errno, &h_errno, &iBytesWritten);
+    if ( rc == FAILURE ) return FAILURE;
+
+    return iBytesWritten;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netcopy needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           ENOENT       =  2, No such file or directory
+           EACCES       = 13, Permission denied
+           EISDIR       = 21, Is a directory
+           EINVAL       = 22, Invalid argument, or "src"
+                              and "dst" are the same file
+           ENFILE       = 23, File table overflow
+           ENAMETOOLONG = 36, File name too long
+
+******************************************************/
+
+ssize_t netctx_copy(netctx_t *ctx, const char *src, const char *dst, off_t offset, size_t nbyte)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    char msg[MSG_SIZE] = "";
+    char frame[ 2 * MSG_SIZE ];
+
+
+    //
+    // Clear errno and h_errno
+    //
+    errno = 0;
+    h_errno = 0;
+
+    //
+    // Every call starts a new trace
+    //
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((dst == NULL) || (strcmp(dst,"") == 0) || (offset < 0)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+    if ( strlen(dst) > MSG_SIZE - 64 ) {
+        errno = ENAMETOOLONG;  // 36 = File name too long
+        return FAILURE;
+    }
+    if ( nbyte > LONG_MAX ) nbyte = LONG_MAX;
+
+    sockfd = wholeFileSockfd( ctx, &server, src );
+    if ( sockfd < 0 ) return FAILURE;
+
+
+    //
+    // Compose my net command to send to the server.  It is a
+    // MSG_SIZE header followed by a MSG_SIZE block holding
+    // the destination pathname.  The header format is:
+    //
+    //     netCmd,connectionMode,offset,nbytes,srcPathname
+    //
+    bzero(frame, sizeof(frame));
+    sprintf(frame, "%d,%d,%ld,%ld,%s", NET_COPY, server.fcMode, (long)offset, (long)nbyte, src);
+    traceTagMessage(frame, MSG_SIZE);
+    strcpy(frame + MSG_SIZE, dst);
+
+    rc = writeFully(sockfd, frame, sizeof(frame));
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netcopy: failed to write cmd to server.  rc= %d\n", rc);
+        close(sockfd);
+        return FAILURE;
+    }
+
+
+    //
+    // The server answers once the copy is done.  The format
+    // is:
+    //
+    //    resultCode, errno, h_errno, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(sockfd, msg, MSG_SIZE -1);
+    close(sockfd);  // Don't need this socket anymore
+    traceSpan( "netcopy", spanStart, traceNow() );
+
+    if ( rc <= 0 ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    long iBytesCopied = 0;
+    sscanf(msg, "%d,%d,%d,%ld", &rc, &errno, &h_errno, &iBytesCopied);
+    if ( rc == FAILURE ) return FAILURE;
+
+    return iBytesCopied;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// Send one batched request and read its response.  "body"
+// holds "count" newline terminated entry lines.  On success
+// "*pReply" is a malloc'ed, null terminated copy of the
+// response lines for the caller to parse and free, and the
+// number of entries that succeeded is returned.
+//
+/////////////////////////////////////////////////////////////
+
+int batchRequest( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc, const char *body, const int nBody,
+                  const int count, char **pReply )
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    int nSuccess = 0;
+    int nReply = 0;
+    char msg[MSG_SIZE] = "";
+    char *frame = NULL;
+
+
+    *pReply = NULL;
+
+    if ( isNetServerInitialized( ctx, netFunc, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+    frame = malloc( MSG_SIZE + nBody );
+    if ( frame == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    sockfd = getSockfd( ctx, server.hostname, server.port );
+    if ( sockfd < 0 ) {
+        free( frame );
+        errno = 0;
+        h_errno = HOST_NOT_FOUND;
+        return FAILURE;
+    }
+
+
+    //
+    // Compose my net command to send to the server.  It is a
+    // MSG_SIZE header followed by the entry lines.  The
+    // header format is:
+    //
+    //     netCmd,connectionMode,count,nBytes
+    //
+    bzero(frame, MSG_SIZE);
+    sprintf(frame, "%d,%d,%d,%d", netFunc, server.fcMode, count, nBody);
+    traceTagMessage(frame, MSG_SIZE);
+    memcpy(frame + MSG_SIZE, body, nBody);
+
+    rc = writeFully(sockfd, frame, MSG_SIZE + nBody);
+    free( frame );
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netbatch: failed to write cmd to server.  rc= %d\n", rc);
+        close(sockfd);
+        return FAILURE;
+    }
+
+
+    //
+    // The response is a MSG_SIZE header message followed by
+    // one line per entry.  The header format is:
+    //
+    //    result,errno,h_errno,nSuccess,nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = readFully(sockfd, msg, MSG_SIZE);
+    if ( rc != MSG_SIZE ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        close(sockfd);
+        return FAILURE;
+    }
+    msg[MSG_SIZE-1] = '\0';
+
+    sscanf(msg, "%d,%d,%d,%d,%d", &rc, &errno, &h_errno, &nSuccess, &nReply);
+    if ( rc == FAILURE ) {
+        close(sockfd);
+        return FAILURE;
+    }
+
+    if ( nReply <= 0 ) {
+        errno = EPROTO;  // 71 = Protocol error
+        close(sockfd);
+        return FAILURE;
+    }
+
+    *pReply = malloc( nReply + 1 );
+    if ( *pReply == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        close(sockfd);
+        return FAILURE;
+    }
+
+    rc = readFully(sockfd, *pReply, nReply);
+    close(sockfd);  // Don't need this socket anymore
+    if ( rc != nReply ) {
+        free( *pReply );
+        *pReply = NULL;
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+    (*pReply)[ nReply ] = '\0';
+
+    return nSuccess;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Check the pathnames of a batch and return the body size
+// needed to carry them, plus "extra" bytes per entry, or
+// FAILURE.  A pathname may not hold a newline, which ends
+// an entry.
+//
+/////////////////////////////////////////////////////////////
+
+int batchPathnames( const char **pathnames, const int count, const int extra )
+{
+    int nBody = 0;
+    int i = 0;
+
+    if ((pathnames == NULL) || (count <= 0) || (count > NET_BATCH_MAX)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    for (i=0; i < count; i++) {
+        if ((pathnames[i] == NULL) || (strcmp(pathnames[i],"") == 0) ||
+            (strchr(pathnames[i], '\n') != NULL)) {
+            errno = EINVAL;  // 22 = Invalid argument
+            return FAILURE;
+        }
+        if ( strlen(pathnames[i]) > 255 ) {
+            errno = ENAMETOOLONG;  // 36 = File name too long
+            return FAILURE;
+        }
+        nBody = nBody + strlen(pathnames[i]) + 1 + extra;
+    }
+    return nBody;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netopen_batch needs to handle these error codes
+
+       For the call:
+           EPERM        =  1, Operation not permitted
+           EINVAL       = 22, Invalid argument
+           ENAMETOOLONG = 36, File name too long
+           ECONNRESET   = 104, Connection reset by peer
+
+       For each entry, as for netopen:
+           ENOENT       =  2, No such file or directory
+           EACCES       = 13, Permission denied
+           EISDIR       = 21, Is a directory
+           ENFILE       = 23, File table overflow
+
+******************************************************/
+
+int netctx_open_batch(netctx_t *ctx, const char **pathnames, const int *flags, int count, int *fds, int *errnos)
+{
+    char *body = NULL;
+    char *reply = NULL;
+    char *pLine = NULL;
+    int nBody = 0;
+    int rc = 0;
+    int i = 0;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((flags == NULL) || (fds == NULL)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    // Each line is "flags,pathname"
+    nBody = batchPathnames( pathnames, count, 16 );
+    if ( nBody == FAILURE ) return FAILURE;
+
+    body = malloc( nBody + 1 );
+    if ( body == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    pLine = body;
+    for (i=0; i < count; i++) {
+        if ((flags[i] != O_RDONLY) && (flags[i] != O_WRONLY) && (flags[i] != O_RDWR)) {
+            free( body );
+            errno = EINVAL;  // 22 = Invalid argument
+            return FAILURE;
+        }
+        pLine = pLine + sprintf(pLine, "%d,%s\n", flags[i], pathnames[i]);
+    }
+
+    rc = batchRequest( ctx, NET_OPEN_BATCH, body, (int)(pLine - body), count, &reply );
+    free( body );
+    traceSpan( "netopen_batch", spanStart, traceNow() );
+    if ( rc == FAILURE ) return FAILURE;
+
+
+    //
+    // Each response line is:
+    //
+    //    result,errno,netfd
+    //
+    pLine = reply;
+    for (i=0; i < count; i++) {
+        int result = FAILURE;
+        int error = EPROTO;
+
+        fds[i] = FAILURE;
+        if ((pLine != NULL) && (sscanf(pLine, "%d,%d,%d", &result, &error, &fds[i]) != 3)) {
+            result = FAILURE;
+            error = EPROTO;
+        }
+        if ( result == FAILURE ) fds[i] = FAILURE;
+        if ( errnos != NULL ) errnos[i] = error;
+
+        if ( pLine != NULL ) pLine = strchr(pLine, '\n');
+        if ( pLine != NULL ) pLine++;
+    }
+
+    free( reply );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netstat_batch needs to handle these error codes
+
+       For the call:
+           EPERM        =  1, Operation not permitted
+           EINVAL       = 22, Invalid argument
+           ENAMETOOLONG = 36, File name too long
+           ECONNRESET   = 104, Connection reset by peer
+
+       For each entry, any errno set by stat()
+
+******************************************************/
+
+int netctx_stat_batch(netctx_t *ctx, const char **pathnames, int count, NET_STAT_TYPE *stats)
+{
+    char *body = NULL;
+    char *reply = NULL;
+    char *pLine = NULL;
+    int nBody = 0;
+    int rc = 0;
+    int i = 0;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ( stats == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    // Each line is "pathname"
+    nBody = batchPathnames( pathnames, count, 0 );
+    if ( nBody == FAILURE ) return FAILURE;
+
+    body = malloc( nBody + 1 );
+    if ( body == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    pLine = body;
+    for (i=0; i < count; i++) {
+        pLine = pLine + sprintf(pLine, "%s\n", pathnames[i]);
+    }
+
+    rc = batchRequest( ctx, NET_STAT_BATCH, body, (int)(pLine - body), count, &reply );
+    free( body );
+    traceSpan( "netstat_batch", spanStart, traceNow() );
+    if ( rc == FAILURE ) return FAILURE;
+
+
+    //
+    // Each response line is:
+    //
+    //    result,errno,size,mode,mtime
+    //
+    pLine = reply;
+    for (i=0; i < count; i++) {
+        bzero(&stats[i], sizeof(NET_STAT_TYPE));
+        if ((pLine == NULL) ||
+            (sscanf(pLine, "%d,%d,%ld,%d,%ld", &stats[i].result, &stats[i].error,
+                    &stats[i].size, &stats[i].mode, &stats[i].mtime) != 5)) {
+            stats[i].result = FAILURE;
+            stats[i].error = EPROTO;
+        }
+
+        if ( pLine != NULL ) pLine = strchr(pLine, '\n');
+        if ( pLine != NULL ) pLine++;
+    }
+
+    free( reply );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netclose_batch needs to handle these error codes
+
+       For the call:
+           EPERM        =  1, Operation not permitted
+           EINVAL       = 22, Invalid argument
+           ECONNRESET   = 104, Connection reset by peer
+
+       For each entry, as for netclose:
+           EBADF        =  9, Bad file descriptor
+
+******************************************************/
+
+int netctx_close_batch(netctx_t *ctx, const int *fds, int count, int *errnos)
+{
+    char *body = NULL;
+    char *reply = NULL;
+    char *pLine = NULL;
+    int rc = 0;
+    int i = 0;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((fds == NULL) || (count <= 0) || (count > NET_BATCH_MAX)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    // Each line is "netfd"
+    body = malloc( (count * 16) + 1 );
+    if ( body == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    pLine = body;
+    for (i=0; i < count; i++) {
+        pLine = pLine + sprintf(pLine, "%d\n", fds[i]);
+    }
+
+    rc = batchRequest( ctx, NET_CLOSE_BATCH, body, (int)(pLine - body), count, &reply );
+    free( body );
+    traceSpan( "netclose_batch", spanStart, traceNow() );
+    if ( rc == FAILURE ) return FAILURE;
+
+
+    //
+    // Each response line is:
+    //
+    //    result,errno
+    //
+    pLine = reply;
+    for (i=0; i < count; i++) {
+        int result = FAILURE;
+        int error = EPROTO;
+
+        if ((pLine != NULL) && (sscanf(pLine, "%d,%d", &result, &error) != 2)) {
+            error = EPROTO;
+        }
+        if ( errnos != NULL ) errnos[i] = (result == SUCCESS) ? 0 : error;
+        if ( result == SUCCESS ) setAdvice( ctx, fds[i], NET_ADVICE_NORMAL );
+
+        if ( pLine != NULL ) pLine = strchr(pLine, '\n');
+        if ( pLine != NULL ) pLine++;
+    }
+
+    free( reply );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netreadv needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EBADF        =  9, Bad file descriptor
+           ENOMEM       = 12, Out of memory
+           EACCES       = 13, Permission denied
+           EINVAL       = 22, Invalid argument
+           ECONNRESET   = 104, Connection reset by peer
+
+******************************************************/
+
+ssize_t netctx_readv(netctx_t *ctx, int netfd, const struct iovec *iov, int iovcnt)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int nBytes = 0;
+    int i      = 0;
+    ssize_t rc = 0;
+    char *buf  = NULL;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    nBytes = iovecBytes( iov, iovcnt );
+    if ( nBytes == FAILURE ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    if ( isNetServerInitialized( ctx, NET_READ, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+
+    //
+    // An inline read scatters the response straight into the
+    // caller's buffers
+    //
+    if ( nBytes <= INLINE_DATA_SIZE ) {
+        sockfd = getSockfd( ctx, server.hostname, server.port );
+        if ( sockfd < 0 ) {
+            errno = 0;
+            h_errno = HOST_NOT_FOUND;
+            return FAILURE;
+        }
+        rc = netreadInline(sockfd, netfd, getAdvice(ctx, netfd), iov, iovcnt, nBytes);
+        close(sockfd);  // Don't need this socket anymore
+        traceSpan( "netreadv", spanStart, traceNow() );
+        return rc;
+    }
+
+
+    //
+    // A data port read lands in one buffer, which is then
+    // scattered
+    //
+    buf = malloc( nBytes );
+    if ( buf == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    rc = netctx_read(ctx, netfd, buf, nBytes);
+    if ( rc > 0 ) {
+        long done = 0;
+
+        for (i=0; (i < iovcnt) && (done < rc); i++) {
+            long n = ((long)iov[i].iov_len < rc - done) ? (long)iov[i].iov_len : rc - done;
+
+            memcpy(iov[i].iov_base, buf + done, n);
+            done = done + n;
+        }
+    }
+    free( buf );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netwritev needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EBADF        =  9, Bad file descriptor
+           ENOMEM       = 12, Out of memory
+           EACCES       = 13, Permission denied
+           EINVAL       = 22, Invalid argument
+           ECONNRESET   = 104, Connection reset by peer
+
+******************************************************/
+
+ssize_t netctx_writev(netctx_t *ctx, int netfd, const struct iovec *iov, int iovcnt)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int nBytes = 0;
+    int i      = 0;
+    ssize_t rc = 0;
+    char *buf  = NULL;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    nBytes = iovecBytes( iov, iovcnt );
+    if ( nBytes == FAILURE ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    if ( isNetServerInitialized( ctx, NET_WRITE, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+
+    //
+    // An inline write gathers the caller's buffers behind the
+    // command header
+    //
+    if ( nBytes <= INLINE_DATA_SIZE ) {
+        sockfd = getSockfd( ctx, server.hostname, server.port );
+        if ( sockfd < 0 ) {
+            errno = 0;
+            h_errno = HOST_NOT_FOUND;
+            return FAILURE;
+        }
+        rc = netwriteInline(sockfd, netfd, server.txId, getAdvice(ctx, netfd), iov, iovcnt, nBytes);
+        close(sockfd);  // Don't need this socket anymore
+        traceSpan( "netwritev", spanStart, traceNow() );
+        return rc;
+    }
+
+
+    //
+    // A data port write is split from one buffer, so gather
+    // into one first
+    //
+    buf = malloc( nBytes );
+    if ( buf == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    long done = 0;
+    for (i=0; i < iovcnt; i++) {
+        memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+        done = done + iov[i].iov_len;
+    }
+
+    rc = netctx_write(ctx, netfd, buf, nBytes);
+    free( buf );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netreadranges needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EBADF        =  9, Bad file descriptor
+           ENOMEM       = 12, Out of memory
+           EACCES       = 13, Permission denied
+           EISDIR       = 21, Is a directory
+           EINVAL       = 22, Invalid argument
+           EPROTO       = 71, Protocol error
+           ECONNRESET   = 104, Connection reset by peer
+
+******************************************************/
+
+ssize_t netctx_readranges(netctx_t *ctx, int netfd, NET_RANGE_TYPE *ranges, int count, void **bufs)
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    int i      = 0;
+    long nWant = 0;
+    int nLines = 0;
+    int nData  = 0;
+    char msg[MSG_SIZE] = "";
+    char *frame = NULL;
+    char *pLine = NULL;
+    struct iovec *iov = NULL;
+
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+
+    //
+    // Check input parameters
+    //
+    if ((ranges == NULL) || (bufs == NULL) || (count <= 0) || (count > NET_RANGES_MAX)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+    for (i=0; i < count; i++) {
+        if ((ranges[i].offset < 0) || (ranges[i].length < 0) ||
+            ((bufs[i] == NULL) && (ranges[i].length > 0))) {
+            errno = EINVAL;  // 22 = Invalid argument
+            return FAILURE;
+        }
+        ranges[i].nBytes = 0;
+        nWant = nWant + ranges[i].length;
+    }
+    if ( nWant > INT_MAX ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    if ( isNetServerInitialized( ctx, NET_READ, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+    // Each entry line is "offset,length"
+    frame = malloc( MSG_SIZE + (count * 48) + 1 );
+    iov   = malloc( sizeof(struct iovec) * count );
+    if ((frame == NULL) || (iov == NULL)) {
+        if ( frame != NULL ) free( frame );
+        if ( iov != NULL ) free( iov );
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    sockfd = getSockfd( ctx, server.hostname, server.port );
+    if ( sockfd < 0 ) {
+        free( frame );
+        free( iov );
+        errno = 0;
+        h_errno = HOST_NOT_FOUND;
+        return FAILURE;
+    }
+
+
+    //
+    // Compose my net command to send to the server.  It is a
+    // MSG_SIZE header followed by one line per range.  The
+    // header format is:
+    //
+    //     netCmd,netFd,count,nBytes,advice
+    //
+    pLine = frame + MSG_SIZE;
+    for (i=0; i < count; i++) {
+        pLine = pLine + sprintf(pLine, "%ld,%d\n", ranges[i].offset, ranges[i].length);
+    }
+    bzero(frame, MSG_SIZE);
+    sprintf(frame, "%d,%d,%d,%d,%d", NET_READ_RANGES, netfd, count, (int)(pLine - frame - MSG_SIZE),
+            getAdvice(ctx, netfd));
+    traceTagMessage(frame, MSG_SIZE);
+
+    rc = writeFully(sockfd, frame, (int)(pLine - frame));
+    if ( rc < 0 ) {
+        // Failed to write command to server
+        fprintf(stderr, "netreadranges: failed to write cmd to server.  rc= %d\n", rc);
+        rc = FAILURE;
+    }
+
+
+    //
+    // The response is a MSG_SIZE header, one line per range
+    // with the bytes read for it, then the data of every
+    // range in order.  The header format is:
+    //
+    //    result,errno,h_errno,nLines,nData
+    //
+    if ( rc != FAILURE ) {
+        bzero(msg, MSG_SIZE);
+        if ( readFully(sockfd, msg, MSG_SIZE) != MSG_SIZE ) {
+            errno = ECONNRESET;  // 104 = Connection reset by peer
+            rc = FAILURE;
+        }
+        else {
+            msg[MSG_SIZE-1] = '\0';
+            sscanf(msg, "%d,%d,%d,%d,%d", &rc, &errno, &h_errno, &nLines, &nData);
+        }
+    }
+
+    // The frame buffer is big enough for the lines
+    if ((rc != FAILURE) &&
+        ((nLines <= 0) || (nLines > count * 48) || (nData < 0) || (nData > nWant) ||
+         (readFully(sockfd, frame, nLines) != nLines))) {
+        errno = EPROTO;  // 71 = Protocol error
+        rc = FAILURE;
+    }
+
+    if ( rc != FAILURE ) {
+        long nTotal = 0;
+
+        frame[ nLines ] = '\0';
+        pLine = frame;
+        for (i=0; (i < count) && (rc != FAILURE); i++) {
+            if ((pLine == NULL) || (sscanf(pLine, "%d", &ranges[i].nBytes) != 1) ||
+                (ranges[i].nBytes < 0) || (ranges[i].nBytes > ranges[i].length)) {
+                rc = FAILURE;
+            }
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len  = ranges[i].nBytes;
+            nTotal = nTotal + ranges[i].nBytes;
+
+            if ( pLine != NULL ) pLine = strchr(pLine, '\n');
+            if ( pLine != NULL ) pLine++;
+        }
+        if ((rc == FAILURE) || (nTotal != nData)) {
+            errno = EPROTO;  // 71 = Protocol error
+            rc = FAILURE;
+        }
+    }
+
+    //
+    // Each range's data goes straight into its buffer
+    //
+    if ( rc != FAILURE ) {
+        if ( readvFully(sockfd, iov, count, nData) != nData ) {
+            errno = ECONNRESET;  // 104 = Connection reset by peer
+            rc = FAILURE;
+        }
+        else {
+            rc = nData;
+        }
+    }
+
+    close(sockfd);  // Don't need this socket anymore
+    free( frame );
+    free( iov );
+    traceSpan( "netreadranges", spanStart, traceNow() );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// Send a command that takes a netfd and one number, such
+// as netadvise, and wait for its result.  The command
+// format is:
+//
+//     netCmd,netFd,arg,0
+//
+// and the response is:
+//
+//     result,errno,h_errno,value
+//
+// where "value" is the netfd, or what the command returns,
+// and is passed back in "value" if that is not NULL.  A
+// transaction command sends its id as "arg", with no netFd.
+//
+/////////////////////////////////////////////////////////////
+
+int fdCommand( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc, const int netfd, const long arg,
+               long *value )
+{
+    NET_SERVER server;
+    int sockfd = -1;
+    int rc     = 0;
+    long result = 0;
+    char msg[MSG_SIZE] = "";
+
+
+    if ( isNetServerInitialized( ctx, netFunc, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+
+    sockfd = getSockfd( ctx, server.hostname, server.port );
+    if ( sockfd < 0 ) {
+        errno = 0;
+        h_errno = HOST_NOT_FOUND;
+        return FAILURE;
+    }
+
+    bzero(msg, MSG_SIZE);
+    sprintf(msg, "%d,%d,%ld,0", netFunc, netfd, arg);
+
+    traceTagMessage(msg, MSG_SIZE);
+    rc = write(sockfd, msg, strlen(msg));
+    if ( rc < 0 ) {
+        fprintf(stderr, "libnetfiles: failed to write cmd %d to server.  rc= %d\n", netFunc, rc);
+        close(sockfd);
+        return FAILURE;
+    }
+
+    bzero(msg, MSG_SIZE);
+    rc = read(sockfd, msg, MSG_SIZE -1);
+    close(sockfd);  // Don't need this socket anymore
+    if ( rc <= 0 ) {
+        errno = ECONNRESET;  // 104 = Connection reset by peer
+        return FAILURE;
+    }
+
+    sscanf(msg, "%d,%d,%d,%ld", &rc, &errno, &h_errno, &result);
+    if ( value != NULL ) *value = result;
+    return (rc == FAILURE) ? FAILURE : SUCCESS;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// A netfd is derived from its slot in the server's table,
+// so its hint is kept at the same slot.  Returns the slot,
+// or FAILURE if "netfd" can't be one.
+//
+/////////////////////////////////////////////////////////////
+
+int adviceSlot( const int netfd )
+{
+    int i = 0;
+
+    if ((netfd > -10) || (netfd % 10 != 0)) return FAILURE;
+
+    i = (-netfd / 10) - 1;
+    return (i < FD_TABLE_SIZE) ? i : FAILURE;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// The netadvise hint of "netfd" in "ctx", NET_ADVICE_NORMAL
+// if it has none
+//
+/////////////////////////////////////////////////////////////
+
+int getAdvice( netctx_t *ctx, const int netfd )
+{
+    int i = adviceSlot( netfd );
+    int advice = NET_ADVICE_NORMAL;
+
+    if ( i == FAILURE ) return NET_ADVICE_NORMAL;
+
+    pthread_mutex_lock( &ctx->lock );
+    advice = ctx->advice[i];
+    pthread_mutex_unlock( &ctx->lock );
+    return advice;
+}
+
+
+void setAdvice( netctx_t *ctx, const int netfd, const int advice )
+{
+    int i = adviceSlot( netfd );
+
+    if ( i == FAILURE ) return;
+
+    pthread_mutex_lock( &ctx->lock );
+    ctx->advice[i] = advice;
+    pthread_mutex_unlock( &ctx->lock );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netadvise needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EBADF        =  9, Bad file descriptor
+           EINVAL       = 22, Invalid argument
+
+******************************************************/
+
+int netctx_advise(netctx_t *ctx, int netfd, int advice)
+{
+    int rc = 0;
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if (((advice & NET_ADVICE_MASK) > NET_ADVICE_WILLNEED) ||
+        ((advice & ~(NET_ADVICE_MASK | NET_ADVICE_DIRECT)) != 0)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    //
+    // The server checks the hint and starts any read ahead;
+    // it is kept here and sent with each transfer of "netfd"
+    //
+    rc = fdCommand( ctx, NET_ADVISE, netfd, advice, NULL );
+    if ( rc == SUCCESS ) setAdvice( ctx, netfd, advice );
+    traceSpan( "netadvise", spanStart, traceNow() );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netdurability needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EBADF        =  9, Bad file descriptor
+           EINVAL       = 22, Invalid argument
+
+******************************************************/
+
+int netctx_durability(netctx_t *ctx, int netfd, int mode)
+{
+    int rc = 0;
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((mode < NET_DURABLE_NONE) || (mode > NET_DURABLE_WRITE)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    rc = fdCommand( ctx, NET_DURABILITY, netfd, mode, NULL );
+    traceSpan( "netdurability", spanStart, traceNow() );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netfsync needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EIO          =  5, I/O error, or any other
+                              error of the server's fdatasync
+           EBADF        =  9, Bad file descriptor
+
+******************************************************/
+
+int netctx_fsync(netctx_t *ctx, int netfd)
+{
+    int rc = 0;
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    rc = fdCommand( ctx, NET_FSYNC, netfd, 0, NULL );
+    traceSpan( "netfsync", spanStart, traceNow() );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  nettx_begin needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           ENFILE       = 23, too many transactions open
+                              on the server
+           EINPROGRESS  = 115, the context already has a
+                               transaction open
+
+******************************************************/
+
+//
+// The transaction belongs to the context, so the netwrites
+// of every thread using the context are staged in it
+//
+int netctx_tx_begin(netctx_t *ctx)
+{
+    NET_SERVER server;
+    long txId = 0;
+    int rc = 0;
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ((isNetServerInitialized( ctx, NET_TX_BEGIN, &server ) == TRUE) && (server.txId != 0)) {
+        errno = EINPROGRESS;  // 115 = Operation now in progress
+        return FAILURE;
+    }
+
+    rc = fdCommand( ctx, NET_TX_BEGIN, 0, 0, &txId );
+    if ( rc == SUCCESS ) {
+        pthread_mutex_lock( &ctx->lock );
+        if ( ctx->server.txId == 0 ) ctx->server.txId = txId;
+        else rc = FAILURE;   // another thread got in first
+        pthread_mutex_unlock( &ctx->lock );
+
+        if ( rc == FAILURE ) {
+            fdCommand( ctx, NET_TX_ABORT, 0, txId, NULL );
+            errno = EINPROGRESS;  // 115 = Operation now in progress
+        }
+    }
+
+    traceSpan( "nettx_begin", spanStart, traceNow() );
+    return rc;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  nettx_commit and nettx_abort need to handle these
+  error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EIO          =  5, I/O error, or any other
+                              error of the server's
+                              fdatasync or rename.  After
+                              a rename error the
+                              transaction stays open
+           EBUSY        = 16, another thread of the context
+                              is committing the transaction
+           EINVAL       = 22, no transaction is open
+
+******************************************************/
+
+//
+// End the context's transaction with "netFunc", NET_TX_COMMIT
+// or NET_TX_ABORT.  Either way the context no longer has a
+// transaction afterwards, unless a commit stopped part way:
+// the server then keeps the transaction, and answers with
+// its id, for the commit to be tried again.
+//
+int txEnd( netctx_t *ctx, const NET_FUNCTION_TYPE netFunc )
+{
+    NET_SERVER server;
+    long kept = 0;
+    int rc = 0;
+
+    errno = 0;
+    h_errno = 0;
+    traceBegin();
+    uint64_t spanStart = traceNow();
+
+    if ( isNetServerInitialized( ctx, netFunc, &server ) != TRUE ) {
+        errno = EPERM;  // 1 = Operation not permitted
+        return FAILURE;
+    }
+    if ( server.txId == 0 ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    rc = fdCommand( ctx, netFunc, 0, server.txId, &kept );
+
+    pthread_mutex_lock( &ctx->lock );
+    if ((ctx->server.txId == server.txId) && ((rc == SUCCESS) || (kept != server.txId))) {
+        ctx->server.txId = 0;
+    }
+    pthread_mutex_unlock( &ctx->lock );
+
+    traceSpan( (netFunc == NET_TX_COMMIT) ? "nettx_commit" : "nettx_abort", spanStart, traceNow() );
+    return rc;
+}
+
+
+int netctx_tx_commit(netctx_t *ctx)
+{
+    return txEnd( ctx, NET_TX_COMMIT );
+}
+
+
+int netctx_tx_abort(netctx_t *ctx)
+{
+    return txEnd( ctx, NET_TX_ABORT );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netwrite_from_fd needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EIO          =  5, I/O error (local file too short)
+           EBADF        =  9, Bad file descriptor
+           EINVAL       = 22, Invalid argument
+           EFBIG        = 27, File too large
+           plus any errno of netwrite
+
+******************************************************/
+
+ssize_t netctx_write_from_fd(netctx_t *ctx, int netfd, int localfd, off_t offset, size_t nbyte)
+{
+    errno = 0;
+    if ((localfd < 0) || (offset < 0)) {
+        errno = (localfd < 0) ? EBADF : EINVAL;
+        return FAILURE;
+    }
+
+    //
+    // netwrite replaces the whole file in one request, and
+    // its sizes are ints, so the file can't be sent in pieces
+    //
+    if ( nbyte > INT_MAX ) {
+        errno = EFBIG;  // 27 = File too large
+        return FAILURE;
+    }
+
+    return netwriteFrom( ctx, netfd, NULL, localfd, offset, nbyte );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netread_to_fd needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EIO          =  5, I/O error (writing the local file)
+           EBADF        =  9, Bad file descriptor
+           EINVAL       = 22, Invalid argument
+           plus any errno of netread
+
+******************************************************/
+
+ssize_t netctx_read_to_fd(netctx_t *ctx, int netfd, int localfd, off_t offset, size_t nbyte)
+{
+    errno = 0;
+    if ((localfd < 0) || (offset < 0)) {
+        errno = (localfd < 0) ? EBADF : EINVAL;
+        return FAILURE;
+    }
+
+    // Like any read, a large one may come back short
+    if ( nbyte > INT_MAX ) nbyte = INT_MAX;
+
+    return netreadTo( ctx, netfd, NULL, localfd, offset, nbyte );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// The legacy calls.  Each runs on the default context that
+// netserverinit set up.
+//
+/////////////////////////////////////////////////////////////
+
+int netopen(const char *pathname, int flags)
+{
+    return netctx_open( &gDefaultCtx, pathname, flags );
+}
+
+
+ssize_t netread(int fildes, void *buf, size_t nbyte)
+{
+    return netctx_read( &gDefaultCtx, fildes, buf, nbyte );
+}
+
+
+ssize_t netwrite(int fildes, const void *buf, size_t nbyte)
+{
+    return netctx_write( &gDefaultCtx, fildes, buf, nbyte );
+}
+
+
+int netclose(int fd)
+{
+    return netctx_close( &gDefaultCtx, fd );
+}
+
+
+ssize_t netstats(char *buf, size_t nbyte)
+{
+    return netctx_stats( &gDefaultCtx, buf, nbyte );
+}
+
+
+ssize_t netreadv(int fildes, const struct iovec *iov, int iovcnt)
+{
+    return netctx_readv( &gDefaultCtx, fildes, iov, iovcnt );
+}
+
+
+ssize_t netwritev(int fildes, const struct iovec *iov, int iovcnt)
+{
+    return netctx_writev( &gDefaultCtx, fildes, iov, iovcnt );
+}
+
+
+ssize_t netreadranges(int fildes, NET_RANGE_TYPE *ranges, int count, void **bufs)
+{
+    return netctx_readranges( &gDefaultCtx, fildes, ranges, count, bufs );
+}
+
+
+ssize_t netget(const char *pathname, void *buf, size_t nbyte)
+{
+    return netctx_get( &gDefaultCtx, pathname, buf, nbyte );
+}
+
+
+ssize_t netput(const char *pathname, const void *buf, size_t nbyte)
+{
+    return netctx_put( &gDefaultCtx, pathname, buf, nbyte );
+}
+
+
+ssize_t netcopy(const char *src, const char *dst, off_t offset, size_t nbyte)
+{
+    return netctx_copy( &gDefaultCtx, src, dst, offset, nbyte );
+}
+
+
+int netopen_batch(const char **pathnames, const int *flags, int count, int *fds, int *errnos)
+{
+    return netctx_open_batch( &gDefaultCtx, pathnames, flags, count, fds, errnos );
+}
+
+
+int netstat_batch(const char **pathnames, int count, NET_STAT_TYPE *stats)
+{
+    return netctx_stat_batch( &gDefaultCtx, pathnames, count, stats );
+}
+
+
+int netclose_batch(const int *fds, int count, int *errnos)
+{
+    return netctx_close_batch( &gDefaultCtx, fds, count, errnos );
+}
+
+
+ssize_t netwrite_from_fd(int fildes, int localfd, off_t offset, size_t nbyte)
+{
+    return netctx_write_from_fd( &gDefaultCtx, fildes, localfd, offset, nbyte );
+}
+
+
+ssize_t netread_to_fd(int fildes, int localfd, off_t offset, size_t nbyte)
+{
+    return netctx_read_to_fd( &gDefaultCtx, fildes, localfd, offset, nbyte );
+}
+
+
+int netadvise(int fildes, int advice)
+{
+    return netctx_advise( &gDefaultCtx, fildes, advice );
+}
+
+
+int netdurability(int fildes, int mode)
+{
+    return netctx_durability( &gDefaultCtx, fildes, mode );
+}
+
+
+int netfsync(int fildes)
+{
+    return netctx_fsync( &gDefaultCtx, fildes );
+}
+
+
+int nettx_begin(void)
+{
+    return netctx_tx_begin( &gDefaultCtx );
+}
+
+
+int nettx_commit(void)
+{
+    return netctx_tx_commit( &gDefaultCtx );
+}
+
+
+int nettx_abort(void)
+{
+    return netctx_tx_abort( &gDefaultCtx );
+}
+
+
+ssize_t netread_stream(int fildes, NET_STREAM_CALLBACK callback, void *userData)
+{
+    return netctx_read_stream( &gDefaultCtx, fildes, NET_STREAM_CHUNK_SIZE, NET_STREAM_DEPTH,
+                               callback, userData );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+unsigned long long nettrace_last()
+{
+    return (unsigned long long)traceCurrent();
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  nettrace_export needs to handle these error codes
+
+       Implemented:
+           EINVAL = 22, Invalid argument
+           plus any errno set by fopen
+
+******************************************************/
+
+int nettrace_export(const char *path, unsigned long long traceId)
+{
+    FILE *fp = NULL;
+    int nSpans = 0;
+
+    errno = 0;
+    h_errno = 0;
+
+    if ( path == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    fp = fopen(path, "w");
+    if ( fp == NULL ) return FAILURE;
+
+    nSpans = traceWriteJson( fp, (uint64_t)traceId );
+    if ( fclose(fp) != 0 ) return FAILURE;
+
+    return nSpans;
 }
 
 /////////////////////////////////////////////////////////////
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include "libnetfiles.h"
+#include "netadmin.h"
+#include "nettrace.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void *adminThread( void *sfd );
+static void  lowerPriority();
+static void  serveRequest( const int sockfd, char *body );
+static void  serveTrace( const int sockfd, const char *query );
+static void  sendResponse( const int sockfd, const char *status,
+                           const char *contentType, const char *body, const int nBytes );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Start the admin endpoint on the given port.  Returns
+// SUCCESS once the port is bound and the thread started.
+//
+/////////////////////////////////////////////////////////////
+
+int adminStart( const int port )
+{
+    int sockfd  = -1;
+    int sockOpt = 1;
+    pthread_t tid;
+    struct sockaddr_in serv_addr;
+
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        fprintf(stderr,"netfileserver: admin socket() failed, errno= %d\n", errno);
+        return FAILURE;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
+
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+    if ((bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) ||
+        (listen(sockfd, 16) < 0))
+    {
+        fprintf(stderr,"netfileserver: admin port %d not available, errno= %d\n", port, errno);
+        close(sockfd);
+        return FAILURE;
+    }
+
+    int *pSockfd = malloc(sizeof(int));
+    *pSockfd = sockfd;
+    if ( pthread_create(&tid, NULL, &adminThread, pSockfd) != 0 ) {
+        free(pSockfd);
+        close(sockfd);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Move the calling thread out of the way of the data path.
+// SCHED_IDLE only runs when nothing else wants the CPU.  If
+// the kernel refuses it, fall back to the lowest nice value
+// for this thread.
+//
+/////////////////////////////////////////////////////////////
+
+static void lowerPriority()
+{
+    struct sched_param param;
+
+    bzero(&param, sizeof(param));
+    if ( pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0 ) {
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Requests are served one at a time.  Scrapes are small and
+// infrequent, and a single thread keeps the admin endpoint
+// from ever using more than one (idle) CPU.
+//
+/////////////////////////////////////////////////////////////
+
+static void *adminThread( void *sfd )
+{
+    const int sockfd = *((int *)sfd);
+    int newsockfd = -1;
+    struct timeval timeout = { ADMIN_IO_TIMEOUT, 0 };
+    char *body = malloc(ADMIN_RESPONSE_SIZE);
+
+    free(sfd);
+    pthread_detach( pthread_self() );
+    lowerPriority();
+
+    while ( body != NULL ) {
+        newsockfd = accept(sockfd, NULL, NULL);
+        if ( newsockfd < 0 ) {
+            if ( errno == EINTR ) continue;
+            fprintf(stderr,"netfileserver: admin accept() failed, errno= %d\n", errno);
+            break;
+        }
+
+        // One thread serves every admin client, so a client
+        // that connects and never sends or reads can't hold
+        // it for longer than the timeout.
+        setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(newsockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        serveRequest( newsockfd, body );
+        close(newsockfd);
+    }
+
+    if ( body != NULL ) free(body);
+    close(sockfd);
+    pthread_exit( NULL );
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void serveRequest( const int sockfd, char *body )
+{
+    char request[ADMIN_REQUEST_SIZE] = "";
+    char method[16] = "";
+    char path[256]  = "";
+    int  rc = 0;
+    int  nBytes = 0;
+
+
+    //
+    // Only the request line matters.  It always arrives in the
+    // first segment for the small GET requests scrapers send.
+    //
+    rc = read(sockfd, request, ADMIN_REQUEST_SIZE - 1);
+    if ( rc <= 0 ) return;
+    request[rc] = '\0';
+
+    if ( sscanf(request, "%15s %255s", method, path) != 2 ) {
+        sendResponse(sockfd, "400 Bad Request", "text/plain", "bad request\n", 12);
+        return;
+    }
+
+    if ( strcmp(method, "GET") != 0 ) {
+        sendResponse(sockfd, "405 Method Not Allowed", "text/plain", "GET only\n", 9);
+        return;
+    }
+
+    // Split off any query string
+    char *query = strchr(path, '?');
+    if ( query != NULL ) *query++ = '\0';
+
+    if ( strcmp(path, "/metrics") == 0 ) {
+        nBytes = formatPrometheus( body, ADMIN_RESPONSE_SIZE );
+        sendResponse(sockfd, "200 OK", "text/plain; version=0.0.4", body, nBytes);
+    }
+    else if ( strcmp(path, "/fdtable") == 0 ) {
+        nBytes = formatFDtableJson( body, ADMIN_RESPONSE_SIZE );
+        sendResponse(sockfd, "200 OK", "application/json", body, nBytes);
+    }
+    else if ( strcmp(path, "/transfers") == 0 ) {
+        nBytes = formatTransfersJson( body, ADMIN_RESPONSE_SIZE );
+        sendResponse(sockfd, "200 OK", "application/json", body, nBytes);
+    }
+    else if ( strcmp(path, "/trace") == 0 ) {
+        serveTrace( sockfd, query );
+    }
+    else {
+        sendResponse(sockfd, "404 Not Found", "text/plain", "not found\n", 10);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// GET /trace returns the span rings as Chrome trace-event
+// JSON.  "?id=<hex>" limits it to a single trace.  The
+// rings can hold far more than ADMIN_RESPONSE_SIZE, so the
+// document is built in a growing memory stream instead.
+//
+/////////////////////////////////////////////////////////////
+
+static void serveTrace( const int sockfd, const char *query )
+{
+    unsigned long long traceId = 0;
+    char  *json = NULL;
+    size_t nBytes = 0;
+    FILE  *fp = NULL;
+
+    if ( query != NULL ) {
+        const char *id = strstr(query, "id=");
+        if ( id != NULL ) traceId = strtoull(id + 3, NULL, 16);
+    }
+
+    fp = open_memstream(&json, &nBytes);
+    if ( fp == NULL ) {
+        sendResponse(sockfd, "500 Internal Server Error", "text/plain", "no memory\n", 10);
+        return;
+    }
+    traceWriteJson( fp, (uint64_t)traceId );
+    fclose(fp);
+
+    sendResponse(sockfd, "200 OK", "application/json", json, (int)nBytes);
+    free(json);
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void sendResponse( const int sockfd, const char *status,
+                          const char *contentType, const char *body, const int nBytes )
+{
+    char header[256] = "";
+    int  nSent = 0;
+    int  rc = 0;
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %d\r\n"
+             "Connection: close\r\n"
+             "\r\n", status, contentType, nBytes);
+
+    if ( write(sockfd, header, strlen(header)) < 0 ) return;
+
+    while ( nSent < nBytes ) {
+        rc = write(sockfd, body + nSent, nBytes - nSent);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return;
+        }
+        nSent = nSent + rc;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write "s" as a quoted JSON string.  Returns the number of
+// characters written, not counting the NUL.
+//
+/////////////////////////////////////////////////////////////
+
+int adminJsonString( char *buf, const size_t len, const char *s )
+{
+    size_t n = 0;
+
+    if ( len < 3 ) return 0;
+
+    buf[n++] = '"';
+    for ( ; (*s != '\0') && (n + 7 < len); s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if ((c == '"') || (c == '\\')) {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        }
+        else if ( c < 0x20 ) {
+            n += snprintf(buf + n, len - n, "\\u%04x", c);
+        }
+        else {
+            buf[n++] = c;
+        }
+    }
+    buf[n++] = '"';
+    buf[n] = '\0';
+
+    return (int)n;
+}
+
+/////////////////////////////////////////////////////////////
+
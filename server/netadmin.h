@@ -0,0 +1,73 @@
+#ifndef 	_NETADMIN_H_
+#define    	_NETADMIN_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "netadmin.h" file declares the optional admin HTTP
+// endpoint of the net file server.  It runs on its own port
+// in a single low priority thread and serves:
+//
+//     GET /metrics     Prometheus text format
+//     GET /fdtable     JSON snapshot of the fd table
+//     GET /transfers   JSON snapshot of active transfers
+//     GET /trace       Chrome trace-event JSON of recent
+//                      request spans, "?id=<hex>" for one
+//
+/////////////////////////////////////////////////////////////
+
+
+#include <stddef.h>
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Constant and type definitions
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// Largest response body the admin endpoint will produce
+//
+#define ADMIN_RESPONSE_SIZE   (256 * 1024)
+
+
+//
+// Largest HTTP request accepted.  Only the request line
+// is looked at, the rest is read and discarded.
+//
+#define ADMIN_REQUEST_SIZE    2048
+
+
+//
+// Seconds an admin client has to send its request, and
+// to take each part of the response
+//
+#define ADMIN_IO_TIMEOUT      5
+
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+int  adminStart( const int port );
+int  adminJsonString( char *buf, const size_t len, const char *s );
+
+
+//
+// Provided by netfileserver.c, which owns the fd table
+// and the active transfer list.
+//
+int  formatFDtableJson( char *buf, const size_t len );
+int  formatTransfersJson( char *buf, const size_t len );
+int  formatPrometheus( char *buf, const size_t len );
+
+
+
+#endif    // _NETADMIN_H_
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Asynchronous netopen, netread and netwrite.
+//
+// A request is queued and its handle returned at once.  A
+// pool of NET_ASYNC_WORKERS threads, started on first use,
+// takes requests off the queue and runs the blocking call.
+// The result goes on the completion queue.  While the queue
+// is not empty the eventfd returned by netasync_fd is
+// readable, so the caller can add it to its own poll, select
+// or epoll loop and call netasync_poll when it fires.
+//
+// The completion queue and the eventfd change together under
+// one lock: a completion adds to the eventfd counter, and
+// the poll that empties the queue also clears the counter.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct ASYNC_REQUEST {
+    struct ASYNC_REQUEST *next;
+    NET_COMPLETION_TYPE done;     // handle, op and user data set at submit
+    char pathname[256];           // for NET_OPEN
+    int flags;                    // for NET_OPEN
+    int netfd;                    // for NET_READ and NET_WRITE
+    void *buf;
+    size_t nbyte;
+} ASYNC_REQUEST_TYPE;
+
+
+typedef struct {
+    ASYNC_REQUEST_TYPE *head;
+    ASYNC_REQUEST_TYPE *tail;
+    int count;
+} ASYNC_QUEUE_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void  asyncOnce();
+static void *asyncWorker( void *arg );
+static long  asyncSubmit( ASYNC_REQUEST_TYPE *req );
+static void  asyncPush( ASYNC_QUEUE_TYPE *queue, ASYNC_REQUEST_TYPE *req );
+static ASYNC_REQUEST_TYPE *asyncPop( ASYNC_QUEUE_TYPE *queue );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static pthread_once_t   gAsyncOnce = PTHREAD_ONCE_INIT;
+static int              gAsyncReady = FALSE;
+static _Atomic long     gAsyncSeq = 0;
+
+// Requests waiting for a worker
+static ASYNC_QUEUE_TYPE gPending;
+static pthread_mutex_t  gPendingLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gPendingCond = PTHREAD_COND_INITIALIZER;
+
+// Finished requests waiting for netasync_poll
+static ASYNC_QUEUE_TYPE gDone;
+static pthread_mutex_t  gDoneLock = PTHREAD_MUTEX_INITIALIZER;
+static int              gDoneEventFd = -1;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Create the eventfd and start the worker pool.  If that
+// fails, every submit fails with EAGAIN.
+//
+/////////////////////////////////////////////////////////////
+
+static void asyncOnce()
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i = 0;
+
+    gDoneEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( gDoneEventFd < 0 ) {
+        fprintf(stderr, "netasync: eventfd() failed, errno= %d\n", errno);
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i=0; i < NET_ASYNC_WORKERS; i++) {
+        if ( pthread_create(&tid, &attr, &asyncWorker, NULL) != 0 ) break;
+    }
+    pthread_attr_destroy(&attr);
+
+    if ( i == 0 ) {
+        fprintf(stderr, "netasync: cannot start worker threads, errno= %d\n", errno);
+        return;
+    }
+    gAsyncReady = TRUE;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void asyncPush( ASYNC_QUEUE_TYPE *queue, ASYNC_REQUEST_TYPE *req )
+{
+    req->next = NULL;
+    if ( queue->tail == NULL ) queue->head = req;
+    else queue->tail->next = req;
+    queue->tail = req;
+    queue->count++;
+}
+
+
+static ASYNC_REQUEST_TYPE *asyncPop( ASYNC_QUEUE_TYPE *queue )
+{
+    ASYNC_REQUEST_TYPE *req = queue->head;
+
+    if ( req != NULL ) {
+        queue->head = req->next;
+        if ( queue->head == NULL ) queue->tail = NULL;
+        queue->count--;
+    }
+    return req;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// A worker runs one blocking call at a time.  errno is per
+// thread, so each call's errno is picked up right after it
+// returns.
+//
+/////////////////////////////////////////////////////////////
+
+static void *asyncWorker( void *arg )
+{
+    ASYNC_REQUEST_TYPE *req = NULL;
+    uint64_t one = 1;
+
+    while ( TRUE ) {
+        pthread_mutex_lock( &gPendingLock );
+        while ( gPending.head == NULL ) {
+            pthread_cond_wait( &gPendingCond, &gPendingLock );
+        }
+        req = asyncPop( &gPending );
+        pthread_mutex_unlock( &gPendingLock );
+
+        switch (req->done.op) {
+            case NET_OPEN:
+                req->done.result = netopen(req->pathname, req->flags);
+                break;
+
+            case NET_READ:
+                req->done.result = netread(req->netfd, req->buf, req->nbyte);
+                break;
+
+            case NET_WRITE:
+                req->done.result = netwrite(req->netfd, req->buf, req->nbyte);
+                break;
+
+            default:
+                errno = EINVAL;
+                req->done.result = FAILURE;
+                break;
+        }
+        req->done.error = (req->done.result == FAILURE) ? errno : 0;
+
+        pthread_mutex_lock( &gDoneLock );
+        asyncPush( &gDone, req );
+        if ( write(gDoneEventFd, &one, sizeof(one)) < 0 ) {
+            fprintf(stderr, "netasync: eventfd write failed, errno= %d\n", errno);
+        }
+        pthread_mutex_unlock( &gDoneLock );
+    }
+
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Queue a request for the workers and return its handle
+//
+/////////////////////////////////////////////////////////////
+
+static long asyncSubmit( ASYNC_REQUEST_TYPE *req )
+{
+    pthread_once( &gAsyncOnce, asyncOnce );
+    if ( gAsyncReady != TRUE ) {
+        free( req );
+        errno = EAGAIN;  // 11 = Resource temporarily unavailable
+        return FAILURE;
+    }
+
+    req->done.requestId = atomic_fetch_add(&gAsyncSeq, 1) + 1;
+
+    pthread_mutex_lock( &gPendingLock );
+    asyncPush( &gPending, req );
+    pthread_cond_signal( &gPendingCond );
+    pthread_mutex_unlock( &gPendingLock );
+
+    return req->done.requestId;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netopen_async needs to handle these error codes
+
+       Implemented:
+           EAGAIN       = 11, Resource temporarily unavailable
+           ENOMEM       = 12, Out of memory
+           EINVAL       = 22, Invalid argument
+           ENAMETOOLONG = 36, File name too long
+
+       Errors of the open itself come back in the
+       completion, as for netopen.
+
+******************************************************/
+
+long netopen_async(const char *pathname, int flags, void *userData)
+{
+    ASYNC_REQUEST_TYPE *req = NULL;
+
+    errno = 0;
+    if ( pathname == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+    if ( strlen(pathname) >= sizeof(req->pathname) ) {
+        errno = ENAMETOOLONG;  // 36 = File name too long
+        return FAILURE;
+    }
+
+    req = calloc( 1, sizeof(ASYNC_REQUEST_TYPE) );
+    if ( req == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    req->done.op = NET_OPEN;
+    req->done.userData = userData;
+    strcpy(req->pathname, pathname);
+    req->flags = flags;
+
+    return asyncSubmit( req );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netread_async needs to handle these error codes
+
+       Implemented:
+           EAGAIN       = 11, Resource temporarily unavailable
+           ENOMEM       = 12, Out of memory
+           EINVAL       = 22, Invalid argument
+
+       Errors of the read itself come back in the
+       completion, as for netread.
+
+******************************************************/
+
+long netread_async(int fildes, void *buf, size_t nbyte, void *userData)
+{
+    ASYNC_REQUEST_TYPE *req = NULL;
+
+    errno = 0;
+    if ( buf == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    req = calloc( 1, sizeof(ASYNC_REQUEST_TYPE) );
+    if ( req == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    req->done.op = NET_READ;
+    req->done.userData = userData;
+    req->netfd = fildes;
+    req->buf = buf;
+    req->nbyte = nbyte;
+
+    return asyncSubmit( req );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netwrite_async needs to handle these error codes
+
+       Implemented:
+           EAGAIN       = 11, Resource temporarily unavailable
+           ENOMEM       = 12, Out of memory
+           EINVAL       = 22, Invalid argument
+
+       Errors of the write itself come back in the
+       completion, as for netwrite.
+
+******************************************************/
+
+long netwrite_async(int fildes, const void *buf, size_t nbyte, void *userData)
+{
+    ASYNC_REQUEST_TYPE *req = NULL;
+
+    errno = 0;
+    if ( buf == NULL ) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    req = calloc( 1, sizeof(ASYNC_REQUEST_TYPE) );
+    if ( req == NULL ) {
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+
+    req->done.op = NET_WRITE;
+    req->done.userData = userData;
+    req->netfd = fildes;
+    req->buf = (void *)buf;
+    req->nbyte = nbyte;
+
+    return asyncSubmit( req );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+int netasync_fd()
+{
+    pthread_once( &gAsyncOnce, asyncOnce );
+    if ( gAsyncReady != TRUE ) {
+        errno = EAGAIN;  // 11 = Resource temporarily unavailable
+        return FAILURE;
+    }
+    return gDoneEventFd;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netasync_poll needs to handle these error codes
+
+       Implemented:
+           EAGAIN       = 11, Resource temporarily unavailable
+           EINVAL       = 22, Invalid argument
+           plus any errno set by poll
+
+******************************************************/
+
+int netasync_poll(NET_COMPLETION_TYPE *completions, int max, int timeoutMs)
+{
+    ASYNC_REQUEST_TYPE *req = NULL;
+    struct pollfd pfd;
+    uint64_t counter = 0;
+    int n = 0;
+
+    errno = 0;
+    if ((completions == NULL) || (max <= 0)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    pthread_once( &gAsyncOnce, asyncOnce );
+    if ( gAsyncReady != TRUE ) {
+        errno = EAGAIN;  // 11 = Resource temporarily unavailable
+        return FAILURE;
+    }
+
+    //
+    // Wait for the eventfd unless told not to.  A signal or a
+    // timeout returns no completions.
+    //
+    if ( timeoutMs != 0 ) {
+        pfd.fd = gDoneEventFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if ( poll(&pfd, 1, timeoutMs) < 0 ) {
+            return (errno == EINTR) ? 0 : FAILURE;
+        }
+    }
+
+    pthread_mutex_lock( &gDoneLock );
+    while ((n < max) && ((req = asyncPop( &gDone )) != NULL)) {
+        completions[n++] = req->done;
+        free( req );
+    }
+    if ( gDone.head == NULL ) {
+        // Nothing left, so the eventfd goes quiet
+        if ( read(gDoneEventFd, &counter, sizeof(counter)) < 0 ) counter = 0;
+    }
+    pthread_mutex_unlock( &gDoneLock );
+
+    return n;
+}
@@ -9,9 +9,21 @@
 #include <pthread.h>
 #include <fcntl.h>
 
+#include <getopt.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <limits.h>
+
 #include <sys/stat.h>
+#include <sys/random.h>
 
 #include "libnetfiles.h"
+#include "netstats.h"
+#include "netadmin.h"
+#include "nettrace.h"
+#include "netpool.h"
+#include "netsync.h"
+#include "netjournal.h"
 
 
 /////////////////////////////////////////////////////////////
@@ -21,13 +33,113 @@
 /////////////////////////////////////////////////////////////
 
 
+//
+// A file written in transaction mode is built up under its
+// name with this added, and renamed over the file on commit
+//
+#define VERSION_EXT     ".txn"
+
+//
+// Open transactions the server keeps track of.  A file a
+// transaction writes is staged under its name with TX_EXT
+// and the transaction number added.
+//
+#define TX_TABLE_SIZE   64
+#define TX_EXT          ".tx"
+#define TX_LEASE_NS     (300 * 1000000000ULL)
+
+//
+// Before its renames, a commit writes down the files it is
+// about to rename, in a record in TX_RECORD_DIR ("-t") named
+// after the control port and the transaction.  A server that
+// stops part way through the renames finishes them on startup.
+//
+#define TX_RECORD_DIR   "/var/tmp/netfileserver"
+
+//
+// Bytes copied at a time where copy_file_range can't be used,
+// and by a netcopy between progress updates
+//
+#define COPY_CHUNK_SIZE    (1024 * 1024)
+#define COPY_PROGRESS_SIZE (64 * 1024 * 1024)
+
+//
+// Number of pathname hash chains in the fd table
+//
+#define FD_HASH_SIZE     1024
+
+//
+// Most worker threads used for one batched request.  Each
+// entry of a batch is one line, at most a pathname and its
+// flags, of no more than BATCH_LINE_MAX bytes.
+//
+#define BATCH_WORKERS    8
+#define BATCH_LINE_MAX   (MSG_SIZE + 16)
+
+//
+// Ranges of a netreadranges at most this far apart are read
+// together, reading the gap between them into scratch space.
+// Each range comes as an "offset,length" line of at most
+// RANGE_LINE_MAX bytes.
+//
+#define RANGE_GAP_MAX    4096
+#define RANGE_LINE_MAX   48
+
+//
+// An inline netwrite refused as too large has its data read
+// and dropped, so the client sees the refusal, up to this
+// much.  Past that the connection is closed on the client.
+//
+#define INLINE_DRAIN_MAX  (2 * INLINE_DATA_SIZE)
+
+//
+// Data port parts are moved between the socket and the disk
+// in blocks of this size, so the memory a netread or
+// netwrite takes doesn't grow with the part
+//
+#define XFER_BLOCK_SIZE  65536
+
+//
+// A netread part of a file with NET_ADVICE_DIRECT is read
+// with O_DIRECT in blocks of DIRECT_BLOCK_SIZE, at offsets
+// and lengths that are multiples of DIRECT_ALIGN.  Pool
+// buffers this large are mapped, so they are page aligned.
+//
+#define DIRECT_BLOCK_SIZE  (1024 * 1024)
+#define DIRECT_ALIGN       4096
+
+
 typedef struct {
     int  fd;                      // File descriptor (must be negative)
     FILE_CONNECTION_MODE fcMode;  // File connection mode
     int fileOpenFlags;            // Open file flags
     char pathname[256];           // file path name
+    int bPrivate;                 // TRUE= held by one netget/netput, never shared
+    int hashNext;                 // next slot on the same pathname hash chain, -1= end
+    int durability;               // NET_DURABLE_* from netdurability
+    char dataPath[288];           // where the data is: pathname, a new version or a snapshot
+    int snapFd;                   // open snapshot of the committed version, -1= none
 } NET_FD_TYPE;
 
+//
+// An open transaction and the files it has staged so far.
+// A slot with an "id" of 0 is free.  The id is random, so
+// only the client that began the transaction can name it,
+// and a transaction left idle for TX_LEASE_NS is aborted.
+//
+typedef struct {
+    char pathname[256];           // file to be replaced on commit
+    char stagePath[288];          // where its new contents are staged
+} TX_FILE_TYPE;
+
+typedef struct {
+    long id;
+    int nFiles;
+    int bCommitting;              // TRUE from nettx_commit on: no more writes
+    uint64_t lastUsed;            // statsNow() of its last begin or write
+    TX_FILE_TYPE files[ NET_TX_MAX_FILES ];
+} NET_TX_TYPE;
+
 typedef struct {
     int sockfd;  // file transfer socket
     int port;    // port number
@@ -35,6 +147,95 @@ typedef struct {
     NET_FD_TYPE netFd;
 } FILE_TRANSFER_SOCKET_TYPE;
 
+//
+// An accepted control connection handed to a ProcessNetCmd
+// worker.  The accept time is used to measure queueing delay.
+//
+typedef struct {
+    int sockfd;
+    uint64_t acceptTime;
+} NET_REQUEST_TYPE;
+
+//
+// An active netread, netwrite or netcopy transfer.
+// Transfers are kept in a list so the admin endpoint can
+// report them.  "bytesDone" is updated by the listener
+// threads as each part completes, and by a netcopy as each
+// chunk is copied.
+//
+typedef struct NET_TRANSFER {
+    struct NET_TRANSFER *next;
+    int id;                       // transfer sequence number
+    NET_FUNCTION_TYPE netFunc;    // NET_READ, NET_WRITE or NET_COPY
+    int netfd;
+    char pathname[256];
+    long nBytes;                  // bytes requested
+    int parts;                    // data ports used
+    _Atomic long bytesDone;       // bytes moved so far
+    uint64_t startTime;
+} NET_TRANSFER_TYPE;
+
+//
+// What the admin endpoint copies out of an fd table entry
+// and a transfer, to format with the locks released.  No
+// more than ADMIN_TRANSFERS_MAX transfers fit in a response.
+//
+typedef struct {
+    int slot;
+    int fd;
+    FILE_CONNECTION_MODE fcMode;
+    int fileOpenFlags;
+    int durability;
+    int bSnapshot;
+    char pathname[256];
+} ADMIN_FD_TYPE;
+
+typedef struct {
+    int id;
+    NET_FUNCTION_TYPE netFunc;
+    int netfd;
+    long nBytes;
+    long bytesDone;
+    int parts;
+    uint64_t startTime;
+    char pathname[256];
+} ADMIN_TRANSFER_TYPE;
+
+#define ADMIN_TRANSFERS_MAX  (ADMIN_RESPONSE_SIZE / 128)
+
+//
+// Argument handed to each netreadListener/netwriteListener
+//
+typedef struct {
+    int sockfd;                   // listening socket for this part
+    NET_TRANSFER_TYPE *xfer;      // transfer this part belongs to
+} NET_LISTENER_TYPE;
+
+//
+// A batched open, stat or close.  Workers take entries by
+// advancing "next" and each writes only its own entries'
+// results, so the batch needs no lock.
+//
+typedef struct {
+    NET_FUNCTION_TYPE netFunc;
+    FILE_CONNECTION_MODE fcMode;  // for NET_OPEN_BATCH
+    int count;
+    char **args;                  // each entry's line of the request body
+    char (*results)[64];          // each entry's line of the response body
+    _Atomic int next;             // next entry to process
+    uint64_t traceId;
+} NET_BATCH_TYPE;
+
+//
+// One range of a netreadranges, clipped to the file size.
+// "dataPos" is where its data starts in the response.
+//
+typedef struct {
+    long offset;
+    int  nBytes;
+    int  dataPos;
+} READ_RANGE_TYPE;
+
 typedef struct QNode {
 	int file_descriptor;
 	struct QNode *next;
@@ -49,7 +250,14 @@ typedef struct QNode {
 void initialize();
 static void sig_handler( const int signo );
 static void SetupSignals();
+void *statsSignalThread( void *arg );
+int  countFDtable();
+void getStatsGauges( STATS_GAUGES_TYPE *gauges );
+int  readFully( const int sockfd, char *buf, const int nBytes );
+int  drainFully( const int sockfd, const long nBytes );
+int  writeFully( const int sockfd, const char *buf, const int nBytes );
 int getSockfd( const int port ); // create a socket binded to a port
+int bindPort( const int port );
 int findOpenPorts();
 
 //
@@ -75,18 +283,50 @@ int Do_netopen( NET_FD_TYPE *netFd );
 //
 // Functions for processing "netwrite"
 //
-int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portList );
+int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portList,
+                 NET_TRANSFER_TYPE *xfer );
 void *netwriteListener( void *sockfd );
-int savePartfile( int netfd, int seqNum, char *data, int nBytes);
-int reconstruct( const int netfd, const int parts);
+int recvPartfile( const int sockfd, const int netfd, const int seqNum, const int nBytes );
+void preallocate( const int fd, const long nBytes );
+int reconstruct( const int netfd, const long txId, const int parts, const int advice );
 
 
 //
 // Functions for processing "netread"
 //
-int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int *portCount, char *portList );
+int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int *portCount, char *portList,
+                NET_TRANSFER_TYPE *xfer );
 void *netreadListener( void *sockfd );
-char *readFile( const int netfd, const int iStartPos, const int iBytesWanted);
+char *readFile( const int netfd, const int iStartPos, const int iBytesWanted, const int advice );
+void adviseBefore( const int fd, const int advice, const off_t offset, const off_t len );
+void adviseAfter( const int fd, const int advice, const off_t offset, const off_t len );
+void dropWritten( FILE *fp, const int advice );
+int  sendFilePart( const int sockfd, const int netfd, const int iStartPos, const int nBytes,
+                   const int bSparse, const int advice );
+int  mapExtents( const int fd, const long start, const int nCovered, int *extOff, int *extLen );
+
+
+//
+// Functions for processing batched "netopen", "netstat" and "netclose"
+//
+int  Do_batch( const int sockfd, const NET_FUNCTION_TYPE netFunc, char *msg, const int nHeaderLeft );
+void *batchWorker( void *arg );
+void batchEntry( NET_BATCH_TYPE *batch, const int index );
+
+
+//
+// Functions for processing "netreadranges"
+//
+int  Do_readRanges( const int sockfd, char *msg, const int nHeaderLeft );
+int  compareRanges( const void *a, const void *b );
+
+
+//
+// Functions for processing inline "netread" and "netwrite"
+//
+int writeFile( const int netfd, const long txId, const char *data, const int nBytes, const int advice );
+int writeTarget( const int netfd, const long txId, NET_FD_TYPE *fileInfo );
+long Do_netcopy( const int srcNetfd, const int dstNetfd, const long offset, const long nBytes );
 
 
 //
@@ -95,9 +335,48 @@ char *readFile( const int netfd, const int iStartPos, const int iBytesWanted);
 int matchFD( NET_FD_TYPE *netFd );
 int createFD( NET_FD_TYPE *netFd );
 int deleteFD( int fd );
+int setAdvice( const int netfd, const int advice );
+int setDurability( const int netfd, const int mode );
+int closeFD( const int netfd );
 int tableFull();
+unsigned int hashPathname( const char *pathname );
 NET_FD_TYPE *LookupFDtable( const int netfd );
-void printFDtable();
+int copyFDentry( const int netfd, NET_FD_TYPE *entry );
+int openFDdata( const int netfd, const int flags );
+
+
+//
+// Functions to keep the versions of a file written in
+// transaction mode
+//
+int isNewVersion( const NET_FD_TYPE *pFD );
+int versionHeld( const char *pathname );
+void pinSnapshot( NET_FD_TYPE *pFD );
+int newVersion( const NET_FD_TYPE *pFD );
+int commitVersion( const NET_FD_TYPE *pFD );
+long copyRange( const int fdIn, off_t offIn, const int fdOut, off_t offOut, const long nBytes );
+
+
+//
+// Functions to manage transactions
+//
+NET_TX_TYPE *LookupTXtable( const long txId );
+long txBegin();
+void txReap();
+int txStage( const long txId, NET_FD_TYPE *fileInfo );
+int txCommit( const long txId );
+int txAbort( const long txId );
+int txIsOpen( const long txId );
+int txWriteRecord( const NET_TX_TYPE *commit, char *recordPath, const size_t len );
+int txRollForward( const char *recordPath );
+void txRecover();
+
+
+//
+// Functions to track active transfers
+//
+NET_TRANSFER_TYPE *beginTransfer( const NET_FUNCTION_TYPE netFunc, const int netfd, const long nBytes );
+void endTransfer( NET_TRANSFER_TYPE *xfer );
 
 
 //
@@ -105,7 +384,7 @@ void printFDtable();
 //
 int canOpen( NET_FD_TYPE *netFd );
 int canWrite( const int netfd, const int nBytes);
-int canRead( const int netfd, const int nBytes, int *fileSize);
+int canRead( const int netfd, const int nBytes, long *fileSize);
 
 
 
@@ -116,14 +395,42 @@ int canRead( const int netfd, const int nBytes, int *fileSize);
 /////////////////////////////////////////////////////////////
 
 int  bTerminate = FALSE;
+int  Server_Port = NET_SERVER_PORT_NUM;    // control port, "-p"
+char TX_Record_Dir[256] = TX_RECORD_DIR;   // commit records, "-t"
 pthread_t HB_thread_ID = 0;
 int queue_size = 0;
 QNode *queue = NULL;
 
 //
-// Here is my net file descriptor table
+// Here is my net file descriptor table.  Entries for the
+// same pathname are found through FD_Hash, which holds the
+// first slot of each hash chain (-1 = empty chain).  No slot
+// below FD_FreeHint is free.
 //
 NET_FD_TYPE   FD_Table[ FD_TABLE_SIZE ];
+int           FD_Hash[ FD_HASH_SIZE ];
+int           FD_FreeHint = 0;
+
+//
+// Guards the fd table against concurrent open, close and
+// snapshot.  The policy check in "canOpen" and the slot
+// allocation in "createFD" must happen as one step.
+//
+pthread_mutex_t FD_Table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Open transactions.  Guarded by FD_Table_lock as well,
+// since staging a file and committing it change which
+// version the file's readers see.
+//
+NET_TX_TYPE   TX_Table[ TX_TABLE_SIZE ];
+
+//
+// Active transfer list
+//
+NET_TRANSFER_TYPE *Transfer_List = NULL;
+int Transfer_Seq = 0;
+pthread_mutex_t Transfer_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 
@@ -132,48 +439,130 @@ NET_FD_TYPE   FD_Table[ FD_TABLE_SIZE ];
 
 int main(int argc, char *argv[]) {
     int sockfd  = 0;
-    int sockOpt = 1;
     int newsockfd = 0;
-    int rc = 0;
 
-    struct sockaddr_in serv_addr, cli_addr;
+    struct sockaddr_storage cli_addr;
     int clilen = sizeof(cli_addr);
     pthread_t    ProcessNetCmd_threadID = 0;
+    pthread_t    statsSignal_threadID = 0;
+    sigset_t     statsSignalSet;
+    int          adminPort = 0;
+    int          bHugePages = FALSE;
+    long         budgetMB = POOL_BUDGET_MB;
+    char        *journalPath = NULL;
+    int          opt = 0;
+
+
+    //
+    // Command line options:
+    //
+    //     -a port    serve /metrics, /fdtable and /transfers
+    //                over HTTP on this port
+    //     -H         back the large transfer buffers with
+    //                huge pages
+    //     -j file    take small writes through a write-ahead
+    //                journal kept in this file
+    //     -m MB      memory budget for transfer buffers,
+    //                POOL_BUDGET_MB by default
+    //     -p port    control port, NET_SERVER_PORT_NUM by default.
+    //                Data ports are the next
+    //                MAX_FILE_TRANSFER_SOCKETS ports.
+    //     -t dir     keep transaction commit records in this
+    //                directory, TX_RECORD_DIR by default
+    //
+    while ((opt = getopt(argc, argv, "a:Hj:m:p:t:")) != -1) {
+        switch (opt) {
+            case 'a':
+                adminPort = atoi(optarg);
+                break;
+
+            case 'H':
+                bHugePages = TRUE;
+                break;
+
+            case 'j':
+                journalPath = optarg;
+                break;
+
+            case 'm':
+                budgetMB = atol(optarg);
+                if ( budgetMB <= 0 ) {
+                    fprintf(stderr, "netfileserver: invalid memory budget %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'p':
+                Server_Port = atoi(optarg);
+                if ((Server_Port <= 0) || (Server_Port + MAX_FILE_TRANSFER_SOCKETS > 65535)) {
+                    fprintf(stderr, "netfileserver: invalid port %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                if ( strlen(optarg) >= sizeof(TX_Record_Dir) ) {
+                    fprintf(stderr, "netfileserver: directory name too long %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                strcpy( TX_Record_Dir, optarg );
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-a adminPort] [-H] [-j journal] [-m MB] [-p port] [-t dir]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
 
     SetupSignals();  // Set up signal handlers
 
 
+    //
+    // SIGUSR1 dumps the server statistics.  It is blocked here,
+    // before any thread is created, so that every thread inherits
+    // the mask and only the statistics thread receives it through
+    // sigwait().
+    //
+    statsInit();
+    poolInit( bHugePages, (uint64_t)budgetMB * 1024 * 1024 );
+    sigemptyset(&statsSignalSet);
+    sigaddset(&statsSignalSet, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statsSignalSet, NULL);
+    pthread_create(&statsSignal_threadID, NULL, &statsSignalThread, NULL);
+
+    if ( adminPort > 0 ) {
+        if ( adminStart( adminPort ) != SUCCESS ) exit(EXIT_FAILURE);
+    }
+
+
     //
     // Initialize file descriptor table
     //
     initialize();
 
     //
-    // Create a new socket for my listener
+    // Replay the journal before taking any request
     //
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        fprintf(stderr,"netfileserver: socket() failed, errno= %d\n", errno);
+    if ((journalPath != NULL) && (journalInit( journalPath ) == FAILURE)) {
+        fprintf(stderr, "netfileserver: cannot use journal \"%s\", errno= %d (%s)\n",
+                journalPath, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
-    if (rc != 0) {
-        fprintf(stderr,"netfileserver: setsockopt() returned %d, errno= %d\n", rc, errno);
-    }
+    //
+    // Then finish the commits a previous run left part way
+    //
+    txRecover();
 
     //
-    // Initialize the server address structure to be
-    // used for binding my socket to a port number.
-    // This port number is hard-coded in the
-    // "libnetfiles.h" header file called "NET_SERVER_PORT_NUM".
+    // Create a new socket for my listener, bound to the
+    // port number.  This port number defaults to
+    // "NET_SERVER_PORT_NUM" in the "libnetfiles.h" header
+    // file, or is given with "-p".
     //
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(NET_SERVER_PORT_NUM);
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    sockfd = bindPort( Server_Port );
+    if (sockfd < 0)
     {
         fprintf(stderr,"netfileserver: bind() failed, errno= %d\n", errno);
         exit(EXIT_FAILURE);
@@ -181,10 +570,12 @@ int main(int argc, char *argv[]) {
 
 
     //
-    // Listen on the socket.  Allow a connection
-    // backlog of size "50".
+    // Listen on the socket.  Asynchronous clients connect
+    // in bursts of up to NET_ASYNC_WORKERS at a time, so the
+    // backlog is as large as the system allows.  A dropped
+    // SYN costs the client a second.
     //
-    if (listen(sockfd, 50) < 0)
+    if (listen(sockfd, SOMAXCONN) < 0)
     {
         fprintf(stderr,"netfileserver: listen() failed, errno= %d\n", errno);
         close(sockfd);
@@ -248,7 +639,14 @@ int main(int argc, char *argv[]) {
             // to spawn a worker thread to handle this request.
             //
             //printf("netfileserver: listener accepted a new request from socket\n");
-	    pthread_create(&ProcessNetCmd_threadID, NULL, &ProcessNetCmd, &newsockfd);
+            //
+            // Each worker gets its own copy of the socket so the next
+            // accept() cannot overwrite it before the worker reads it.
+            //
+            NET_REQUEST_TYPE *request = malloc(sizeof(NET_REQUEST_TYPE));
+            request->sockfd = newsockfd;
+            request->acceptTime = statsNow();
+	    pthread_create(&ProcessNetCmd_threadID, NULL, &ProcessNetCmd, request);
 	    
 
             //printf("netfileserver: listener spawned a new worker thread with ID %d\n",ProcessNetCmd_threadID);
@@ -413,18 +811,54 @@ static void SetupSignals()
 
 }
 
+/////////////////////////////////////////////////////////////
+//
+// This thread waits for SIGUSR1 and prints the server
+// statistics to stdout.  SIGUSR1 is blocked in every other
+// thread, so the report is produced outside of signal
+// context and can safely call printf.
+//
+/////////////////////////////////////////////////////////////
+
+void *statsSignalThread( void *arg )
+{
+    sigset_t set;
+    int signo = 0;
+    STATS_GAUGES_TYPE gauges;
+    char *report = malloc(STATS_TEXT_SIZE);
+
+    pthread_detach( pthread_self() );
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while ( report != NULL ) {
+        if ( sigwait(&set, &signo) != 0 ) continue;
+
+        getStatsGauges( &gauges );
+        statsFormatText( report, STATS_TEXT_SIZE, &gauges );
+        printf("%s", report);
+        fflush(stdout);
+    }
+
+    pthread_exit( NULL );
+}
+
 /////////////////////////////////////////////////////////////
 
 
-void *ProcessNetCmd( void *newSocket_FD )
+void *ProcessNetCmd( void *newRequest )
 {
     int rc = 0;
     int netfd = -1;
     int nBytes = -1;
     int nBytesWant = -1;
-    int *sockfd = newSocket_FD;
+    int newSocket_FD = ((NET_REQUEST_TYPE *)newRequest)->sockfd;
+    int *sockfd = &newSocket_FD;
     NET_FD_TYPE  *newFd = NULL;
     int filePartsCount = 0;
+    long txId = 0;
+    int advice = NET_ADVICE_NORMAL;   // the client's netadvise hint for "netfd"
 
     char msg[MSG_SIZE] = "";
     char myThreadLabel[64] = "";
@@ -436,7 +870,22 @@ void *ProcessNetCmd( void *newSocket_FD )
     // An array of spawned thread ID's
     pthread_t   pTids[MAX_FILE_TRANSFER_SOCKETS];
 
+    // Transfer record for netread and netwrite
+    NET_TRANSFER_TYPE *xfer = NULL;
+
+    // Set when a case has already sent its own response
+    int bResponseSent = FALSE;
+    int nMsgRead = 0;
+    int bFailed = FALSE;
+    uint64_t startTime = statsNow();
+    uint64_t acceptTime = ((NET_REQUEST_TYPE *)newRequest)->acceptTime;
+
 
+    //
+    // Time spent between accept() in main and this thread running
+    //
+    statsRecordPhase( PHASE_QUEUE, startTime - acceptTime );
+    free( newRequest );
 
     sprintf(myThreadLabel, "netfileserver: ProcessNetCmd %ld,", pthread_self());
 
@@ -451,6 +900,14 @@ void *ProcessNetCmd( void *newSocket_FD )
         if ( *sockfd != 0 ) close(*sockfd);
 	pthread_exit( NULL );
     }
+    nMsgRead = rc;  // an inline write's data follows its MSG_SIZE header
+
+
+    //
+    // Adopt the client's trace ID, if the message carries one
+    //
+    traceUntagMessage( msg );
+    traceSpan( "queue", acceptTime, startTime );
     
 
     //
@@ -488,6 +945,7 @@ void *ProcessNetCmd( void *newSocket_FD )
 
             sscanf(msg, "%u,%d,%d,%s", &netFunc, (int *)&(newFd->fcMode),
                       &(newFd->fileOpenFlags), newFd->pathname );
+            newFd->bPrivate = FALSE;
 
 
             //
@@ -533,7 +991,9 @@ void *ProcessNetCmd( void *newSocket_FD )
             // Check if reading is allowed for this "netfd"
             //
             int fileSize = 0;
-            rc = canRead(netfd, nBytesWant, &fileSize);
+            long fullSize = 0;
+            rc = canRead(netfd, nBytesWant, &fullSize);
+            fileSize = (fullSize < INT_MAX) ? (int)fullSize : INT_MAX;  // netread sizes are ints
 
             if (rc == SUCCESS) {
                  //
@@ -544,10 +1004,15 @@ void *ProcessNetCmd( void *newSocket_FD )
                  // of file parts that will be created.  We need this
                  // parts count to reconstruct the final data read.
                  //
-                 filePartsCount  = Do_netread(nBytesWant, fileSize, pTids, &portCount, portList);
+                 xfer = beginTransfer( NET_READ, netfd, (nBytesWant < fileSize) ? nBytesWant : fileSize );
+                 filePartsCount  = Do_netread(nBytesWant, fileSize, pTids, &portCount, portList, xfer);
 
                  rc = SUCCESS;
                  if ( filePartsCount == FAILURE )  rc = FAILURE;
+                 if ( filePartsCount <= 0 ) {
+                     endTransfer( xfer );
+                     xfer = NULL;
+                 }
 
 	         //printf("%s Do_netread returns filePartsCount= %d\n", myThreadLabel, filePartsCount);
 
@@ -566,6 +1031,9 @@ void *ProcessNetCmd( void *newSocket_FD )
 	    //
 	    //    result,errno,h_errno,netFd,fileSize,portCount,portList
 	    //
+	    // portList holds each data port as an offset from
+	    // the control port.
+	    //
 	    bzero(msg, MSG_SIZE);
 	    if ( rc == FAILURE  ) {
 		sprintf(msg, "%d,%d,%d,%d,%d,0,0", FAILURE, errno, h_errno, netfd, fileSize);
@@ -607,11 +1075,15 @@ void *ProcessNetCmd( void *newSocket_FD )
 		    //            myThreadLabel, pTids[i], (int)(*nBytesRecv));
 
                     //
-                    // Calculate the total bytes send to the client for the netread cmd
+                    // Calculate the total bytes send to the client for the
+                    // netread cmd.  A listener that failed returns NULL.
                     //
-                    nBytes = nBytes + (int)(*nBytesRecv);
-                    free(nBytesRecv);
+                    if ( nBytesRecv != NULL ) {
+                        nBytes = nBytes + (int)(*nBytesRecv);
+                        free(nBytesRecv);
+                    }
 		}
+		endTransfer( xfer );
 	    }
 
 	    rc = SUCCESS;
@@ -638,9 +1110,12 @@ void *ProcessNetCmd( void *newSocket_FD )
 
 	    //
 	    // Incoming message format is:
-	    //     4,netfd,nBytes,0
+	    //     4,netfd,nBytes,txId,advice
+	    //
+	    // where txId is the transaction to stage the write
+	    // in, or 0, and advice the client's netadvise hint.
 	    //
-	    sscanf(msg, "%u,%d,%d", &netFunc, &netfd, &nBytes);
+	    sscanf(msg, "%u,%d,%d,%ld,%d", &netFunc, &netfd, &nBytes, &txId, &advice);
 
 
 	    //
@@ -658,10 +1133,15 @@ void *ProcessNetCmd( void *newSocket_FD )
 		    // of file parts that will be created.  We need this
 		    // parts count to reconstruct the final data file.
 		    //
-		    filePartsCount  = Do_netwrite(nBytes, pTids, &portCount, portList);
+		    xfer = beginTransfer( NET_WRITE, netfd, nBytes );
+		    filePartsCount  = Do_netwrite(nBytes, pTids, &portCount, portList, xfer);
 
 		    rc = SUCCESS;
 		    if ( filePartsCount == FAILURE )  rc = FAILURE;
+		    if ( filePartsCount <= 0 ) {
+			endTransfer( xfer );
+			xfer = NULL;
+		    }
 
 		    //printf("%s Do_netwrite returns filePartsCount= %d\n", myThreadLabel, filePartsCount);
 
@@ -675,11 +1155,14 @@ void *ProcessNetCmd( void *newSocket_FD )
 		    //
 		    // create an empty file.
 		    //
-		    NET_FD_TYPE *pFD = LookupFDtable(netfd);
-		    FILE *fp = fopen(pFD->pathname,"w");
+		    NET_FD_TYPE fileInfo;
+		    FILE *fp = NULL;
+		    bzero(&fileInfo, sizeof(fileInfo));
+		    if ((writeTarget( netfd, txId, &fileInfo ) == SUCCESS) &&
+		        (journalSupersede( fileInfo.dataPath ) == SUCCESS)) fp = fopen(fileInfo.dataPath,"w");
 		    if ( fp == NULL ) {
 			// Fail to open the temp file
-			fprintf(stderr,"%s fails to create \"%s\", errno= %d\n",myThreadLabel,pFD->pathname,errno);
+			fprintf(stderr,"%s fails to create \"%s\", errno= %d\n",myThreadLabel,fileInfo.pathname,errno);
 			rc = FAILURE;
 		    }
 
@@ -698,6 +1181,9 @@ void *ProcessNetCmd( void *newSocket_FD )
 	    //
 	    //    result,errno,h_errno,netFd,portCount,portList
 	    //
+	    // portList holds each data port as an offset from
+	    // the control port.
+	    //
 	    bzero(msg, MSG_SIZE);
 	    if ( rc == FAILURE  ) {
 		sprintf(msg, "%d,%d,%d,%d,0,0", FAILURE, errno, h_errno, netfd);
@@ -736,7 +1222,11 @@ void *ProcessNetCmd( void *newSocket_FD )
 		//
 		// Reconstruct the written file from all the piece parts
 		//
-		nBytes = reconstruct( netfd, filePartsCount); // Total bytes written
+		uint64_t reconstructTime = statsNow();
+		nBytes = reconstruct( netfd, txId, filePartsCount, advice ); // Total bytes written
+		statsRecordPhase( PHASE_RECONSTRUCT, statsNow() - reconstructTime );
+		traceSpan( "reconstruct", reconstructTime, statsNow() );
+		endTransfer( xfer );
 		//printf("%s netwriteListener: reconstruct returns %d bytes\n", myThreadLabel, nBytes);
 		rc = SUCCESS;
 	    }
@@ -771,7 +1261,7 @@ void *ProcessNetCmd( void *newSocket_FD )
 	    // that was closed.  Otherwise, it will return a "-1".
 	    //
 	    //printf("%s trying to delete netfd %d\n", myThreadLabel, netfd);
-	    rc = deleteFD( netfd );
+	    rc = closeFD( netfd );
 	    //printf("%s deleteFD returns %d\n", myThreadLabel, rc);
 
 
@@ -790,88 +1280,632 @@ void *ProcessNetCmd( void *newSocket_FD )
 
 	    break;
 
-	case INVALID:
-	default:
-	    //printf("%s received invalid net function\n", myThreadLabel);
-	    errno = EINVAL;
-	    rc = FAILURE;
-	    sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
-	    break;
-    }
+	case NET_STATS:
+	    //
+	    // Incoming message format is:
+	    //     6,0,0,0
+	    //
+	    // The response is a MSG_SIZE header message followed by
+	    // the text report.  The header format is:
+	    //
+	    //    result,errno,h_errno,nBytes
+	    //
+	    {
+		STATS_GAUGES_TYPE gauges;
+		char *report = malloc(STATS_TEXT_SIZE);
+
+		if ( report == NULL ) {
+		    errno = ENOMEM;
+		    sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+		    break;
+		}
 
+		getStatsGauges( &gauges );
+		nBytes = statsFormatText( report, STATS_TEXT_SIZE, &gauges );
 
+		bzero(msg, MSG_SIZE);
+		sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, nBytes);
+		if ((writeFully(*sockfd, msg, MSG_SIZE) < 0) ||
+		    (writeFully(*sockfd, report, nBytes) < 0)) {
+		    fprintf(stderr,"%s fails to write stats report to socket\n", myThreadLabel);
+		}
+		free( report );
+		bResponseSent = TRUE;
+	    }
+	    break;
 
-    //
-    // Send my final server response back to the client
-    //
-    rc = write(*sockfd, msg, strlen(msg) );
-    if ( rc < 0 ) {
-	fprintf(stderr,"%s fails to write to socket\n", myThreadLabel);
-    }
+	case NET_READ_INLINE:
+	    //
+	    // Incoming message format is:
+	    //    7,netFd,nBytesWant,advice
+	    //
+	    // The response is a MSG_SIZE header message followed by
+	    // the file data.  The header format is:
+	    //
+	    //    result,errno,h_errno,nBytes
+	    //
+	    {
+		long fileSize = 0;
+		char *pData = NULL;
 
-    if ( *sockfd != 0 ) close(*sockfd);
-    pthread_exit( NULL );
-}
+		sscanf(msg, "%u,%d,%d,%d", &netFunc, &netfd, &nBytesWant, &advice);
 
-/////////////////////////////////////////////////////////////
+		nBytes = 0;
+		if ( nBytesWant > INLINE_DATA_SIZE ) {
+		    errno = EINVAL;
+		    rc = FAILURE;
+		}
+		else {
+		    rc = canRead(netfd, nBytesWant, &fileSize);
+		}
 
-int Do_netopen( NET_FD_TYPE *newFd )
-{
-    int rc = -1;
+		if ( rc == SUCCESS ) {
+		    nBytes = (nBytesWant < fileSize) ? nBytesWant : fileSize;
+		    if ( nBytes > 0 ) {
+			pData = readFile( netfd, 0, nBytes, advice );
+			if ( pData == NULL ) rc = FAILURE;
+		    }
+		}
 
-    //
-    // Verify the specified file exists and accessible
-    //
-    rc = open(newFd->pathname, newFd->fileOpenFlags);
-    if ( rc < 0 ) {
-	// File open failed
-	//fprintf(stderr,"netopen: errno= %d \"%s\", h_errno= %d\n", errno, strerror(errno), h_errno);
+		bzero(msg, MSG_SIZE);
+		if ( rc == FAILURE ) {
+		    sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+		}
+		else {
+		    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, nBytes);
+		}
 
-	if ((errno == ENOENT) && (newFd->fileOpenFlags != O_RDONLY)) {
-	    // This file does not exist but I am trying to write to
-	    // it to create.  I can ignore this open error.
-	    errno = 0;
-	}
-	else {
-	    // This file cannot be opened.  It may be a
-	    // directory or no file access permission.
-	    return FAILURE;
-	}
-    }
+		uint64_t phaseTime = statsNow();
+		if ((writeFully(*sockfd, msg, MSG_SIZE) < 0) ||
+		    ((rc == SUCCESS) && (writeFully(*sockfd, pData, nBytes) < 0))) {
+		    fprintf(stderr,"%s fails to write inline data to socket\n", myThreadLabel);
+		    rc = FAILURE;
+		}
+		else if ( rc == SUCCESS ) {
+		    statsRecordPhase( PHASE_NET_SEND, statsNow() - phaseTime );
+		    statsCount( COUNTER_BYTES_OUT, nBytes );
+		}
 
-    //
-    // Successfully opened the given file.
-    //
-    close( rc );
-    //printf("netopen: opened and closed \"%s\"\n", newFd->pathname);
+		if ( pData != NULL ) poolPut( pData, nBytes );
+		bFailed = (rc == FAILURE);
+		bResponseSent = TRUE;
+	    }
+	    break;
 
+	case NET_WRITE_INLINE:
+	    //
+	    // Incoming message is a MSG_SIZE header followed by
+	    // the file data.  The header format is:
+	    //    8,netFd,nBytes,txId,advice
+	    //
+	    {
+		char *pData = NULL;
+		int nHeaderLeft = MSG_SIZE - nMsgRead;
+		int nBuf = 0;
+
+		sscanf(msg, "%u,%d,%d,%ld,%d", &netFunc, &netfd, &nBytes, &txId, &advice);
+		if ((nBytes < 0) || (nBytes > INLINE_DATA_SIZE)) {
+		    // Take in what was sent, so the refusal gets back
+		    if ( nBytes <= INLINE_DRAIN_MAX ) {
+			drainFully(*sockfd, (long)nHeaderLeft + ((nBytes > 0) ? nBytes : 0));
+		    }
+		    errno = EINVAL;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		    break;
+		}
 
-    //
-    // Now we need to check the net file connection access policy.
-    //
-    if ( canOpen(newFd) == FALSE ) {
-	//printf("canOpen() returns FALSE\n");
-	//printFDtable();
+		//
+		// Take in the rest of the header and all of the data
+		// before answering, even if the write is refused.
+		// Closing on unread data would reset the connection
+		// and lose the response.
+		//
+		nBuf = nHeaderLeft + nBytes + 1;
+		pData = poolGet( nBuf );
+		if ( pData == NULL ) {
+		    drainFully(*sockfd, (long)nHeaderLeft + nBytes);
+		    errno = ENOMEM;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		    break;
+		}
 
-	// Not allowed by access policy
-	errno = EACCES;
-	enqueue(newFd->fd);
-	return FAILURE;
-    };
+		uint64_t phaseTime = statsNow();
+		rc = readFully(*sockfd, pData, nHeaderLeft + nBytes);
+		if ( rc != nHeaderLeft + nBytes ) {
+		    fprintf(stderr,"%s fails to read inline data from socket\n", myThreadLabel);
+		    errno = ECONNRESET;
+		    rc = FAILURE;
+		}
+		else {
+		    statsRecordPhase( PHASE_NET_RECV, statsNow() - phaseTime );
+		    statsCount( COUNTER_BYTES_IN, nBytes );
+		    rc = canWrite(netfd, nBytes);
+		}
 
+		if ( rc == SUCCESS ) rc = writeFile( netfd, txId, pData + nHeaderLeft, nBytes, advice );
+		poolPut( pData, nBuf );
 
-    //
-    // Store this new file descriptor in fd table
-    //
-    int old_rc = rc;
-    rc = createFD( newFd );
-    if ( rc == FAILURE ) {
+		//
+		// Compose my final response message.  The format is:
+		//
+		//    result,errno,h_errno,nBytes
+		//
+		bzero(msg, MSG_SIZE);
+		if ( rc == FAILURE  ) {
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		}
+		else {
+		    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, rc);
+		}
+	    }
+	    break;
+
+	case NET_GET:
+	    //
+	    // Open, read and close in one request.  Incoming
+	    // message format is:
+	    //    9,connectionMode,nBytesWant,pathname
+	    //
+	    // The response is a MSG_SIZE header message followed by
+	    // the file data.  The header format is:
+	    //
+	    //    result,errno,h_errno,nBytes
+	    //
+	    {
+		NET_FD_TYPE getFd;
+		long fileSize = 0;
+		char *pData = NULL;
+
+		bzero(&getFd, sizeof(getFd));
+		sscanf(msg, "%u,%d,%d,%255s", &netFunc, (int *)&(getFd.fcMode), &nBytesWant, getFd.pathname);
+		getFd.fileOpenFlags = O_RDONLY;
+		getFd.bPrivate = TRUE;
+
+		//
+		// The private fd holds the connection mode policy
+		// for as long as the read takes
+		//
+		nBytes = 0;
+		netfd = Do_netopen( &getFd );
+		rc = (netfd == FAILURE) ? FAILURE : canRead(netfd, nBytesWant, &fileSize);
+
+		if ( rc == SUCCESS ) {
+		    nBytes = (nBytesWant < fileSize) ? nBytesWant : fileSize;
+		    if ( nBytes > 0 ) {
+			pData = readFile( netfd, 0, nBytes, NET_ADVICE_NORMAL );
+			if ( pData == NULL ) rc = FAILURE;
+		    }
+		}
+		if ( netfd != FAILURE ) deleteFD( netfd );
+
+		bzero(msg, MSG_SIZE);
+		if ( rc == FAILURE ) {
+		    sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+		}
+		else {
+		    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, nBytes);
+		}
+
+		uint64_t phaseTime = statsNow();
+		if ((writeFully(*sockfd, msg, MSG_SIZE) < 0) ||
+		    ((rc == SUCCESS) && (writeFully(*sockfd, pData, nBytes) < 0))) {
+		    fprintf(stderr,"%s fails to write netget data to socket\n", myThreadLabel);
+		    rc = FAILURE;
+		}
+		else if ( rc == SUCCESS ) {
+		    statsRecordPhase( PHASE_NET_SEND, statsNow() - phaseTime );
+		    statsCount( COUNTER_BYTES_OUT, nBytes );
+		}
+
+		if ( pData != NULL ) poolPut( pData, nBytes );
+		bFailed = (rc == FAILURE);
+		bResponseSent = TRUE;
+	    }
+	    break;
+
+	case NET_PUT:
+	    //
+	    // Open, write and close in one request.  Incoming
+	    // message is a MSG_SIZE header followed by the file
+	    // data.  The header format is:
+	    //    10,connectionMode,nBytes,pathname
+	    //
+	    {
+		NET_FD_TYPE putFd;
+		char *pData = NULL;
+		int nHeaderLeft = MSG_SIZE - nMsgRead;
+		int nBuf = 0;
+
+		bzero(&putFd, sizeof(putFd));
+		sscanf(msg, "%u,%d,%d,%255s", &netFunc, (int *)&(putFd.fcMode), &nBytes, putFd.pathname);
+		putFd.fileOpenFlags = O_WRONLY;
+		putFd.bPrivate = TRUE;
+
+		if ( nBytes < 0 ) {
+		    errno = EINVAL;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		    break;
+		}
+
+		//
+		// As for an inline write, take in all of the data
+		// before answering.  Data too large for the memory
+		// budget is read and thrown away, and the netput
+		// refused.
+		//
+		if ((long)nHeaderLeft + nBytes < INT_MAX) nBuf = nHeaderLeft + nBytes + 1;
+		pData = (nBuf > 0) ? poolGet( nBuf ) : NULL;
+		if ( pData == NULL ) {
+		    drainFully(*sockfd, (long)nHeaderLeft + nBytes);
+		    errno = ENOMEM;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		    break;
+		}
+
+		uint64_t phaseTime = statsNow();
+		rc = readFully(*sockfd, pData, nHeaderLeft + nBytes);
+		if ( rc != nHeaderLeft + nBytes ) {
+		    fprintf(stderr,"%s fails to read netput data from socket\n", myThreadLabel);
+		    errno = ECONNRESET;
+		    rc = FAILURE;
+		}
+		else {
+		    statsRecordPhase( PHASE_NET_RECV, statsNow() - phaseTime );
+		    statsCount( COUNTER_BYTES_IN, nBytes );
+
+		    netfd = Do_netopen( &putFd );
+		    rc = (netfd == FAILURE) ? FAILURE :
+		         writeFile( netfd, 0, pData + nHeaderLeft, nBytes, NET_ADVICE_NORMAL );
+
+		    // Closing commits the version written in transaction mode
+		    if ((netfd != FAILURE) && (closeFD( netfd ) == FAILURE)) rc = FAILURE;
+		}
+		poolPut( pData, nBuf );
+
+		//
+		// Compose my final response message.  The format is:
+		//
+		//    result,errno,h_errno,nBytes
+		//
+		bzero(msg, MSG_SIZE);
+		if ( rc == FAILURE  ) {
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		}
+		else {
+		    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, rc);
+		}
+	    }
+	    break;
+
+	case NET_OPEN_BATCH:
+	case NET_STAT_BATCH:
+	case NET_CLOSE_BATCH:
+	    //
+	    // Many opens, stats or closes in one request.  See
+	    // "Do_batch" for the message formats.
+	    //
+	    rc = Do_batch( *sockfd, netFunc, msg, MSG_SIZE - nMsgRead );
+	    bFailed = (rc == FAILURE);
+	    bResponseSent = TRUE;
+	    break;
+
+	case NET_READ_RANGES:
+	    //
+	    // Many ranges of one file in one request.  See
+	    // "Do_readRanges" for the message formats.
+	    //
+	    rc = Do_readRanges( *sockfd, msg, MSG_SIZE - nMsgRead );
+	    bFailed = (rc == FAILURE);
+	    bResponseSent = TRUE;
+	    break;
+
+	case NET_ADVISE:
+	    //
+	    // Incoming message format is:
+	    //     15,netfd,advice,0
+	    //
+	    sscanf(msg, "%u,%d,%d", &netFunc, &netfd, &advice);
+	    rc = setAdvice( netfd, advice );
+
+	    //
+	    // Compose a response message.  The format is:
+	    //
+	    //    result,errno,h_errno,netFd
+	    //
+	    if ( rc == FAILURE ) {
+		sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+	    }
+	    else {
+		sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, netfd);
+	    }
+	    break;
+
+	case NET_DURABILITY:
+	    //
+	    // Incoming message format is:
+	    //     16,netfd,mode,0
+	    //
+	    {
+		int mode = NET_DURABLE_NONE;
+
+		sscanf(msg, "%u,%d,%d", &netFunc, &netfd, &mode);
+		rc = setDurability( netfd, mode );
+	    }
+
+	    if ( rc == FAILURE ) {
+		sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+	    }
+	    else {
+		sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, netfd);
+	    }
+	    break;
+
+	case NET_FSYNC:
+	    //
+	    // Incoming message format is:
+	    //     17,netfd,0,0
+	    //
+	    // The sync joins whatever group commit is forming.
+	    //
+	    sscanf(msg, "%u,%d", &netFunc, &netfd);
+	    {
+		NET_FD_TYPE fileInfo;
+
+		rc = copyFDentry( netfd, &fileInfo );
+		if ( rc == FAILURE ) errno = EBADF;
+		else rc = syncFile( fileInfo.dataPath );
+	    }
+
+	    if ( rc == FAILURE ) {
+		sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+	    }
+	    else {
+		sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, netfd);
+	    }
+	    break;
+
+	case NET_COPY:
+	    //
+	    // Copy from one file to another on the server.
+	    // Incoming message is a MSG_SIZE header followed by a
+	    // MSG_SIZE block holding the destination pathname.
+	    // The header format is:
+	    //    21,connectionMode,offset,nBytes,srcPathname
+	    //
+	    {
+		NET_FD_TYPE srcFd;
+		NET_FD_TYPE dstFd;
+		char block[ 2 * MSG_SIZE ];
+		int nHeaderLeft = MSG_SIZE - nMsgRead;
+		long offset = 0;
+		long nCopy = 0;
+		long nCopied = FAILURE;
+		int srcNetfd = FAILURE;
+		int dstNetfd = FAILURE;
+
+		bzero(&srcFd, sizeof(srcFd));
+		bzero(&dstFd, sizeof(dstFd));
+		sscanf(msg, "%u,%d,%ld,%ld,%255s", &netFunc, (int *)&(srcFd.fcMode), &offset, &nCopy,
+		       srcFd.pathname);
+		srcFd.fileOpenFlags = O_RDONLY;
+		srcFd.bPrivate = TRUE;
+
+		rc = readFully(*sockfd, block, nHeaderLeft + MSG_SIZE);
+		if ( rc != nHeaderLeft + MSG_SIZE ) {
+		    fprintf(stderr,"%s fails to read netcopy destination from socket\n", myThreadLabel);
+		    errno = ECONNRESET;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		    break;
+		}
+		block[ nHeaderLeft + MSG_SIZE - 1 ] = '\0';
+		sscanf(block + nHeaderLeft, "%255s", dstFd.pathname);
+		dstFd.fcMode = srcFd.fcMode;
+		dstFd.fileOpenFlags = O_WRONLY;
+		dstFd.bPrivate = TRUE;
+
+		//
+		// Private fds hold the connection mode policy for
+		// both files for as long as the copy takes
+		//
+		errno = 0;
+		if ((offset < 0) || (nCopy < 0) || (dstFd.pathname[0] == '\0') ||
+		    (strcmp(srcFd.pathname, dstFd.pathname) == 0)) {
+		    errno = EINVAL;
+		}
+		else {
+		    srcNetfd = Do_netopen( &srcFd );
+		    if ( srcNetfd != FAILURE ) dstNetfd = Do_netopen( &dstFd );
+		    if ( dstNetfd != FAILURE ) nCopied = Do_netcopy( srcNetfd, dstNetfd, offset, nCopy );
+		}
+		int err = errno;
+		if ( srcNetfd != FAILURE ) deleteFD( srcNetfd );
+
+		// Closing commits the copy made in transaction mode
+		if ((dstNetfd != FAILURE) && (closeFD( dstNetfd ) == FAILURE) && (nCopied != FAILURE)) {
+		    err = errno;
+		    nCopied = FAILURE;
+		}
+		errno = err;
+
+		//
+		// Compose my final response message.  The format is:
+		//
+		//    result,errno,h_errno,nBytes
+		//
+		bzero(msg, MSG_SIZE);
+		if ( nCopied == FAILURE ) {
+		    rc = FAILURE;
+		    sprintf(msg, "%d,%d,%d,%d", FAILURE, errno, h_errno, FAILURE);
+		}
+		else {
+		    rc = SUCCESS;
+		    errno = 0;
+		    sprintf(msg, "%d,%d,%d,%ld", SUCCESS, errno, h_errno, nCopied);
+		}
+	    }
+	    break;
+
+	case NET_TX_BEGIN:
+	case NET_TX_COMMIT:
+	case NET_TX_ABORT:
+	    //
+	    // Incoming message format is:
+	    //     18,0,0,0        begin
+	    //     19,0,txId,0     commit
+	    //     20,0,txId,0     abort
+	    //
+	    sscanf(msg, "%u,%*d,%ld", &netFunc, &txId);
+	    if ( netFunc == NET_TX_BEGIN )       rc = ((txId = txBegin()) == FAILURE) ? FAILURE : SUCCESS;
+	    else if ( netFunc == NET_TX_COMMIT ) rc = txCommit( txId );
+	    else                                 rc = txAbort( txId );
+
+	    //
+	    // Compose a response message.  The format is:
+	    //
+	    //    result,errno,h_errno,txId
+	    //
+	    // A commit that stopped part way keeps its transaction
+	    // open, and says so with its id.
+	    //
+	    if ( rc == FAILURE ) {
+		int err = errno;
+		if ((netFunc != NET_TX_COMMIT) || (txIsOpen( txId ) == FALSE)) txId = 0;
+		sprintf(msg, "%d,%d,%d,%ld", FAILURE, err, h_errno, txId);
+	    }
+	    else {
+		sprintf(msg, "%d,%d,%d,%ld", SUCCESS, errno, h_errno, txId);
+	    }
+	    break;
+
+	case INVALID:
+	default:
+	    //printf("%s received invalid net function\n", myThreadLabel);
+	    errno = EINVAL;
+	    rc = FAILURE;
+	    sprintf(msg, "%d,%d,%d,0", FAILURE, errno, h_errno);
+	    break;
+    }
+
+
+
+    //
+    // Send my final server response back to the client
+    //
+    if ( bResponseSent == FALSE ) {
+	rc = write(*sockfd, msg, strlen(msg) );
+	if ( rc < 0 ) {
+	    fprintf(stderr,"%s fails to write to socket\n", myThreadLabel);
+	}
+
+	// Every response message starts with the result code
+	sscanf(msg, "%d,", &rc);
+	bFailed = (rc == FAILURE);
+    }
+
+    if ( *sockfd != 0 ) close(*sockfd);
+
+    statsRecordOp( netFunc, statsNow() - startTime, bFailed );
+    traceSpan( statsOpName(netFunc), startTime, statsNow() );
+    pthread_exit( NULL );
+}
+
+/////////////////////////////////////////////////////////////
+
+int Do_netopen( NET_FD_TYPE *newFd )
+{
+    int rc = -1;
+
+    //
+    // Verify the specified file exists and accessible
+    //
+    rc = open(newFd->pathname, newFd->fileOpenFlags);
+    if ( rc < 0 ) {
+	// File open failed
+	//fprintf(stderr,"netopen: errno= %d \"%s\", h_errno= %d\n", errno, strerror(errno), h_errno);
+
+	if ((errno == ENOENT) && (newFd->fileOpenFlags != O_RDONLY)) {
+	    // This file does not exist but I am trying to write to
+	    // it to create.  I can ignore this open error.
+	    errno = 0;
+	}
+	else {
+	    // This file cannot be opened.  It may be a
+	    // directory or no file access permission.
+	    return FAILURE;
+	}
+    }
+
+    //
+    // Successfully opened the given file.
+    //
+    close( rc );
+    //printf("netopen: opened and closed \"%s\"\n", newFd->pathname);
+
+
+    //
+    // Now we need to check the net file connection access policy.
+    // The check and the fd table update must not be split by
+    // another open of the same file.
+    //
+    pthread_mutex_lock( &FD_Table_lock );
+    if ( canOpen(newFd) == FALSE ) {
+	pthread_mutex_unlock( &FD_Table_lock );
+	//printf("canOpen() returns FALSE\n");
+
+	// Not allowed by access policy
+	errno = EACCES;
+	enqueue(newFd->fd);
+	return FAILURE;
+    };
+
+
+    //
+    // Store this new file descriptor in fd table
+    //
+    int old_rc = rc;
+    rc = createFD( newFd );
+    if ( rc == FAILURE ) {
+	pthread_mutex_unlock( &FD_Table_lock );
 	// No more empty slot in file descriptor table.
 	errno = ENFILE;
 	enqueue(old_rc);
 	return FAILURE;
     }
 
+
+    //
+    // A writer in transaction mode works on a new version of
+    // the file.  Everyone already reading the file, and every
+    // reader that comes while the writer is open, keeps the
+    // committed version it opened.
+    //
+    NET_FD_TYPE *pFD = LookupFDtable( rc );
+    NET_FD_TYPE version;
+    int i = 0;
+
+    version.fileOpenFlags = O_RDONLY;
+    if ( isNewVersion(pFD) == TRUE ) {
+	strcpy( pFD->dataPath, pFD->pathname );
+	strcat( pFD->dataPath, VERSION_EXT );
+	for (i = FD_Hash[ hashPathname(pFD->pathname) ]; i >= 0; i = FD_Table[i].hashNext) {
+	    if ((&FD_Table[i] != pFD) && (strcmp(FD_Table[i].pathname, pFD->pathname) == 0)) {
+		pinSnapshot( &FD_Table[i] );
+	    }
+	}
+	version = *pFD;
+    }
+    else if ((pFD->fileOpenFlags == O_RDONLY) && (versionHeld(pFD->pathname) == TRUE)) {
+	pinSnapshot( pFD );
+    }
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    if ((version.fileOpenFlags != O_RDONLY) && (newVersion(&version) == FAILURE)) {
+	int err = errno;
+	deleteFD( rc );
+	errno = err;
+	return FAILURE;
+    }
+
     return rc;  // This is the file descriptor
 }
 
@@ -891,7 +1925,8 @@ int Do_netopen( NET_FD_TYPE *newFd )
 // returned in case of error.  Otherwise, the total number
 // of parts count is returned.
 //
-int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portList )
+int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portList,
+                 NET_TRANSFER_TYPE *xfer )
 {
     *portCount = 0;
     portList[0] = '\0';
@@ -928,7 +1963,7 @@ int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portL
     //         because some ports may be in use.
     //
     int sockfd = -1;
-    int port = NET_SERVER_PORT_NUM + 1;
+    int port = Server_Port + 1;
     int j = 0;
     int i = 1;
     for (i=1; i <= MAX_FILE_TRANSFER_SOCKETS; i++) {
@@ -941,18 +1976,20 @@ int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portL
 	    // Opened this port for listening
 	    //
 	    *portCount = (*portCount) +1;
+	    statsCount( COUNTER_PORTS_BOUND, 1 );
 	    char sTemp[16] = "";
-	    sprintf(sTemp, "%d,", port);
+	    sprintf(sTemp, "%d,", port - Server_Port);  // sent as an offset
 	    strcat(portList, sTemp);
 
 	    //
 	    // Step 4: Spawn a new netwriteListener thread to
 	    //         listen for data coming in from a port
 	    //
-	    int *pSockfd = malloc(sizeof(int));
-	    *pSockfd= sockfd;
-	    pthread_create(&pTids[j], NULL, &netwriteListener, pSockfd );
-	    //printf("netfileserver: Do_netwrite spawned thread %ld, sockfd= %d\n",pTids[j],*pSockfd);
+	    NET_LISTENER_TYPE *pListener = malloc(sizeof(NET_LISTENER_TYPE));
+	    pListener->sockfd = sockfd;
+	    pListener->xfer = xfer;
+	    pthread_create(&pTids[j], NULL, &netwriteListener, pListener );
+	    //printf("netfileserver: Do_netwrite spawned thread %ld, sockfd= %d\n",pTids[j],sockfd);
 	    j++;
 	}
 
@@ -962,12 +1999,15 @@ int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portL
 	if ( *portCount >= portWanted) break;
     }
 
+    if ( xfer != NULL ) xfer->parts = *portCount;
+
     //printf("netfileserver: Do_netwrite portWanted= %d, portCount= %d, portList= %s\n",
     //               portWanted, *portCount, portList);
 
     if ( *portCount <= 0 ) {
 	// All ports are in use.  Cannot do net write now.
 	//printf("netfileserver: no port is available.  Cannot do netwrite now.\n");
+	statsCount( COUNTER_PORTS_EXHAUSTED, 1 );
 	errno = ETIMEDOUT;
 	return FAILURE;
     }
@@ -984,7 +2024,8 @@ int Do_netwrite( const int nBytes, pthread_t *pTids, int *portCount, char *portL
 // also the same as the number of "netreadListener" threads
 // spawned by this function.
 //
-int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int *portCount, char *portList )
+int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int *portCount, char *portList,
+                NET_TRANSFER_TYPE *xfer )
 {
     *portCount = 0;
     portList[0] = '\0';
@@ -1034,7 +2075,7 @@ int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int
     //         because some ports may be in use.
     //
     int sockfd = -1;
-    int port = NET_SERVER_PORT_NUM + 1;
+    int port = Server_Port + 1;
     int j = 0;
     int i = 1;
     for (i=1; i <= MAX_FILE_TRANSFER_SOCKETS; i++) {
@@ -1047,19 +2088,21 @@ int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int
             // Opened this port for listening
             //
             *portCount = (*portCount) + 1;
+            statsCount( COUNTER_PORTS_BOUND, 1 );
             char sTemp[16] = "";
-            sprintf(sTemp, "%d,", port);
+            sprintf(sTemp, "%d,", port - Server_Port);  // sent as an offset
             strcat(portList, sTemp);
 
             //
             // Step 4: Spawn a new netreadListener thread to
             //         send data to the client
             //
-            int *pSockfd = malloc(sizeof(int));
-            *pSockfd= sockfd;
-            pthread_create(&pTids[j], NULL, &netreadListener, pSockfd );
+            NET_LISTENER_TYPE *pListener = malloc(sizeof(NET_LISTENER_TYPE));
+            pListener->sockfd = sockfd;
+            pListener->xfer = xfer;
+            pthread_create(&pTids[j], NULL, &netreadListener, pListener );
 
-            //printf("netfileserver: Do_netread spawned thread %ld, sockfd= %d\n",pTids[j],*pSockfd);
+            //printf("netfileserver: Do_netread spawned thread %ld, sockfd= %d\n",pTids[j],sockfd);
             j++;
         }
 
@@ -1069,12 +2112,15 @@ int Do_netread( const int nBytesWant, const int fileSize, pthread_t *pTids, int
         if ( *portCount >= portWanted) break;
     }
 
+    if ( xfer != NULL ) xfer->parts = *portCount;
+
     //printf("netfileserver: Do_netread portWanted= %d, portCount= %d, portList= %s\n",
     //               portWanted, *portCount, portList);
 
     if ( *portCount <= 0 ) {
         // All ports are in use.  Cannot do net read now.
         printf("netfileserver: no port is available.  Cannot do netread now.\n");
+        statsCount( COUNTER_PORTS_EXHAUSTED, 1 );
         errno = ETIMEDOUT;
         return FAILURE;
     }
@@ -1097,6 +2143,22 @@ void initialize()
         FD_Table[i].fcMode = INVALID_FILE_MODE;
         FD_Table[i].fileOpenFlags = O_RDONLY;
         FD_Table[i].pathname[0] = '\0';
+        FD_Table[i].bPrivate = FALSE;
+        FD_Table[i].hashNext = -1;
+        FD_Table[i].durability = NET_DURABLE_NONE;
+        FD_Table[i].dataPath[0] = '\0';
+        FD_Table[i].snapFd = -1;
+    }
+
+    for (i=0; i < FD_HASH_SIZE; i++) {
+        FD_Hash[i] = -1;
+    }
+    FD_FreeHint = 0;
+
+    for (i=0; i < TX_TABLE_SIZE; i++) {
+        TX_Table[i].id = 0;
+        TX_Table[i].nFiles = 0;
+        TX_Table[i].bCommitting = FALSE;
     }
 }
 
@@ -1106,38 +2168,14 @@ void initialize()
 int getSockfd( const int port )
 {
     int sockfd = -1;
-    int sockOpt = 1;
-    int rc = 0;
-    struct sockaddr_in serv_addr;
-
-
-    //
-    // Create a new socket for my listener
-    //
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        fprintf(stderr,"netfileserver: socket() failed, errno= %d\n", errno);
-        return FAILURE;
-    }
-
-    rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
-    if (rc != 0)
-    {
-        fprintf(stderr,"netfileserver: setsockopt() returned %d, errno= %d\n", rc, errno);
-    };
 
 
     //
-    // Initialize the server address structure to be
-    // used for binding my socket to a port number.
-    // This port number is hard-coded in the
-    // "libnetfiles.h" header file called "NET_SERVER_PORT_NUM".
+    // Create a new socket for my listener, bound to
+    // the data port
     //
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    sockfd = bindPort( port );
+    if (sockfd < 0)
     {
         // This port may have already opened by another thread
         if ( errno == EADDRINUSE ) {
@@ -1165,11 +2203,155 @@ int getSockfd( const int port )
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// Create a socket bound to "port" on every local address.
+// It is an IPv6 socket that also takes IPv4 clients, so the
+// server answers on whichever address a client resolved;
+// a host without IPv6 gets a plain IPv4 socket.  Returns
+// the socket, or FAILURE with errno set.
+//
 /////////////////////////////////////////////////////////////
 
+int bindPort( const int port )
+{
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in  addr4;
+    int sockfd  = -1;
+    int sockOpt = 1;
+    int v6Only  = 0;
+    int rc = 0;
 
 
-//
+    sockfd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (sockfd >= 0) {
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+
+        bzero((char *) &addr6, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(port);
+        if (bind(sockfd, (struct sockaddr *) &addr6, sizeof(addr6)) == 0) {
+            return sockfd;
+        }
+
+        // In use is in use for IPv4 as well
+        rc = errno;
+        close(sockfd);
+        errno = rc;
+        if ( errno == EADDRINUSE ) return FAILURE;
+    }
+
+
+    //
+    // No IPv6 here, so listen on IPv4 only
+    //
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        fprintf(stderr,"netfileserver: socket() failed, errno= %d\n", errno);
+        return FAILURE;
+    }
+
+    rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockOpt, sizeof(sockOpt));
+    if (rc != 0) {
+        fprintf(stderr,"netfileserver: setsockopt() returned %d, errno= %d\n", rc, errno);
+    }
+
+    bzero((char *) &addr4, sizeof(addr4));
+    addr4.sin_family = AF_INET;
+    addr4.sin_addr.s_addr = INADDR_ANY;
+    addr4.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *) &addr4, sizeof(addr4)) < 0) {
+        rc = errno;
+        close(sockfd);
+        errno = rc;
+        return FAILURE;
+    }
+
+    return sockfd;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Read exactly "nBytes" from the socket.  Returns the number
+// of bytes read, which is less than "nBytes" only if the
+// client closed the connection, or FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+int readFully( const int sockfd, char *buf, const int nBytes )
+{
+    int nRead = 0;
+    int rc = 0;
+
+    while ( nRead < nBytes ) {
+        rc = read(sockfd, buf + nRead, nBytes - nRead);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        if ( rc == 0 ) break;  // connection closed
+        nRead = nRead + rc;
+    }
+    return nRead;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Read and throw away the "nBytes" that follow a request the
+// server refuses, so the client gets to read the refusal
+// rather than have its connection reset.  Returns SUCCESS,
+// or FAILURE if the client closed the connection first.
+//
+/////////////////////////////////////////////////////////////
+
+int drainFully( const int sockfd, const long nBytes )
+{
+    char buf[ 4096 ];
+    long nLeft = nBytes;
+    int nWant = 0;
+
+    while ( nLeft > 0 ) {
+        nWant = (nLeft < (long)sizeof(buf)) ? (int)nLeft : (int)sizeof(buf);
+        if ( readFully(sockfd, buf, nWant) != nWant ) return FAILURE;
+        nLeft = nLeft - nWant;
+    }
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write all "nBytes" to the socket, retrying short writes.
+// Returns the number of bytes written or FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+int writeFully( const int sockfd, const char *buf, const int nBytes )
+{
+    int nWritten = 0;
+    int rc = 0;
+
+    while ( nWritten < nBytes ) {
+        rc = write(sockfd, buf + nWritten, nBytes - nWritten);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            return FAILURE;
+        }
+        nWritten = nWritten + rc;
+    }
+    return nWritten;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+
+//
 // matchFD() function returns the index of the FD table that
 // contains the NET_FD_TYPE entry that we are looking for.
 // The return value is **NOT** the actual file descriptor
@@ -1184,25 +2366,43 @@ int matchFD( NET_FD_TYPE *newFd )
     int i = 0;
 
     //
-    // Find the given file descriptor in the file descriptor table
+    // Find the given file descriptor in the file descriptor table.
+    // Only the slots on this pathname's hash chain can match.
     //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
+    for (i = FD_Hash[ hashPathname(newFd->pathname) ]; i >= 0; i = FD_Table[i].hashNext) {
         if ((strcmp(FD_Table[i].pathname, newFd->pathname) == 0) &&
             (FD_Table[i].fcMode == newFd->fcMode) &&
-            (FD_Table[i].fileOpenFlags == newFd->fileOpenFlags))
+            (FD_Table[i].fileOpenFlags == newFd->fileOpenFlags) &&
+            (FD_Table[i].bPrivate == FALSE) &&
+            (FD_Table[i].snapFd < 0))
         {
             // Found the file descriptor specified
-            //printFDtable();
             return i;
         }
     }
 
     // Cannot find the file descriptor specified
-    //printFDtable();
     return FAILURE;
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// FNV-1a hash of a pathname, used to pick its FD_Hash chain
+//
+/////////////////////////////////////////////////////////////
+
+unsigned int hashPathname( const char *pathname )
+{
+    unsigned int hash = 2166136261u;
+
+    while ( *pathname != '\0' ) {
+        hash = (hash ^ (unsigned char)*pathname++) * 16777619u;
+    }
+    return hash % FD_HASH_SIZE;
+}
+
+
 /////////////////////////////////////////////////////////////
 //
 // This function returns a NET_FD_TYPE data structure found
@@ -1215,22 +2415,84 @@ NET_FD_TYPE *LookupFDtable( const int netfd )
     int i = 0;
 
     //
-    // Find the given file descriptor in the file descriptor table
+    // A net fd is derived from its slot index (see createFD),
+    // so the slot can be computed rather than searched for.
     //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
-        if (FD_Table[i].fd == netfd) {
-            // Found the file descriptor specified
-            //printFDtable();
+    if ((netfd > -10) || (netfd % 10 != 0)) return NULL;
 
-            return &FD_Table[i];
-        }
+    i = (-netfd / 10) - 1;
+    if ((i < FD_TABLE_SIZE) && (FD_Table[i].fd == netfd)) {
+        // Found the file descriptor specified
+        return &FD_Table[i];
     }
 
     // Cannot find the file descriptor specified
-    //printFDtable();
     return NULL;
 }
 
+
+/////////////////////////////////////////////////////////////
+//
+// Copy the fd table entry for "netfd" while holding the
+// table lock.  Transfer threads use the copy, because
+// another client sharing the same netfd may close it (and
+// clear the entry) while the transfer is still running.
+//
+/////////////////////////////////////////////////////////////
+
+int copyFDentry( const int netfd, NET_FD_TYPE *entry )
+{
+    NET_FD_TYPE *pFD = NULL;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    pFD = LookupFDtable( netfd );
+    if ( pFD != NULL ) {
+        *entry = *pFD;
+        entry->snapFd = -1;   // only the table owns the snapshot; read it with openFDdata()
+    }
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    return (pFD != NULL) ? SUCCESS : FAILURE;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Open the data "netfd" reads with "flags", and return the
+// descriptor, or -1 with errno set.  A pinned snapshot is
+// reopened through its /proc name while holding the table
+// lock, so the last reader of the old version cannot close
+// it (and let the fd number go to another file) in between.
+//
+/////////////////////////////////////////////////////////////
+
+int openFDdata( const int netfd, const int flags )
+{
+    NET_FD_TYPE *pFD = NULL;
+    char pathname[288] = "";
+    int bOpened = FALSE;
+    int fd = -1;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    pFD = LookupFDtable( netfd );
+    if ( pFD == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBADF;
+        return -1;
+    }
+    if ( pFD->snapFd >= 0 ) {
+        sprintf(pathname, "/proc/self/fd/%d", pFD->snapFd);
+        fd = open(pathname, flags);
+        bOpened = TRUE;
+    }
+    else strcpy( pathname, pFD->dataPath );
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    if ( bOpened == FALSE ) fd = open(pathname, flags);
+
+    return fd;
+}
+
 /////////////////////////////////////////////////////////////
 //
 // This function return a file descriptor.  A valid net file
@@ -1247,12 +2509,13 @@ int createFD( NET_FD_TYPE *newFd )
     int rc = -1;
 
     //
-    // Try to find the file descriptor from fd table
+    // Try to find the file descriptor from fd table.  A
+    // private entry (netget/netput) always gets its own slot,
+    // so closing it cannot affect anyone else.
     //
-    rc = matchFD( newFd );
+    rc = newFd->bPrivate ? FAILURE : matchFD( newFd );
     if ( rc >= 0 ) {
         // Found the file descriptor.  No need to re-create.
-        //printFDtable();
         //printf("createFD: found fd %d, no need to create new fd\n", FD_Table[rc].fd);
         return FD_Table[rc].fd;
     }
@@ -1261,22 +2524,31 @@ int createFD( NET_FD_TYPE *newFd )
     // The given file descriptor is not in fd table.  Need to
     // find an available slot in the file descriptor table to
     // to save the information for this new file descriptor.
+    // The lowest free slot is used, so fd numbers stay small.
     //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
+    for (i = FD_FreeHint; i < FD_TABLE_SIZE; i++) {
         if ( FD_Table[i].pathname[0] == '\0' ) {
             // Found an empty slot in my FD table
+            unsigned int hash = hashPathname( newFd->pathname );
+
             FD_Table[i].fd = (-10 * (i+1));  // fd must be negative
             FD_Table[i].fcMode = newFd->fcMode;
             FD_Table[i].fileOpenFlags = newFd->fileOpenFlags;
             strcpy( FD_Table[i].pathname, newFd->pathname);
-            //printFDtable();
+            FD_Table[i].bPrivate = newFd->bPrivate;
+            FD_Table[i].hashNext = FD_Hash[hash];
+            FD_Table[i].durability = NET_DURABLE_NONE;
+            strcpy( FD_Table[i].dataPath, newFd->pathname );
+            FD_Table[i].snapFd = -1;
+            FD_Hash[hash] = i;
+            FD_FreeHint = i + 1;
 
             return FD_Table[i].fd;  // fd must be negative
          }
     }
+    FD_FreeHint = FD_TABLE_SIZE;
 
     // File descriptor table is full
-    //printFDtable();
     return FAILURE;
 }
 
@@ -1286,690 +2558,2787 @@ int createFD( NET_FD_TYPE *newFd )
 
 int deleteFD( int fd )
 {
+    NET_FD_TYPE *pFD = NULL;
+    int *pLink = NULL;
     int i = 0;
 
     //
     // Try to find the file descriptor from fd table
     //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
-        if ( FD_Table[i].fd == fd ) {
-            // Found the fd that I want to delete
-            FD_Table[i].fd = 0;  // fd must be negative
-            FD_Table[i].fcMode = INVALID_FILE_MODE;
-            FD_Table[i].fileOpenFlags = O_RDONLY;
-            FD_Table[i].pathname[0] = '\0';
-            //printFDtable();
-
-            return fd;
-         }
+    pthread_mutex_lock( &FD_Table_lock );
+    pFD = LookupFDtable( fd );
+    if ( pFD == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBADF;
+        return FAILURE;
     }
-    //printFDtable();
-    errno = EBADF;
-    return FAILURE;
-}
-
-/////////////////////////////////////////////////////////////
-
-int tableFull() {
-	int full = 1; //true initially
-	int i;
-	for (i = 0; i < FD_TABLE_SIZE; i++) {
-		if (FD_Table[i].pathname == '\0') {
-			full = 0;
-			return full;
-		}
-	}
-	return full;
-}
-
-/////////////////////////////////////////////////////////////
-
-void printFDtable()
-{
-    int i = 0;
+    i = (int)(pFD - FD_Table);
 
     //
-    // print the content of the fd table
+    // Unlink the slot from its pathname hash chain
     //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
-        printf("FD_Table[%i]: fd= %d, fcMode= %d, fileOpenFlags= %d, pathname= %s\n",
-                i, FD_Table[i].fd, FD_Table[i].fcMode,
-                FD_Table[i].fileOpenFlags, FD_Table[i].pathname);
-    }
+    pLink = &FD_Hash[ hashPathname(pFD->pathname) ];
+    while ((*pLink >= 0) && (*pLink != i)) pLink = &FD_Table[*pLink].hashNext;
+    if ( *pLink == i ) *pLink = pFD->hashNext;
+
+    // Found the fd that I want to delete
+    pFD->fd = 0;  // fd must be negative
+    pFD->fcMode = INVALID_FILE_MODE;
+    pFD->fileOpenFlags = O_RDONLY;
+    pFD->pathname[0] = '\0';
+    pFD->bPrivate = FALSE;
+    pFD->hashNext = -1;
+    pFD->durability = NET_DURABLE_NONE;
+    pFD->dataPath[0] = '\0';
+    if ( pFD->snapFd >= 0 ) close( pFD->snapFd );   // the last reader of an old version frees it
+    pFD->snapFd = -1;
+    if ( i < FD_FreeHint ) FD_FreeHint = i;
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    return fd;
 }
 
-/////////////////////////////////////////////////////////////
 
+/////////////////////////////////////////////////////////////
+//
+// Check a netadvise hint for "netfd".  The entry may be
+// shared by other clients, so the hint isn't kept here: the
+// client sends it with each netread and netwrite of the fd.
+// NET_ADVICE_WILLNEED starts reading the file in right away.
+//
+/////////////////////////////////////////////////////////////
 
-int canOpen( NET_FD_TYPE *newFd )
+int setAdvice( const int netfd, const int advice )
 {
-    int i = 0;
-
-    //
-    // Search each entry in the file descriptor table looking
-    // for the pathname.
-    //
-    for (i=0; i < FD_TABLE_SIZE; i++) {
-        if (strcmp(FD_Table[i].pathname, newFd->pathname) == 0)
-        {
-            //
-            // Found the specified pathname.  This file
-            // has already been opened by a client.
-            //
-            FILE_CONNECTION_MODE  fc = FD_Table[i].fcMode;
-            int  oFlag = FD_Table[i].fileOpenFlags;
-
-
-            //
-            // I am told to open this file in a new mode of
-            // operation.  I must determine if that is allowed.
-            //
-            switch (newFd->fcMode) {
-                case TRANSACTION_MODE:
-                    //
-                    // For transaction mode, that means this file must
-                    // not be opened by another client for any reason.
-                    //
-                    return FALSE;  // Already opened by another client
-                    break;
-
-                case EXCLUSIVE_MODE:
-                case UNRESTRICTED_MODE:
-                    //
-                    // Check if this file can be opened in exclusive mode.
-                    // This means no fd has been assigned to this file that
-                    // has any kind of write permission (i.e. O_WRONLY or O_RDWR)
-                    //
-                    if (fc == TRANSACTION_MODE) return FALSE;
-
-                    switch (newFd->fileOpenFlags) {
-                        case O_RDONLY:
-                            // Allow to open
-                            break;
-
-                        case O_WRONLY:
-                        case O_RDWR:
-                            if ((fc == EXCLUSIVE_MODE) && (oFlag != O_RDONLY))
-                                return FALSE;
-
-                            break;
-                     }
-                     break;
-
-                case INVALID_FILE_MODE:
-                     return FALSE;
-                     break;
-
-            } // Switch on new wanted connection mode
+    int fd = -1;
 
-        }  // Found the pathname in FD_Table
+    if (((advice & NET_ADVICE_MASK) > NET_ADVICE_WILLNEED) ||
+        ((advice & ~(NET_ADVICE_MASK | NET_ADVICE_DIRECT)) != 0)) {
+        errno = EINVAL;
+        return FAILURE;
+    }
 
-    }  // For each entry in FD_Table
+    pthread_mutex_lock( &FD_Table_lock );
+    if ( LookupFDtable( netfd ) == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBADF;
+        return FAILURE;
+    }
+    pthread_mutex_unlock( &FD_Table_lock );
 
+    if ((advice & NET_ADVICE_MASK) == NET_ADVICE_WILLNEED) {
+        fd = openFDdata(netfd, O_RDONLY);
+        if ( fd >= 0 ) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
 
-    //
-    // At this point, I have passed all tests.  I am allowed
-    // to open this file in the specified connection mode and
-    // file open flags.
-    //
-    return TRUE;
+    return SUCCESS;
 }
 
-/////////////////////////////////////////////////////////////
 
+/////////////////////////////////////////////////////////////
+//
+// Record when writes to "netfd" are to be made durable
+//
+/////////////////////////////////////////////////////////////
 
-int canWrite( const int netfd, const int nBytes)
+int setDurability( const int netfd, const int mode )
 {
-    //
-    // Check if this netfd is opened for O_RDONLY
-    //
-
-    NET_FD_TYPE *pFD = LookupFDtable(netfd);
-    if ( pFD == NULL ) {
-        // There is no such netfd in my file
-        // descriptor table.
-        errno = EBADF;
-        return FAILURE;
-    }
+    NET_FD_TYPE *pFD = NULL;
 
-    if (pFD->fileOpenFlags == O_RDONLY) {
-        // This netfd is opened for read-only mode
-        errno = EACCES;
+    if ((mode < NET_DURABLE_NONE) || (mode > NET_DURABLE_WRITE)) {
+        errno = EINVAL;
         return FAILURE;
     }
 
-    if (nBytes < 0) {
-        // Invalid input argument.  Cannot write negative
-        // number of bytes into a file.
-        errno = EINVAL;
+    pthread_mutex_lock( &FD_Table_lock );
+    pFD = LookupFDtable( netfd );
+    if ( pFD == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBADF;
         return FAILURE;
     }
+    pFD->durability = mode;
+    pthread_mutex_unlock( &FD_Table_lock );
 
-    // This "netfd" is allowed for writing
     return SUCCESS;
 }
 
-/////////////////////////////////////////////////////////////
-
 
-int canRead( const int netfd, const int nBytesWant, int *fileSize)
-{
-    *fileSize = 0;
-
-    //
-    // Check if this netfd is opened for O_RDONLY
-    //
+/////////////////////////////////////////////////////////////
+//
+// netclose.  A file opened for writing with
+// NET_DURABLE_CLOSE is synced first, and a new version
+// written in transaction mode is committed; the netfd is
+// closed even if that fails, as close(2) does, but the
+// failure is returned.
+//
+/////////////////////////////////////////////////////////////
 
-    NET_FD_TYPE *fileInfo = LookupFDtable(netfd);
-    if ( fileInfo == NULL ) {
-        // There is no such netfd in my file
-        // descriptor table.
-        errno = EBADF;
-        return FAILURE;
+int closeFD( const int netfd )
+{
+    NET_FD_TYPE fileInfo;
+    int rc = SUCCESS;
+    int err = 0;
+
+    if ( copyFDentry( netfd, &fileInfo ) == SUCCESS ) {
+        if ( isNewVersion(&fileInfo) == TRUE ) {
+            rc = commitVersion( &fileInfo );
+            err = errno;
+        }
+        else if ((fileInfo.durability == NET_DURABLE_CLOSE) &&
+                 (fileInfo.fileOpenFlags != O_RDONLY)) {
+            rc = syncFile( fileInfo.pathname );
+            err = errno;
+        }
     }
 
-    if (fileInfo->fileOpenFlags == O_WRONLY) {
-        // This netfd is opened for write-only mode
-        errno = EACCES;
+    if ( deleteFD( netfd ) == FAILURE ) return FAILURE;
+    if ( rc == FAILURE ) {
+        errno = err;
         return FAILURE;
     }
+    return netfd;
+}
 
-    if (nBytesWant < 0) {
-        // Invalid input argument.  Cannot read negative
-        // number of bytes from a file.
-        errno = EINVAL;
-        return FAILURE;
-    }
+/////////////////////////////////////////////////////////////
+//
+// TRUE if "pFD" writes a new version of its file, to be
+// committed on close
+//
+/////////////////////////////////////////////////////////////
 
-    //
-    // Get the file size
-    //
-    FILE *fpRead = NULL;
+int isNewVersion( const NET_FD_TYPE *pFD )
+{
+    return ((pFD->fcMode == TRANSACTION_MODE) && (pFD->fileOpenFlags != O_RDONLY)) ? TRUE : FALSE;
+}
 
-    // Open the file for reading
-    fpRead = fopen(fileInfo->pathname,"r");
-    if ( fpRead == NULL ) {
-        // Fail to open the temp file
-        fprintf(stderr,"netfileserver: canRead: fails to open \"%s\" for read, errno= %d\n",
-                  fileInfo->pathname, errno);
-        errno = EACCES;
-        return FAILURE;
-    }
 
-    // Go to the end of the temp file.
-    if (fseek(fpRead, 0L, SEEK_END) == 0) {
-        *fileSize = ftell(fpRead);   // Get the size of the file.
-    }
-    if (fpRead != NULL) fclose(fpRead);
+/////////////////////////////////////////////////////////////
+//
+// TRUE if a new version of "pathname" is being written,
+// by a writer in transaction mode or in a transaction.  The
+// caller holds FD_Table_lock.
+//
+/////////////////////////////////////////////////////////////
 
+int versionHeld( const char *pathname )
+{
+    int i = 0;
+    int j = 0;
 
-    // This "netfd" is allowed for reading
-    return SUCCESS;
+    for (i = FD_Hash[ hashPathname(pathname) ]; i >= 0; i = FD_Table[i].hashNext) {
+        if ((strcmp(FD_Table[i].pathname, pathname) == 0) && (isNewVersion(&FD_Table[i]) == TRUE)) {
+            return TRUE;
+        }
+    }
+
+    // A transaction its client left behind no longer counts
+    txReap();
+    for (i=0; i < TX_TABLE_SIZE; i++) {
+        if ( TX_Table[i].id == 0 ) continue;
+        for (j=0; j < TX_Table[i].nFiles; j++) {
+            if ( strcmp(TX_Table[i].files[j].pathname, pathname) == 0 ) return TRUE;
+        }
+    }
+    return FALSE;
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// Hold on to the version of the file "pFD" reads now.  The
+// open descriptor keeps that version alive after a commit
+// replaces it, and openFDdata() reads go through it.  The
+// caller holds FD_Table_lock.
+//
 /////////////////////////////////////////////////////////////
 
-
-void *netwriteListener( void *sfd )
+void pinSnapshot( NET_FD_TYPE *pFD )
 {
-    const int sockfd = *((int *)sfd);
-
-    int newsockfd = 0;
-    struct sockaddr_in  cli_addr;
-    int clilen = sizeof(cli_addr);
-    int rc = 0;
+    int fd = -1;
 
-    char msg[MSG_SIZE] = "";
-    char myThreadLabel[128] = "";
-    sprintf(myThreadLabel, "netfileserver: netwriteListener %ld,", pthread_self());
+    if ((pFD->snapFd >= 0) || (pFD->fileOpenFlags != O_RDONLY)) return;
 
+    fd = open(pFD->pathname, O_RDONLY);
+    if ( fd < 0 ) return;   // nothing to keep; reads see the file as it is
 
-    free(sfd);
-    //printf("%s waiting to accept from sockfd %d\n", myThreadLabel, sockfd);
-    if ((newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, (socklen_t *)&clilen)) < 0)
-    {
-        //
-        // Socket accept function returns an error
-        //
-        fprintf(stderr,"%s accept() failed, sockfd= %d, errno= %d (%s), h_errno= %d\n",
-                 myThreadLabel, sockfd, errno, strerror(errno), h_errno);
+    pFD->snapFd = fd;
+}
 
-        if ( newsockfd != 0 ) close(newsockfd);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
-    }
-    if ( sockfd != 0 ) close(sockfd);
 
+/////////////////////////////////////////////////////////////
+//
+// Start the new version of a file opened for writing in
+// transaction mode.  A writer that can read starts from a
+// copy of the committed file, shared on disk where the file
+// system supports it.  A write-only writer replaces the whole
+// file with its first netwrite, so its version is created
+// then.
+//
+/////////////////////////////////////////////////////////////
 
-    //
-    // First incoming message format is:
-    //     netwrite, netfd, seqNum, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    rc = read(newsockfd, msg, MSG_SIZE -1);
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
-                 myThreadLabel, errno, h_errno);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+int newVersion( const NET_FD_TYPE *pFD )
+{
+    struct stat fileStat;
+    int fdIn = -1;
+    int fdOut = -1;
+    int rc = SUCCESS;
+    int err = 0;
+
+    // Left over from a writer that never closed
+    unlink( pFD->dataPath );
+    if ( pFD->fileOpenFlags == O_WRONLY ) return SUCCESS;
+
+    fdIn = open(pFD->pathname, O_RDONLY);
+    if ((fdIn < 0) || (fstat(fdIn, &fileStat) < 0)) {
+        if ( fdIn >= 0 ) close(fdIn);
+        if ( errno != ENOENT ) return FAILURE;
+
+        // A new file starts empty
+        fdOut = open(pFD->dataPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if ( fdOut < 0 ) return FAILURE;
+        close(fdOut);
+        return SUCCESS;
     }
-    //printf("%s received \"%s\"\n", myThreadLabel, msg);
-
-    int netFunc = -1;
-    int netfd = -1;
-    int seqNum = -1;
-    int nBytes = -1;
-    sscanf(msg, "%d,%d,%d,%d", &netFunc, &netfd, &seqNum, &nBytes);
-    //printf("%s netFunc= %d, netfd= %d, seqNum= %d, nBytes= %d\n",
-    //         myThreadLabel, netFunc, netfd, seqNum, nBytes);
-
 
-    //
-    // Send my response back to the client
-    //     resultCode, errno, h_errno, seqNum, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%d,%d", SUCCESS, errno, h_errno, seqNum, nBytes);
-    rc = write(newsockfd, msg, strlen(msg) );
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to write \"%s\"\n", myThreadLabel, msg);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+    fdOut = open(pFD->dataPath, O_WRONLY | O_CREAT | O_TRUNC, fileStat.st_mode & 07777);
+    if ( fdOut < 0 ) {
+        err = errno;
+        close(fdIn);
+        errno = err;
+        return FAILURE;
     }
-    //printf("%s responded \"%s\"\n", myThreadLabel, msg);
-
-
-    //
-    // Read nBytes of data from the client
-    //
-    char *data;
-    data = malloc(nBytes * sizeof(char));
-    bzero(data, nBytes);
 
-    rc = read(newsockfd, data, nBytes);
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
-                 myThreadLabel, errno, h_errno);
-        if ( sockfd != 0 ) close(sockfd);
+    if ( copyRange(fdIn, 0, fdOut, 0, (long)fileStat.st_size) != (long)fileStat.st_size ) {
+        err = (errno != 0) ? errno : EIO;
+        unlink( pFD->dataPath );
         rc = FAILURE;
-        pthread_exit( &rc );
     }
+    close(fdIn);
+    close(fdOut);
 
-    nBytes = rc;  // This is the number of bytes received
-    //printf("%s received %d bytes of data\n", myThreadLabel, nBytes);
+    errno = err;
+    return rc;
+}
 
 
-    //
-    // Save the received data into a temporary file
-    // using the sequence number as part of the file name
-    //
-    rc = savePartfile( netfd, seqNum, data, nBytes);
-    free(data);
+/////////////////////////////////////////////////////////////
+//
+// Make a new version the committed one.  It is put on disk
+// first and then renamed over the file, so anyone opening
+// the file gets either all of the old version or all of the
+// new; the directory is then synced to keep the rename.
+// Readers holding the old version keep reading it until
+// they close.  A write-only writer that wrote nothing
+// leaves the file as it was.
+//
+/////////////////////////////////////////////////////////////
 
+int commitVersion( const NET_FD_TYPE *pFD )
+{
+    struct stat fileStat;
 
-    //
-    // Send my response back to the client
-    //     resultCode, errno, h_errno, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, nBytes);
-    rc = write(newsockfd, msg, strlen(msg) );
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to write \"%s\"\n", myThreadLabel, msg);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+    if ((stat(pFD->dataPath, &fileStat) < 0) && (errno == ENOENT)) {
+        errno = 0;
+        return SUCCESS;
     }
-    //printf("%s responded \"%s\"\n", myThreadLabel, msg);
 
-    if ( newsockfd != 0 ) close(newsockfd);
-    rc = SUCCESS;
-    pthread_exit( &nBytes );
+    // No journal record may outlive the rename onto the file
+    if ((journalSupersede( pFD->pathname ) == FAILURE) ||
+        (syncFile( pFD->dataPath ) == FAILURE) ||
+        (rename(pFD->dataPath, pFD->pathname) < 0)) {
+        int err = errno;
+        unlink( pFD->dataPath );
+        errno = err;
+        return FAILURE;
+    }
 
+    // The rename itself is on disk once the directory is
+    return syncDir( pFD->pathname );
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// Copy "nBytes" from "fdIn" at "offIn" to "fdOut" at
+// "offOut" without going through the server's memory where
+// the kernel can do it, by copy_file_range.  That shares
+// the blocks on file systems with reflinks.  Otherwise the
+// data goes through a pooled buffer.  Returns the number of
+// bytes copied, which is short at the end of "fdIn", or
+// FAILURE.
+//
 /////////////////////////////////////////////////////////////
 
-
-int savePartfile( int netfd, int seqNum, char *data, int nBytes)
+long copyRange( const int fdIn, off_t offIn, const int fdOut, off_t offOut, const long nBytes )
 {
-    NET_FD_TYPE  *fileInfo;
-    char tempfile[256] = "";
-    char fileExt[16] = "";
-    FILE *fp;
-    int rc = FAILURE;
-
+    char *buf = NULL;
+    long nDone = 0;
+    ssize_t n = 0;
+
+    while ( nDone < nBytes ) {
+        n = copy_file_range(fdIn, &offIn, fdOut, &offOut, (size_t)(nBytes - nDone), 0);
+        if ( n <= 0 ) break;
+        nDone = nDone + n;
+        statsCount( COUNTER_COPY_BYTES, n );
+    }
+    if ((nDone == nBytes) || (n == 0)) return nDone;
 
-    //printf("netfileserver: savePartfile: netfd= \"%d\"\n", netfd);
-    //printFDtable();
     //
-    // Lookup file information from the given netfd to compose
-    // the temporary file name.  It is the target filename
-    // with a numeric extension such as ".1", ".2", etc.
+    // Not across these files; copy the rest by hand
     //
-    fileInfo = LookupFDtable( netfd );
-    strcpy( tempfile, fileInfo->pathname );
-    sprintf(fileExt, ".%d", seqNum );
-    strcat( tempfile, fileExt);
-    //printf("netfileserver: savePartfile: temp tempfile= \"%s\"\n", tempfile);
+    if ((errno != EXDEV) && (errno != EINVAL) && (errno != ENOSYS) &&
+        (errno != EOPNOTSUPP) && (errno != EBADF)) return FAILURE;
 
-    // Open the temp file for writing
-    fp = fopen(tempfile,"w");
-    if ( fp == NULL ) {
-        // Fail to open the temp file
-        fprintf(stderr,"netfileserver: savePartfile: fails to open \"%s\", errno= %d\n",tempfile,errno);
+    buf = poolGet( COPY_CHUNK_SIZE );
+    if ( buf == NULL ) {
+        errno = ENOMEM;
         return FAILURE;
     }
 
-    rc = fwrite(data, sizeof(char), nBytes, fp);
-    if ( fflush(fp) != 0 ) {
-        fprintf(stderr,"netfileserver: savePartfile: fails to fflush \"%s\", errno= %d\n",tempfile,errno);
+    while ( nDone < nBytes ) {
+        n = pread(fdIn, buf, ((nBytes - nDone) < COPY_CHUNK_SIZE) ? (size_t)(nBytes - nDone) : COPY_CHUNK_SIZE, offIn);
+        if ( n <= 0 ) break;
+        errno = 0;
+        if ( pwrite(fdOut, buf, (size_t)n, offOut) != n ) {
+            if ( errno == 0 ) errno = EIO;
+            n = -1;
+            break;
+        }
+        offIn = offIn + n;
+        offOut = offOut + n;
+        nDone = nDone + n;
+        statsCount( COUNTER_COPY_BYTES, n );
+        statsCount( COUNTER_COPY_BUFFERED, n );
     }
+    poolPut( buf, COPY_CHUNK_SIZE );
 
-    if ( fp != NULL ) fclose(fp);
-
-    return rc;
+    return (n < 0) ? FAILURE : nDone;
 }
 
-
+/////////////////////////////////////////////////////////////
+//
+// Find transaction "txId" in the transaction table.  One
+// whose lease has run out is aborted rather than found.
+// The caller holds FD_Table_lock.
+//
 /////////////////////////////////////////////////////////////
 
-
-int reconstruct( const int netfd, const int parts)
+NET_TX_TYPE *LookupTXtable( const long txId )
 {
-    NET_FD_TYPE  *fileInfo;
-    char tempfile[256] = "";
-    char fileExt[16] = "";
-    FILE *fpWrite, *fpRead;
-    long iTotalFileSize = 0;
-
+    int i = 0;
 
-    if ( parts <= 0 ) return SUCCESS;
+    if ( txId <= 0 ) return NULL;
+    txReap();
+    for (i=0; i < TX_TABLE_SIZE; i++) {
+        if ( TX_Table[i].id == txId ) return &TX_Table[i];
+    }
+    return NULL;
+}
 
-    // Find the file to write to
-    fileInfo = LookupFDtable( netfd );
-    //printf("netfileserver: reconstruct: pathname= \"%s\"\n", fileInfo->pathname);
 
-    // Open the final data file for writing
-    fpWrite = fopen(fileInfo->pathname,"w");
-    if ( fpWrite == NULL ) {
-        // Fail to open the data file for writing
-        fprintf(stderr,"netfileserver: reconstruct: fails to open \"%s\" for write, errno= %d\n",
-                   fileInfo->pathname, errno);
-        return FAILURE;
-    }
+/////////////////////////////////////////////////////////////
+//
+// nettx_begin.  Returns the new transaction's id, a random
+// number only its client knows, or FAILURE with errno
+// ENFILE if too many are open.
+//
+/////////////////////////////////////////////////////////////
 
-    long bufsize = 0;
-    char *data = NULL;
-    int seqNum = 1;
+long txBegin()
+{
+    NET_TX_TYPE *slot = NULL;
+    long txId = 0;
+    int i = 0;
 
-    for (seqNum=1; seqNum<= parts; seqNum++) {
-        strcpy( tempfile, fileInfo->pathname );
-        sprintf(fileExt, ".%d", seqNum );
-        strcat( tempfile, fileExt);
-        //printf("netfileserver: reconstruct: tempfile= \"%s\"\n", tempfile);
+    pthread_mutex_lock( &FD_Table_lock );
+    txReap();
+    for (i=0; (i < TX_TABLE_SIZE) && (slot == NULL); i++) {
+        if ( TX_Table[i].id == 0 ) slot = &TX_Table[i];
+    }
 
-        // Open the temp file for reading
-        fpRead = fopen(tempfile,"r");
-        if ( fpRead == NULL ) {
-            // Fail to open the temp file
-            fprintf(stderr,"netfileserver: reconstruct: fails to open \"%s\" for read, errno= %d\n",
-                      tempfile,errno);
-            if (fpWrite != NULL) fclose(fpWrite);
+    while ((slot != NULL) && (txId == 0)) {
+        if ( getrandom(&txId, sizeof(txId), 0) != sizeof(txId) ) {
+            pthread_mutex_unlock( &FD_Table_lock );
+            errno = EIO;
             return FAILURE;
         }
+        txId = txId & LONG_MAX;
+        if ( LookupTXtable(txId) != NULL ) txId = 0;
+    }
+    if ( slot != NULL ) {
+        slot->id = txId;
+        slot->nFiles = 0;
+        slot->bCommitting = FALSE;
+        slot->lastUsed = statsNow();
+    }
+    pthread_mutex_unlock( &FD_Table_lock );
 
+    if ( slot == NULL ) {
+        errno = ENFILE;
+        return FAILURE;
+    }
+    return txId;
+}
 
-        // Read the entire part file into memory
-        bufsize = 0;
-        data = NULL;
 
-        // Go to the end of the temp file.
-        if (fseek(fpRead, 0L, SEEK_END) == 0) {
-            // Get the size of the file.
-            bufsize = ftell(fpRead);
-            if (bufsize != -1) {
-                // Allocate our buffer to that size.
-                data = malloc(sizeof(char) * (bufsize + 1));
-                bzero(data,bufsize+1);
+/////////////////////////////////////////////////////////////
+//
+// Abort every transaction that has been idle longer than
+// its lease, as its client has most likely gone away.  The
+// caller holds FD_Table_lock.
+//
+/////////////////////////////////////////////////////////////
 
-                // Go back to the start of the file.
-                if (fseek(fpRead, 0L, SEEK_SET) != 0) {
-                    // Error
-                    if (data != NULL) free(data);
-                    data = NULL;
-                }
-            }
+void txReap()
+{
+    uint64_t now = statsNow();
+    int i = 0;
+    int j = 0;
 
-            if ( data != NULL ) {
-                // Read the entire file into memory.
-                size_t dataSize = fread(data, sizeof(char), bufsize, fpRead);
-                if (dataSize == 0) {
-                    fprintf(stderr,"netfileserver: reconstruct: fails to read \"%s\", errno= %d\n",
-                       tempfile, errno);
+    for (i=0; i < TX_TABLE_SIZE; i++) {
+        if ((TX_Table[i].id == 0) || (TX_Table[i].bCommitting == TRUE)) continue;
+        if ( now - TX_Table[i].lastUsed < TX_LEASE_NS ) continue;
 
-                    if (data != NULL) free(data);
-                    data = NULL;
-                }
-            }
-        }
-        if (fpRead != NULL) fclose(fpRead);
+        for (j=0; j < TX_Table[i].nFiles; j++) unlink( TX_Table[i].files[j].stagePath );
+        TX_Table[i].id = 0;
+        TX_Table[i].nFiles = 0;
+        statsCount( COUNTER_TX_ABORTS, 1 );
+    }
+}
 
-        if ( data != NULL ) {
-            // Write the part data into the output file
-            int nBytes = -1;
-            nBytes = fwrite(data, sizeof(char), bufsize, fpWrite);
-            iTotalFileSize = iTotalFileSize + nBytes;
-            if (data != NULL)   free(data);
 
-            if ( seqNum == 1 ) {
-                //
-                // After the first part in the file sequence,
-                // I must open the data file for append mode.
+/////////////////////////////////////////////////////////////
+//
+// Point "fileInfo" at the staged file for its pathname in
+// transaction "txId", adding the file to the transaction
+// on its first write.  From then until the transaction ends
+// the file's readers keep the version they have, as for a
+// writer in transaction mode.
+//
+/////////////////////////////////////////////////////////////
+
+int txStage( const long txId, NET_FD_TYPE *fileInfo )
+{
+    NET_TX_TYPE *tx = NULL;
+    TX_FILE_TYPE *file = NULL;
+    char fileExt[32] = "";
+    int i = 0;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    tx = LookupTXtable( txId );
+    if ( tx == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EINVAL;
+        return FAILURE;
+    }
+    if ( tx->bCommitting == TRUE ) {
+        // Too late: the commit already has its list of files
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBUSY;
+        return FAILURE;
+    }
+
+    for (i=0; i < tx->nFiles; i++) {
+        if ( strcmp(tx->files[i].pathname, fileInfo->pathname) == 0 ) file = &tx->files[i];
+    }
+
+    if ( file == NULL ) {
+        if ( tx->nFiles >= NET_TX_MAX_FILES ) {
+            pthread_mutex_unlock( &FD_Table_lock );
+            errno = EMFILE;
+            return FAILURE;
+        }
+
+        for (i = FD_Hash[ hashPathname(fileInfo->pathname) ]; i >= 0; i = FD_Table[i].hashNext) {
+            if ( strcmp(FD_Table[i].pathname, fileInfo->pathname) == 0 ) pinSnapshot( &FD_Table[i] );
+        }
+
+        file = &tx->files[ tx->nFiles++ ];
+        strcpy( file->pathname, fileInfo->pathname );
+        strcpy( file->stagePath, fileInfo->pathname );
+        sprintf(fileExt, "%s%lx", TX_EXT, txId );
+        strcat( file->stagePath, fileExt );
+    }
+    strcpy( fileInfo->dataPath, file->stagePath );
+    tx->lastUsed = statsNow();
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// nettx_commit.  Every staged file is synced, all in one
+// group, and then renamed over its file with the fd table
+// locked, so no netopen comes between the renames: it sees
+// all of the new versions or none.  If a file can't be
+// synced nothing is committed and the transaction is
+// aborted.  Once the commit has started the transaction
+// takes no more writes.
+//
+// The renames are written down in a commit record first,
+// so a crash part way through them is finished on restart
+// by txRecover.  A rename that fails stops the commit there
+// and keeps the transaction, with the files not yet in
+// place, so nettx_commit can be tried again or the rest
+// aborted.  Readers that had a file open keep their version
+// until they close, as after a commit in transaction mode.
+// The directories are synced before the record is removed,
+// so the renames are on disk when the commit returns.
+//
+/////////////////////////////////////////////////////////////
+
+int txCommit( const long txId )
+{
+    NET_TX_TYPE *tx = NULL;
+    NET_TX_TYPE commit;
+    const char *stagePaths[ NET_TX_MAX_FILES ];
+    char recordPath[320] = "";
+    struct stat fileStat;
+    int nStaged = 0;
+    int nRenamed = 0;
+    int bRecorded = FALSE;
+    int rc = SUCCESS;
+    int err = 0;
+    int i = 0;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    tx = LookupTXtable( txId );
+    if ((tx != NULL) && (tx->bCommitting == FALSE)) {
+        tx->bCommitting = TRUE;
+        commit = *tx;
+    }
+    else tx = NULL;
+    pthread_mutex_unlock( &FD_Table_lock );
+    if ( tx == NULL ) {
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    //
+    // A file whose staged write failed before creating it,
+    // or that an earlier try already renamed, has nothing
+    // to commit
+    //
+    for (i=0; i < commit.nFiles; i++) {
+        if ( stat(commit.files[i].stagePath, &fileStat) == 0 ) {
+            stagePaths[ nStaged++ ] = commit.files[i].stagePath;
+        }
+    }
+
+    if ( syncFiles( stagePaths, nStaged ) == FAILURE ) {
+        err = errno;
+        rc = FAILURE;
+    }
+    for (i=0; (i < commit.nFiles) && (rc == SUCCESS); i++) {
+        if ( journalSupersede( commit.files[i].pathname ) == FAILURE ) {
+            err = errno;
+            rc = FAILURE;
+        }
+    }
+    if ( rc == SUCCESS ) {
+        if ( txWriteRecord( &commit, recordPath, sizeof(recordPath) ) == SUCCESS ) bRecorded = TRUE;
+        else {
+            err = errno;
+            rc = FAILURE;
+        }
+    }
+
+    //
+    // The transaction can't be aborted or reaped while it
+    // commits, so it is still in the table
+    //
+    pthread_mutex_lock( &FD_Table_lock );
+    for (i=0; (i < commit.nFiles) && (rc == SUCCESS); i++) {
+        if ((rename(commit.files[i].stagePath, commit.files[i].pathname) == 0) || (errno == ENOENT)) {
+            nRenamed = i + 1;
+        }
+        else {
+            err = errno;
+            rc = FAILURE;
+            fprintf(stderr,"netfileserver: txCommit: fails to rename \"%s\", errno= %d\n",
+                    commit.files[i].stagePath, err);
+        }
+    }
+    tx = LookupTXtable( txId );
+    if ((rc == SUCCESS) || (bRecorded == FALSE)) {
+        for (i = nRenamed; i < commit.nFiles; i++) unlink( commit.files[i].stagePath );
+        tx->id = 0;
+        tx->nFiles = 0;
+    }
+    else tx->lastUsed = statsNow();   // kept for another try
+    tx->bCommitting = FALSE;
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    for (i=0; i < nRenamed; i++) {
+        if ((syncDir( commit.files[i].pathname ) == FAILURE) && (rc == SUCCESS)) {
+            err = errno;
+            rc = FAILURE;
+        }
+    }
+    if ( bRecorded == TRUE ) unlink( recordPath );
+
+    if ( rc == SUCCESS ) statsCount( COUNTER_TX_COMMITS, 1 );
+    else if ( bRecorded == FALSE ) statsCount( COUNTER_TX_ABORTS, 1 );
+    if ( rc == FAILURE ) {
+        errno = err;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// nettx_abort.  The staged files are removed and the files
+// stay as they were.
+//
+/////////////////////////////////////////////////////////////
+
+int txAbort( const long txId )
+{
+    NET_TX_TYPE *tx = NULL;
+    int i = 0;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    tx = LookupTXtable( txId );
+    if ( tx == NULL ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EINVAL;
+        return FAILURE;
+    }
+    if ( tx->bCommitting == TRUE ) {
+        pthread_mutex_unlock( &FD_Table_lock );
+        errno = EBUSY;
+        return FAILURE;
+    }
+    for (i=0; i < tx->nFiles; i++) unlink( tx->files[i].stagePath );
+    tx->id = 0;
+    tx->nFiles = 0;
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    statsCount( COUNTER_TX_ABORTS, 1 );
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// TRUE if transaction "txId" is open
+//
+/////////////////////////////////////////////////////////////
+
+int txIsOpen( const long txId )
+{
+    int bOpen = FALSE;
+
+    pthread_mutex_lock( &FD_Table_lock );
+    bOpen = (LookupTXtable( txId ) != NULL) ? TRUE : FALSE;
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    return bOpen;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write the commit record of "commit" and return its name in
+// "recordPath".  The record is each staged file's name and
+// the name it is renamed to, each ending in a '\0'.  It is
+// written under a ".tmp" name, synced and renamed into place,
+// so a record that is there is whole.
+//
+/////////////////////////////////////////////////////////////
+
+int txWriteRecord( const NET_TX_TYPE *commit, char *recordPath, const size_t len )
+{
+    char tempPath[336] = "";
+    FILE *fp = NULL;
+    int rc = SUCCESS;
+    int err = 0;
+    int i = 0;
+
+    snprintf(recordPath, len, "%s/tx-%d-%lx", TX_Record_Dir, Server_Port, commit->id);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", recordPath);
+
+    fp = fopen(tempPath, "w");
+    if ( fp == NULL ) {
+        fprintf(stderr,"netfileserver: txCommit: fails to create \"%s\", errno= %d\n", tempPath, errno);
+        return FAILURE;
+    }
+    for (i=0; i < commit->nFiles; i++) {
+        fwrite(commit->files[i].stagePath, strlen(commit->files[i].stagePath) + 1, 1, fp);
+        fwrite(commit->files[i].pathname, strlen(commit->files[i].pathname) + 1, 1, fp);
+    }
+    if ((fflush(fp) != 0) || (fdatasync(fileno(fp)) < 0)) {
+        err = errno;
+        rc = FAILURE;
+    }
+    fclose(fp);
+
+    if ((rc == SUCCESS) && ((rename(tempPath, recordPath) < 0) || (syncDir( recordPath ) == FAILURE))) {
+        err = errno;
+        rc = FAILURE;
+    }
+    if ( rc == FAILURE ) {
+        unlink( tempPath );
+        unlink( recordPath );
+        errno = err;
+    }
+    return rc;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Finish the renames of the commit record at "recordPath",
+// left by a run that stopped part way through them.  A
+// staged file that is gone was renamed already.  The record
+// is removed once every rename is on disk, and kept if one
+// fails, to be tried again at the next startup.
+//
+/////////////////////////////////////////////////////////////
+
+int txRollForward( const char *recordPath )
+{
+    const size_t size = NET_TX_MAX_FILES * (sizeof(TX_FILE_TYPE) + 2);
+    char *record = NULL;
+    char *stagePath = NULL;
+    char *pathname = NULL;
+    char *end = NULL;
+    FILE *fp = NULL;
+    size_t n = 0;
+    int rc = SUCCESS;
+
+    record = malloc( size + 1 );
+    if ( record == NULL ) return FAILURE;
+
+    fp = fopen(recordPath, "r");
+    if ( fp == NULL ) {
+        free( record );
+        return FAILURE;
+    }
+    n = fread(record, 1, size, fp);
+    fclose(fp);
+    record[n] = '\0';
+    end = record + n;
+
+    for (stagePath = record; (stagePath < end) && (rc == SUCCESS); stagePath = pathname + strlen(pathname) + 1) {
+        pathname = stagePath + strlen(stagePath) + 1;
+        if ( pathname >= end ) break;
+
+        if (((rename(stagePath, pathname) < 0) && (errno != ENOENT)) ||
+            (syncDir( pathname ) == FAILURE)) {
+            fprintf(stderr,"netfileserver: fails to finish committing \"%s\", errno= %d\n", pathname, errno);
+            rc = FAILURE;
+        }
+    }
+    free( record );
+
+    if ( rc == SUCCESS ) unlink( recordPath );
+    return rc;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// At startup, finish every commit this server's port left
+// part way, and drop the records of commits that never got
+// to their renames.  Records of servers on other ports are
+// theirs to finish.
+//
+/////////////////////////////////////////////////////////////
+
+void txRecover()
+{
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+    char prefix[32] = "";
+    char recordPath[ sizeof(TX_Record_Dir) + sizeof(entry->d_name) ] = "";
+    size_t nameLen = 0;
+    int nRecords = 0;
+
+    if ((mkdir(TX_Record_Dir, 0700) < 0) && (errno != EEXIST)) {
+        fprintf(stderr, "netfileserver: cannot create \"%s\", errno= %d, transactions can't be committed\n",
+                TX_Record_Dir, errno);
+        return;
+    }
+    dir = opendir(TX_Record_Dir);
+    if ( dir == NULL ) {
+        fprintf(stderr, "netfileserver: cannot read \"%s\", errno= %d\n", TX_Record_Dir, errno);
+        return;
+    }
+
+    sprintf(prefix, "tx-%d-", Server_Port);
+    while ((entry = readdir(dir)) != NULL) {
+        if ( strncmp(entry->d_name, prefix, strlen(prefix)) != 0 ) continue;
+        snprintf(recordPath, sizeof(recordPath), "%s/%s", TX_Record_Dir, entry->d_name);
+
+        nameLen = strlen(entry->d_name);
+        if ((nameLen > 4) && (strcmp(entry->d_name + nameLen - 4, ".tmp") == 0)) {
+            unlink( recordPath );
+            continue;
+        }
+        if ( txRollForward( recordPath ) == SUCCESS ) nRecords++;
+    }
+    closedir(dir);
+
+    if ( nRecords > 0 ) {
+        printf("netfileserver: finished %d transaction commits from \"%s\"\n", nRecords, TX_Record_Dir);
+        fflush(stdout);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+
+int tableFull() {
+	int full = 1; //true initially
+	int i;
+	for (i = 0; i < FD_TABLE_SIZE; i++) {
+		if (FD_Table[i].pathname == '\0') {
+			full = 0;
+			return full;
+		}
+	}
+	return full;
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Returns the number of entries in use in the fd table
+//
+/////////////////////////////////////////////////////////////
+
+int countFDtable()
+{
+    int i = 0;
+    int count = 0;
+
+    for (i=0; i < FD_TABLE_SIZE; i++) {
+        if ( FD_Table[i].pathname[0] != '\0' ) count++;
+    }
+    return count;
+}
+
+/////////////////////////////////////////////////////////////
+
+void getStatsGauges( STATS_GAUGES_TYPE *gauges )
+{
+    gauges->fdInUse      = countFDtable();
+    gauges->fdCapacity   = FD_TABLE_SIZE;
+    gauges->portCapacity = MAX_FILE_TRANSFER_SOCKETS;
+
+    POOL_USAGE_TYPE usage;
+    poolUsage( &usage );
+    gauges->poolHeldBytes  = usage.heldBytes;
+    gauges->poolIdleBytes  = usage.idleBytes;
+    gauges->budgetBytes    = usage.budgetBytes;
+    gauges->inFlightBytes  = usage.inFlightBytes;
+    gauges->nBudgetWaiting = usage.nWaiting;
+    gauges->rssBytes       = usage.rssBytes;
+}
+
+/////////////////////////////////////////////////////////////
+
+//
+// Format the entries in use in the fd table as JSON for the
+// admin endpoint.  Returns the number of characters written.
+//
+// The admin thread runs at the lowest priority, so it only
+// copies the entries under the lock and formats the copy
+// with the lock released.  It is never descheduled in the
+// middle of formatting with netopen and netclose waiting.
+//
+/////////////////////////////////////////////////////////////
+
+int formatFDtableJson( char *buf, const size_t len )
+{
+    ADMIN_FD_TYPE *entries = NULL;
+    int nEntries = 0;
+    int i = 0;
+    size_t n = 0;
+
+    entries = malloc( sizeof(ADMIN_FD_TYPE) * FD_TABLE_SIZE );
+    if ( entries == NULL ) return snprintf(buf, len, "{\"error\":\"no memory\"}\n");
+
+    pthread_mutex_lock( &FD_Table_lock );
+    for (i=0; i < FD_TABLE_SIZE; i++) {
+        if ( FD_Table[i].pathname[0] == '\0' ) continue;
+
+        entries[nEntries].slot          = i;
+        entries[nEntries].fd            = FD_Table[i].fd;
+        entries[nEntries].fcMode        = FD_Table[i].fcMode;
+        entries[nEntries].fileOpenFlags = FD_Table[i].fileOpenFlags;
+        entries[nEntries].durability    = FD_Table[i].durability;
+        entries[nEntries].bSnapshot     = (FD_Table[i].snapFd >= 0);
+        strcpy( entries[nEntries].pathname, FD_Table[i].pathname );
+        nEntries++;
+    }
+    pthread_mutex_unlock( &FD_Table_lock );
+
+    n += snprintf(buf, len, "{\"capacity\":%d,\"entries\":[", FD_TABLE_SIZE);
+    for (i=0; (i < nEntries) && (n < len); i++) {
+        n += snprintf(buf + n, len - n, "%s{\"slot\":%d,\"fd\":%d,\"fcMode\":%d,\"fileOpenFlags\":%d,\"durability\":%d,\"snapshot\":%s,\"pathname\":",
+                      (i == 0) ? "" : ",", entries[i].slot, entries[i].fd, entries[i].fcMode,
+                      entries[i].fileOpenFlags, entries[i].durability,
+                      entries[i].bSnapshot ? "true" : "false");
+        if ( n < len ) n += adminJsonString(buf + n, len - n, entries[i].pathname);
+        if ( n < len ) n += snprintf(buf + n, len - n, "}");
+    }
+    free( entries );
+
+    if ( n < len ) n += snprintf(buf + n, len - n, "]}\n");
+    if ( n >= len ) n = len - 1;   // output was truncated
+    return (int)n;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+int formatPrometheus( char *buf, const size_t len )
+{
+    STATS_GAUGES_TYPE gauges;
+
+    getStatsGauges( &gauges );
+    return statsFormatPrometheus( buf, len, &gauges );
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Register a new transfer in the active transfer list.  The
+// list lock is only taken when a transfer starts and ends.
+//
+/////////////////////////////////////////////////////////////
+
+NET_TRANSFER_TYPE *beginTransfer( const NET_FUNCTION_TYPE netFunc, const int netfd, const long nBytes )
+{
+    NET_TRANSFER_TYPE *xfer = calloc(1, sizeof(NET_TRANSFER_TYPE));
+    NET_FD_TYPE fileInfo;
+
+    if ( xfer == NULL ) return NULL;
+
+    xfer->netFunc = netFunc;
+    xfer->netfd = netfd;
+    xfer->nBytes = nBytes;
+    xfer->startTime = statsNow();
+    atomic_init( &xfer->bytesDone, 0 );
+
+    if ( copyFDentry( netfd, &fileInfo ) == SUCCESS ) strcpy( xfer->pathname, fileInfo.pathname );
+
+    pthread_mutex_lock( &Transfer_lock );
+    xfer->id = ++Transfer_Seq;
+    xfer->next = Transfer_List;
+    Transfer_List = xfer;
+    pthread_mutex_unlock( &Transfer_lock );
+
+    statsCount( COUNTER_XFER_STARTED, 1 );
+    return xfer;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+void endTransfer( NET_TRANSFER_TYPE *xfer )
+{
+    NET_TRANSFER_TYPE **pp = NULL;
+
+    if ( xfer == NULL ) return;
+
+    pthread_mutex_lock( &Transfer_lock );
+    for (pp = &Transfer_List; *pp != NULL; pp = &((*pp)->next)) {
+        if ( *pp == xfer ) {
+            *pp = xfer->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &Transfer_lock );
+
+    statsCount( COUNTER_XFER_FINISHED, 1 );
+    free( xfer );
+}
+
+/////////////////////////////////////////////////////////////
+
+
+//
+// As formatFDtableJson, the list is copied under its lock,
+// up to ADMIN_TRANSFERS_MAX transfers, and formatted after.
+//
+int formatTransfersJson( char *buf, const size_t len )
+{
+    NET_TRANSFER_TYPE *xfer = NULL;
+    ADMIN_TRANSFER_TYPE *copies = NULL;
+    uint64_t now = statsNow();
+    int nCopies = 0;
+    int i = 0;
+    size_t n = 0;
+
+    copies = malloc( sizeof(ADMIN_TRANSFER_TYPE) * ADMIN_TRANSFERS_MAX );
+    if ( copies == NULL ) return snprintf(buf, len, "{\"error\":\"no memory\"}\n");
+
+    pthread_mutex_lock( &Transfer_lock );
+    for (xfer = Transfer_List; (xfer != NULL) && (nCopies < ADMIN_TRANSFERS_MAX); xfer = xfer->next) {
+        copies[nCopies].id        = xfer->id;
+        copies[nCopies].netFunc   = xfer->netFunc;
+        copies[nCopies].netfd     = xfer->netfd;
+        copies[nCopies].nBytes    = xfer->nBytes;
+        copies[nCopies].bytesDone = atomic_load(&xfer->bytesDone);
+        copies[nCopies].parts     = xfer->parts;
+        copies[nCopies].startTime = xfer->startTime;
+        strcpy( copies[nCopies].pathname, xfer->pathname );
+        nCopies++;
+    }
+    pthread_mutex_unlock( &Transfer_lock );
+
+    n += snprintf(buf, len, "{\"transfers\":[");
+    for (i=0; (i < nCopies) && (n < len); i++) {
+        n += snprintf(buf + n, len - n,
+                      "%s{\"id\":%d,\"function\":\"%s\",\"fd\":%d,\"bytes\":%ld,"
+                      "\"bytesDone\":%ld,\"parts\":%d,\"elapsedMs\":%.3f,\"pathname\":",
+                      (i == 0) ? "" : ",", copies[i].id, statsOpName(copies[i].netFunc), copies[i].netfd,
+                      copies[i].nBytes, copies[i].bytesDone, copies[i].parts,
+                      (now - copies[i].startTime) / 1e6);
+        if ( n < len ) n += adminJsonString(buf + n, len - n, copies[i].pathname);
+        if ( n < len ) n += snprintf(buf + n, len - n, "}");
+    }
+    free( copies );
+
+    if ( n < len ) n += snprintf(buf + n, len - n, "]}\n");
+    if ( n >= len ) n = len - 1;   // output was truncated
+    return (int)n;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+int canOpen( NET_FD_TYPE *newFd )
+{
+    int i = 0;
+
+    //
+    // Search each entry on the pathname's hash chain looking
+    // for the pathname.
+    //
+    for (i = FD_Hash[ hashPathname(newFd->pathname) ]; i >= 0; i = FD_Table[i].hashNext) {
+        if (strcmp(FD_Table[i].pathname, newFd->pathname) == 0)
+        {
+            //
+            // Found the specified pathname.  This file
+            // has already been opened by a client.
+            //
+            FILE_CONNECTION_MODE  fc = FD_Table[i].fcMode;
+            int  oFlag = FD_Table[i].fileOpenFlags;
+
+
+            //
+            // I am told to open this file in a new mode of
+            // operation.  I must determine if that is allowed.
+            //
+            switch (newFd->fcMode) {
+                case TRANSACTION_MODE:
+                    //
+                    // For transaction mode, that means this file must
+                    // not be opened by another client for any reason.
+                    // A writer builds a new version of its own, so
+                    // readers of the committed version may stay.
+                    //
+                    if ((newFd->fileOpenFlags == O_RDONLY) ||
+                        (fc == TRANSACTION_MODE) || (oFlag != O_RDONLY)) {
+                        return FALSE;  // Already opened by another client
+                    }
+                    break;
+
+                case EXCLUSIVE_MODE:
+                case UNRESTRICTED_MODE:
+                    //
+                    // Check if this file can be opened in exclusive mode.
+                    // This means no fd has been assigned to this file that
+                    // has any kind of write permission (i.e. O_WRONLY or O_RDWR)
+                    //
+                    // A reader may open a file being written in
+                    // transaction mode.  It reads a snapshot of the
+                    // committed version.
+                    //
+                    if ((fc == TRANSACTION_MODE) &&
+                        ((oFlag == O_RDONLY) || (newFd->fileOpenFlags != O_RDONLY))) return FALSE;
+
+                    switch (newFd->fileOpenFlags) {
+                        case O_RDONLY:
+                            // Allow to open
+                            break;
+
+                        case O_WRONLY:
+                        case O_RDWR:
+                            if ((fc == EXCLUSIVE_MODE) && (oFlag != O_RDONLY))
+                                return FALSE;
+
+                            break;
+                     }
+                     break;
+
+                case INVALID_FILE_MODE:
+                     return FALSE;
+                     break;
+
+            } // Switch on new wanted connection mode
+
+        }  // Found the pathname in FD_Table
+
+    }  // For each entry in FD_Table
+
+
+    //
+    // At this point, I have passed all tests.  I am allowed
+    // to open this file in the specified connection mode and
+    // file open flags.
+    //
+    return TRUE;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+int canWrite( const int netfd, const int nBytes)
+{
+    //
+    // Check if this netfd is opened for O_RDONLY
+    //
+
+    NET_FD_TYPE *pFD = LookupFDtable(netfd);
+    if ( pFD == NULL ) {
+        // There is no such netfd in my file
+        // descriptor table.
+        errno = EBADF;
+        return FAILURE;
+    }
+
+    if (pFD->fileOpenFlags == O_RDONLY) {
+        // This netfd is opened for read-only mode
+        errno = EACCES;
+        return FAILURE;
+    }
+
+    if (nBytes < 0) {
+        // Invalid input argument.  Cannot write negative
+        // number of bytes into a file.
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    // This "netfd" is allowed for writing
+    return SUCCESS;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+int canRead( const int netfd, const int nBytesWant, long *fileSize)
+{
+    *fileSize = 0;
+
+    //
+    // Check if this netfd is opened for O_RDONLY
+    //
+
+    NET_FD_TYPE entry;
+    NET_FD_TYPE *fileInfo = (copyFDentry( netfd, &entry ) == SUCCESS) ? &entry : NULL;
+    if ( fileInfo == NULL ) {
+        // There is no such netfd in my file
+        // descriptor table.
+        errno = EBADF;
+        return FAILURE;
+    }
+
+    if (fileInfo->fileOpenFlags == O_WRONLY) {
+        // This netfd is opened for write-only mode
+        errno = EACCES;
+        return FAILURE;
+    }
+
+    if (nBytesWant < 0) {
+        // Invalid input argument.  Cannot read negative
+        // number of bytes from a file.
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    //
+    // Get the file size
+    //
+    FILE *fpRead = NULL;
+
+    // Open the file for reading
+    int fd = openFDdata(netfd, O_RDONLY);
+    if ( fd >= 0 ) fpRead = fdopen(fd, "r");
+    if ( fpRead == NULL ) {
+        // Fail to open the temp file
+        if ( fd >= 0 ) close(fd);
+        fprintf(stderr,"netfileserver: canRead: fails to open \"%s\" for read, errno= %d\n",
+                  fileInfo->pathname, errno);
+        errno = EACCES;
+        return FAILURE;
+    }
+
+    //
+    // A directory opens fine for reading, but has no
+    // data to read
+    //
+    struct stat fileStat;
+    if ((fstat(fileno(fpRead), &fileStat) == 0) && S_ISDIR(fileStat.st_mode)) {
+        fclose(fpRead);
+        errno = EISDIR;
+        return FAILURE;
+    }
+
+    // Go to the end of the temp file.
+    if (fseek(fpRead, 0L, SEEK_END) == 0) {
+        *fileSize = ftell(fpRead);   // Get the size of the file.
+    }
+    if (fpRead != NULL) fclose(fpRead);
+
+
+    // This "netfd" is allowed for reading
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void *netwriteListener( void *sfd )
+{
+    const int sockfd = ((NET_LISTENER_TYPE *)sfd)->sockfd;
+    NET_TRANSFER_TYPE *xfer = ((NET_LISTENER_TYPE *)sfd)->xfer;
+
+    int newsockfd = 0;
+    struct sockaddr_storage cli_addr;
+    int clilen = sizeof(cli_addr);
+    int rc = 0;
+
+    char msg[MSG_SIZE] = "";
+    char myThreadLabel[128] = "";
+    sprintf(myThreadLabel, "netfileserver: netwriteListener %ld,", pthread_self());
+
+
+    free(sfd);
+    //printf("%s waiting to accept from sockfd %d\n", myThreadLabel, sockfd);
+    uint64_t acceptTime = statsNow();
+    newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, (socklen_t *)&clilen);
+    uint64_t phaseTime = statsNow();
+    statsRecordPhase( PHASE_ACCEPT, phaseTime - acceptTime );
+    statsCount( COUNTER_PORTS_RELEASED, 1 );   // listening port closes below
+    if ( newsockfd < 0 )
+    {
+        //
+        // Socket accept function returns an error
+        //
+        fprintf(stderr,"%s accept() failed, sockfd= %d, errno= %d (%s), h_errno= %d\n",
+                 myThreadLabel, sockfd, errno, strerror(errno), h_errno);
+
+        if ( newsockfd != 0 ) close(newsockfd);
+        if ( sockfd != 0 ) close(sockfd);
+        rc = FAILURE;
+        pthread_exit( &rc );
+    }
+    if ( sockfd != 0 ) close(sockfd);
+
+
+    //
+    // First incoming message format is:
+    //     netwrite, netfd, seqNum, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(newsockfd, msg, MSG_SIZE -1);
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
+                 myThreadLabel, errno, h_errno);
+        if ( sockfd != 0 ) close(sockfd);
+        rc = FAILURE;
+        pthread_exit( &rc );
+    }
+    //printf("%s received \"%s\"\n", myThreadLabel, msg);
+
+    traceUntagMessage( msg );
+    traceSpan( "accept", acceptTime, phaseTime );
+
+    int netFunc = -1;
+    int netfd = -1;
+    int seqNum = -1;
+    int nBytes = -1;
+    sscanf(msg, "%d,%d,%d,%d", &netFunc, &netfd, &seqNum, &nBytes);
+    //printf("%s netFunc= %d, netfd= %d, seqNum= %d, nBytes= %d\n",
+    //         myThreadLabel, netFunc, netfd, seqNum, nBytes);
+
+
+    //
+    // Send my response back to the client
+    //     resultCode, errno, h_errno, seqNum, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    sprintf(msg, "%d,%d,%d,%d,%d", SUCCESS, errno, h_errno, seqNum, nBytes);
+    rc = write(newsockfd, msg, strlen(msg) );
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to write \"%s\"\n", myThreadLabel, msg);
+        if ( sockfd != 0 ) close(sockfd);
+        rc = FAILURE;
+        pthread_exit( &rc );
+    }
+    //printf("%s responded \"%s\"\n", myThreadLabel, msg);
+
+
+    //
+    // Read nBytes of data from the client into a temporary
+    // file named with the sequence number, until all of it
+    // is in or the client goes away
+    //
+    phaseTime = statsNow();
+    rc = recvPartfile( newsockfd, netfd, seqNum, nBytes );
+    traceSpan( "recv", phaseTime, statsNow() );
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
+                 myThreadLabel, errno, h_errno);
+        if ( sockfd != 0 ) close(sockfd);
+        rc = FAILURE;
+        pthread_exit( &rc );
+    }
+
+    nBytes = rc;  // This is the number of bytes received
+    statsCount( COUNTER_BYTES_IN, nBytes );
+    if ( xfer != NULL ) atomic_fetch_add( &xfer->bytesDone, nBytes );
+    //printf("%s received %d bytes of data\n", myThreadLabel, nBytes);
+
+
+    //
+    // Send my response back to the client
+    //     resultCode, errno, h_errno, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    sprintf(msg, "%d,%d,%d,%d", SUCCESS, errno, h_errno, nBytes);
+    rc = write(newsockfd, msg, strlen(msg) );
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to write \"%s\"\n", myThreadLabel, msg);
+        if ( sockfd != 0 ) close(sockfd);
+        rc = FAILURE;
+        pthread_exit( &rc );
+    }
+    //printf("%s responded \"%s\"\n", myThreadLabel, msg);
+
+    if ( newsockfd != 0 ) close(newsockfd);
+    rc = SUCCESS;
+    pthread_exit( &nBytes );
+
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// Reserve disk space for the "nBytes" about to be written
+// to "fd", so a large file goes down in a few long extents
+// rather than growing one write at a time.  The file's size
+// is left as it is and grows as the data is appended.  It's
+// only a hint: a file system that can't preallocate just
+// writes the file the usual way.
+//
+/////////////////////////////////////////////////////////////
+
+void preallocate( const int fd, const long nBytes )
+{
+    if ( nBytes > 0 ) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, nBytes);
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Receive "nBytes" of part "seqNum" from the socket into its
+// temporary file, XFER_BLOCK_SIZE bytes at a time.  Returns
+// the number of bytes received, which is less than "nBytes"
+// if the client closed the connection first, or FAILURE.
+//
+// If the part file can't be written the data is still read
+// and dropped, so the client isn't cut off mid-send; the
+// file is then found missing when it is reconstructed.
+//
+/////////////////////////////////////////////////////////////
+
+int recvPartfile( const int sockfd, const int netfd, const int seqNum, const int nBytes )
+{
+    NET_FD_TYPE  fileInfo;
+    char tempfile[256] = "";
+    char fileExt[16] = "";
+    char *block = NULL;
+    FILE *fp = NULL;
+    int nRecv = 0;
+    int rc = 0;
+    uint64_t diskTime = 0;
+    uint64_t netTime = 0;
+    uint64_t startTime = statsNow();
+
+
+    //printf("netfileserver: recvPartfile: netfd= \"%d\"\n", netfd);
+    //
+    // Lookup file information from the given netfd to compose
+    // the temporary file name.  It is the target filename
+    // with a numeric extension such as ".1", ".2", etc.
+    //
+    if ( copyFDentry( netfd, &fileInfo ) == SUCCESS ) {
+        strcpy( tempfile, fileInfo.pathname );
+        sprintf(fileExt, ".%d", seqNum );
+        strcat( tempfile, fileExt);
+        //printf("netfileserver: recvPartfile: temp tempfile= \"%s\"\n", tempfile);
+
+        // Open the temp file for writing
+        fp = fopen(tempfile,"w");
+        if ( fp == NULL ) {
+            // Fail to open the temp file
+            fprintf(stderr,"netfileserver: recvPartfile: fails to open \"%s\", errno= %d\n",tempfile,errno);
+        }
+        else {
+            preallocate( fileno(fp), nBytes );
+        }
+    }
+
+    block = poolGet( XFER_BLOCK_SIZE );
+    if ( block == NULL ) {
+        if ( fp != NULL ) fclose(fp);
+        errno = ENOMEM;
+        return FAILURE;
+    }
+
+    while ( nRecv < nBytes ) {
+        int nWant = ((nBytes - nRecv) < XFER_BLOCK_SIZE) ? (nBytes - nRecv) : XFER_BLOCK_SIZE;
+
+        startTime = statsNow();
+        rc = readFully(sockfd, block, nWant);
+        netTime += statsNow() - startTime;
+        if ( rc <= 0 ) break;   // the client went away, or failed
+
+        startTime = statsNow();
+        if ((fp != NULL) && (fwrite(block, sizeof(char), rc, fp) != (size_t)rc)) {
+            fprintf(stderr,"netfileserver: recvPartfile: fails to write \"%s\", errno= %d\n",tempfile,errno);
+            fclose(fp);
+            fp = NULL;
+        }
+        diskTime += statsNow() - startTime;
+        nRecv = nRecv + rc;
+    }
+
+    startTime = statsNow();
+    if ((fp != NULL) && (fflush(fp) != 0)) {
+        fprintf(stderr,"netfileserver: recvPartfile: fails to fflush \"%s\", errno= %d\n",tempfile,errno);
+    }
+    if ( fp != NULL ) fclose(fp);
+    diskTime += statsNow() - startTime;
+
+    poolPut( block, XFER_BLOCK_SIZE );
+    statsRecordPhase( PHASE_NET_RECV, netTime );
+    statsRecordPhase( PHASE_DISK_IO, diskTime );
+
+    if ((rc < 0) && (nRecv == 0)) return FAILURE;
+    return nRecv;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+int reconstruct( const int netfd, const long txId, const int parts, const int advice )
+{
+    NET_FD_TYPE  fileInfo;
+    char tempfile[256] = "";
+    char fileExt[16] = "";
+    FILE *fpWrite, *fpRead;
+    long iTotalFileSize = 0;
+
+
+    if ( parts <= 0 ) return SUCCESS;
+
+    // Find the file to write to
+    if ( writeTarget( netfd, txId, &fileInfo ) == FAILURE ) return FAILURE;
+    //printf("netfileserver: reconstruct: pathname= \"%s\"\n", fileInfo.pathname);
+
+    if ( journalSupersede( fileInfo.dataPath ) == FAILURE ) return FAILURE;
+
+    // Open the final data file for writing
+    fpWrite = fopen(fileInfo.dataPath,"w");
+    if ( fpWrite == NULL ) {
+        // Fail to open the data file for writing
+        fprintf(stderr,"netfileserver: reconstruct: fails to open \"%s\" for write, errno= %d\n",
+                   fileInfo.pathname, errno);
+        return FAILURE;
+    }
+
+    char *data = poolGet( XFER_BLOCK_SIZE );
+    size_t dataSize = 0;
+    long partSize = 0;
+    int seqNum = 1;
+    struct stat st;
+
+    //
+    // The parts are all in, so the final size is known.
+    // Reserve it before the first byte goes in.
+    //
+    for (seqNum=1; seqNum<= parts; seqNum++) {
+        strcpy( tempfile, fileInfo.pathname );
+        sprintf(fileExt, ".%d", seqNum );
+        strcat( tempfile, fileExt);
+        if ( stat(tempfile, &st) == 0 ) iTotalFileSize = iTotalFileSize + st.st_size;
+    }
+    preallocate( fileno(fpWrite), iTotalFileSize );
+    iTotalFileSize = 0;
+
+    if ( data == NULL ) {
+        fclose(fpWrite);
+        errno = ENOMEM;
+        return FAILURE;
+    }
+
+    for (seqNum=1; seqNum<= parts; seqNum++) {
+        strcpy( tempfile, fileInfo.pathname );
+        sprintf(fileExt, ".%d", seqNum );
+        strcat( tempfile, fileExt);
+        //printf("netfileserver: reconstruct: tempfile= \"%s\"\n", tempfile);
+
+        // Open the temp file for reading
+        fpRead = fopen(tempfile,"r");
+        if ( fpRead == NULL ) {
+            // Fail to open the temp file
+            fprintf(stderr,"netfileserver: reconstruct: fails to open \"%s\" for read, errno= %d\n",
+                      tempfile,errno);
+            if (fpWrite != NULL) fclose(fpWrite);
+            poolPut( data, XFER_BLOCK_SIZE );
+            return FAILURE;
+        }
+
+
+        //
+        // Copy the part file into the output file a block
+        // at a time, however large the part is
+        //
+        partSize = 0;
+        while ((dataSize = fread(data, sizeof(char), XFER_BLOCK_SIZE, fpRead)) > 0) {
+            partSize = partSize + (long)fwrite(data, sizeof(char), dataSize, fpWrite);
+        }
+        if (partSize == 0) {
+            fprintf(stderr,"netfileserver: reconstruct: fails to read \"%s\", errno= %d\n",
+               tempfile, errno);
+        }
+        if (fpRead != NULL) fclose(fpRead);
+
+        if ( partSize > 0 ) {
+            iTotalFileSize = iTotalFileSize + partSize;
+
+            if ( seqNum == 1 ) {
+                //
+                // After the first part in the file sequence,
+                // I must open the data file for append mode.
                 //
                 fclose(fpWrite);
-                fpWrite = fopen(fileInfo->pathname,"a");
+                fpWrite = fopen(fileInfo.dataPath,"a");
+            }
+        }
+        else {
+            // Cannot retrieve the piece part data
+            if (fpWrite != NULL) fclose(fpWrite);
+            poolPut( data, XFER_BLOCK_SIZE );
+            return FAILURE;
+        }
+
+
+        // Remove the part file
+        remove(tempfile);
+
+    }  //Append the next piece part
+
+    // Finish reconstructing the data file from piece parts
+    if (fpWrite != NULL) {
+        dropWritten( fpWrite, advice );
+        fclose(fpWrite);
+    }
+    poolPut( data, XFER_BLOCK_SIZE );
+
+
+    //printf("netfileserver: reconstruct: created \"%s\", filesize= %ld\n",
+    //         fileInfo.pathname, iTotalFileSize);
+
+    if ((fileInfo.durability == NET_DURABLE_WRITE) && (syncFile( fileInfo.dataPath ) == FAILURE)) {
+        return FAILURE;
+    }
+
+    return iTotalFileSize;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void *netreadListener( void *sfd )
+{
+    const int sockfd = ((NET_LISTENER_TYPE *)sfd)->sockfd;
+    NET_TRANSFER_TYPE *xfer = ((NET_LISTENER_TYPE *)sfd)->xfer;
+
+    int newsockfd = 0;
+    struct sockaddr_storage cli_addr;
+    int clilen = sizeof(cli_addr);
+    int rc = 0;
+
+    char msg[MSG_SIZE] = "";
+    char myThreadLabel[128] = "";
+    sprintf(myThreadLabel, "netfileserver: netreadListener %ld,", pthread_self());
+
+
+    free(sfd);
+    //printf("%s waiting to accept from sockfd %d\n", myThreadLabel, sockfd);
+    uint64_t acceptTime = statsNow();
+    newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, (socklen_t *)&clilen);
+    uint64_t phaseTime = statsNow();
+    statsRecordPhase( PHASE_ACCEPT, phaseTime - acceptTime );
+    statsCount( COUNTER_PORTS_RELEASED, 1 );   // listening port closes below
+    if ( newsockfd < 0 )
+    {
+        //
+        // Socket accept function returns an error
+        //
+        fprintf(stderr,"%s accept() failed, sockfd= %d, errno= %d (%s), h_errno= %d\n",
+                 myThreadLabel, sockfd, errno, strerror(errno), h_errno);
+
+        if ( newsockfd != 0 ) close(newsockfd);
+        if ( sockfd != 0 ) close(sockfd);
+        pthread_exit( NULL );
+    }
+    if ( sockfd != 0 ) close(sockfd);
+
+
+    //
+    // First incoming message format is:
+    //     netread, netfd, seqNum, iStartPos, nBytes, bSparse, advice
+    //
+    // "bSparse" is left out by clients that want the data
+    // as it is, holes and all.  "advice" is the client's
+    // netadvise hint for the fd.
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(newsockfd, msg, MSG_SIZE -1);
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
+                 myThreadLabel, errno, h_errno);
+        if ( sockfd != 0 ) close(sockfd);
+        pthread_exit( NULL );
+    }
+    //printf("%s received \"%s\"\n", myThreadLabel, msg);
+
+    traceUntagMessage( msg );
+    traceSpan( "accept", acceptTime, phaseTime );
+
+    int netFunc   = -1;
+    int netfd     =  0;
+    int seqNum    = -1;
+    int iStartPos = -1;
+    int nBytes    = -1;
+    int bSparse   = FALSE;
+    int advice    = NET_ADVICE_NORMAL;
+    sscanf(msg, "%d,%d,%d,%d,%d,%d,%d", &netFunc, &netfd, &seqNum, &iStartPos, &nBytes, &bSparse, &advice);
+
+    //printf("%s netFunc= %d, netfd= %d, seqNum= %d, iStartPos= %d, nBytes= %d\n",
+    //         myThreadLabel, netFunc, netfd, seqNum, iStartPos, nBytes);
+
+
+    //
+    // Send "nBytes" of data starting at position "iStartPos"
+    // of the file referred to as "netfd" to the client
+    //
+    phaseTime = statsNow();
+    rc = sendFilePart( newsockfd, netfd, iStartPos, nBytes, bSparse, advice );
+    statsRecordPhase( PHASE_NET_SEND, statsNow() - phaseTime );
+    traceSpan( "send", phaseTime, statsNow() );
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to send %d bytes of data to client\n", myThreadLabel, nBytes);
+        if ( newsockfd != 0 ) close(newsockfd);
+        pthread_exit( NULL );
+    }
+    statsCount( COUNTER_BYTES_OUT, rc );
+    if ( xfer != NULL ) atomic_fetch_add( &xfer->bytesDone, rc );
+    //printf("%s sent %d bytes of data to client\n", myThreadLabel, rc);
+
+    if ( rc < nBytes ) {
+        //
+        // The file is shorter than the part, e.g. it was cut
+        // short by a concurrent netwrite.  End the data stream
+        // so the client sees what there is and sends its
+        // response instead of both sides waiting on each other.
+        //
+        shutdown(newsockfd, SHUT_WR);
+    }
+
+
+
+    //
+    // Read the response from the client saying the number
+    // of bytes received.  The incoming message format is:
+    //
+    //     resultCode, errno, h_errno, nBytes
+    //
+    bzero(msg, MSG_SIZE);
+    rc = read(newsockfd, msg, MSG_SIZE -1);
+    if ( rc < 0 ) {
+        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
+                 myThreadLabel, errno, h_errno);
+        if ( sockfd != 0 ) close(sockfd);
+        pthread_exit( NULL );
+    }
+
+    //printf("%s received \"%s\"\n", myThreadLabel, msg);
+
+    traceUntagMessage( msg );
+
+    int resultCode  = FAILURE;
+    int *pBytesRecv  = malloc(sizeof(int));
+    *pBytesRecv = 0;   // client went away without saying
+    sscanf(msg, "%d,%d,%d,%d", &resultCode, &errno, &h_errno, pBytesRecv);
+
+    //printf("%s resultCode= %d, errno= %d, h_errno= %d, iBytesRecv= %d\n",
+    //         myThreadLabel, resultCode, errno, h_errno, *pBytesRecv);
+
+
+    if ( newsockfd != 0 ) close(newsockfd);
+    rc = SUCCESS;
+    pthread_exit( pBytesRecv );
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// Pass a request's netadvise hint to the kernel before and
+// after "len" bytes from "offset" are read through "fd".
+// A file read once has its pages dropped from the page
+// cache afterwards, so a bulk transfer doesn't push out the
+// files other clients keep coming back to.  So does a file
+// read with NET_ADVICE_DIRECT, for any part of it that was
+// read through the cache after all.
+//
+/////////////////////////////////////////////////////////////
+
+void adviseBefore( const int fd, const int advice, const off_t offset, const off_t len )
+{
+    switch ( advice & NET_ADVICE_MASK ) {
+        case NET_ADVICE_SEQUENTIAL:
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            break;
+
+        case NET_ADVICE_RANDOM:
+            posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+            break;
+
+        case NET_ADVICE_ONCE:
+            posix_fadvise(fd, offset, len, POSIX_FADV_NOREUSE);
+            break;
+
+        case NET_ADVICE_WILLNEED:
+            posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void adviseAfter( const int fd, const int advice, const off_t offset, const off_t len )
+{
+    if (((advice & NET_ADVICE_MASK) == NET_ADVICE_ONCE) ||
+        ((advice & NET_ADVICE_DIRECT) != 0)) {
+        posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+    }
+}
+
+
+//
+// The write side of adviseAfter.  Dirty pages can't be
+// dropped, so the file is flushed to disk first; writes are
+// not done with O_DIRECT, since a netwrite's parts arrive
+// at any alignment.
+//
+void dropWritten( FILE *fp, const int advice )
+{
+    if (((advice & NET_ADVICE_MASK) == NET_ADVICE_ONCE) ||
+        ((advice & NET_ADVICE_DIRECT) != 0)) {
+        fflush(fp);
+        fdatasync(fileno(fp));
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+char *readFile( const int netfd, const int iStartPos, const int iBytesWanted, const int advice )
+{
+    NET_FD_TYPE  fileInfo;
+    FILE *fpRead = NULL;
+    char *pData  = NULL;
+    int fd = -1;
+    uint64_t startTime = statsNow();
+
+
+    if ((iStartPos <0) || (iBytesWanted <=0)) return NULL;
+
+    // Find the file to read from
+    if ( copyFDentry( netfd, &fileInfo ) == FAILURE ) return NULL;
+    //printf("netfileserver: readFile: pathname= \"%s\"\n", fileInfo.pathname);
+
+    // Open the data file for reading
+    fd = openFDdata(netfd, O_RDONLY);
+    if ( fd >= 0 ) fpRead = fdopen(fd, "r");
+    if ( fpRead == NULL ) {
+        // Fail to open the data file for reading
+        if ( fd >= 0 ) close(fd);
+        fprintf(stderr,"netfileserver: readFile: fails to open \"%s\" for read, errno= %d\n",
+                   fileInfo.pathname, errno);
+        return NULL;
+    }
+
+
+    //
+    // Set the file position to "iStartPos" relative
+    // to the beginning of the file.
+    //
+    if (fseek(fpRead, iStartPos, SEEK_SET) == 0) {
+        pData = poolGet( iBytesWanted );
+
+        if ( pData != NULL ) {
+            int iBytesRead = 0;
+            adviseBefore(fileno(fpRead), advice, iStartPos, iBytesWanted);
+            iBytesRead = (int)fread(pData, sizeof(char), iBytesWanted, fpRead);
+            adviseAfter(fileno(fpRead), advice, iStartPos, iBytesWanted);
+            if ( iBytesRead > 0) {
+                // A file that shrank since its size was taken
+                // reads short; don't send a pooled buffer's
+                // old contents in place of the missing bytes
+                if ( iBytesRead < iBytesWanted ) {
+                    bzero(pData + iBytesRead, iBytesWanted - iBytesRead);
+                }
+
+                // Read "iBytesRead" from the file
+                if (fpRead != NULL) fclose(fpRead);
+                statsRecordPhase( PHASE_DISK_IO, statsNow() - startTime );
+                traceSpan( "readFile", startTime, statsNow() );
+                return pData;
             }
         }
+    } // End of fseek()
+
+
+    // Fail to read from the file
+    fprintf(stderr,"netfileserver: readFile: fails to read \"%s\", errno= %d, iStartPos= %d, iBytesWanted= %d\n",
+               fileInfo.pathname, errno, iStartPos, iBytesWanted);
+
+    if (pData != NULL)  poolPut(pData, iBytesWanted);
+    if (fpRead != NULL) fclose(fpRead);
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Find where the data is in "nCovered" bytes of "fd" from
+// "start", skipping holes.  Fills in the extents' offsets
+// from "start" and lengths, and returns how many there are.
+// The last one that fits takes in everything after it,
+// holes and all.  A file system that can't tell holes from
+// data gives a single extent.
+//
+/////////////////////////////////////////////////////////////
+
+int mapExtents( const int fd, const long start, const int nCovered, int *extOff, int *extLen )
+{
+    off_t pos = start;
+    off_t end = start + nCovered;
+    off_t data = 0;
+    off_t hole = 0;
+    int n = 0;
+
+    while ((pos < end) && (n < NET_SPARSE_EXTENTS)) {
+        data = lseek(fd, pos, SEEK_DATA);
+        if ( data < 0 ) {
+            if ( errno == ENXIO ) break;   // nothing but hole from here on
+            data = pos;
+            hole = end;
+        }
         else {
-            // Cannot retrieve the piece part data
+            if ( data >= end ) break;
+            hole = lseek(fd, data, SEEK_HOLE);
+            if ((hole < 0) || (hole > end) || (n == NET_SPARSE_EXTENTS - 1)) hole = end;
+        }
+
+        extOff[n] = (int)(data - start);
+        extLen[n] = (int)(hole - data);
+        n++;
+        pos = hole;
+    }
+    return n;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Send "nBytes" of the file behind "netfd", from position
+// "iStartPos", to the socket.  The file is read and sent
+// XFER_BLOCK_SIZE bytes at a time.  Returns the number of
+// bytes sent, which is less than "nBytes" if the file ends
+// first, or FAILURE if the socket fails.
+//
+// With "bSparse", a MSG_SIZE map of where the data is goes
+// first and holes are not sent.  The map format is:
+//
+//    nCovered,nExtents,offset,length,offset,length,...
+//
+// "nCovered" is how much of the part the file has, and the
+// bytes sent are the extents' data, in order.  The holes
+// count as sent.
+//
+// A part of at least NET_DIRECT_MIN_SIZE bytes of a file
+// with NET_ADVICE_DIRECT is read with O_DIRECT instead,
+// DIRECT_BLOCK_SIZE bytes at a time, from the aligned block
+// that holds each position.  Where the file system refuses
+// O_DIRECT, the part is read through the page cache.
+//
+/////////////////////////////////////////////////////////////
+
+int sendFilePart( const int sockfd, const int netfd, const int iStartPos, const int nBytes,
+                  const int bSparse, const int advice )
+{
+    NET_FD_TYPE fileInfo;
+    struct stat st;
+    char map[MSG_SIZE] = "";
+    int extOff[ NET_SPARSE_EXTENTS ];
+    int extLen[ NET_SPARSE_EXTENTS ];
+    int nExtents = 1;
+    int nCovered = nBytes;
+    int e = 0;
+    char *block = NULL;
+    int blockSize = XFER_BLOCK_SIZE;
+    int bDirect = FALSE;
+    int bShort = FALSE;
+    int fd = -1;
+    int nSent = 0;
+    int rc = 0;
+    uint64_t diskTime = 0;
+
+
+    if ((iStartPos < 0) || (nBytes <= 0)) return 0;
+
+    // Find the file to read from
+    if ( copyFDentry( netfd, &fileInfo ) == FAILURE ) return 0;
+
+    if (((advice & NET_ADVICE_DIRECT) != 0) && (nBytes >= NET_DIRECT_MIN_SIZE)) {
+        fd = openFDdata(netfd, O_RDONLY | O_DIRECT);
+        if ( fd >= 0 ) {
+            bDirect = TRUE;
+            blockSize = DIRECT_BLOCK_SIZE;
+        }
+    }
+    if ( fd < 0 ) fd = openFDdata(netfd, O_RDONLY);
+    if ( fd < 0 ) {
+        fprintf(stderr,"netfileserver: sendFilePart: fails to open \"%s\" for read, errno= %d\n",
+                   fileInfo.pathname, errno);
+        return 0;
+    }
+    adviseBefore(fd, advice, iStartPos, nBytes);
+
+    extOff[0] = 0;
+    extLen[0] = nBytes;
+    if ( bSparse ) {
+        if ( fstat(fd, &st) == 0 ) {
+            if ( st.st_size <= iStartPos ) nCovered = 0;
+            else if ( st.st_size - iStartPos < nBytes ) nCovered = (int)(st.st_size - iStartPos);
+        }
+        nExtents = mapExtents( fd, iStartPos, nCovered, extOff, extLen );
+
+        sprintf(map, "%d,%d", nCovered, nExtents);
+        for (e=0; e < nExtents; e++) {
+            sprintf(map + strlen(map), ",%d,%d", extOff[e], extLen[e]);
+        }
+        if ( writeFully(sockfd, map, MSG_SIZE) < MSG_SIZE ) {
+            close(fd);
             return FAILURE;
         }
+    }
 
+    block = poolGet( blockSize );
+    if ( block == NULL ) {
+        close(fd);
+        return 0;
+    }
 
-        // Remove the part file
-        remove(tempfile);
+    for (e=0; (e < nExtents) && (nSent != FAILURE) && (bShort == FALSE); e++) {
+        int extEnd = extOff[e] + extLen[e];
 
-    }  //Append the next piece part
+        nSent = extOff[e];   // the hole before this extent counts as sent
+        while ( nSent < extEnd ) {
+            off_t pos = (off_t)iStartPos + nSent;
+            int skip = bDirect ? (int)(pos % DIRECT_ALIGN) : 0;
+            int nWant = ((extEnd - nSent + skip) < blockSize) ? (extEnd - nSent + skip) : blockSize;
 
-    // Finish reconstructing the data file from piece parts
-    if (fpWrite != NULL) fclose(fpWrite);
+            if ( bDirect ) nWant = (nWant + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+            uint64_t startTime = statsNow();
+            ssize_t nRead = pread(fd, block, nWant, pos - skip);
+            diskTime += statsNow() - startTime;
+
+            if ((nRead < 0) && (errno == EINVAL) && bDirect) {
+                // The file system took the open but not the read
+                close(fd);
+                fd = openFDdata(netfd, O_RDONLY);
+                if ( fd < 0 ) {
+                    bShort = TRUE;
+                    break;
+                }
+                bDirect = FALSE;
+                continue;
+            }
+
+            nRead = nRead - skip;
+            if ( nRead > extEnd - nSent ) nRead = extEnd - nSent;
+            if ( nRead <= 0 ) {
+                // end of file, or it can't be read
+                bShort = TRUE;
+                break;
+            }
+
+            rc = writeFully(sockfd, block + skip, (int)nRead);
+            if ( rc < nRead ) {
+                nSent = FAILURE;
+                break;
+            }
+            nSent += (int)nRead;
+        }
+    }
+    if ((nSent != FAILURE) && (bShort == FALSE)) nSent = nCovered;
+    statsRecordPhase( PHASE_DISK_IO, diskTime );
+
+    if ( fd >= 0 ) {
+        adviseAfter(fd, advice, iStartPos, nBytes);
+        close(fd);
+    }
+    poolPut( block, blockSize );
+    return nSent;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Find where a netwrite to "netfd" goes: the entry's own
+// file, or the file it stages in transaction "txId".  Fills
+// in "fileInfo" with the entry, with "dataPath" set to that
+// file.  A staged file is synced when it is committed, so
+// its writes don't wait for the disk.
+//
+/////////////////////////////////////////////////////////////
+
+int writeTarget( const int netfd, const long txId, NET_FD_TYPE *fileInfo )
+{
+    if ( copyFDentry( netfd, fileInfo ) == FAILURE ) {
+        errno = EBADF;
+        return FAILURE;
+    }
+    if ( txId == 0 ) return SUCCESS;
+
+    if ( txStage( txId, fileInfo ) == FAILURE ) return FAILURE;
+    fileInfo->durability = NET_DURABLE_NONE;
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Replace the contents of the file behind "netfd" with
+// "nBytes" of data, as reconstruct does for a netwrite that
+// came in parts.  Returns the number of bytes written or
+// FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+int writeFile( const int netfd, const long txId, const char *data, const int nBytes, const int advice )
+{
+    NET_FD_TYPE  fileInfo;
+    FILE *fpWrite = NULL;
+    int iBytesWritten = 0;
+    uint64_t startTime = statsNow();
+
+
+    // Find the file to write to
+    if ( writeTarget( netfd, txId, &fileInfo ) == FAILURE ) return FAILURE;
+
+    //
+    // With -j, a small write is durable once it is in the
+    // journal, whatever the file's durability mode.  A staged
+    // write, or one to a new version in transaction mode,
+    // needn't be until its commit, and is not journaled: a
+    // replay would bring back the uncommitted version file.
+    //
+    if ( journalEnabled() && (nBytes <= JOURNAL_MAX_WRITE) &&
+         (strcmp(fileInfo.dataPath, fileInfo.pathname) == 0) ) {
+        iBytesWritten = journalWrite( fileInfo.dataPath, data, nBytes );
+        statsRecordPhase( PHASE_DISK_IO, statsNow() - startTime );
+        traceSpan( "journalWrite", startTime, statsNow() );
+        return iBytesWritten;
+    }
+    if ( journalSupersede( fileInfo.dataPath ) == FAILURE ) return FAILURE;
+
+    fpWrite = fopen(fileInfo.dataPath,"w");
+    if ( fpWrite == NULL ) {
+        // Fail to open the data file for writing
+        fprintf(stderr,"netfileserver: writeFile: fails to open \"%s\" for write, errno= %d\n",
+                   fileInfo.pathname, errno);
+        return FAILURE;
+    }
+
+    iBytesWritten = (int)fwrite(data, sizeof(char), nBytes, fpWrite);
+    dropWritten( fpWrite, advice );
+    if ((fclose(fpWrite) != 0) || (iBytesWritten != nBytes)) {
+        fprintf(stderr,"netfileserver: writeFile: fails to write \"%s\", errno= %d\n",
+                   fileInfo.pathname, errno);
+        return FAILURE;
+    }
+
+    statsRecordPhase( PHASE_DISK_IO, statsNow() - startTime );
+    traceSpan( "writeFile", startTime, statsNow() );
+
+    if ((fileInfo.durability == NET_DURABLE_WRITE) && (syncFile( fileInfo.dataPath ) == FAILURE)) {
+        return FAILURE;
+    }
+    return iBytesWritten;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Replace the contents of the file behind "dstNetfd" with
+// up to "nBytes" of the file behind "srcNetfd", starting at
+// "offset".  The data is copied COPY_PROGRESS_SIZE bytes at
+// a time so the transfer list shows how far it has got.
+// Returns the number of bytes copied or FAILURE.
+//
+/////////////////////////////////////////////////////////////
+
+long Do_netcopy( const int srcNetfd, const int dstNetfd, const long offset, const long nBytes )
+{
+    NET_FD_TYPE srcInfo;
+    NET_FD_TYPE dstInfo;
+    NET_TRANSFER_TYPE *xfer = NULL;
+    struct stat srcStat;
+    struct stat dstStat;
+    long fileSize = 0;
+    long nWant = 0;
+    long nDone = 0;
+    long n = 0;
+    int fdIn = -1;
+    int fdOut = -1;
+    int err = 0;
+    uint64_t startTime = 0;
+
+    if ( canRead( srcNetfd, 0, &fileSize ) == FAILURE ) return FAILURE;
+    if ((copyFDentry( srcNetfd, &srcInfo ) == FAILURE) ||
+        (copyFDentry( dstNetfd, &dstInfo ) == FAILURE)) {
+        errno = EBADF;
+        return FAILURE;
+    }
+
+    if ( offset < fileSize ) nWant = ((fileSize - offset) < nBytes) ? (fileSize - offset) : nBytes;
+
+    if ( journalSupersede( dstInfo.dataPath ) == FAILURE ) return FAILURE;
 
+    fdIn = openFDdata(srcNetfd, O_RDONLY);
+    if ( fdIn < 0 ) {
+        fprintf(stderr,"netfileserver: Do_netcopy: fails to open \"%s\" for read, errno= %d\n",
+                srcInfo.pathname, errno);
+        return FAILURE;
+    }
+    fdOut = open(dstInfo.dataPath, O_WRONLY | O_CREAT, 0666);
+    if ( fdOut < 0 ) {
+        err = errno;
+        fprintf(stderr,"netfileserver: Do_netcopy: fails to open \"%s\" for write, errno= %d\n",
+                dstInfo.pathname, err);
+        close(fdIn);
+        errno = err;
+        return FAILURE;
+    }
+
+    //
+    // The names may differ and still be the same file, through
+    // "..", a symbolic link or a hard link.  The destination is
+    // only emptied once it is known not to be the source.
+    //
+    if ((fstat(fdIn, &srcStat) < 0) || (fstat(fdOut, &dstStat) < 0)) err = errno;
+    else if ((srcStat.st_dev == dstStat.st_dev) && (srcStat.st_ino == dstStat.st_ino)) err = EINVAL;
+    else if ( ftruncate(fdOut, 0) < 0 ) err = errno;
+    if ( err != 0 ) {
+        close(fdIn);
+        close(fdOut);
+        errno = err;
+        return FAILURE;
+    }
 
-    //printf("netfileserver: reconstruct: created \"%s\", filesize= %ld\n",
-    //         fileInfo->pathname, iTotalFileSize);
+    xfer = beginTransfer( NET_COPY, srcNetfd, nWant );
+    startTime = statsNow();
+    while ( nDone < nWant ) {
+        n = copyRange( fdIn, offset + nDone, fdOut, nDone,
+                       ((nWant - nDone) < COPY_PROGRESS_SIZE) ? (nWant - nDone) : COPY_PROGRESS_SIZE );
+        if ( n <= 0 ) break;
+        nDone = nDone + n;
+        if ( xfer != NULL ) atomic_fetch_add( &xfer->bytesDone, n );
+    }
+    err = errno;
+    statsRecordPhase( PHASE_DISK_IO, statsNow() - startTime );
+    traceSpan( "copy", startTime, statsNow() );
+    endTransfer( xfer );
+
+    close(fdIn);
+    if ((close(fdOut) < 0) && (n >= 0)) {
+        err = errno;
+        n = FAILURE;
+    }
 
-    return iTotalFileSize;
+    errno = err;
+    return (n < 0) ? FAILURE : nDone;
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// Do_batch handles a batched open, stat or close.  The
+// request is a MSG_SIZE header followed by one line per
+// entry.  The header format is:
+//
+//    op,connectionMode,count,nBytes
+//
+// and each body line is "flags,pathname" for an open,
+// "pathname" for a stat and "netfd" for a close.  The
+// entries are shared out over up to BATCH_WORKERS threads.
+//
+// The response is a MSG_SIZE header followed by one line per
+// entry, in request order.  The header format is:
+//
+//    result,errno,h_errno,count,nBytes
+//
+// and each line is "result,errno,netfd" for an open,
+// "result,errno,size,mode,mtime" for a stat and
+// "result,errno" for a close.  Returns SUCCESS if the
+// response was sent, or FAILURE.
+//
 /////////////////////////////////////////////////////////////
 
-
-void *netreadListener( void *sfd )
+int Do_batch( const int sockfd, const NET_FUNCTION_TYPE netFunc, char *msg, const int nHeaderLeft )
 {
-    const int sockfd = *((int *)sfd);
-
-    int newsockfd = 0;
-    struct sockaddr_in  cli_addr;
-    int clilen = sizeof(cli_addr);
+    NET_BATCH_TYPE batch;
+    pthread_t tids[ BATCH_WORKERS ];
+    char *pBody = NULL;
+    char *pReply = NULL;
+    char *pLine = NULL;
+    int nBytes = 0;
+    int nWorkers = 0;
+    int nReply = 0;
+    int nSuccess = 0;
     int rc = 0;
-
-    char msg[MSG_SIZE] = "";
-    char myThreadLabel[128] = "";
-    sprintf(myThreadLabel, "netfileserver: netreadListener %ld,", pthread_self());
+    int i = 0;
+    uint64_t phaseTime = 0;
 
 
-    free(sfd);
-    //printf("%s waiting to accept from sockfd %d\n", myThreadLabel, sockfd);
-    if ((newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, (socklen_t *)&clilen)) < 0)
-    {
-        //
-        // Socket accept function returns an error
-        //
-        fprintf(stderr,"%s accept() failed, sockfd= %d, errno= %d (%s), h_errno= %d\n",
-                 myThreadLabel, sockfd, errno, strerror(errno), h_errno);
+    bzero(&batch, sizeof(batch));
+    sscanf(msg, "%u,%d,%d,%d", &batch.netFunc, (int *)&(batch.fcMode), &batch.count, &nBytes);
+    batch.netFunc = netFunc;
 
-        if ( newsockfd != 0 ) close(newsockfd);
-        if ( sockfd != 0 ) close(sockfd);
+    //
+    // Take in the whole body before answering, even a bad one,
+    // so the response is not lost to a reset connection.  A
+    // body too long for NET_BATCH_MAX entries is thrown away
+    // as it is read, rather than held.
+    //
+    if ((batch.count <= 0) || (batch.count > NET_BATCH_MAX) ||
+        (nBytes <= 0) || (nBytes > NET_BATCH_MAX * BATCH_LINE_MAX)) {
+        drainFully(sockfd, (long)nHeaderLeft + ((nBytes > 0) ? nBytes : 0));
+        nBytes = 0;
+        errno = EINVAL;
         rc = FAILURE;
-        pthread_exit( &rc );
     }
-    if ( sockfd != 0 ) close(sockfd);
+    else if ((pBody = poolGet( nHeaderLeft + nBytes + 1 )) == NULL) {
+        drainFully(sockfd, (long)nHeaderLeft + nBytes);
+        errno = ENOMEM;
+        rc = FAILURE;
+    }
+    else {
+        phaseTime = statsNow();
+        rc = readFully(sockfd, pBody, nHeaderLeft + nBytes);
+        if ( rc != nHeaderLeft + nBytes ) {
+            fprintf(stderr,"netfileserver: Do_batch: fails to read batch from socket\n");
+            errno = ECONNRESET;
+            rc = FAILURE;
+        }
+        else {
+            statsRecordPhase( PHASE_NET_RECV, statsNow() - phaseTime );
+            statsCount( COUNTER_BYTES_IN, nBytes );
+            rc = SUCCESS;
+        }
+    }
 
+    if ( rc == SUCCESS ) {
+        batch.args    = malloc( sizeof(char *) * batch.count );
+        batch.results = malloc( sizeof(*batch.results) * batch.count );
+        if ((batch.args == NULL) || (batch.results == NULL)) {
+            errno = ENOMEM;
+            rc = FAILURE;
+        }
+    }
 
     //
-    // First incoming message format is:
-    //     netread, netfd, seqNum, iStartPos, nBytes
+    // Split the body into its entry lines
     //
-    bzero(msg, MSG_SIZE);
-    rc = read(newsockfd, msg, MSG_SIZE -1);
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
-                 myThreadLabel, errno, h_errno);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+    if ( rc == SUCCESS ) {
+        pLine = pBody + nHeaderLeft;
+        pLine[ nBytes ] = '\0';
+        for (i=0; i < batch.count; i++) {
+            char *pEnd = strchr(pLine, '\n');
+
+            if ( pEnd == NULL ) break;
+            *pEnd = '\0';
+            batch.args[i] = pLine;
+            pLine = pEnd + 1;
+        }
+        if ( i != batch.count ) {
+            errno = EINVAL;
+            rc = FAILURE;
+        }
     }
-    //printf("%s received \"%s\"\n", myThreadLabel, msg);
 
-    int netFunc   = -1;
-    int netfd     =  0;
-    int seqNum    = -1;
-    int iStartPos = -1;
-    int nBytes    = -1;
-    sscanf(msg, "%d,%d,%d,%d,%d", &netFunc, &netfd, &seqNum, &iStartPos, &nBytes);
+    //
+    // Process the entries.  Small batches are not worth a
+    // thread; this thread always takes a share of the work.
+    //
+    if ( rc == SUCCESS ) {
+        batch.traceId = traceCurrent();
+        atomic_store(&batch.next, 0);
+
+        nWorkers = (batch.count + 63) / 64;
+        if ( nWorkers > BATCH_WORKERS ) nWorkers = BATCH_WORKERS;
+        for (i=1; i < nWorkers; i++) {
+            if ( pthread_create(&tids[i], NULL, &batchWorker, &batch) != 0 ) break;
+        }
+        nWorkers = i;
 
-    //printf("%s netFunc= %d, netfd= %d, seqNum= %d, iStartPos= %d, nBytes= %d\n",
-    //         myThreadLabel, netFunc, netfd, seqNum, iStartPos, nBytes);
+        batchWorker( &batch );
+        for (i=1; i < nWorkers; i++) {
+            pthread_join(tids[i], NULL);
+        }
 
+        for (i=0; i < batch.count; i++) {
+            int entryResult = FAILURE;
 
-    //
-    // read "nBytes" of data starting at position "iStartPos"
-    // from the file referred to as "netfd"
-    //
-    char *pData = NULL;
-    pData = readFile( netfd, iStartPos, nBytes);
+            sscanf(batch.results[i], "%d,", &entryResult);
+            if ( entryResult == SUCCESS ) nSuccess++;
+            nReply = nReply + strlen(batch.results[i]) + 1;
+        }
+
+        pReply = malloc( MSG_SIZE + nReply );
+        if ( pReply == NULL ) {
+            errno = ENOMEM;
+            rc = FAILURE;
+        }
+    }
 
 
     //
-    // Send "nBytes" of data to the client
+    // Compose and send the response
     //
-    if (( pData != NULL) && (nBytes > 0 )) {
-        rc = write(newsockfd, pData, nBytes);
-        if ( rc < 0 ) {
-            fprintf(stderr,"%s fails to send %d bytes of data to client\n", myThreadLabel, nBytes);
-            if ( pData != NULL ) free(pData);
-            if ( sockfd != 0 ) close(sockfd);
+    if ( rc == FAILURE ) {
+        bzero(msg, MSG_SIZE);
+        sprintf(msg, "%d,%d,%d,0,0", FAILURE, errno, h_errno);
+        if ( writeFully(sockfd, msg, MSG_SIZE) < 0 ) {
+            fprintf(stderr,"netfileserver: Do_batch: fails to write response to socket\n");
+        }
+    }
+    else {
+        bzero(pReply, MSG_SIZE);
+        sprintf(pReply, "%d,0,0,%d,%d", SUCCESS, nSuccess, nReply);
+
+        pLine = pReply + MSG_SIZE;
+        for (i=0; i < batch.count; i++) {
+            pLine = pLine + sprintf(pLine, "%s\n", batch.results[i]);
+        }
+
+        phaseTime = statsNow();
+        if ( writeFully(sockfd, pReply, MSG_SIZE + nReply) < 0 ) {
+            fprintf(stderr,"netfileserver: Do_batch: fails to write response to socket\n");
             rc = FAILURE;
-            pthread_exit( &rc );
         }
-        if ( pData != NULL ) free(pData);
-        //printf("%s sent %d bytes of data to client\n", myThreadLabel, nBytes);
+        else {
+            statsRecordPhase( PHASE_NET_SEND, statsNow() - phaseTime );
+            statsCount( COUNTER_BYTES_OUT, nReply );
+        }
     }
 
+    if ( pReply != NULL ) free( pReply );
+    if ( batch.results != NULL ) free( batch.results );
+    if ( batch.args != NULL ) free( batch.args );
+    if ( pBody != NULL ) poolPut( pBody, nHeaderLeft + nBytes + 1 );
+    return rc;
+}
 
 
-    //
-    // Read the response from the client saying the number
-    // of bytes received.  The incoming message format is:
-    //
-    //     resultCode, errno, h_errno, nBytes
-    //
-    bzero(msg, MSG_SIZE);
-    rc = read(newsockfd, msg, MSG_SIZE -1);
-    if ( rc < 0 ) {
-        fprintf(stderr,"%s fails to read from socket, errno= %d, h_errno= %d\n",
-                 myThreadLabel, errno, h_errno);
-        if ( sockfd != 0 ) close(sockfd);
-        rc = FAILURE;
-        pthread_exit( &rc );
+/////////////////////////////////////////////////////////////
+//
+// A batch worker takes the next unprocessed entry until none
+// are left
+//
+/////////////////////////////////////////////////////////////
+
+void *batchWorker( void *arg )
+{
+    NET_BATCH_TYPE *batch = (NET_BATCH_TYPE *)arg;
+    int i = 0;
+
+    traceSetCurrent( batch->traceId );
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        batchEntry( batch, i );
     }
+    return NULL;
+}
 
-    //printf("%s received \"%s\"\n", myThreadLabel, msg);
 
-    int resultCode  = FAILURE;
-    int *pBytesRecv  = malloc(sizeof(int));
-    sscanf(msg, "%d,%d,%d,%d", &resultCode, &errno, &h_errno, pBytesRecv);
+/////////////////////////////////////////////////////////////
+//
+// Process one batch entry and write its response line.  An
+// open entry goes through Do_netopen, so it is subject to the
+// same connection mode policy as a single netopen.
+//
+/////////////////////////////////////////////////////////////
 
-    //printf("%s resultCode= %d, errno= %d, h_errno= %d, iBytesRecv= %d\n",
-    //         myThreadLabel, resultCode, errno, h_errno, *pBytesRecv);
+void batchEntry( NET_BATCH_TYPE *batch, const int index )
+{
+    char *arg = batch->args[ index ];
+    char *result = batch->results[ index ];
+    int rc = FAILURE;
 
+    errno = 0;
+    switch (batch->netFunc)
+    {
+        case NET_OPEN_BATCH:
+        {
+            NET_FD_TYPE openFd;
+            char *pPath = strchr(arg, ',');
+
+            bzero(&openFd, sizeof(openFd));
+            openFd.fcMode = batch->fcMode;
+            openFd.bPrivate = FALSE;
+            if ((pPath == NULL) || (strlen(pPath + 1) >= sizeof(openFd.pathname))) {
+                errno = (pPath == NULL) ? EINVAL : ENAMETOOLONG;
+            }
+            else {
+                sscanf(arg, "%d,", &(openFd.fileOpenFlags));
+                strcpy(openFd.pathname, pPath + 1);
+                rc = Do_netopen( &openFd );
+            }
 
-    if ( newsockfd != 0 ) close(newsockfd);
-    rc = SUCCESS;
-    pthread_exit( pBytesRecv );
+            if ( rc == FAILURE ) sprintf(result, "%d,%d,%d", FAILURE, errno, FAILURE);
+            else sprintf(result, "%d,0,%d", SUCCESS, rc);
+            break;
+        }
+
+        case NET_STAT_BATCH:
+        {
+            struct stat st;
+
+            if ( stat(arg, &st) != 0 ) {
+                sprintf(result, "%d,%d,0,0,0", FAILURE, errno);
+            }
+            else {
+                sprintf(result, "%d,0,%ld,%d,%ld", SUCCESS, (long)st.st_size,
+                        (int)st.st_mode, (long)st.st_mtime);
+            }
+            break;
+        }
+
+        case NET_CLOSE_BATCH:
+        {
+            int netfd = 0;
+
+            if ( sscanf(arg, "%d", &netfd) != 1 ) errno = EINVAL;
+            else rc = closeFD( netfd );
+
+            if ( rc == FAILURE ) sprintf(result, "%d,%d", FAILURE, errno);
+            else sprintf(result, "%d,0", SUCCESS);
+            break;
+        }
+
+        default:
+            sprintf(result, "%d,%d", FAILURE, EINVAL);
+            break;
+    }
 }
 
 
+/////////////////////////////////////////////////////////////
+//
+// Do_readRanges serves a netreadranges.  The request is a
+// MSG_SIZE header followed by one "offset,length" line per
+// range.  The header format is:
+//
+//    14,netFd,count,nBytes,advice
+//
+// where advice is the client's netadvise hint for netFd.
+//
+// Ranges are clipped to the end of the file and sorted by
+// offset.  Ranges that touch, or are at most RANGE_GAP_MAX
+// apart, are read with a single preadv, the gap going into
+// a scratch buffer.  Overlapping ranges start a new read.
+//
+// The response is a MSG_SIZE header, one line per range with
+// the bytes read for it, then the data of every range in
+// request order.  The header format is:
+//
+//    result,errno,h_errno,nLines,nData
+//
+// Returns SUCCESS if the response was sent, or FAILURE.
+//
 /////////////////////////////////////////////////////////////
 
-
-char *readFile( const int netfd, const int iStartPos, const int iBytesWanted)
+int Do_readRanges( const int sockfd, char *msg, const int nHeaderLeft )
 {
-    NET_FD_TYPE  *fileInfo = NULL;
-    FILE *fpRead = NULL;
-    char *pData  = NULL;
+    NET_FUNCTION_TYPE netFunc = INVALID;
+    NET_FD_TYPE fileInfo;
+    READ_RANGE_TYPE *ranges = NULL;
+    READ_RANGE_TYPE **sorted = NULL;
+    struct iovec *iov = NULL;
+    char *pBody = NULL;
+    char *pData = NULL;
+    char *pLines = NULL;
+    char *pLine = NULL;
+    char gap[ RANGE_GAP_MAX ];
+    int netfd = 0;
+    int count = 0;
+    int nBytes = 0;
+    int advice = NET_ADVICE_NORMAL;
+    int nBody = 0;
+    long fileSize = 0;
+    int fd = -1;
+    int nData = 0;
+    int nLines = 0;
+    int nReads = 0;
+    int rc = SUCCESS;
+    int i = 0;
+    uint64_t phaseTime = 0;
 
 
-    if ((iStartPos <0) || (iBytesWanted <=0)) return NULL;
+    sscanf(msg, "%u,%d,%d,%d,%d", &netFunc, &netfd, &count, &nBytes, &advice);
 
-    // Find the file to read from
-    fileInfo = LookupFDtable( netfd );
+    //
+    // Take in the whole body before answering.  Each range is
+    // one line of at most RANGE_LINE_MAX bytes, so a longer
+    // body is refused unread.  The body is bounded by that,
+    // so it is malloc'd rather than borrowed: the data buffer
+    // must be this request's only pool borrow.
+    //
+    if ((count <= 0) || (count > NET_RANGES_MAX) ||
+        (nBytes <= 0) || (nBytes > NET_RANGES_MAX * RANGE_LINE_MAX)) {
+        drainFully(sockfd, (long)nHeaderLeft + ((nBytes > 0) ? nBytes : 0));
+        errno = EINVAL;
+        rc = FAILURE;
+    }
+    else {
+        nBody = nBytes;
+        pBody = malloc( nHeaderLeft + nBody + 1 );
+        if ( pBody == NULL ) {
+            drainFully(sockfd, (long)nHeaderLeft + nBody);
+            errno = ENOMEM;
+            rc = FAILURE;
+        }
+        else if ( readFully(sockfd, pBody, nHeaderLeft + nBody) != nHeaderLeft + nBody ) {
+            fprintf(stderr,"netfileserver: Do_readRanges: fails to read ranges from socket\n");
+            errno = ECONNRESET;
+            rc = FAILURE;
+        }
+    }
 
-    if ( fileInfo == NULL ) return NULL;
-    //printf("netfileserver: readFile: pathname= \"%s\"\n", fileInfo->pathname);
+    if ( rc == SUCCESS ) {
+        rc = canRead(netfd, 0, &fileSize);
+    }
 
-    // Open the data file for reading
-    fpRead = fopen(fileInfo->pathname,"r");
-    if ( fpRead == NULL ) {
-        // Fail to open the data file for reading
-        fprintf(stderr,"netfileserver: readFile: fails to open \"%s\" for read, errno= %d\n",
-                   fileInfo->pathname, errno);
-        return NULL;
+    if ( rc == SUCCESS ) {
+        ranges = malloc( sizeof(READ_RANGE_TYPE) * count );
+        sorted = malloc( sizeof(READ_RANGE_TYPE *) * count );
+        iov    = malloc( sizeof(struct iovec) * ((2 * count) + 1) );
+        pLines = malloc( (count * 16) + 1 );
+        if ((ranges == NULL) || (sorted == NULL) || (iov == NULL) || (pLines == NULL)) {
+            errno = ENOMEM;
+            rc = FAILURE;
+        }
     }
 
 
     //
-    // Set the file position to "iStartPos" relative
-    // to the beginning of the file.
+    // Parse the ranges, clip them to the file and lay out
+    // their data in request order
     //
-    if (fseek(fpRead, iStartPos, SEEK_SET) == 0) {
-        pData = malloc( iBytesWanted * sizeof(char) );
-        bzero(pData, iBytesWanted);
+    if ( rc == SUCCESS ) {
+        pLine = pBody + nHeaderLeft;
+        pLine[ nBody ] = '\0';
+        for (i=0; (i < count) && (rc == SUCCESS); i++) {
+            long length = 0;
+
+            if ((pLine == NULL) ||
+                (sscanf(pLine, "%ld,%ld", &ranges[i].offset, &length) != 2) ||
+                (ranges[i].offset < 0) || (length < 0) || ((long)nData + length > INT_MAX)) {
+                errno = EINVAL;
+                rc = FAILURE;
+                break;
+            }
 
-        if ( pData != NULL ) {
-            int iBytesRead = 0;
-            iBytesRead = (int)fread(pData, sizeof(char), iBytesWanted, fpRead);
-            if ( iBytesRead > 0) {
-                // Read "iBytesRead" from the file
-                if (fpRead != NULL) fclose(fpRead);
-                return pData;
+            if ( ranges[i].offset >= fileSize ) length = 0;
+            else if ( ranges[i].offset + length > fileSize ) length = fileSize - ranges[i].offset;
+
+            ranges[i].nBytes = (int)length;
+            ranges[i].dataPos = nData;
+            nData = nData + ranges[i].nBytes;
+            sorted[i] = &ranges[i];
+            nLines = nLines + sprintf(pLines + nLines, "%d\n", ranges[i].nBytes);
+
+            pLine = strchr(pLine, '\n');
+            if ( pLine != NULL ) pLine++;
+        }
+    }
+
+    if ((rc == SUCCESS) && (nData > 0)) {
+        pData = poolGet( nData );
+        if ( copyFDentry( netfd, &fileInfo ) == FAILURE ) {
+            errno = EBADF;
+            rc = FAILURE;
+        }
+        else if ( pData == NULL ) {
+            errno = ENOMEM;
+            rc = FAILURE;
+        }
+        else {
+            fd = openFDdata(netfd, O_RDONLY);
+            if ( fd < 0 ) rc = FAILURE;
+            else adviseBefore(fd, advice, 0, 0);
+        }
+    }
+
+
+    //
+    // Read the ranges in file order, one preadv per run of
+    // neighbouring ranges
+    //
+    if ((rc == SUCCESS) && (nData > 0)) {
+        int first = 0;
+
+        phaseTime = statsNow();
+        qsort(sorted, count, sizeof(READ_RANGE_TYPE *), compareRanges);
+
+        while ((first < count) && (rc == SUCCESS)) {
+            long runStart = sorted[first]->offset;
+            long runEnd = runStart;
+            int nVec = 0;
+            int last = first;
+
+            for (last = first; last < count; last++) {
+                READ_RANGE_TYPE *r = sorted[last];
+
+                if ( r->nBytes == 0 ) continue;
+                if ( nVec > 0 ) {
+                    if ((r->offset < runEnd) || (r->offset - runEnd > RANGE_GAP_MAX) ||
+                        (nVec + 2 > IOV_MAX)) break;
+                    if ( r->offset > runEnd ) {
+                        iov[nVec].iov_base = gap;
+                        iov[nVec].iov_len  = r->offset - runEnd;
+                        nVec++;
+                    }
+                }
+                else {
+                    runStart = r->offset;
+                }
+                iov[nVec].iov_base = pData + r->dataPos;
+                iov[nVec].iov_len  = r->nBytes;
+                nVec++;
+                runEnd = r->offset + r->nBytes;
+            }
+
+            if ( nVec > 0 ) {
+                ssize_t nRead = preadv(fd, iov, nVec, runStart);
+
+                adviseAfter(fd, advice, runStart, runEnd - runStart);
+                nReads++;
+                if ( nRead != runEnd - runStart ) {
+                    // The file shrank under us
+                    if ( nRead >= 0 ) errno = EIO;
+                    rc = FAILURE;
+                }
             }
+            first = last;
         }
-    } // End of fseek()
 
+        statsRecordPhase( PHASE_DISK_IO, statsNow() - phaseTime );
+        traceSpan( "readRanges", phaseTime, statsNow() );
+    }
+    if ( fd >= 0 ) close(fd);
 
-    // Fail to read from the file
-    fprintf(stderr,"netfileserver: readFile: fails to read \"%s\", errno= %d, iStartPos= %d, iBytesWanted= %d\n",
-               fileInfo->pathname, errno, iStartPos, iBytesWanted);
 
-    if (pData != NULL)  free(pData);
-    if (fpRead != NULL) fclose(fpRead);
-    return NULL;
+    //
+    // Compose and send the response
+    //
+    bzero(msg, MSG_SIZE);
+    if ( rc == FAILURE ) {
+        sprintf(msg, "%d,%d,%d,0,0", FAILURE, errno, h_errno);
+        if ( writeFully(sockfd, msg, MSG_SIZE) < 0 ) {
+            fprintf(stderr,"netfileserver: Do_readRanges: fails to write response to socket\n");
+        }
+    }
+    else {
+        sprintf(msg, "%d,%d,%d,%d,%d", SUCCESS, 0, 0, nLines, nData);
+
+        phaseTime = statsNow();
+        if ((writeFully(sockfd, msg, MSG_SIZE) < 0) ||
+            (writeFully(sockfd, pLines, nLines) < 0) ||
+            ((nData > 0) && (writeFully(sockfd, pData, nData) < 0))) {
+            fprintf(stderr,"netfileserver: Do_readRanges: fails to write response to socket\n");
+            rc = FAILURE;
+        }
+        else {
+            statsRecordPhase( PHASE_NET_SEND, statsNow() - phaseTime );
+            statsCount( COUNTER_BYTES_OUT, nData );
+        }
+    }
+
+    if ( pLines != NULL ) free( pLines );
+    if ( pData != NULL )  poolPut( pData, nData );
+    if ( iov != NULL )    free( iov );
+    if ( sorted != NULL ) free( sorted );
+    if ( ranges != NULL ) free( ranges );
+    if ( pBody != NULL )  free( pBody );
+    return rc;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// qsort comparison of two ranges by file offset
+//
+/////////////////////////////////////////////////////////////
+
+int compareRanges( const void *a, const void *b )
+{
+    long x = (*(READ_RANGE_TYPE * const *)a)->offset;
+    long y = (*(READ_RANGE_TYPE * const *)b)->offset;
+
+    return (x > y) - (x < y);
 }
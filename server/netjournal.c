@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/uio.h>
+
+#include "libnetfiles.h"
+#include "netstats.h"
+#include "netsync.h"
+#include "netjournal.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// The journal is a file of records, each a JOURNAL_HEADER_TYPE
+// followed by the target's pathname and the data written to
+// it.  A netwrite replaces a file's contents, so writing a
+// record to its file again is harmless, which is what makes
+// replay after a crash safe however far the last run got.
+//
+// Records appended to the journal also wait in memory, in
+// journal order, until they are written to their files.  A
+// writer whose record has reached the disk writes every
+// record up to its own: anything appended before it reached
+// the disk with it, and writing them in order keeps two
+// writes to one file from landing the wrong way round.
+//
+// Locks are taken apply lock first, then journal lock.
+//
+/////////////////////////////////////////////////////////////
+
+
+#define JOURNAL_MAGIC   0x4a4e4c31      // "JNL1"
+
+
+typedef struct {
+    uint32_t magic;
+    uint32_t pathLen;
+    uint32_t dataLen;
+    uint32_t checksum;                  // of the pathname and data
+    uint64_t seq;
+} JOURNAL_HEADER_TYPE;
+
+
+//
+// A record in the journal not yet written to its file
+//
+typedef struct JOURNAL_ENTRY {
+    struct JOURNAL_ENTRY *next;
+    uint64_t seq;
+    int nBytes;
+    char pathname[256];
+    char data[];
+} JOURNAL_ENTRY_TYPE;
+
+
+//
+// A file written from the journal since it was last emptied
+//
+typedef struct JOURNAL_DIRTY {
+    struct JOURNAL_DIRTY *next;
+    char pathname[256];
+} JOURNAL_DIRTY_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static uint32_t checksum( const char *pathname, const int pathLen, const char *data, const int nBytes );
+static void     applyRecord( const char *pathname, const char *data, const int nBytes );
+static void     applyUpTo( const uint64_t seq );
+static int      checkpoint();
+static void    *checkpointThread( void *arg );
+static int      replay();
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static char                 gJournalPath[256] = "";
+static int                  gJournalFd     = -1;
+static pthread_mutex_t      gJournalLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t      gApplyLock     = PTHREAD_MUTEX_INITIALIZER;
+static long                 gJournalBytes  = 0;
+static uint64_t             gNextSeq       = 1;
+static JOURNAL_ENTRY_TYPE  *gQueueHead     = NULL;
+static JOURNAL_ENTRY_TYPE  *gQueueTail     = NULL;
+static JOURNAL_DIRTY_TYPE  *gDirty         = NULL;
+static int                  gDirtyLost     = FALSE;   // a file is missing from gDirty
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+static uint32_t checksum( const char *pathname, const int pathLen, const char *data, const int nBytes )
+{
+    uint32_t sum = 2166136261u;     // FNV-1a
+    int i = 0;
+
+    for (i=0; i < pathLen; i++) sum = (sum ^ (unsigned char)pathname[i]) * 16777619u;
+    for (i=0; i < nBytes; i++)  sum = (sum ^ (unsigned char)data[i]) * 16777619u;
+    return sum;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Replace the contents of "pathname" with a record's data,
+// and remember to sync it at the next checkpoint.  Called
+// with the apply lock held.
+//
+/////////////////////////////////////////////////////////////
+
+static void applyRecord( const char *pathname, const char *data, const int nBytes )
+{
+    JOURNAL_DIRTY_TYPE *dirty = NULL;
+    int fd = -1;
+    int nDone = 0;
+    ssize_t rc = 0;
+
+    fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd < 0 ) {
+        fprintf(stderr,"netfileserver: journal: fails to open \"%s\", errno= %d\n", pathname, errno);
+        return;
+    }
+    while ( nDone < nBytes ) {
+        rc = pwrite(fd, data + nDone, nBytes - nDone, nDone);
+        if ( rc < 0 ) {
+            if ( errno == EINTR ) continue;
+            fprintf(stderr,"netfileserver: journal: fails to write \"%s\", errno= %d\n", pathname, errno);
+            break;
+        }
+        nDone = nDone + (int)rc;
+    }
+    close(fd);
+
+    for (dirty = gDirty; dirty != NULL; dirty = dirty->next) {
+        if ( strcmp(dirty->pathname, pathname) == 0 ) return;
+    }
+    dirty = malloc( sizeof(JOURNAL_DIRTY_TYPE) );
+    if ( dirty == NULL ) {
+        gDirtyLost = TRUE;          // synced anyway: checkpoint syncs the journal first
+        return;
+    }
+    strcpy( dirty->pathname, pathname );
+    dirty->next = gDirty;
+    gDirty = dirty;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write every waiting record up to "seq" to its file, in
+// journal order.  The caller knows they are all on disk in
+// the journal.
+//
+/////////////////////////////////////////////////////////////
+
+static void applyUpTo( const uint64_t seq )
+{
+    JOURNAL_ENTRY_TYPE *entry = NULL;
+
+    pthread_mutex_lock( &gApplyLock );
+    while ( TRUE ) {
+        pthread_mutex_lock( &gJournalLock );
+        entry = gQueueHead;
+        if ((entry != NULL) && (entry->seq <= seq)) {
+            gQueueHead = entry->next;
+            if ( gQueueHead == NULL ) gQueueTail = NULL;
+        }
+        else {
+            entry = NULL;
+        }
+        pthread_mutex_unlock( &gJournalLock );
+        if ( entry == NULL ) break;
+
+        applyRecord( entry->pathname, entry->data, entry->nBytes );
+        free( entry );
+    }
+    pthread_mutex_unlock( &gApplyLock );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Empty the journal.  Everything in it is written to its
+// file and every file written from it is synced, after which
+// the records are no longer needed.  If any file fails to
+// sync, the journal is kept as it is.  Appends wait
+// meanwhile.
+//
+/////////////////////////////////////////////////////////////
+
+static int checkpoint()
+{
+    JOURNAL_DIRTY_TYPE *dirty = NULL;
+    JOURNAL_DIRTY_TYPE *failed = NULL;
+    int err = 0;
+
+    pthread_mutex_lock( &gApplyLock );
+    pthread_mutex_lock( &gJournalLock );
+    if ( gJournalBytes == 0 ) {
+        pthread_mutex_unlock( &gJournalLock );
+        pthread_mutex_unlock( &gApplyLock );
+        return SUCCESS;
+    }
+
+    fdatasync( gJournalFd );
+    while ( gQueueHead != NULL ) {
+        JOURNAL_ENTRY_TYPE *entry = gQueueHead;
+
+        gQueueHead = entry->next;
+        applyRecord( entry->pathname, entry->data, entry->nBytes );
+        free( entry );
+    }
+    gQueueTail = NULL;
+
+    while ( gDirty != NULL ) {
+        dirty = gDirty;
+        gDirty = dirty->next;
+        if ((syncFile( dirty->pathname ) == SUCCESS) || (errno == ENOENT)) {
+            free( dirty );     // on disk, or removed since
+            continue;
+        }
+        err = errno;
+        fprintf(stderr,"netfileserver: journal: fails to sync \"%s\", errno= %d\n", dirty->pathname, err);
+        dirty->next = failed;
+        failed = dirty;
+    }
+
+    //
+    // A file that could not be synced may still lose its
+    // writes, so the journal keeps them, and the file is
+    // tried again at the next checkpoint
+    //
+    if ( failed != NULL ) gDirty = failed;
+    else if ( ftruncate(gJournalFd, 0) == 0 ) {
+        fdatasync( gJournalFd );
+        gJournalBytes = 0;
+        gDirtyLost = FALSE;
+        statsCount( COUNTER_JOURNAL_CHECKPOINTS, 1 );
+    }
+    pthread_mutex_unlock( &gJournalLock );
+    pthread_mutex_unlock( &gApplyLock );
+
+    if ( failed != NULL ) {
+        errno = err;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+//
+// A checkpoint that failed is tried again after
+// JOURNAL_CHECKPOINT_MS, however large the journal is
+//
+static void *checkpointThread( void *arg )
+{
+    struct timespec tick = { 0, 100 * 1000 * 1000 };
+    uint64_t lastTime = statsNow();
+    long nBytes = 0;
+    int bFailed = FALSE;
+
+    while ( TRUE ) {
+        nanosleep( &tick, NULL );
+
+        pthread_mutex_lock( &gJournalLock );
+        nBytes = gJournalBytes;
+        pthread_mutex_unlock( &gJournalLock );
+
+        if (((nBytes >= JOURNAL_CHECKPOINT_BYTES) && (bFailed == FALSE)) ||
+            ((nBytes > 0) && (statsNow() - lastTime >= (uint64_t)JOURNAL_CHECKPOINT_MS * 1000000))) {
+            bFailed = (checkpoint() == FAILURE);
+            lastTime = statsNow();
+        }
+    }
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write every whole record left in the journal to its file
+// again.  Reading stops at the first record that is cut
+// short or doesn't check out: the crash came while it was
+// being appended, so it was never acknowledged.
+//
+/////////////////////////////////////////////////////////////
+
+static int replay()
+{
+    JOURNAL_HEADER_TYPE header;
+    char pathname[256] = "";
+    char *data = NULL;
+    off_t pos = 0;
+    int nRecords = 0;
+
+    data = malloc( JOURNAL_MAX_WRITE );
+    if ( data == NULL ) return FAILURE;
+
+    pthread_mutex_lock( &gApplyLock );
+    while ( pread(gJournalFd, &header, sizeof(header), pos) == sizeof(header) ) {
+        if ((header.magic != JOURNAL_MAGIC) || (header.pathLen == 0) ||
+            (header.pathLen >= sizeof(pathname)) || (header.dataLen > JOURNAL_MAX_WRITE)) break;
+        pos = pos + sizeof(header);
+
+        if ( pread(gJournalFd, pathname, header.pathLen, pos) != header.pathLen ) break;
+        pathname[header.pathLen] = '\0';
+        pos = pos + header.pathLen;
+
+        if ( pread(gJournalFd, data, header.dataLen, pos) != header.dataLen ) break;
+        pos = pos + header.dataLen;
+
+        if ( checksum(pathname, header.pathLen, data, header.dataLen) != header.checksum ) break;
+
+        applyRecord( pathname, data, header.dataLen );
+        gNextSeq = header.seq + 1;
+        nRecords++;
+    }
+    pthread_mutex_unlock( &gApplyLock );
+    free( data );
+
+    if ( nRecords > 0 ) {
+        printf("netfileserver: replayed %d journal records from \"%s\"\n", nRecords, gJournalPath);
+        fflush(stdout);
+    }
+
+    //
+    // Sync the files and empty the journal, which drops a
+    // torn record at its end as well
+    //
+    gJournalBytes = lseek(gJournalFd, 0, SEEK_END);
+    if ( checkpoint() == FAILURE ) return FAILURE;
+    if ( gJournalBytes != 0 ) return FAILURE;
+    return SUCCESS;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Open the journal at "pathname", creating it if need be,
+// and replay what a previous run left in it.  Called once,
+// before any request is taken.
+//
+/////////////////////////////////////////////////////////////
+
+int journalInit( const char *pathname )
+{
+    pthread_t tid;
+
+    if ( strlen(pathname) >= sizeof(gJournalPath) ) {
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+    strcpy( gJournalPath, pathname );
+
+    gJournalFd = open(pathname, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if ( gJournalFd < 0 ) return FAILURE;
+
+    if ( replay() == FAILURE ) {
+        close( gJournalFd );
+        gJournalFd = -1;
+        return FAILURE;
+    }
+
+    if ( pthread_create(&tid, NULL, checkpointThread, NULL) != 0 ) return FAILURE;
+    pthread_detach( tid );
+    return SUCCESS;
+}
+
+
+int journalEnabled()
+{
+    return (gJournalFd >= 0) ? TRUE : FALSE;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Replace the contents of "pathname" with "nBytes" of data,
+// through the journal.  Returns once the record is on disk
+// and written to the file, with "nBytes", or FAILURE with
+// errno set.
+//
+/////////////////////////////////////////////////////////////
+
+int journalWrite( const char *pathname, const char *data, const int nBytes )
+{
+    JOURNAL_HEADER_TYPE header;
+    JOURNAL_ENTRY_TYPE *entry = NULL;
+    struct iovec iov[3];
+    int pathLen = (int)strlen(pathname);
+    int nTotal = 0;
+    ssize_t rc = 0;
+
+    if ((pathLen == 0) || (pathLen >= (int)sizeof(entry->pathname)) ||
+        (nBytes < 0) || (nBytes > JOURNAL_MAX_WRITE)) {
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    entry = malloc( sizeof(JOURNAL_ENTRY_TYPE) + nBytes );
+    if ( entry == NULL ) {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    strcpy( entry->pathname, pathname );
+    memcpy( entry->data, data, nBytes );
+    entry->nBytes = nBytes;
+    entry->next = NULL;
+
+    bzero(&header, sizeof(header));
+    header.magic    = JOURNAL_MAGIC;
+    header.pathLen  = pathLen;
+    header.dataLen  = nBytes;
+    header.checksum = checksum(pathname, pathLen, data, nBytes);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = (void *)pathname;
+    iov[1].iov_len  = pathLen;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len  = nBytes;
+    nTotal = (int)sizeof(header) + pathLen + nBytes;
+
+    //
+    // Append the record.  One writev on an O_APPEND file puts
+    // it down in one piece; if it goes in short, it is cut off
+    // again so the next record doesn't follow a torn one.
+    //
+    pthread_mutex_lock( &gJournalLock );
+    entry->seq = gNextSeq++;
+    header.seq = entry->seq;
+    rc = writev(gJournalFd, iov, 3);
+    if ( rc != nTotal ) {
+        if ( rc >= 0 ) errno = EIO;
+        if ( ftruncate(gJournalFd, gJournalBytes) < 0 ) {
+            fprintf(stderr,"netfileserver: journal: fails to cut off a torn record, errno= %d\n", errno);
+        }
+        pthread_mutex_unlock( &gJournalLock );
+        free( entry );
+        return FAILURE;
+    }
+    gJournalBytes = gJournalBytes + nTotal;
+    if ( gQueueTail != NULL ) gQueueTail->next = entry;
+    else gQueueHead = entry;
+    gQueueTail = entry;
+    pthread_mutex_unlock( &gJournalLock );
+
+    statsCount( COUNTER_JOURNAL_WRITES, 1 );
+
+    //
+    // Wait for the journal to reach the disk, along with every
+    // other record appended meanwhile, then write the file
+    //
+    if ( syncFile( gJournalPath ) == FAILURE ) return FAILURE;
+    applyUpTo( header.seq );
+
+    return nBytes;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Called before a write to "pathname" that doesn't go
+// through the journal, or a rename onto it, is acknowledged.
+// Replay writes a record over whatever its file holds, so a
+// record for the file still in the journal would undo the
+// newer data after a crash.  If there is one, the journal
+// is emptied first, which also writes every record still on
+// its way.  Returns SUCCESS, or FAILURE with errno set if
+// the journal can't be emptied.
+//
+/////////////////////////////////////////////////////////////
+
+int journalSupersede( const char *pathname )
+{
+    JOURNAL_ENTRY_TYPE *entry = NULL;
+    JOURNAL_DIRTY_TYPE *dirty = NULL;
+    int bJournaled = FALSE;
+
+    if ( gJournalFd < 0 ) return SUCCESS;
+
+    pthread_mutex_lock( &gApplyLock );
+    pthread_mutex_lock( &gJournalLock );
+    if ( gJournalBytes > 0 ) {
+        bJournaled = gDirtyLost;
+        for (dirty = gDirty; (dirty != NULL) && (bJournaled == FALSE); dirty = dirty->next) {
+            if ( strcmp(dirty->pathname, pathname) == 0 ) bJournaled = TRUE;
+        }
+        for (entry = gQueueHead; (entry != NULL) && (bJournaled == FALSE); entry = entry->next) {
+            if ( strcmp(entry->pathname, pathname) == 0 ) bJournaled = TRUE;
+        }
+    }
+    pthread_mutex_unlock( &gJournalLock );
+    pthread_mutex_unlock( &gApplyLock );
+
+    if ( bJournaled == FALSE ) return SUCCESS;
+    return checkpoint();
+}
+
+/////////////////////////////////////////////////////////////
@@ -0,0 +1,62 @@
+#ifndef 	_NETJOURNAL_H_
+#define    	_NETJOURNAL_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "netjournal.h" file declares the server's write-ahead
+// journal (-j).  A small write is appended to the journal
+// and acknowledged once a group commit has the journal on
+// disk.  Only then is it written to its file, through the
+// page cache.  Every so often the journaled files are synced
+// and the journal is emptied.
+//
+// A crash can then leave a file cut short or half written,
+// but never with its journal record lost: on startup every
+// whole record left in the journal is written again, in
+// order, before the server takes requests.  A file written
+// any other way has its records checkpointed out of the
+// journal first, so a replay can't bring back older data.
+//
+/////////////////////////////////////////////////////////////
+
+
+#include <stdint.h>
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Constant and type definitions
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// Writes of at most this many bytes are journaled
+//
+#define JOURNAL_MAX_WRITE        INLINE_DATA_SIZE
+
+//
+// The journal is emptied when it grows past this size, or
+// has not been for JOURNAL_CHECKPOINT_MS
+//
+#define JOURNAL_CHECKPOINT_BYTES (64L * 1024 * 1024)
+#define JOURNAL_CHECKPOINT_MS    1000
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+int  journalInit( const char *pathname );
+int  journalEnabled();
+int  journalWrite( const char *pathname, const char *data, const int nBytes );
+int  journalSupersede( const char *pathname );
+
+
+
+#endif    // _NETJOURNAL_H_
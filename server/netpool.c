@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+
+#include "libnetfiles.h"
+#include "netstats.h"
+#include "netpool.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// A buffer's size class follows from the size it was asked
+// for, so poolPut is told that size and no header is kept
+// in front of the buffer.  That keeps every pooled buffer
+// exactly its class size, which is what lets the large
+// classes sit on whole huge pages.
+//
+// An idle buffer holds the link to the next idle buffer of
+// its class in its own first bytes.
+//
+// Every thread has a POOL_CACHE_TYPE of its own, so a thread
+// that borrows and returns buffers of one size over and
+// over never takes a lock.  When a thread exits, its cache
+// moves to the shared lists for the next thread to use.
+//
+// The budget is a ticket queue: each borrow takes the next
+// ticket and goes ahead when its ticket is up and its bytes
+// fit, so a large borrow is not passed over forever by a
+// stream of small ones.  Every transfer path holds at most
+// one borrowed buffer at a time, which is what keeps a
+// waiting borrow from blocking the returns it waits for.
+// Each thread counts what it holds, and a second borrow is
+// refused rather than left to wait on its own buffer.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct POOL_FREE {
+    struct POOL_FREE *next;
+} POOL_FREE_TYPE;
+
+
+typedef struct {
+    POOL_FREE_TYPE *head[ POOL_CLASSES ];
+    int count[ POOL_CLASSES ];
+} POOL_CACHE_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void             poolOnce();
+static void             flushCache( void *cache );
+static POOL_CACHE_TYPE *getCache();
+static int              sizeClass( const size_t nBytes );
+static size_t           classSize( const int c );
+static void            *allocClass( const int c );
+static void             releaseClass( void *buf, const int c );
+static void             putShared( void *buf, const int c );
+static void             budgetAcquire( const size_t nBytes );
+static void             budgetRelease( const size_t nBytes );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static pthread_once_t   gPoolOnce   = PTHREAD_ONCE_INIT;
+static pthread_key_t    gPoolKey;
+static pthread_mutex_t  gPoolLock   = PTHREAD_MUTEX_INITIALIZER;
+static POOL_FREE_TYPE  *gShared[ POOL_CLASSES ];
+static uint64_t         gSharedBytes = 0;
+static int              gHugePages   = FALSE;
+
+static _Atomic uint64_t gHeldBytes = 0;
+static _Atomic uint64_t gIdleBytes = 0;
+
+static pthread_mutex_t  gBudgetLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gBudgetCond   = PTHREAD_COND_INITIALIZER;
+static uint64_t         gBudgetBytes  = (uint64_t)POOL_BUDGET_MB * 1024 * 1024;
+static uint64_t         gInFlight     = 0;
+static uint64_t         gNextTicket   = 0;
+static uint64_t         gServing      = 0;
+
+static _Thread_local POOL_CACHE_TYPE *tPoolCache = NULL;
+static _Thread_local int              tBorrowed  = 0;    // buffers this thread holds
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void poolOnce()
+{
+    pthread_key_create( &gPoolKey, flushCache );
+}
+
+
+void poolInit( const int bHugePages, const uint64_t budgetBytes )
+{
+    gHugePages = bHugePages;
+    if ( budgetBytes > 0 ) gBudgetBytes = budgetBytes;
+    pthread_once( &gPoolOnce, poolOnce );
+}
+
+
+static int sizeClass( const size_t nBytes )
+{
+    size_t size = POOL_MIN_SIZE;
+    int c = 0;
+
+    while ((size < nBytes) && (c < POOL_CLASSES)) {
+        size = size * 2;
+        c++;
+    }
+    return (c < POOL_CLASSES) ? c : FAILURE;
+}
+
+
+static size_t classSize( const int c )
+{
+    return (size_t)POOL_MIN_SIZE << c;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Thread exit destructor.  The cached buffers go to the
+// shared lists, or back to the system if those are full.
+//
+/////////////////////////////////////////////////////////////
+
+static void flushCache( void *arg )
+{
+    POOL_CACHE_TYPE *cache = (POOL_CACHE_TYPE *)arg;
+    POOL_FREE_TYPE *buf = NULL;
+    int c = 0;
+
+    tPoolCache = NULL;
+    for (c=0; c < POOL_CLASSES; c++) {
+        while ( cache->head[c] != NULL ) {
+            buf = cache->head[c];
+            cache->head[c] = buf->next;
+            putShared( buf, c );
+        }
+    }
+    free( cache );
+}
+
+
+static POOL_CACHE_TYPE *getCache()
+{
+    if ( tPoolCache != NULL ) return tPoolCache;
+
+    pthread_once( &gPoolOnce, poolOnce );
+    tPoolCache = calloc( 1, sizeof(POOL_CACHE_TYPE) );
+    if ( tPoolCache != NULL ) pthread_setspecific( gPoolKey, tPoolCache );
+    return tPoolCache;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Get a fresh buffer of class "c" from the system.  Large
+// classes are mapped, on huge pages when asked for and
+// available, else with a hint that they may be backed by
+// transparent huge pages.
+//
+/////////////////////////////////////////////////////////////
+
+static void *allocClass( const int c )
+{
+    size_t size = classSize(c);
+    void *buf = MAP_FAILED;
+
+    if ( size < POOL_MMAP_SIZE ) {
+        buf = malloc( size );
+        if ( buf != NULL ) atomic_fetch_add( &gHeldBytes, size );
+        return buf;
+    }
+
+    if ((gHugePages == TRUE) && (size >= POOL_HUGE_SIZE)) {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if ( buf == MAP_FAILED ) {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( buf == MAP_FAILED ) return NULL;
+        if ((gHugePages == TRUE) && (size >= POOL_HUGE_SIZE)) madvise(buf, size, MADV_HUGEPAGE);
+    }
+
+    atomic_fetch_add( &gHeldBytes, size );
+    return buf;
+}
+
+
+static void releaseClass( void *buf, const int c )
+{
+    size_t size = classSize(c);
+
+    atomic_fetch_sub( &gHeldBytes, size );
+    if ( size < POOL_MMAP_SIZE ) free( buf );
+    else munmap( buf, size );
+}
+
+
+static void putShared( void *buf, const int c )
+{
+    size_t size = classSize(c);
+
+    //
+    // Idle memory is kept within the budget as well
+    //
+    pthread_mutex_lock( &gPoolLock );
+    if ((gSharedBytes + size <= POOL_SHARED_BYTES) && (gSharedBytes + size <= gBudgetBytes)) {
+        ((POOL_FREE_TYPE *)buf)->next = gShared[c];
+        gShared[c] = buf;
+        gSharedBytes = gSharedBytes + size;
+        pthread_mutex_unlock( &gPoolLock );
+        return;
+    }
+    pthread_mutex_unlock( &gPoolLock );
+
+    atomic_fetch_sub( &gIdleBytes, size );
+    releaseClass( buf, c );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Count "nBytes" against the budget, waiting in line until
+// they fit.  "nBytes" is never more than the budget.
+//
+/////////////////////////////////////////////////////////////
+
+static void budgetAcquire( const size_t nBytes )
+{
+    uint64_t ticket = 0;
+    uint64_t waitStart = 0;
+
+    pthread_mutex_lock( &gBudgetLock );
+    ticket = gNextTicket++;
+    while ((ticket != gServing) || (gInFlight + nBytes > gBudgetBytes)) {
+        if ( waitStart == 0 ) {
+            waitStart = statsNow();
+            statsCount( COUNTER_POOL_WAITS, 1 );
+        }
+        pthread_cond_wait( &gBudgetCond, &gBudgetLock );
+    }
+    gServing++;
+    gInFlight = gInFlight + nBytes;
+    pthread_cond_broadcast( &gBudgetCond );   // the next ticket may fit too
+    pthread_mutex_unlock( &gBudgetLock );
+
+    if ( waitStart != 0 ) statsRecordPhase( PHASE_MEMORY_WAIT, statsNow() - waitStart );
+}
+
+
+static void budgetRelease( const size_t nBytes )
+{
+    pthread_mutex_lock( &gBudgetLock );
+    gInFlight = gInFlight - nBytes;
+    pthread_cond_broadcast( &gBudgetCond );
+    pthread_mutex_unlock( &gBudgetLock );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Borrow a buffer of at least "nBytes".  Its contents are
+// whatever the last user left in it.  Waits while the
+// memory budget is used up.  Returns NULL, with errno
+// ENOMEM, if there is no memory or the buffer is larger
+// than the whole budget, or with EDEADLK if the thread
+// already holds a buffer: it could wait forever for the
+// budget that buffer takes up.
+//
+/////////////////////////////////////////////////////////////
+
+void *poolGet( const size_t nBytes )
+{
+    POOL_CACHE_TYPE *cache = NULL;
+    POOL_FREE_TYPE *buf = NULL;
+    int c = sizeClass( nBytes );
+
+    statsCount( COUNTER_POOL_GETS, 1 );
+    if ( tBorrowed > 0 ) {
+        fprintf(stderr,"netfileserver: poolGet: %ld bytes asked for by a thread holding a buffer\n",
+                (long)nBytes);
+        errno = EDEADLK;
+        return NULL;
+    }
+    if ( ((c == FAILURE) ? nBytes : classSize(c)) > gBudgetBytes ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    budgetAcquire( (c == FAILURE) ? nBytes : classSize(c) );
+
+    if ( c == FAILURE ) {
+        // Too large to pool
+        buf = malloc( nBytes );
+        if ( buf == NULL ) budgetRelease( nBytes );
+        else tBorrowed++;
+        return buf;
+    }
+
+    cache = getCache();
+    if ((cache != NULL) && (cache->head[c] != NULL)) {
+        buf = cache->head[c];
+        cache->head[c] = buf->next;
+        cache->count[c]--;
+    }
+    else {
+        pthread_mutex_lock( &gPoolLock );
+        buf = gShared[c];
+        if ( buf != NULL ) {
+            gShared[c] = buf->next;
+            gSharedBytes = gSharedBytes - classSize(c);
+        }
+        pthread_mutex_unlock( &gPoolLock );
+    }
+
+    if ( buf == NULL ) {
+        buf = allocClass( c );
+        if ( buf == NULL ) budgetRelease( classSize(c) );
+        else tBorrowed++;
+        return buf;
+    }
+
+    atomic_fetch_sub( &gIdleBytes, classSize(c) );
+    statsCount( COUNTER_POOL_HITS, 1 );
+    tBorrowed++;
+    return buf;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Give back a buffer from poolGet.  "nBytes" must be the
+// size it was borrowed with, and the thread that borrowed
+// it gives it back.
+//
+/////////////////////////////////////////////////////////////
+
+void poolPut( void *buf, const size_t nBytes )
+{
+    POOL_CACHE_TYPE *cache = NULL;
+    int c = sizeClass( nBytes );
+    int limit = 0;
+
+    if ( buf == NULL ) return;
+    if ( tBorrowed > 0 ) tBorrowed--;
+    budgetRelease( (c == FAILURE) ? nBytes : classSize(c) );
+    if ( c == FAILURE ) {
+        free( buf );
+        return;
+    }
+
+    atomic_fetch_add( &gIdleBytes, classSize(c) );
+
+    cache = getCache();
+    limit = (classSize(c) > POOL_THREAD_BYTES) ? 1 : POOL_THREAD_BUFS;
+    if ((cache != NULL) && (cache->count[c] < limit)) {
+        ((POOL_FREE_TYPE *)buf)->next = cache->head[c];
+        cache->head[c] = buf;
+        cache->count[c]++;
+        return;
+    }
+
+    putShared( buf, c );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// What the pool holds, and the whole process' resident set
+// size for comparison
+//
+/////////////////////////////////////////////////////////////
+
+void poolUsage( POOL_USAGE_TYPE *usage )
+{
+    FILE *fp = NULL;
+    long pages = 0;
+    long rssPages = 0;
+
+    usage->heldBytes = atomic_load( &gHeldBytes );
+    usage->idleBytes = atomic_load( &gIdleBytes );
+
+    pthread_mutex_lock( &gBudgetLock );
+    usage->budgetBytes   = gBudgetBytes;
+    usage->inFlightBytes = gInFlight;
+    usage->nWaiting      = (int)(gNextTicket - gServing);
+    pthread_mutex_unlock( &gBudgetLock );
+    usage->rssBytes  = 0;
+
+    fp = fopen("/proc/self/statm", "r");
+    if ( fp != NULL ) {
+        if ( fscanf(fp, "%ld %ld", &pages, &rssPages) == 2 ) {
+            usage->rssBytes = (uint64_t)rssPages * (uint64_t)sysconf(_SC_PAGESIZE);
+        }
+        fclose(fp);
+    }
+}
+
+/////////////////////////////////////////////////////////////
@@ -0,0 +1,99 @@
+#ifndef 	_NETPOOL_H_
+#define    	_NETPOOL_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "netpool.h" file declares the server's transfer
+// buffer pool.  Buffers come in power-of-two size classes.
+// A buffer that is given back is kept for the next request
+// of its class, first in a small cache of the thread that
+// returned it and then in a shared list, so a busy server
+// stops going to malloc and faulting in fresh pages for
+// every chunk it moves.  Buffers are never zero-filled.
+//
+// All borrowed buffers together must fit in the memory
+// budget.  A borrow that would go over it waits, in arrival
+// order, for others to be given back.  A request that stalls
+// this way stops reading from its socket, so the client is
+// held back by TCP flow control rather than the server
+// running out of memory.  A thread holds one buffer at a
+// time; poolGet refuses a second one with EDEADLK.
+//
+/////////////////////////////////////////////////////////////
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Constant and type definitions
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// Size classes run from POOL_MIN_SIZE to POOL_MAX_SIZE
+// bytes, doubling.  Larger requests are not pooled.
+//
+#define POOL_MIN_SIZE      4096
+#define POOL_MAX_SIZE      (64 * 1024 * 1024)
+#define POOL_CLASSES       15
+
+
+//
+// How much idle memory is kept.  Each thread caches up to
+// POOL_THREAD_BUFS buffers of a class, or one if a class
+// is larger than POOL_THREAD_BYTES.  The shared lists keep
+// at most POOL_SHARED_BYTES in all, and no more than the
+// memory budget; anything past that goes back to the system.
+//
+#define POOL_THREAD_BUFS   4
+#define POOL_THREAD_BYTES  (1024 * 1024)
+#define POOL_SHARED_BYTES  (256 * 1024 * 1024)
+
+
+//
+// Classes of at least this size are mapped with mmap, and
+// with -H backed by huge pages where the system has them
+//
+#define POOL_MMAP_SIZE     (256 * 1024)
+#define POOL_HUGE_SIZE     (2 * 1024 * 1024)
+
+
+//
+// Default memory budget for borrowed buffers, in MB (-m).
+// A single borrow larger than the budget is refused.
+//
+#define POOL_BUDGET_MB     512
+
+
+typedef struct {
+    uint64_t heldBytes;        // pooled buffers, in use or idle
+    uint64_t idleBytes;        // waiting in a thread cache or shared list
+    uint64_t budgetBytes;      // the memory budget
+    uint64_t inFlightBytes;    // borrowed now, counted against the budget
+    int      nWaiting;         // borrows waiting for the budget
+    uint64_t rssBytes;         // resident set size of the whole server
+} POOL_USAGE_TYPE;
+
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void   poolInit( const int bHugePages, const uint64_t budgetBytes );
+void  *poolGet( const size_t nBytes );
+void   poolPut( void *buf, const size_t nBytes );
+void   poolUsage( POOL_USAGE_TYPE *usage );
+
+
+
+#endif    // _NETPOOL_H_
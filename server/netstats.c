@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libnetfiles.h"
+#include "netstats.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Each thread that records a metric is handed a private
+// STATS_BLOCK_TYPE.  Only the owning thread ever writes to
+// its block, so an update is a relaxed load and store with
+// no lock prefix and no shared cache lines.  The registry
+// lock is only taken when a thread first records something
+// and when it exits, never per operation.
+//
+// Blocks are never freed.  When a thread exits its block is
+// marked free and handed to the next new thread, keeping all
+// the values it has accumulated.  The totals are therefore
+// always the sum of every block in the registry.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct STATS_BLOCK {
+    struct STATS_BLOCK *next;   // registry chain
+    int inUse;                  // TRUE= owned by a live thread
+    _Atomic uint64_t counters[ COUNTER_COUNT ];
+    _Atomic uint64_t opErrors[ STATS_MAX_OPS ];
+    STATS_HISTOGRAM_TYPE ops[ STATS_MAX_OPS ];
+    STATS_HISTOGRAM_TYPE phases[ PHASE_COUNT ];
+} STATS_BLOCK_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void              statsOnce();
+static void              releaseBlock( void *block );
+static STATS_BLOCK_TYPE *getBlock();
+static int               bucketIndex( const uint64_t ns );
+static uint64_t          bucketUpperBound( const int bucket );
+static void              recordValue( STATS_HISTOGRAM_TYPE *hist, const uint64_t ns );
+static void              addHistogram( STATS_HIST_SNAPSHOT_TYPE *to, STATS_HISTOGRAM_TYPE *from );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static pthread_once_t    gStatsOnce   = PTHREAD_ONCE_INIT;
+static pthread_key_t     gStatsKey;
+static pthread_mutex_t   gStatsLock   = PTHREAD_MUTEX_INITIALIZER;
+static STATS_BLOCK_TYPE *gStatsBlocks = NULL;
+static uint64_t          gStartTime   = 0;
+
+static _Thread_local STATS_BLOCK_TYPE *tStatsBlock = NULL;
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void statsOnce()
+{
+    pthread_key_create( &gStatsKey, releaseBlock );
+    gStartTime = statsNow();
+}
+
+
+void statsInit()
+{
+    pthread_once( &gStatsOnce, statsOnce );
+}
+
+
+uint64_t statsNow()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Thread exit destructor.  The block goes back to the free
+// pool with its values intact.
+//
+/////////////////////////////////////////////////////////////
+
+static void releaseBlock( void *block )
+{
+    pthread_mutex_lock( &gStatsLock );
+    ((STATS_BLOCK_TYPE *)block)->inUse = FALSE;
+    pthread_mutex_unlock( &gStatsLock );
+}
+
+
+static STATS_BLOCK_TYPE *getBlock()
+{
+    STATS_BLOCK_TYPE *block = tStatsBlock;
+
+    if ( block != NULL ) return block;
+
+    statsInit();
+
+    //
+    // First metric recorded by this thread.  Reuse a block
+    // left behind by a finished thread, or add a new one.
+    //
+    pthread_mutex_lock( &gStatsLock );
+    for (block = gStatsBlocks; block != NULL; block = block->next) {
+        if ( block->inUse == FALSE ) break;
+    }
+
+    if ( block == NULL ) {
+        block = calloc( 1, sizeof(STATS_BLOCK_TYPE) );
+        if ( block == NULL ) {
+            pthread_mutex_unlock( &gStatsLock );
+            return NULL;
+        }
+        block->next = gStatsBlocks;
+        gStatsBlocks = block;
+    }
+    block->inUse = TRUE;
+    pthread_mutex_unlock( &gStatsLock );
+
+    pthread_setspecific( gStatsKey, block );
+    tStatsBlock = block;
+    return block;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Single writer update.  Readers may see a value one update
+// behind, but never a torn one.
+//
+/////////////////////////////////////////////////////////////
+
+static inline void bump( _Atomic uint64_t *value, const uint64_t n )
+{
+    atomic_store_explicit( value,
+                           atomic_load_explicit(value, memory_order_relaxed) + n,
+                           memory_order_relaxed );
+}
+
+
+static int bucketIndex( const uint64_t ns )
+{
+    if ( ns < STATS_SUB_BUCKETS ) return (int)ns;
+
+    int magnitude = 63 - __builtin_clzll( ns );   // floor(log2(ns)), >= 3
+    if ( magnitude >= STATS_MAX_MAGNITUDE ) return STATS_HIST_BUCKETS - 1;
+
+    int sub = (int)((ns >> (magnitude - 3)) & (STATS_SUB_BUCKETS - 1));
+    return ((magnitude - 2) * STATS_SUB_BUCKETS) + sub;
+}
+
+
+static uint64_t bucketUpperBound( const int bucket )
+{
+    if ( bucket < STATS_SUB_BUCKETS ) return (uint64_t)bucket;
+
+    int magnitude = (bucket / STATS_SUB_BUCKETS) + 2;
+    int sub = bucket % STATS_SUB_BUCKETS;
+    return (((uint64_t)(STATS_SUB_BUCKETS + sub + 1)) << (magnitude - 3)) - 1;
+}
+
+
+static void recordValue( STATS_HISTOGRAM_TYPE *hist, const uint64_t ns )
+{
+    bump( &hist->count, 1 );
+    bump( &hist->sum, ns );
+    bump( &hist->buckets[ bucketIndex(ns) ], 1 );
+    if ( ns > atomic_load_explicit(&hist->max, memory_order_relaxed) ) {
+        atomic_store_explicit( &hist->max, ns, memory_order_relaxed );
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+void statsCount( const NET_COUNTER_TYPE counter, const uint64_t n )
+{
+    STATS_BLOCK_TYPE *block = getBlock();
+
+    if ((block == NULL) || (counter < 0) || (counter >= COUNTER_COUNT)) return;
+    bump( &block->counters[counter], n );
+}
+
+
+void statsRecordOp( const int netFunc, const uint64_t ns, const int failed )
+{
+    STATS_BLOCK_TYPE *block = getBlock();
+    int op = ((netFunc > 0) && (netFunc < STATS_MAX_OPS)) ? netFunc : 0;
+
+    if ( block == NULL ) return;
+    recordValue( &block->ops[op], ns );
+    if ( failed ) bump( &block->opErrors[op], 1 );
+}
+
+
+void statsRecordPhase( const NET_PHASE_TYPE phase, const uint64_t ns )
+{
+    STATS_BLOCK_TYPE *block = getBlock();
+
+    if ((block == NULL) || (phase < 0) || (phase >= PHASE_COUNT)) return;
+    recordValue( &block->phases[phase], ns );
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void addHistogram( STATS_HIST_SNAPSHOT_TYPE *to, STATS_HISTOGRAM_TYPE *from )
+{
+    int i = 0;
+    uint64_t max = atomic_load_explicit( &from->max, memory_order_relaxed );
+
+    to->count += atomic_load_explicit( &from->count, memory_order_relaxed );
+    to->sum   += atomic_load_explicit( &from->sum, memory_order_relaxed );
+    if ( max > to->max ) to->max = max;
+
+    for (i=0; i < STATS_HIST_BUCKETS; i++) {
+        to->buckets[i] += atomic_load_explicit( &from->buckets[i], memory_order_relaxed );
+    }
+}
+
+
+void statsSnapshot( STATS_SNAPSHOT_TYPE *snap )
+{
+    STATS_BLOCK_TYPE *block = NULL;
+    int i = 0;
+
+    statsInit();
+    memset( snap, 0, sizeof(STATS_SNAPSHOT_TYPE) );
+    snap->uptimeNs = statsNow() - gStartTime;
+
+    //
+    // The chain only ever grows at the head, so it is safe
+    // to walk it without the lock once the head is read.
+    //
+    pthread_mutex_lock( &gStatsLock );
+    block = gStatsBlocks;
+    pthread_mutex_unlock( &gStatsLock );
+
+    for ( ; block != NULL; block = block->next) {
+        for (i=0; i < COUNTER_COUNT; i++) {
+            snap->counters[i] += atomic_load_explicit( &block->counters[i], memory_order_relaxed );
+        }
+        for (i=0; i < STATS_MAX_OPS; i++) {
+            snap->opErrors[i] += atomic_load_explicit( &block->opErrors[i], memory_order_relaxed );
+            addHistogram( &snap->ops[i], &block->ops[i] );
+        }
+        for (i=0; i < PHASE_COUNT; i++) {
+            addHistogram( &snap->phases[i], &block->phases[i] );
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Returns the upper bound of the bucket holding the q-th
+// quantile (0.0 - 1.0), capped at the largest value seen.
+//
+/////////////////////////////////////////////////////////////
+
+uint64_t statsPercentile( const STATS_HIST_SNAPSHOT_TYPE *hist, const double q )
+{
+    uint64_t rank = 0;
+    uint64_t seen = 0;
+    int i = 0;
+
+    if ( hist->count == 0 ) return 0;
+
+    rank = (uint64_t)(q * (double)hist->count);
+    if ( rank >= hist->count ) rank = hist->count - 1;
+
+    for (i=0; i < STATS_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if ( seen > rank ) {
+            uint64_t bound = bucketUpperBound(i);
+            return (bound < hist->max) ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+const char *statsOpName( const int netFunc )
+{
+    switch (netFunc) {
+        case NET_SERVERINIT:    return "serverinit";
+        case NET_OPEN:          return "open";
+        case NET_READ:          return "read";
+        case NET_WRITE:         return "write";
+        case NET_CLOSE:         return "close";
+        case NET_STATS:         return "stats";
+        case NET_READ_INLINE:   return "read_inline";
+        case NET_WRITE_INLINE:  return "write_inline";
+        case NET_GET:           return "get";
+        case NET_PUT:           return "put";
+        case NET_OPEN_BATCH:    return "open_batch";
+        case NET_STAT_BATCH:    return "stat_batch";
+        case NET_CLOSE_BATCH:   return "close_batch";
+        case NET_READ_RANGES:   return "read_ranges";
+        case NET_ADVISE:        return "advise";
+        case NET_DURABILITY:    return "durability";
+        case NET_FSYNC:         return "fsync";
+        case NET_TX_BEGIN:      return "tx_begin";
+        case NET_TX_COMMIT:     return "tx_commit";
+        case NET_TX_ABORT:      return "tx_abort";
+        case NET_COPY:          return "copy";
+        default:                return "other";
+    }
+}
+
+
+const char *statsPhaseName( const NET_PHASE_TYPE phase )
+{
+    switch (phase) {
+        case PHASE_ACCEPT:      return "accept";
+        case PHASE_QUEUE:       return "queue";
+        case PHASE_DISK_IO:     return "disk_io";
+        case PHASE_NET_SEND:    return "net_send";
+        case PHASE_NET_RECV:    return "net_recv";
+        case PHASE_RECONSTRUCT: return "reconstruct";
+        case PHASE_MEMORY_WAIT: return "memory_wait";
+        case PHASE_FSYNC:       return "fsync";
+        default:                return "unknown";
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Format a human readable report into "buf".  Returns the
+// number of characters written, not counting the NUL.
+// Latencies are printed in microseconds.
+//
+/////////////////////////////////////////////////////////////
+
+static int formatHistogram( char *buf, const size_t len, const char *name,
+                            const STATS_HIST_SNAPSHOT_TYPE *hist, const uint64_t errors )
+{
+    return snprintf(buf, len, "%-12s %10lu %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                    name, (unsigned long)hist->count, (unsigned long)errors,
+                    (hist->count > 0) ? (hist->sum / (double)hist->count) / 1000.0 : 0.0,
+                    statsPercentile(hist, 0.50)  / 1000.0,
+                    statsPercentile(hist, 0.99)  / 1000.0,
+                    statsPercentile(hist, 0.999) / 1000.0,
+                    hist->max / 1000.0);
+}
+
+
+int statsFormatText( char *buf, const size_t len, const STATS_GAUGES_TYPE *gauges )
+{
+    STATS_SNAPSHOT_TYPE *snap = NULL;
+    size_t n = 0;
+    int i = 0;
+
+    if ((buf == NULL) || (len == 0)) return 0;
+    buf[0] = '\0';
+
+    // The snapshot is large, keep it off the stack
+    snap = malloc( sizeof(STATS_SNAPSHOT_TYPE) );
+    if ( snap == NULL ) return 0;
+    statsSnapshot( snap );
+
+#define APPEND(...) \
+    do { if (n < len) n += snprintf(buf + n, len - n, __VA_ARGS__); } while (0)
+
+    APPEND("netfileserver statistics\n");
+    APPEND("uptime_seconds     %.1f\n", snap->uptimeNs / 1e9);
+    APPEND("bytes_in           %lu\n", (unsigned long)snap->counters[COUNTER_BYTES_IN]);
+    APPEND("bytes_out          %lu\n", (unsigned long)snap->counters[COUNTER_BYTES_OUT]);
+    APPEND("transfers_total    %lu\n", (unsigned long)snap->counters[COUNTER_XFER_STARTED]);
+    APPEND("transfers_active   %lu\n", (unsigned long)(snap->counters[COUNTER_XFER_STARTED] -
+                                                       snap->counters[COUNTER_XFER_FINISHED]));
+    if ( gauges != NULL ) {
+        APPEND("fd_table_in_use    %d/%d\n", gauges->fdInUse, gauges->fdCapacity);
+        APPEND("ports_in_use       %lu/%d\n", (unsigned long)(snap->counters[COUNTER_PORTS_BOUND] -
+                                                              snap->counters[COUNTER_PORTS_RELEASED]),
+                                              gauges->portCapacity);
+    }
+    APPEND("ports_exhausted    %lu\n", (unsigned long)snap->counters[COUNTER_PORTS_EXHAUSTED]);
+    APPEND("pool_gets          %lu\n", (unsigned long)snap->counters[COUNTER_POOL_GETS]);
+    APPEND("pool_hit_rate      %.1f%%\n", (snap->counters[COUNTER_POOL_GETS] == 0) ? 0.0 :
+                                          100.0 * snap->counters[COUNTER_POOL_HITS] /
+                                          snap->counters[COUNTER_POOL_GETS]);
+    APPEND("memory_waits       %lu\n", (unsigned long)snap->counters[COUNTER_POOL_WAITS]);
+    APPEND("fsync_requests     %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_REQUESTS]);
+    APPEND("fsync_groups       %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_GROUPS]);
+    APPEND("fsync_flushes      %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_FLUSHES]);
+    APPEND("journal_writes     %lu\n", (unsigned long)snap->counters[COUNTER_JOURNAL_WRITES]);
+    APPEND("journal_checkpoints %lu\n", (unsigned long)snap->counters[COUNTER_JOURNAL_CHECKPOINTS]);
+    APPEND("tx_commits         %lu\n", (unsigned long)snap->counters[COUNTER_TX_COMMITS]);
+    APPEND("tx_aborts          %lu\n", (unsigned long)snap->counters[COUNTER_TX_ABORTS]);
+    APPEND("copy_bytes         %lu\n", (unsigned long)snap->counters[COUNTER_COPY_BYTES]);
+    APPEND("copy_buffered      %lu\n", (unsigned long)snap->counters[COUNTER_COPY_BUFFERED]);
+    if ( gauges != NULL ) {
+        APPEND("pool_held_bytes    %lu\n", (unsigned long)gauges->poolHeldBytes);
+        APPEND("pool_idle_bytes    %lu\n", (unsigned long)gauges->poolIdleBytes);
+        APPEND("memory_in_flight   %lu/%lu\n", (unsigned long)gauges->inFlightBytes,
+                                              (unsigned long)gauges->budgetBytes);
+        APPEND("memory_waiting     %d\n", gauges->nBudgetWaiting);
+        APPEND("resident_bytes     %lu\n", (unsigned long)gauges->rssBytes);
+    }
+
+    APPEND("\n%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+           "operation", "count", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (i=0; i < STATS_MAX_OPS; i++) {
+        if ( snap->ops[i].count == 0 ) continue;
+        if ( n < len ) n += formatHistogram( buf + n, len - n, statsOpName(i), &snap->ops[i], snap->opErrors[i] );
+    }
+
+    APPEND("\n%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+           "phase", "count", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (i=0; i < PHASE_COUNT; i++) {
+        if ( n < len ) n += formatHistogram( buf + n, len - n, statsPhaseName(i), &snap->phases[i], 0 );
+    }
+
+#undef APPEND
+
+    free( snap );
+    if ( n >= len ) n = len - 1;   // output was truncated
+    return (int)n;
+}
+
+/////////////////////////////////////////////////////////////
+//
+// Format the metrics in the Prometheus text exposition
+// format.  Histograms are exported with one "le" bucket per
+// power of two between 1us and 64s, which keeps a scrape to
+// a few thousand lines.  Returns the number of characters
+// written, not counting the NUL.
+//
+/////////////////////////////////////////////////////////////
+
+#define PROM_FIRST_MAGNITUDE  10   // 2^10 ns ~ 1us
+#define PROM_LAST_MAGNITUDE   36   // 2^36 ns ~ 64s
+
+static int formatPromHistogram( char *buf, const size_t len, const char *name,
+                                const char *label, const char *value,
+                                const STATS_HIST_SNAPSHOT_TYPE *hist )
+{
+    size_t n = 0;
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    int magnitude = 0;
+
+    for (magnitude = PROM_FIRST_MAGNITUDE; magnitude <= PROM_LAST_MAGNITUDE; magnitude++) {
+        //
+        // Buckets of this magnitude and below hold values < 2^magnitude
+        //
+        int lastBucket = (magnitude - 2) * STATS_SUB_BUCKETS;
+        for ( ; bucket < lastBucket; bucket++) cumulative += hist->buckets[bucket];
+
+        if ( n < len ) n += snprintf(buf + n, len - n, "%s_bucket{%s=\"%s\",le=\"%.9g\"} %lu\n",
+                                     name, label, value, (double)(1ULL << magnitude) / 1e9,
+                                     (unsigned long)cumulative);
+    }
+
+    if ( n < len ) n += snprintf(buf + n, len - n,
+                                 "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n"
+                                 "%s_sum{%s=\"%s\"} %.9f\n"
+                                 "%s_count{%s=\"%s\"} %lu\n",
+                                 name, label, value, (unsigned long)hist->count,
+                                 name, label, value, hist->sum / 1e9,
+                                 name, label, value, (unsigned long)hist->count);
+    return (int)n;
+}
+
+
+int statsFormatPrometheus( char *buf, const size_t len, const STATS_GAUGES_TYPE *gauges )
+{
+    STATS_SNAPSHOT_TYPE *snap = NULL;
+    size_t n = 0;
+    int i = 0;
+
+    if ((buf == NULL) || (len == 0)) return 0;
+    buf[0] = '\0';
+
+    snap = malloc( sizeof(STATS_SNAPSHOT_TYPE) );
+    if ( snap == NULL ) return 0;
+    statsSnapshot( snap );
+
+#define APPEND(...) \
+    do { if (n < len) n += snprintf(buf + n, len - n, __VA_ARGS__); } while (0)
+
+    APPEND("# TYPE netfiles_uptime_seconds gauge\n");
+    APPEND("netfiles_uptime_seconds %.3f\n", snap->uptimeNs / 1e9);
+    APPEND("# TYPE netfiles_bytes_in_total counter\n");
+    APPEND("netfiles_bytes_in_total %lu\n", (unsigned long)snap->counters[COUNTER_BYTES_IN]);
+    APPEND("# TYPE netfiles_bytes_out_total counter\n");
+    APPEND("netfiles_bytes_out_total %lu\n", (unsigned long)snap->counters[COUNTER_BYTES_OUT]);
+    APPEND("# TYPE netfiles_transfers_total counter\n");
+    APPEND("netfiles_transfers_total %lu\n", (unsigned long)snap->counters[COUNTER_XFER_STARTED]);
+    APPEND("# TYPE netfiles_transfers_active gauge\n");
+    APPEND("netfiles_transfers_active %lu\n", (unsigned long)(snap->counters[COUNTER_XFER_STARTED] -
+                                                              snap->counters[COUNTER_XFER_FINISHED]));
+    APPEND("# TYPE netfiles_ports_exhausted_total counter\n");
+    APPEND("netfiles_ports_exhausted_total %lu\n", (unsigned long)snap->counters[COUNTER_PORTS_EXHAUSTED]);
+    APPEND("# TYPE netfiles_ports_in_use gauge\n");
+    APPEND("netfiles_ports_in_use %lu\n", (unsigned long)(snap->counters[COUNTER_PORTS_BOUND] -
+                                                          snap->counters[COUNTER_PORTS_RELEASED]));
+    if ( gauges != NULL ) {
+        APPEND("# TYPE netfiles_ports_capacity gauge\n");
+        APPEND("netfiles_ports_capacity %d\n", gauges->portCapacity);
+        APPEND("# TYPE netfiles_fd_table_in_use gauge\n");
+        APPEND("netfiles_fd_table_in_use %d\n", gauges->fdInUse);
+        APPEND("# TYPE netfiles_fd_table_capacity gauge\n");
+        APPEND("netfiles_fd_table_capacity %d\n", gauges->fdCapacity);
+        APPEND("# TYPE netfiles_pool_held_bytes gauge\n");
+        APPEND("netfiles_pool_held_bytes %lu\n", (unsigned long)gauges->poolHeldBytes);
+        APPEND("# TYPE netfiles_pool_idle_bytes gauge\n");
+        APPEND("netfiles_pool_idle_bytes %lu\n", (unsigned long)gauges->poolIdleBytes);
+        APPEND("# TYPE netfiles_memory_budget_bytes gauge\n");
+        APPEND("netfiles_memory_budget_bytes %lu\n", (unsigned long)gauges->budgetBytes);
+        APPEND("# TYPE netfiles_memory_in_flight_bytes gauge\n");
+        APPEND("netfiles_memory_in_flight_bytes %lu\n", (unsigned long)gauges->inFlightBytes);
+        APPEND("# TYPE netfiles_memory_waiting gauge\n");
+        APPEND("netfiles_memory_waiting %d\n", gauges->nBudgetWaiting);
+        APPEND("# TYPE netfiles_resident_bytes gauge\n");
+        APPEND("netfiles_resident_bytes %lu\n", (unsigned long)gauges->rssBytes);
+    }
+    APPEND("# TYPE netfiles_pool_gets_total counter\n");
+    APPEND("netfiles_pool_gets_total %lu\n", (unsigned long)snap->counters[COUNTER_POOL_GETS]);
+    APPEND("# TYPE netfiles_pool_hits_total counter\n");
+    APPEND("netfiles_pool_hits_total %lu\n", (unsigned long)snap->counters[COUNTER_POOL_HITS]);
+    APPEND("# TYPE netfiles_memory_waits_total counter\n");
+    APPEND("netfiles_memory_waits_total %lu\n", (unsigned long)snap->counters[COUNTER_POOL_WAITS]);
+    APPEND("# TYPE netfiles_fsync_requests_total counter\n");
+    APPEND("netfiles_fsync_requests_total %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_REQUESTS]);
+    APPEND("# TYPE netfiles_fsync_groups_total counter\n");
+    APPEND("netfiles_fsync_groups_total %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_GROUPS]);
+    APPEND("# TYPE netfiles_fsync_flushes_total counter\n");
+    APPEND("netfiles_fsync_flushes_total %lu\n", (unsigned long)snap->counters[COUNTER_FSYNC_FLUSHES]);
+    APPEND("# TYPE netfiles_journal_writes_total counter\n");
+    APPEND("netfiles_journal_writes_total %lu\n", (unsigned long)snap->counters[COUNTER_JOURNAL_WRITES]);
+    APPEND("# TYPE netfiles_journal_checkpoints_total counter\n");
+    APPEND("netfiles_journal_checkpoints_total %lu\n", (unsigned long)snap->counters[COUNTER_JOURNAL_CHECKPOINTS]);
+    APPEND("# TYPE netfiles_tx_commits_total counter\n");
+    APPEND("netfiles_tx_commits_total %lu\n", (unsigned long)snap->counters[COUNTER_TX_COMMITS]);
+    APPEND("# TYPE netfiles_tx_aborts_total counter\n");
+    APPEND("netfiles_tx_aborts_total %lu\n", (unsigned long)snap->counters[COUNTER_TX_ABORTS]);
+    APPEND("# TYPE netfiles_copy_bytes_total counter\n");
+    APPEND("netfiles_copy_bytes_total %lu\n", (unsigned long)snap->counters[COUNTER_COPY_BYTES]);
+    APPEND("# TYPE netfiles_copy_buffered_bytes_total counter\n");
+    APPEND("netfiles_copy_buffered_bytes_total %lu\n", (unsigned long)snap->counters[COUNTER_COPY_BUFFERED]);
+
+    APPEND("# TYPE netfiles_operation_errors_total counter\n");
+    for (i=0; i < STATS_MAX_OPS; i++) {
+        if ( snap->ops[i].count == 0 ) continue;
+        APPEND("netfiles_operation_errors_total{operation=\"%s\"} %lu\n",
+               statsOpName(i), (unsigned long)snap->opErrors[i]);
+    }
+
+    APPEND("# TYPE netfiles_operation_duration_seconds histogram\n");
+    for (i=0; i < STATS_MAX_OPS; i++) {
+        if ( snap->ops[i].count == 0 ) continue;
+        if ( n < len ) n += formatPromHistogram( buf + n, len - n, "netfiles_operation_duration_seconds",
+                                                 "operation", statsOpName(i), &snap->ops[i] );
+    }
+
+    APPEND("# TYPE netfiles_phase_duration_seconds histogram\n");
+    for (i=0; i < PHASE_COUNT; i++) {
+        if ( n < len ) n += formatPromHistogram( buf + n, len - n, "netfiles_phase_duration_seconds",
+                                                 "phase", statsPhaseName(i), &snap->phases[i] );
+    }
+
+#undef APPEND
+
+    free( snap );
+    if ( n >= len ) n = len - 1;   // output was truncated
+    return (int)n;
+}
+
+/////////////////////////////////////////////////////////////
+
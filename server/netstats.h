@@ -0,0 +1,166 @@
+#ifndef 	_NETSTATS_H_
+#define    	_NETSTATS_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "netstats.h" file declares the server metrics
+// collector.  Every server thread owns a private block of
+// counters and latency histograms, so recording a value
+// never takes a lock or shares a cache line with another
+// thread.  Readers add all blocks together to produce a
+// snapshot.
+//
+/////////////////////////////////////////////////////////////
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Constant and type definitions
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// One histogram is kept per net function.  The net function
+// code (NET_FUNCTION_TYPE) is used directly as the index, so
+// this must be larger than the highest function code in use.
+// Anything else is counted under index 0.
+//
+#define STATS_MAX_OPS   32
+
+
+//
+// HDR-style histogram layout.  Values are in nanoseconds.
+// Values below 8 get their own bucket.  Above that, every
+// power of two is split into 8 linear sub-buckets, which
+// keeps the relative error under 12.5% all the way up to
+// 2^42 ns (about 73 minutes).
+//
+#define STATS_SUB_BUCKETS     8
+#define STATS_MAX_MAGNITUDE   42
+#define STATS_HIST_BUCKETS    ((STATS_MAX_MAGNITUDE - 2) * STATS_SUB_BUCKETS)
+
+
+//
+// Server request phases that are timed separately
+// from the end to end net function latency.
+//
+typedef enum {
+    PHASE_ACCEPT      = 0,  // data listener waiting in accept()
+    PHASE_QUEUE       = 1,  // accepted request waiting for its worker
+    PHASE_DISK_IO     = 2,  // file reads and part file writes
+    PHASE_NET_SEND    = 3,  // sending file data to a client
+    PHASE_NET_RECV    = 4,  // receiving file data from a client
+    PHASE_RECONSTRUCT = 5,  // rebuilding a written file from parts
+    PHASE_MEMORY_WAIT = 6,  // waiting for the transfer memory budget
+    PHASE_FSYNC       = 7,  // waiting for a group commit to reach the disk
+    PHASE_COUNT       = 8
+} NET_PHASE_TYPE;
+
+
+//
+// Monotonic event counters.  Gauges such as "active
+// transfers" are derived from a pair of counters
+// (started - finished) so they stay contention free.
+//
+typedef enum {
+    COUNTER_BYTES_IN        = 0,  // file data received from clients
+    COUNTER_BYTES_OUT       = 1,  // file data sent to clients
+    COUNTER_XFER_STARTED    = 2,  // netread/netwrite transfers started
+    COUNTER_XFER_FINISHED   = 3,  // netread/netwrite transfers finished
+    COUNTER_PORTS_BOUND     = 4,  // data ports bound for listening
+    COUNTER_PORTS_RELEASED  = 5,  // data ports closed again
+    COUNTER_PORTS_EXHAUSTED = 6,  // transfers refused, no free data port
+    COUNTER_POOL_GETS       = 7,  // transfer buffers borrowed from the pool
+    COUNTER_POOL_HITS       = 8,  // ... of those, reused rather than allocated
+    COUNTER_POOL_WAITS      = 9,  // ... of those, held back by the memory budget
+    COUNTER_FSYNC_REQUESTS  = 10, // files asked to be synced to disk
+    COUNTER_FSYNC_GROUPS    = 11, // group commits they were done in
+    COUNTER_FSYNC_FLUSHES   = 12, // fdatasync calls made for them
+    COUNTER_JOURNAL_WRITES  = 13, // writes taken through the journal
+    COUNTER_JOURNAL_CHECKPOINTS = 14, // times the journal was emptied
+    COUNTER_TX_COMMITS      = 15, // transactions committed
+    COUNTER_TX_ABORTS       = 16, // transactions aborted, or failed to commit
+    COUNTER_COPY_BYTES      = 17, // file data copied on the server
+    COUNTER_COPY_BUFFERED   = 18, // ... of those, through the server's memory
+    COUNTER_COUNT           = 19
+} NET_COUNTER_TYPE;
+
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;     // total nanoseconds
+    _Atomic uint64_t max;     // largest value seen
+    _Atomic uint64_t buckets[ STATS_HIST_BUCKETS ];
+} STATS_HISTOGRAM_TYPE;
+
+
+//
+// A plain (non-atomic) copy of the histograms and counters
+// summed over all threads.  This is what readers work with.
+//
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[ STATS_HIST_BUCKETS ];
+} STATS_HIST_SNAPSHOT_TYPE;
+
+typedef struct {
+    uint64_t uptimeNs;
+    uint64_t counters[ COUNTER_COUNT ];
+    uint64_t opErrors[ STATS_MAX_OPS ];
+    STATS_HIST_SNAPSHOT_TYPE ops[ STATS_MAX_OPS ];
+    STATS_HIST_SNAPSHOT_TYPE phases[ PHASE_COUNT ];
+} STATS_SNAPSHOT_TYPE;
+
+
+//
+// Point-in-time gauges owned by the server itself
+// (the collector has no access to the FD table).
+//
+typedef struct {
+    int fdInUse;
+    int fdCapacity;
+    int portCapacity;
+    uint64_t poolHeldBytes;
+    uint64_t poolIdleBytes;
+    uint64_t budgetBytes;
+    uint64_t inFlightBytes;
+    int      nBudgetWaiting;
+    uint64_t rssBytes;
+} STATS_GAUGES_TYPE;
+
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+void        statsInit();
+uint64_t    statsNow();
+
+void        statsCount( const NET_COUNTER_TYPE counter, const uint64_t n );
+void        statsRecordOp( const int netFunc, const uint64_t ns, const int failed );
+void        statsRecordPhase( const NET_PHASE_TYPE phase, const uint64_t ns );
+
+void        statsSnapshot( STATS_SNAPSHOT_TYPE *snap );
+uint64_t    statsPercentile( const STATS_HIST_SNAPSHOT_TYPE *hist, const double q );
+const char *statsOpName( const int netFunc );
+const char *statsPhaseName( const NET_PHASE_TYPE phase );
+int         statsFormatText( char *buf, const size_t len, const STATS_GAUGES_TYPE *gauges );
+int         statsFormatPrometheus( char *buf, const size_t len, const STATS_GAUGES_TYPE *gauges );
+
+
+
+#endif    // _NETSTATS_H_
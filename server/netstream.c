@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+
+#include "libnetfiles.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Streamed reads.
+//
+// The file is cut into chunks of "chunkSize" bytes, chunk
+// "c" starting at offset c * chunkSize.  "depth" fetcher
+// threads each take the next chunk number and read it with
+// one netreadranges request into its slot of a ring of
+// "depth" chunk buffers.  The calling thread hands the
+// chunks to the callback in file order, freeing each slot
+// for a later chunk as it goes.  A fetcher doesn't start a
+// chunk more than "depth" ahead of the one being delivered,
+// so the stream never holds more than depth * chunkSize
+// bytes, and the server no more than that per stream.
+//
+// The first chunk that comes back short marks end of file.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct {
+    netctx_t *ctx;
+    int netfd;
+    int chunkSize;
+    int depth;
+    char *bufs;              // depth * chunkSize bytes
+    long *slotChunk;         // chunk held by each slot, -1 if none yet
+    int  *slotBytes;         // bytes in each slot's chunk
+    long nextChunk;          // next chunk for a fetcher to read
+    long nDelivered;         // chunks handed to the callback
+    long eofChunk;           // first chunk past end of file
+    int  bStop;              // end of file, an error, or the callback said stop
+    int  error;              // errno of a failed read
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} STREAM_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void *streamFetcher( void *arg );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// A fetcher reads chunks until the stream stops or runs
+// past end of file
+//
+/////////////////////////////////////////////////////////////
+
+static void *streamFetcher( void *arg )
+{
+    STREAM_TYPE *stream = (STREAM_TYPE *)arg;
+    NET_RANGE_TYPE range;
+    void *buf = NULL;
+    ssize_t rc = 0;
+    long chunk = 0;
+    int slot = 0;
+
+    while ( TRUE ) {
+        pthread_mutex_lock( &stream->lock );
+        while ((stream->bStop != TRUE) && (stream->nextChunk < stream->eofChunk) &&
+               (stream->nextChunk - stream->nDelivered >= stream->depth)) {
+            pthread_cond_wait( &stream->cond, &stream->lock );
+        }
+        if ((stream->bStop == TRUE) || (stream->nextChunk >= stream->eofChunk)) {
+            pthread_mutex_unlock( &stream->lock );
+            break;
+        }
+        chunk = stream->nextChunk++;
+        pthread_mutex_unlock( &stream->lock );
+
+        slot = (int)(chunk % stream->depth);
+        buf = stream->bufs + ((long)slot * stream->chunkSize);
+        range.offset = chunk * stream->chunkSize;
+        range.length = stream->chunkSize;
+        range.nBytes = 0;
+        rc = netctx_readranges( stream->ctx, stream->netfd, &range, 1, &buf );
+
+        pthread_mutex_lock( &stream->lock );
+        if ( rc == FAILURE ) {
+            if ( stream->error == 0 ) stream->error = (errno != 0) ? errno : EIO;
+            stream->bStop = TRUE;
+        }
+        else {
+            stream->slotBytes[slot] = range.nBytes;
+            stream->slotChunk[slot] = chunk;
+            if ((range.nBytes < stream->chunkSize) && (chunk + 1 < stream->eofChunk)) {
+                stream->eofChunk = chunk + 1;
+            }
+        }
+        pthread_cond_broadcast( &stream->cond );
+        pthread_mutex_unlock( &stream->lock );
+    }
+
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/*******************************************************
+
+  netread_stream needs to handle these error codes
+
+       Implemented:
+           EPERM        =  1, Operation not permitted
+           EIO          =  5, I/O error
+           EAGAIN       = 11, Resource temporarily unavailable
+           ENOMEM       = 12, Out of memory
+           EINVAL       = 22, Invalid argument
+           plus any errno of netreadranges
+
+******************************************************/
+
+ssize_t netctx_read_stream(netctx_t *ctx, int fildes, int chunkSize, int depth,
+                           NET_STREAM_CALLBACK callback, void *userData)
+{
+    STREAM_TYPE stream;
+    pthread_t tids[ NET_STREAM_DEPTH_MAX ];
+    ssize_t total = 0;
+    int nThreads = 0;
+    int bCancel = FALSE;
+    int slot = 0;
+    int i = 0;
+
+
+    errno = 0;
+    if ((ctx == NULL) || (callback == NULL) || (chunkSize <= 0) ||
+        (depth <= 0) || (depth > NET_STREAM_DEPTH_MAX)) {
+        errno = EINVAL;  // 22 = Invalid argument
+        return FAILURE;
+    }
+
+    bzero(&stream, sizeof(stream));
+    stream.ctx = ctx;
+    stream.netfd = fildes;
+    stream.chunkSize = chunkSize;
+    stream.depth = depth;
+    stream.eofChunk = LONG_MAX;
+    stream.bufs = malloc( (size_t)depth * chunkSize );
+    stream.slotChunk = malloc( sizeof(long) * depth );
+    stream.slotBytes = malloc( sizeof(int) * depth );
+    if ((stream.bufs == NULL) || (stream.slotChunk == NULL) || (stream.slotBytes == NULL)) {
+        free(stream.bufs);
+        free(stream.slotChunk);
+        free(stream.slotBytes);
+        errno = ENOMEM;  // 12 = Out of memory
+        return FAILURE;
+    }
+    for (i=0; i < depth; i++) stream.slotChunk[i] = -1;
+    pthread_mutex_init( &stream.lock, NULL );
+    pthread_cond_init( &stream.cond, NULL );
+
+    for (i=0; i < depth; i++) {
+        if ( pthread_create(&tids[i], NULL, &streamFetcher, &stream) != 0 ) break;
+        nThreads++;
+    }
+    if ( nThreads == 0 ) {
+        stream.bStop = TRUE;
+        stream.error = EAGAIN;  // 11 = Resource temporarily unavailable
+    }
+
+
+    //
+    // Hand the chunks to the callback in order.  The
+    // callback runs without the lock, so the fetchers keep
+    // filling the other slots meanwhile.
+    //
+    pthread_mutex_lock( &stream.lock );
+    while ( stream.nDelivered < stream.eofChunk ) {
+        slot = (int)(stream.nDelivered % depth);
+        while ((stream.slotChunk[slot] != stream.nDelivered) && (stream.bStop != TRUE)) {
+            pthread_cond_wait( &stream.cond, &stream.lock );
+        }
+        if ( stream.slotChunk[slot] != stream.nDelivered ) break;   // stopped
+
+        int nBytes = stream.slotBytes[slot];
+        pthread_mutex_unlock( &stream.lock );
+
+        if ( nBytes > 0 ) {
+            if ( callback(stream.bufs + ((long)slot * chunkSize), nBytes,
+                          stream.nDelivered * chunkSize, userData) != 0 ) {
+                bCancel = TRUE;
+            }
+            total += nBytes;
+        }
+
+        pthread_mutex_lock( &stream.lock );
+        stream.nDelivered++;
+        if ( bCancel == TRUE ) stream.bStop = TRUE;
+        pthread_cond_broadcast( &stream.cond );
+        if ( bCancel == TRUE ) break;
+    }
+    stream.bStop = TRUE;
+    pthread_cond_broadcast( &stream.cond );
+    pthread_mutex_unlock( &stream.lock );
+
+    for (i=0; i < nThreads; i++) pthread_join( tids[i], NULL );
+
+    pthread_cond_destroy( &stream.cond );
+    pthread_mutex_destroy( &stream.lock );
+    free(stream.bufs);
+    free(stream.slotChunk);
+    free(stream.slotBytes);
+
+    //
+    // A read that failed after the end of the file was seen,
+    // or after the callback said stop, doesn't matter; one
+    // before it does
+    //
+    if ((stream.error != 0) && (stream.nDelivered < stream.eofChunk) && (bCancel != TRUE)) {
+        errno = stream.error;
+        return FAILURE;
+    }
+    return total;
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "libnetfiles.h"
+#include "netstats.h"
+#include "netsync.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Each waiting thread links a SYNC_REQUEST_TYPE of its own
+// into the pending list.  The first thread to find no flush
+// running takes the whole list as its group and flushes it
+// with the lock dropped.  It then marks every request of
+// the group done, under the lock, since a waiter frees its
+// requests once it sees them done.
+//
+// A group is flushed in two passes: writeback is started on
+// every file first and then each is waited for, so the disk
+// works on all of them at once rather than one by one.  A
+// file asked for by several requests is flushed once.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct SYNC_REQUEST {
+    struct SYNC_REQUEST *next;
+    const char *pathname;
+    int fd;                       // open while its group is flushed
+    int result;                   // errno of the flush, 0= on disk
+    int done;
+} SYNC_REQUEST_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void flushGroup( SYNC_REQUEST_TYPE *group );
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static pthread_mutex_t    gSyncLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     gSyncCond  = PTHREAD_COND_INITIALIZER;
+static SYNC_REQUEST_TYPE *gPending   = NULL;
+static int                gFlushing  = FALSE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Flush one group.  A request for a file already in the
+// group shares that request's flush.
+//
+/////////////////////////////////////////////////////////////
+
+static void flushGroup( SYNC_REQUEST_TYPE *group )
+{
+    SYNC_REQUEST_TYPE *req = NULL;
+    SYNC_REQUEST_TYPE *first = NULL;
+
+    statsCount( COUNTER_FSYNC_GROUPS, 1 );
+    for (req = group; req != NULL; req = req->next) {
+        req->fd = -1;
+        for (first = group; first != req; first = first->next) {
+            if ( strcmp(first->pathname, req->pathname) == 0 ) break;
+        }
+        if ( first != req ) continue;   // flushed with "first"
+
+        req->fd = open(req->pathname, O_RDONLY);
+        if ( req->fd < 0 ) {
+            req->result = errno;
+            continue;
+        }
+        sync_file_range(req->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    for (req = group; req != NULL; req = req->next) {
+        if ( req->fd < 0 ) continue;
+        statsCount( COUNTER_FSYNC_FLUSHES, 1 );
+        if ( fdatasync(req->fd) < 0 ) req->result = errno;
+        close(req->fd);
+    }
+
+    for (req = group; req != NULL; req = req->next) {
+        for (first = group; first != req; first = first->next) {
+            if ( strcmp(first->pathname, req->pathname) == 0 ) {
+                req->result = first->result;
+                break;
+            }
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Wait until the data written so far to "pathname" is on
+// disk.  Returns SUCCESS, or FAILURE with errno set.
+//
+/////////////////////////////////////////////////////////////
+
+int syncFile( const char *pathname )
+{
+    return syncFiles( &pathname, 1 );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// As syncFile for "count" files at once.  They all go in
+// the same group, so their flushes overlap.  Returns
+// FAILURE, with errno set, if any of them can't be synced.
+//
+/////////////////////////////////////////////////////////////
+
+int syncFiles( const char **pathnames, const int count )
+{
+    SYNC_REQUEST_TYPE *reqs = NULL;
+    SYNC_REQUEST_TYPE *group = NULL;
+    SYNC_REQUEST_TYPE *p = NULL;
+    uint64_t startTime = statsNow();
+    int result = 0;
+    int i = 0;
+
+    if ( count <= 0 ) return SUCCESS;
+
+    reqs = calloc( count, sizeof(SYNC_REQUEST_TYPE) );
+    if ( reqs == NULL ) {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    statsCount( COUNTER_FSYNC_REQUESTS, count );
+
+    pthread_mutex_lock( &gSyncLock );
+    for (i=0; i < count; i++) {
+        reqs[i].pathname = pathnames[i];
+        reqs[i].fd = -1;
+        reqs[i].next = gPending;
+        gPending = &reqs[i];
+    }
+
+    //
+    // The requests went in together, so they are all
+    // marked done together
+    //
+    while ( reqs[0].done == FALSE ) {
+        if ( gFlushing == TRUE ) {
+            pthread_cond_wait( &gSyncCond, &gSyncLock );
+            continue;
+        }
+
+        //
+        // No flush running: lead the next group, which is
+        // everything pending now, this request among them
+        //
+        group = gPending;
+        gPending = NULL;
+        gFlushing = TRUE;
+        pthread_mutex_unlock( &gSyncLock );
+
+        flushGroup( group );
+
+        pthread_mutex_lock( &gSyncLock );
+        while ( group != NULL ) {
+            p = group;
+            group = group->next;
+            p->done = TRUE;
+        }
+        gFlushing = FALSE;
+        pthread_cond_broadcast( &gSyncCond );
+    }
+    pthread_mutex_unlock( &gSyncLock );
+
+    statsRecordPhase( PHASE_FSYNC, statsNow() - startTime );
+    for (i=0; (i < count) && (result == 0); i++) result = reqs[i].result;
+    free( reqs );
+
+    if ( result != 0 ) {
+        errno = result;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////
+//
+// Put the directory entry of "pathname" on disk, so a file
+// created or renamed there survives a crash.  Returns
+// SUCCESS, or FAILURE with errno set.
+//
+/////////////////////////////////////////////////////////////
+
+int syncDir( const char *pathname )
+{
+    char dirname[256] = ".";
+    const char *slash = strrchr(pathname, '/');
+    int fd = -1;
+    int rc = SUCCESS;
+
+    if ( slash == pathname ) strcpy( dirname, "/" );
+    else if ( slash != NULL ) {
+        if ( slash - pathname >= (long)sizeof(dirname) ) {
+            errno = ENAMETOOLONG;
+            return FAILURE;
+        }
+        memcpy( dirname, pathname, slash - pathname );
+        dirname[slash - pathname] = '\0';
+    }
+
+    fd = open(dirname, O_RDONLY | O_DIRECTORY);
+    if ( fd < 0 ) return FAILURE;
+
+    statsCount( COUNTER_FSYNC_FLUSHES, 1 );
+    if ( fsync(fd) < 0 ) rc = FAILURE;
+    close(fd);
+
+    return rc;
+}
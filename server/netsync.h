@@ -0,0 +1,30 @@
+#ifndef 	_NETSYNC_H_
+#define    	_NETSYNC_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "netsync.h" file declares the server's group commit
+// of file syncs.  A thread that needs a file on disk asks
+// for it here and waits.  One of the waiting threads flushes
+// every file asked for so far in one go, while the requests
+// that come in meanwhile gather for the next go, so many
+// writers share the cost of each trip to the disk.
+//
+/////////////////////////////////////////////////////////////
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+int syncFile( const char *pathname );
+int syncFiles( const char **pathnames, const int count );
+int syncDir( const char *pathname );
+
+
+
+#endif    // _NETSYNC_H_
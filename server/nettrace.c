@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/syscall.h>
+
+#include "libnetfiles.h"
+#include "nettrace.h"
+
+
+/////////////////////////////////////////////////////////////
+//
+// Each thread writes its spans into a private ring.  The
+// owner is the only writer: it fills a slot and then
+// publishes it by advancing "head" with a release store.
+// Exporters read "head", copy the slots and read "head"
+// again, dropping any slot the owner may have overwritten
+// in the meantime.  No lock is taken on the record path.
+//
+// Rings are kept after their thread exits and handed to the
+// next new thread, so spans of short-lived data transfer
+// threads remain available for export.
+//
+/////////////////////////////////////////////////////////////
+
+
+typedef struct TRACE_RING {
+    struct TRACE_RING *next;    // registry chain
+    int inUse;                  // TRUE= owned by a live thread
+    _Atomic uint64_t head;      // number of spans ever written
+    TRACE_SPAN_TYPE spans[ TRACE_RING_SIZE ];
+} TRACE_RING_TYPE;
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+static void             traceOnce();
+static void             releaseRing( void *ring );
+static TRACE_RING_TYPE *getRing();
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Declare global variables
+//
+/////////////////////////////////////////////////////////////
+
+static pthread_once_t   gTraceOnce  = PTHREAD_ONCE_INIT;
+static pthread_key_t    gTraceKey;
+static pthread_mutex_t  gTraceLock  = PTHREAD_MUTEX_INITIALIZER;
+static TRACE_RING_TYPE *gTraceRings = NULL;
+static int64_t          gWallOffset = 0;      // realtime - monotonic, in ns
+static _Atomic uint64_t gTraceSeq;
+
+static _Thread_local TRACE_RING_TYPE *tTraceRing = NULL;
+static _Thread_local uint64_t tTraceId = 0;
+static _Thread_local int tTid = 0;
+
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void traceOnce()
+{
+    struct timespec wall;
+    struct timespec mono;
+
+    pthread_key_create( &gTraceKey, releaseRing );
+
+    //
+    // Spans are timed with the monotonic clock, but exported
+    // in wall clock time so client and server timelines line
+    // up (as well as the two hosts' clocks agree).
+    //
+    clock_gettime( CLOCK_REALTIME, &wall );
+    clock_gettime( CLOCK_MONOTONIC, &mono );
+    gWallOffset = ((int64_t)wall.tv_sec - (int64_t)mono.tv_sec) * 1000000000LL +
+                  ((int64_t)wall.tv_nsec - (int64_t)mono.tv_nsec);
+
+    //
+    // Seed the ID sequence so that IDs from different processes
+    // and restarts do not collide.
+    //
+    atomic_init( &gTraceSeq, ((uint64_t)getpid() << 40) ^ (uint64_t)wall.tv_nsec ^
+                             ((uint64_t)wall.tv_sec << 20) );
+}
+
+
+uint64_t traceNow()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// IDs are a sequence number passed through a 64-bit mixing
+// function (splitmix64), so they look random but are
+// unique within a process.
+//
+/////////////////////////////////////////////////////////////
+
+uint64_t traceNewId()
+{
+    uint64_t z = 0;
+
+    pthread_once( &gTraceOnce, traceOnce );
+
+    z = atomic_fetch_add( &gTraceSeq, 0x9E3779B97F4A7C15ULL );
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+
+    return (z == 0) ? 1 : z;
+}
+
+
+//
+// Start a new trace on the calling thread
+//
+uint64_t traceBegin()
+{
+    tTraceId = traceNewId();
+    return tTraceId;
+}
+
+
+void traceSetCurrent( const uint64_t traceId )
+{
+    tTraceId = traceId;
+}
+
+
+uint64_t traceCurrent()
+{
+    return tTraceId;
+}
+
+
+/////////////////////////////////////////////////////////////
+
+
+static void releaseRing( void *ring )
+{
+    pthread_mutex_lock( &gTraceLock );
+    ((TRACE_RING_TYPE *)ring)->inUse = FALSE;
+    pthread_mutex_unlock( &gTraceLock );
+}
+
+
+static TRACE_RING_TYPE *getRing()
+{
+    TRACE_RING_TYPE *ring = tTraceRing;
+
+    if ( ring != NULL ) return ring;
+
+    pthread_once( &gTraceOnce, traceOnce );
+
+    pthread_mutex_lock( &gTraceLock );
+    for (ring = gTraceRings; ring != NULL; ring = ring->next) {
+        if ( ring->inUse == FALSE ) break;
+    }
+
+    if ( ring == NULL ) {
+        ring = calloc( 1, sizeof(TRACE_RING_TYPE) );
+        if ( ring == NULL ) {
+            pthread_mutex_unlock( &gTraceLock );
+            return NULL;
+        }
+        ring->next = gTraceRings;
+        gTraceRings = ring;
+    }
+    ring->inUse = TRUE;
+    pthread_mutex_unlock( &gTraceLock );
+
+    pthread_setspecific( gTraceKey, ring );
+    tTraceRing = ring;
+    tTid = (int)syscall(SYS_gettid);
+    return ring;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Record a span for the current trace of this thread.
+// Spans outside of any trace are not recorded.
+//
+/////////////////////////////////////////////////////////////
+
+void traceSpan( const char *name, const uint64_t start, const uint64_t end )
+{
+    TRACE_RING_TYPE *ring = NULL;
+    TRACE_SPAN_TYPE *span = NULL;
+    uint64_t head = 0;
+
+    if ( tTraceId == 0 ) return;
+
+    ring = getRing();
+    if ( ring == NULL ) return;
+
+    head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+    span = &ring->spans[ head % TRACE_RING_SIZE ];
+    span->traceId = tTraceId;
+    span->name    = name;
+    span->start   = start;
+    span->end     = end;
+    span->tid     = tTid;
+    atomic_store_explicit( &ring->head, head + 1, memory_order_release );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Put the current trace tag in front of an outgoing
+// message.  "len" is the size of the message buffer.
+//
+/////////////////////////////////////////////////////////////
+
+void traceTagMessage( char *msg, const size_t len )
+{
+    char tag[TRACE_TAG_SIZE + 1] = "";
+    size_t msgLen = strlen(msg);
+
+    if ( tTraceId == 0 ) return;
+    if ( msgLen + TRACE_TAG_SIZE + 1 > len ) return;
+
+    snprintf(tag, sizeof(tag), "T%016llx:", (unsigned long long)tTraceId);
+    memmove( msg + TRACE_TAG_SIZE, msg, msgLen + 1 );
+    memcpy( msg, tag, TRACE_TAG_SIZE );
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Strip the trace tag off an incoming message, if it has
+// one, and make it the current trace of this thread.
+// Returns the trace ID, or 0 if the message had no tag.
+//
+/////////////////////////////////////////////////////////////
+
+uint64_t traceUntagMessage( char *msg )
+{
+    unsigned long long traceId = 0;
+
+    if ((msg[0] != 'T') || (strlen(msg) < TRACE_TAG_SIZE) ||
+        (msg[TRACE_TAG_SIZE - 1] != ':'))
+    {
+        tTraceId = 0;
+        return 0;
+    }
+
+    sscanf(msg + 1, "%16llx", &traceId);
+    memmove( msg, msg + TRACE_TAG_SIZE, strlen(msg + TRACE_TAG_SIZE) + 1 );
+
+    tTraceId = (uint64_t)traceId;
+    return tTraceId;
+}
+
+
+/////////////////////////////////////////////////////////////
+//
+// Write all recorded spans, or only those of "traceId" if
+// it is not 0, as a Chrome trace-event JSON document.
+// Returns the number of spans written.
+//
+/////////////////////////////////////////////////////////////
+
+int traceWriteJson( FILE *fp, const uint64_t traceId )
+{
+    TRACE_RING_TYPE *ring = NULL;
+    TRACE_SPAN_TYPE *copy = NULL;
+    int nSpans = 0;
+    int pid = (int)getpid();
+
+    pthread_once( &gTraceOnce, traceOnce );
+
+    copy = malloc( sizeof(TRACE_SPAN_TYPE) * TRACE_RING_SIZE );
+    if ( copy == NULL ) return FAILURE;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    pthread_mutex_lock( &gTraceLock );
+    ring = gTraceRings;
+    pthread_mutex_unlock( &gTraceLock );
+
+    for ( ; ring != NULL; ring = ring->next) {
+        uint64_t head  = atomic_load_explicit( &ring->head, memory_order_acquire );
+        uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        uint64_t after = 0;
+        uint64_t i = 0;
+
+        for (i = first; i < head; i++) {
+            copy[ i % TRACE_RING_SIZE ] = ring->spans[ i % TRACE_RING_SIZE ];
+        }
+
+        //
+        // Anything the owner wrote (or is writing) while we were
+        // copying has replaced the oldest slots.  Skip those.
+        //
+        after = atomic_load_explicit( &ring->head, memory_order_acquire );
+        if ( after + 1 > first + TRACE_RING_SIZE ) first = after + 1 - TRACE_RING_SIZE;
+
+        for (i = first; i < head; i++) {
+            TRACE_SPAN_TYPE *span = &copy[ i % TRACE_RING_SIZE ];
+
+            if ((traceId != 0) && (span->traceId != traceId)) continue;
+
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"netfiles\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"trace\":\"%016llx\"}}",
+                    (nSpans == 0) ? "" : ",", span->name,
+                    (double)((int64_t)span->start + gWallOffset) / 1000.0,
+                    (double)(span->end - span->start) / 1000.0,
+                    pid, span->tid, (unsigned long long)span->traceId);
+            nSpans++;
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+    free( copy );
+    return nSpans;
+}
+
+/////////////////////////////////////////////////////////////
+
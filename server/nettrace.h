@@ -0,0 +1,80 @@
+#ifndef 	_NETTRACE_H_
+#define    	_NETTRACE_H_
+
+
+/////////////////////////////////////////////////////////////
+//
+// This "nettrace.h" file is shared by both the client
+// library and the server.  It records timestamped spans
+// for each request into per-thread ring buffers and
+// exports them in Chrome trace-event JSON format, so a
+// single request can be drawn as a timeline across both
+// sides.
+//
+// Every net function call in libnetfiles starts a new
+// 64-bit trace ID.  The ID is carried in front of every
+// control and data message as a "T<16 hex digits>:" tag,
+// which the receiving side strips off and adopts as the
+// current trace ID of its thread.
+//
+/////////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Constant and type definitions
+//
+/////////////////////////////////////////////////////////////
+
+
+//
+// Number of spans kept per thread.  Older spans are
+// overwritten once a ring is full.
+//
+#define TRACE_RING_SIZE   4096
+
+
+//
+// Length of the "T0123456789abcdef:" message tag
+//
+#define TRACE_TAG_SIZE    18
+
+
+typedef struct {
+    uint64_t traceId;
+    const char *name;     // must point at a string literal
+    uint64_t start;       // monotonic ns
+    uint64_t end;         // monotonic ns
+    int tid;              // kernel thread id
+} TRACE_SPAN_TYPE;
+
+
+
+
+/////////////////////////////////////////////////////////////
+//
+// Function declarations
+//
+/////////////////////////////////////////////////////////////
+
+uint64_t traceNow();
+uint64_t traceNewId();
+uint64_t traceBegin();
+void     traceSetCurrent( const uint64_t traceId );
+uint64_t traceCurrent();
+void     traceSpan( const char *name, const uint64_t start, const uint64_t end );
+
+void     traceTagMessage( char *msg, const size_t len );
+uint64_t traceUntagMessage( char *msg );
+
+int      traceWriteJson( FILE *fp, const uint64_t traceId );
+
+
+
+#endif    // _NETTRACE_H_